@@ -0,0 +1,543 @@
+#include <TokenStream/Generic.h>
+#include <TokenStream/MappedFile.h>
+#include <TokenStream/Pool.h>
+#include <TokenStream/Reader.h>
+#include <TokenStream/StaticCodec.h>
+#include <TokenStream/Validate.h>
+#include <TokenStream/Writer.h>
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Throughput of the Writer and Reader backends for a range of message shapes. Every benchmark
+// reports bytes/s of encoded data and the number of heap allocations per operation.
+//
+// Build in Release mode and run e.g.
+//   tokenstream_bench --benchmark_filter=Employee
+
+namespace {
+
+std::atomic<size_t> allocationCount{0};
+
+} // namespace
+
+// GCC warns when the replacement functions get inlined into code that allocates with the builtin
+// operator new, even though they are the same function here
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  if (auto* p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc{};
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  std::free(p);
+}
+
+namespace {
+
+using TokenStream::Reader;
+using TokenStream::Writer;
+
+// The Employee record from FORMAT.md
+struct Date : TokenStream::Serializable {
+  enum class Token : uint64_t { day, month, year };
+
+  uint8_t day = 0;
+  uint8_t month = 0;
+  uint16_t year = 0;
+
+  TOKEN_MAP(ENUMERATED_TOKEN(day), ENUMERATED_TOKEN(month), ENUMERATED_TOKEN(year))
+};
+
+struct Address : TokenStream::Serializable {
+  enum class Token : uint64_t { address1, address2, city, state, country, postalCode };
+
+  std::string address1;
+  std::string address2;
+  std::string city;
+  std::string state;
+  std::string country;
+  std::string postalCode;
+
+  TOKEN_MAP(ENUMERATED_TOKEN(address1),
+            ENUMERATED_TOKEN(address2),
+            ENUMERATED_TOKEN(city),
+            ENUMERATED_TOKEN(state),
+            ENUMERATED_TOKEN(country),
+            ENUMERATED_TOKEN(postalCode))
+};
+
+struct Employee : TokenStream::Serializable {
+  enum class Token : uint64_t { name, phone, extension, birthDate, hireDate, home, office };
+
+  std::string name;
+  std::string phone;
+  uint32_t extension = 0;
+  Date birthDate;
+  Date hireDate;
+  Address home;
+  Address office;
+
+  TOKEN_MAP(ENUMERATED_TOKEN(name),
+            ENUMERATED_TOKEN(phone),
+            ENUMERATED_TOKEN(extension),
+            ENUMERATED_TOKEN(birthDate),
+            ENUMERATED_TOKEN(hireDate),
+            ENUMERATED_TOKEN(home),
+            ENUMERATED_TOKEN(office))
+};
+
+Employee MakeEmployee() {
+  Employee employee;
+  employee.name = "Joe Smith";
+  employee.phone = "(800) 555-1212";
+  employee.extension = 300;
+  employee.birthDate.day = 27;
+  employee.birthDate.month = 3;
+  employee.birthDate.year = 1966;
+  employee.hireDate.day = 16;
+  employee.hireDate.month = 9;
+  employee.hireDate.year = 1996;
+  employee.home.address1 = "123 Main St.";
+  employee.home.city = "San Diego";
+  employee.home.state = "CA";
+  employee.home.country = "USA";
+  employee.home.postalCode = "92020";
+  employee.office.address1 = "456 Grand Ave.";
+  employee.office.address2 = "Suite 101";
+  employee.office.city = "Escondido";
+  employee.office.state = "CA";
+  employee.office.country = "USA";
+  employee.office.postalCode = "92027";
+  return employee;
+}
+
+// Scalars only
+struct Flat : TokenStream::Serializable {
+  enum class Token : uint64_t { id, count, flags, ratio, timestamp, enabled };
+
+  uint32_t id = 0;
+  int32_t count = 0;
+  uint16_t flags = 0;
+  double ratio = 0;
+  uint64_t timestamp = 0;
+  bool enabled = false;
+
+  TOKEN_MAP(ENUMERATED_TOKEN(id),
+            ENUMERATED_TOKEN(count),
+            ENUMERATED_TOKEN(flags),
+            ENUMERATED_TOKEN(ratio),
+            ENUMERATED_TOKEN(timestamp),
+            ENUMERATED_TOKEN(enabled))
+};
+
+// The same fields without virtual calls
+struct StaticFlat {
+  enum class Token : uint64_t { id, count, flags, ratio, timestamp, enabled };
+
+  uint32_t id = 0;
+  int32_t count = 0;
+  uint16_t flags = 0;
+  double ratio = 0;
+  uint64_t timestamp = 0;
+  bool enabled = false;
+
+  TS_FIELDS(StaticFlat,
+            TS_FIELD(id),
+            TS_FIELD(count),
+            TS_FIELD(flags),
+            TS_FIELD(ratio),
+            TS_FIELD(timestamp),
+            TS_FIELD(enabled))
+};
+
+// An older version of Flat, which skips the fields it does not know
+struct OldFlat : TokenStream::Serializable {
+  using Token = Flat::Token;
+
+  uint32_t id = 0;
+
+  TOKEN_MAP(ENUMERATED_TOKEN(id))
+};
+
+template<typename T>
+T MakeFlat() {
+  T flat;
+  flat.id = 123456;
+  flat.count = -42;
+  flat.flags = 0x8001;
+  flat.ratio = 0.75;
+  flat.timestamp = 1650000000000;
+  flat.enabled = true;
+  return flat;
+}
+
+// A chain of objects, each nested in the previous one
+struct Node : TokenStream::Serializable {
+  enum class Token : uint64_t { value, child };
+
+  uint32_t value = 0;
+  std::unique_ptr<Node> child;
+
+  void Write(Writer& writer) const override {
+    writer.Put(Token::value, value);
+    if (child) {
+      writer.Put(Token::child, *child);
+    }
+  }
+
+  void Read(Reader& reader) override {
+    while (!reader.EOS()) {
+      switch (reader.GetToken<Token>()) {
+        case Token::value:
+          reader >> value;
+          break;
+        case Token::child:
+          child.reset(new Node);
+          reader >> *child;
+          break;
+      }
+    }
+  }
+};
+
+Node MakeChain(size_t depth) {
+  Node root;
+  auto* node = &root;
+  for (size_t i = 1; i < depth; i++) {
+    node->value = static_cast<uint32_t>(i);
+    node->child.reset(new Node);
+    node = node->child.get();
+  }
+  node->value = static_cast<uint32_t>(depth);
+  return root;
+}
+
+TokenStream::Generic MakeGeneric() {
+  TokenStream::Generic nested;
+  nested.Add(1, true).Add(2, std::string("nested"));
+  TokenStream::Generic generic;
+  generic.Add(1, 42u).Add(2, std::string("generic")).Add(3, -7).Add(4, 2.5);
+  generic.Add(5, std::vector<int>{1, 2, 3, 4, 5, 6, 7, 8}).Add(6, nested);
+  return generic;
+}
+
+// Writes and reads one value of some type under token 1
+struct Shape {
+  std::string name;
+  std::function<void(Writer&)> write;
+  std::function<void(Reader&)> read;
+};
+
+template<typename T>
+Shape MakeShape(std::string name, T value) {
+  auto data = std::make_shared<T>(std::move(value));
+  return {std::move(name),
+          [data](Writer& writer) {
+            writer.Put(1, *data);
+          },
+          [](Reader& reader) {
+            T result;
+            reader.GetToken();
+            reader >> result;
+            benchmark::DoNotOptimize(result);
+          }};
+}
+
+std::vector<Shape> MakeShapes() {
+  std::vector<Shape> shapes;
+  shapes.push_back(MakeShape("Flat", MakeFlat<Flat>()));
+  shapes.push_back(MakeShape("StaticFlat", MakeFlat<StaticFlat>()));
+  shapes.push_back(MakeShape("Employee", MakeEmployee()));
+  auto flats = std::make_shared<std::vector<Flat>>(0x400, MakeFlat<Flat>());
+  shapes.push_back({"SkipUnknown",
+                    [flats](Writer& writer) {
+                      writer.Put(1, *flats);
+                    },
+                    [](Reader& reader) {
+                      std::vector<OldFlat> result;
+                      reader.GetToken();
+                      reader >> result;
+                      benchmark::DoNotOptimize(result);
+                    }});
+  // The same objects a member at a time, read whole or just one member
+  shapes.push_back(MakeShape("VectorFlat", *flats));
+  shapes.push_back({"Columns",
+                    [flats](Writer& writer) {
+                      writer.PutColumns(1, *flats);
+                    },
+                    [](Reader& reader) {
+                      std::vector<Flat> result;
+                      reader.GetToken();
+                      reader >> result;
+                      benchmark::DoNotOptimize(result);
+                    }});
+  shapes.push_back({"Column",
+                    [flats](Writer& writer) {
+                      writer.PutColumns(1, *flats);
+                    },
+                    [](Reader& reader) {
+                      std::vector<uint64_t> result;
+                      reader.GetToken();
+                      reader.GetColumn(Flat::Token::timestamp, result);
+                      benchmark::DoNotOptimize(result);
+                    }});
+  for (const size_t depth : {1, 8, 32}) {
+    auto chain = std::make_shared<Node>(MakeChain(depth));
+    shapes.push_back({"Nested/" + std::to_string(depth),
+                      [chain](Writer& writer) {
+                        writer.Put(1, *chain);
+                      },
+                      [](Reader& reader) {
+                        Node result;
+                        reader.GetToken();
+                        reader >> result;
+                        benchmark::DoNotOptimize(result);
+                      }});
+  }
+
+  std::vector<int32_t> numbers(0x10000);
+  for (size_t i = 0; i < numbers.size(); i++) {
+    numbers[i] = static_cast<int32_t>(i * 2654435761u);
+  }
+  shapes.push_back(MakeShape("VectorInt32", std::move(numbers)));
+
+  std::vector<std::string> strings(0x1000);
+  for (size_t i = 0; i < strings.size(); i++) {
+    strings[i] = "string number " + std::to_string(i);
+  }
+  shapes.push_back(MakeShape("VectorString", std::move(strings)));
+
+  std::map<std::string, uint32_t> map;
+  for (uint32_t i = 0; i < 0x400; i++) {
+    map["key" + std::to_string(i)] = i;
+  }
+  shapes.push_back(MakeShape("UnorderedMap", std::unordered_map<std::string, uint32_t>(map.begin(), map.end())));
+  shapes.push_back(MakeShape("Map", std::move(map)));
+
+  // Generic only reads the members it already has, so each read starts from a copy
+  auto generic = std::make_shared<TokenStream::Generic>(MakeGeneric());
+  shapes.push_back({"Generic",
+                    [generic](Writer& writer) {
+                      writer.Put(1, *generic);
+                    },
+                    [generic](Reader& reader) {
+                      auto result = *generic;
+                      reader.GetToken();
+                      reader >> result;
+                      benchmark::DoNotOptimize(result);
+                    }});
+
+  TokenStream::Binary blob(0x100000);
+  for (size_t i = 0; i < blob.size(); i++) {
+    blob[i] = static_cast<uint8_t>(i * 31);
+  }
+  shapes.push_back(MakeShape("Blob", std::move(blob)));
+  return shapes;
+}
+
+// Runs the benchmark loop. \p op returns the number of encoded bytes it handled.
+template<typename Op>
+void Run(benchmark::State& state, Op&& op) {
+  size_t bytes = 0;
+  const auto allocations = allocationCount.load();
+  for (auto _ : state) {
+    bytes += op();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(bytes));
+  state.counters["allocs/op"] = benchmark::Counter(static_cast<double>(allocationCount.load() - allocations),
+                                                   benchmark::Counter::kAvgIterations);
+}
+
+std::string TempPath() {
+  return "tokenstream_bench_" + std::to_string(std::rand()) + ".ts";
+}
+
+size_t EncodedSize(const Shape& shape) {
+  TokenStream::SizeCounter counter;
+  shape.write(counter);
+  return counter.size();
+}
+
+void WriteMemory(benchmark::State& state, const Shape& shape) {
+  TokenStream::MemoryWriter writer;
+  Run(state, [&] {
+    writer.clear();
+    shape.write(writer);
+    return writer.size();
+  });
+}
+
+void WriteGather(benchmark::State& state, const Shape& shape) {
+  TokenStream::GatherWriter writer;
+  Run(state, [&] {
+    writer.clear();
+    shape.write(writer);
+    return writer.size();
+  });
+}
+
+void WriteSizeCounter(benchmark::State& state, const Shape& shape) {
+  Run(state, [&] {
+    TokenStream::SizeCounter counter;
+    shape.write(counter);
+    return counter.size();
+  });
+}
+
+void WriteStream(benchmark::State& state, const Shape& shape) {
+  std::stringstream stream;
+  Run(state, [&] {
+    stream.seekp(0);
+    {
+      Writer writer{stream};
+      shape.write(writer);
+    }
+    return static_cast<size_t>(stream.tellp());
+  });
+}
+
+// Like WriteStream, but the Writer comes from the Pool with its buffers already grown
+void WritePooledStream(benchmark::State& state, const Shape& shape) {
+  std::stringstream stream;
+  Run(state, [&] {
+    stream.seekp(0);
+    {
+      auto writer = TokenStream::Pool::GetWriter(stream);
+      shape.write(*writer);
+    }
+    return static_cast<size_t>(stream.tellp());
+  });
+}
+
+void WriteMappedFile(benchmark::State& state, const Shape& shape) {
+  const auto path = TempPath();
+  const auto size = EncodedSize(shape);
+  Run(state, [&] {
+    TokenStream::MappedFileWriter writer{path, size};
+    shape.write(writer);
+    writer.Close();
+    return size;
+  });
+  std::remove(path.c_str());
+}
+
+void ReadMemory(benchmark::State& state, const Shape& shape) {
+  TokenStream::MemoryWriter writer;
+  shape.write(writer);
+  Run(state, [&] {
+    Reader reader{writer.data(), writer.size()};
+    shape.read(reader);
+    return writer.size();
+  });
+}
+
+// Checks the top-level framing only, which is what a gateway does before reading a frame
+void ReadValidate(benchmark::State& state, const Shape& shape) {
+  TokenStream::MemoryWriter writer;
+  shape.write(writer);
+  Run(state, [&] {
+    benchmark::DoNotOptimize(TokenStream::Validate(writer.data(), writer.size()));
+    return writer.size();
+  });
+}
+
+void ReadStream(benchmark::State& state, const Shape& shape) {
+  TokenStream::MemoryWriter writer;
+  shape.write(writer);
+  std::stringstream stream;
+  stream.write(reinterpret_cast<const char*>(writer.data()), static_cast<std::streamsize>(writer.size()));
+  Run(state, [&] {
+    stream.clear();
+    stream.seekg(0);
+    Reader reader{stream};
+    shape.read(reader);
+    return writer.size();
+  });
+}
+
+void ReadPooledStream(benchmark::State& state, const Shape& shape) {
+  TokenStream::MemoryWriter writer;
+  shape.write(writer);
+  std::stringstream stream;
+  stream.write(reinterpret_cast<const char*>(writer.data()), static_cast<std::streamsize>(writer.size()));
+  Run(state, [&] {
+    stream.clear();
+    stream.seekg(0);
+    auto reader = TokenStream::Pool::GetReader(stream);
+    shape.read(*reader);
+    return writer.size();
+  });
+}
+
+void ReadMappedFile(benchmark::State& state, const Shape& shape) {
+  const auto path = TempPath();
+  const auto size = EncodedSize(shape);
+  {
+    TokenStream::MappedFileWriter writer{path, size};
+    shape.write(writer);
+    writer.Close();
+  }
+  Run(state, [&] {
+    TokenStream::MappedFileReader reader{path};
+    shape.read(reader);
+    return size;
+  });
+  std::remove(path.c_str());
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  using Backend = void (*)(benchmark::State&, const Shape&);
+  const std::pair<const char*, Backend> backends[] = {
+      {"Write/Memory", WriteMemory},
+      {"Write/Gather", WriteGather},
+      {"Write/SizeCounter", WriteSizeCounter},
+      {"Write/Stream", WriteStream},
+      {"Write/PooledStream", WritePooledStream},
+      {"Write/MappedFile", WriteMappedFile},
+      {"Read/Memory", ReadMemory},
+      {"Read/Validate", ReadValidate},
+      {"Read/Stream", ReadStream},
+      {"Read/PooledStream", ReadPooledStream},
+      {"Read/MappedFile", ReadMappedFile},
+  };
+  static const auto shapes = MakeShapes();
+  for (const auto& shape : shapes) {
+    for (const auto& backend : backends) {
+      const auto run = backend.second;
+      benchmark::RegisterBenchmark((shape.name + "/" + backend.first).c_str(),
+                                   [run, &shape](benchmark::State& state) {
+                                     run(state, shape);
+                                   });
+    }
+  }
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -0,0 +1,223 @@
+/*
+ * Copyright 2005-2022 Scott Maxwell
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <list>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace TokenStream {
+
+/** @brief Monotonic memory arena for the temporaries of a serialization session
+ *
+ * Memory is handed out by bumping a pointer through large blocks and individual
+ * deallocations are ignored. Everything is given back at once by Reset(), which keeps
+ * enough memory around that the next message of the same size does not hit the heap.
+ *
+ * While an Arena::Scope is active on a thread, every Writer and Reader created on that
+ * thread uses the arena for its scratch buffers, Generic allocates its members from it,
+ * and default-constructed ArenaAllocator containers (ArenaString, ArenaVector, ...) draw
+ * from it as well.
+ *
+ * @code
+ *  TokenStream::Arena arena;
+ *  for (const auto& message : messages) {
+ *    {
+ *      TokenStream::Arena::Scope scope{arena};
+ *      TokenStream::Reader reader{message};
+ *      Request request; // Uses ArenaString members
+ *      reader >> request;
+ *      Handle(request);
+ *    }
+ *    arena.Reset(); // Everything is released together
+ *  }
+ * @endcode
+ *
+ * @warning Everything allocated from the arena must be destroyed before the arena is reset.
+ * That includes any Writer and Reader created while the Scope was active.
+ *
+ * @see ArenaAllocator
+ */
+class Arena {
+ public:
+  //! Default size of each block fetched from the heap
+  static constexpr size_t DefaultBlockSize = 0x10000;
+
+  //! @brief Creates an empty arena. Nothing is allocated until first use.
+  //! @param blockSize Minimum size of each block fetched from the heap.
+  explicit Arena(size_t blockSize = DefaultBlockSize) : m_blockSize(blockSize) {}
+
+  //! @brief Creates an arena that starts out using a caller-supplied buffer, e.g. on the stack.
+  //! @param buffer Memory to allocate from first. It must outlive the arena.
+  //! @param size Size of \p buffer.
+  //! @param blockSize Minimum size of each block fetched from the heap once \p buffer is used up.
+  Arena(void* buffer, size_t size, size_t blockSize = DefaultBlockSize);
+
+  ~Arena();
+
+  // no copying
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  //! @brief Allocates \p size bytes aligned to \p alignment. Never returns nullptr.
+  //! @pre \p alignment is a power of 2
+  void* Allocate(size_t size, size_t alignment = alignof(std::max_align_t)) {
+    const auto padding = static_cast<size_t>(-reinterpret_cast<uintptr_t>(m_current) & (alignment - 1));
+    if (m_current && padding + size <= static_cast<size_t>(m_end - m_current)) {
+      auto* start = m_current + padding;
+      m_current = start + size;
+      m_used += size;
+      return start;
+    }
+    return AllocateBlock(size, alignment);
+  }
+
+  //! @brief Releases everything allocated so far. Enough memory is kept to satisfy the same amount again without going to the heap.
+  void Reset();
+
+  //! @brief Returns the number of bytes handed out since the last Reset()
+  size_t GetBytesUsed() const {
+    return m_used;
+  }
+
+  //! @brief Returns the arena of the innermost active Scope on this thread, or nullptr if there is none.
+  static Arena* Current();
+
+  //! @brief Makes an arena current on this thread for the lifetime of the Scope.
+  class Scope { // NOLINT
+   public:
+    //! @param arena The arena to make current. The previous one is restored when the Scope is destroyed.
+    explicit Scope(Arena& arena);
+    //! @param arena The arena to make current, or nullptr to go back to the heap for the lifetime of the Scope.
+    explicit Scope(Arena* arena);
+
+    // no copying
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+    ~Scope();
+
+   private:
+    Arena* m_previous;
+  };
+
+ private:
+  struct Block {
+    Block* m_next;
+    size_t m_size;
+  };
+
+  void* AllocateBlock(size_t size, size_t alignment);
+  Block* NewBlock(size_t size);
+  void UseBlock(Block* block);
+  void FreeBlocks();
+
+  size_t m_blockSize;
+  uint8_t* m_current = nullptr;
+  uint8_t* m_end = nullptr;
+  Block* m_blocks = nullptr;
+  // Block kept by Reset() that has not been used yet because the initial buffer comes first
+  Block* m_spare = nullptr;
+  uint8_t* m_initial = nullptr;
+  size_t m_initialSize = 0;
+  size_t m_used = 0;
+  size_t m_reserved = 0;
+};
+
+/** @brief A standard allocator that allocates from an Arena, or from the heap if there is none.
+ *
+ * A default-constructed ArenaAllocator picks up Arena::Current(), so containers declared as
+ * members of a structure use the arena of the Scope they are constructed in. Copies of a
+ * container do the same, so copying data out of a Scope makes a heap copy.
+ */
+template<typename T>
+class ArenaAllocator {
+ public:
+  using value_type = T;
+
+  ArenaAllocator() noexcept : m_arena(Arena::Current()) {}
+  explicit ArenaAllocator(Arena* arena) noexcept : m_arena(arena) {}
+  template<typename U>
+  ArenaAllocator(const ArenaAllocator<U>& other) noexcept : m_arena(other.GetArena()) {} // NOLINT
+
+  T* allocate(size_t count) {
+    if (count > std::numeric_limits<size_t>::max() / sizeof(T)) {
+      throw std::bad_alloc();
+    }
+    if (m_arena) {
+      return static_cast<T*>(m_arena->Allocate(count * sizeof(T), alignof(T)));
+    }
+    return static_cast<T*>(::operator new(count * sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t) noexcept {
+    if (!m_arena) {
+      ::operator delete(p);
+    }
+  }
+
+  ArenaAllocator select_on_container_copy_construction() const {
+    return {};
+  }
+
+  Arena* GetArena() const noexcept {
+    return m_arena;
+  }
+
+  template<typename U>
+  bool operator==(const ArenaAllocator<U>& rhs) const noexcept {
+    return m_arena == rhs.GetArena();
+  }
+  template<typename U>
+  bool operator!=(const ArenaAllocator<U>& rhs) const noexcept {
+    return m_arena != rhs.GetArena();
+  }
+
+ private:
+  Arena* m_arena;
+};
+
+//! @brief std::string that allocates from the current Arena
+using ArenaString = std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>>;
+
+//! @brief Binary that allocates from the current Arena
+using ArenaBinary = std::vector<uint8_t, ArenaAllocator<uint8_t>>;
+
+//! @brief std::vector that allocates from the current Arena
+template<typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+//! @brief std::list that allocates from the current Arena
+template<typename T>
+using ArenaList = std::list<T, ArenaAllocator<T>>;
+
+//! @brief std::map that allocates from the current Arena
+template<typename Key, typename T, typename Compare = std::less<Key>>
+using ArenaMap = std::map<Key, T, Compare, ArenaAllocator<std::pair<const Key, T>>>;
+
+} // namespace TokenStream
@@ -0,0 +1,120 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+
+#pragma once
+
+/** @file
+ *  Contains the Codec interface used by Writer::PutCompressed() and the built-in Lz4Codec.
+ */
+
+#include <TokenStream/TokenStream.h>
+#include <cstddef>
+#include <cstdint>
+
+namespace TokenStream {
+
+/*! @brief General-purpose compression algorithm for compressed chunks
+     *
+     * The id of the codec is stored in each compressed chunk so that the Reader can pick the
+     * codec to decompress it. Lz4Codec is always available. Other algorithms can be plugged in by
+     * implementing this interface and passing the codec to Reader::SetCodec().
+     *
+     * @code
+     * class ZstdCodec : public TokenStream::Codec {
+     *  public:
+     *   uint8_t GetId() const override { return ZstdId; }
+     *   size_t GetMaxCompressedSize(size_t size) const override { return ZSTD_compressBound(size); }
+     *   size_t Compress(const uint8_t* in, size_t size, uint8_t* out, size_t capacity) const override {
+     *     const auto result = ZSTD_compress(out, capacity, in, size, 3);
+     *     return ZSTD_isError(result) ? 0 : result;
+     *   }
+     *   bool Decompress(const uint8_t* in, size_t size, uint8_t* out, size_t outSize) const override {
+     *     return ZSTD_decompress(out, outSize, in, size) == outSize;
+     *   }
+     * };
+     * @endcode
+     *
+     * @see Writer::PutCompressed
+     */
+class Codec {
+ public:
+  //! Id of Lz4Codec
+  static constexpr uint8_t Lz4Id = 1;
+  //! Id reserved for Zstandard
+  static constexpr uint8_t ZstdId = 2;
+
+  virtual ~Codec() = default;
+
+  //! @brief Returns the id that is stored in the stream.
+  virtual uint8_t GetId() const = 0;
+
+  //! @brief Returns the largest size that compressing \p size bytes can produce.
+  virtual size_t GetMaxCompressedSize(size_t size) const = 0;
+
+  //! @brief Compresses \p size bytes from \p in to \p out.
+  //! @return The compressed size or 0 if it does not fit into \p capacity bytes.
+  virtual size_t Compress(const uint8_t* in, size_t size, uint8_t* out, size_t capacity) const = 0;
+
+  //! @brief Decompresses \p size bytes from \p in to exactly \p outSize bytes at \p out.
+  //! @return \e false if the data is malformed.
+  virtual bool Decompress(const uint8_t* in, size_t size, uint8_t* out, size_t outSize) const = 0;
+
+  //! @brief Returns the largest size that \p compressedSize bytes can decompress to.
+  //! Larger sizes are rejected by the Reader before anything is allocated.
+  virtual size_t GetMaxDecompressedSize(size_t compressedSize) const {
+    (void)compressedSize;
+    return SIZE_MAX;
+  }
+};
+
+/*! @brief Codec for the LZ4 block format
+     *
+     * Fast enough to use on every write. The output is the plain LZ4 block format, without the
+     * frame header, so it can be read with any LZ4 implementation.
+     */
+class Lz4Codec final : public Codec {
+ public:
+  //! @brief Returns the shared instance. Lz4Codec has no state.
+  static const Lz4Codec& Get();
+
+  uint8_t GetId() const override {
+    return Lz4Id;
+  }
+  size_t GetMaxCompressedSize(size_t size) const override {
+    return size + size / 255 + 16;
+  }
+  size_t Compress(const uint8_t* in, size_t size, uint8_t* out, size_t capacity) const override;
+  bool Decompress(const uint8_t* in, size_t size, uint8_t* out, size_t outSize) const override;
+  size_t GetMaxDecompressedSize(size_t compressedSize) const override;
+};
+
+/*! @brief Decompresses the data of a chunk written by Writer::PutCompressed().
+     *
+     * The data starts with the codec id and the decompressed size in the TokenStream length
+     * encoding, followed by the compressed bytes.
+     * @param codec Codec to use for ids other than Lz4Codec's, or nullptr
+     * @return \e false if the data is malformed or needs a codec that is not available
+     */
+bool DecompressChunk(const uint8_t* data, size_t size, const Codec* codec, Binary& out);
+
+} // namespace TokenStream
@@ -0,0 +1,50 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+
+#pragma once
+
+/** @file
+ *  Contains the Executor used to encode and decode large containers on several threads.
+ */
+
+#include <cstddef>
+#include <functional>
+
+namespace TokenStream {
+
+//! @brief Runs \e task(0) to \e task(taskCount - 1) on any threads and returns once all of them are done.
+//! Exceptions thrown by a task have to be rethrown on the calling thread, like RunOnThreads() does.
+//! @see Writer::PutContainerParallel
+//! @see Reader::GetContainerParallel
+using Executor = std::function<void(size_t taskCount, const std::function<void(size_t)>& task)>;
+
+//! @brief Returns \p threadCount, or std::thread::hardware_concurrency() if it is 0.
+size_t GetThreadCount(size_t threadCount);
+
+//! @brief Runs the tasks on \p threadCount threads, the calling one included. Idle threads take the next task.
+//! @param threadCount Number of threads. 0 uses std::thread::hardware_concurrency().
+//! @note If a task throws, no more tasks are started, and the first exception is rethrown once every thread
+//! has finished.
+void RunOnThreads(size_t taskCount, const std::function<void(size_t)>& task, size_t threadCount = 0);
+
+} // namespace TokenStream
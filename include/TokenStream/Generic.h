@@ -22,11 +22,13 @@
 
 #pragma once
 
+#include <TokenStream/Arena.h>
 #include <TokenStream/Reader.h>
 #include <TokenStream/TokenStream.h>
 #include <TokenStream/Writer.h>
-#include <map>
-#include <memory>
+#include <cstddef>
+#include <new>
+#include <type_traits>
 #include <utility>
 
 namespace TokenStream {
@@ -45,7 +47,12 @@ namespace TokenStream {
  *  employee.Write(writer);
  * @endcode
  *
+ * @note Members are kept in a flat array sorted by token. Scalars, strings and vectors are stored
+ * inside the array. Larger members, such as nested Generic objects, are allocated from the Arena
+ * that is current when they are added.
+ *
  * @see MemoryWriter
+ * @see Arena
  */
 class Generic : public Serializable {
  public:
@@ -61,18 +68,19 @@ class Generic : public Serializable {
   //! @brief Add a token/value pair. Type is automatically deduced. Specify it manually if you want to be specific.
   template<typename T>
   Generic& Add(Token token, T value) {
-    m_members[token] = std::make_shared<Member<T>>(value);
+    Insert(token).Set<Member<T>>(std::move(value));
     return *this;
   }
 
   //! @brief Add a token/value pair and a defaultValue. Type is automatically deduced. Specify it manually if you want to be specific.
   template<typename T>
   Generic& Add(Token token, T value, T defaultValue) {
-    m_members[token] = std::make_shared<MemberWithDefault<T>>(value, defaultValue);
+    Insert(token).Set<MemberWithDefault<T>>(std::move(value), std::move(defaultValue));
     return *this;
   }
 
   //! @brief Get a pointer to a MemberBase object or nullptr if not present. You will need to do reinterpret_cast<TokenStream::Generic::Member<T>> to the value type you want.
+  //! @note The pointer is invalidated by the next Add() of a new token.
   MemberBase* operator[](Token t);
 
   //! @brief Get the value associated with the specified token. The token MUST be in the map when you call this.
@@ -89,6 +97,11 @@ class Generic : public Serializable {
 
     virtual void Get(Reader& reader) = 0;
     virtual void Put(Token t, Writer& writer) = 0;
+
+    // Storage management for the member array. See Generic::Create.
+    virtual MemberBase* CopyTo(void* storage, Arena* arena) const = 0;
+    virtual MemberBase* MoveTo(void* storage) = 0;
+    virtual void Destroy(Arena* arena) = 0;
   };
 
   //! @brief internal helper class to hold a generic value to serialize
@@ -105,6 +118,18 @@ class Generic : public Serializable {
       writer.Put(t, value);
     }
 
+    MemberBase* CopyTo(void* storage, Arena* arena) const override {
+      return Create<Member>(storage, arena, *this);
+    }
+
+    MemberBase* MoveTo(void* storage) override {
+      return Relocate(this, storage);
+    }
+
+    void Destroy(Arena* arena) override {
+      Release(this, arena);
+    }
+
     T value;
   };
 
@@ -117,11 +142,105 @@ class Generic : public Serializable {
       writer.Put(t, this->value, defaultValue);
     }
 
+    MemberBase* CopyTo(void* storage, Arena* arena) const override {
+      return Create<MemberWithDefault>(storage, arena, *this);
+    }
+
+    MemberBase* MoveTo(void* storage) override {
+      return Relocate(this, storage);
+    }
+
+    void Destroy(Arena* arena) override {
+      Release(this, arena);
+    }
+
     T defaultValue;
   };
 
  private:
-  std::map<Token, std::shared_ptr<MemberBase>> m_members;
+  // Room for a Member<std::string> or a Member<std::vector<T>>. Aligned like a pointer rather than to
+  // max_align_t, so that the storage follows the three pointer-sized fields of an Entry without padding
+  // and an Entry is 64 bytes on 64-bit platforms.
+  static constexpr size_t InlineSize = 40;
+  static constexpr size_t InlineAlignment = alignof(void*);
+
+  template<typename U>
+  static constexpr bool IsInline() {
+    return sizeof(U) <= InlineSize && alignof(U) <= InlineAlignment &&
+        std::is_nothrow_move_constructible<U>::value;
+  }
+
+  // Constructs a member in the inline storage of an entry if it fits, otherwise in the arena or on the heap
+  template<typename U, typename... Args>
+  static MemberBase* Create(void* storage, Arena* arena, Args&&... args) {
+    if (!IsInline<U>()) {
+      storage = arena ? arena->Allocate(sizeof(U), alignof(U)) : ::operator new(sizeof(U));
+    }
+    return new (storage) U(std::forward<Args>(args)...);
+  }
+
+  // Moves an inline member to the storage of another entry. Members outside of an entry just change hands.
+  template<typename U>
+  static MemberBase* Relocate(U* member, void* storage) {
+    if (!IsInline<U>()) {
+      return member;
+    }
+    auto* moved = new (storage) U(std::move(*member));
+    member->~U();
+    return moved;
+  }
+
+  template<typename U>
+  static void Release(U* member, Arena* arena) {
+    member->~U();
+    if (!IsInline<U>() && !arena) {
+      ::operator delete(member);
+    }
+  }
+
+  class Entry {
+   public:
+    explicit Entry(Token token) : m_token(token) {}
+    Entry(const Entry& other);
+    Entry(Entry&& other) noexcept;
+    Entry& operator=(const Entry& other);
+    Entry& operator=(Entry&& other) noexcept;
+    ~Entry() {
+      Reset();
+    }
+
+    template<typename U, typename... Args>
+    void Set(Args&&... args) {
+      Reset();
+      m_arena = Arena::Current();
+      m_member = Create<U>(m_storage, m_arena, std::forward<Args>(args)...);
+    }
+
+    Token GetToken() const {
+      return m_token;
+    }
+
+    MemberBase* GetMember() const {
+      return m_member;
+    }
+
+   private:
+    void Reset();
+    void MoveFrom(Entry& other);
+
+    Token m_token;
+    MemberBase* m_member = nullptr;
+    Arena* m_arena = nullptr;
+    alignas(InlineAlignment) unsigned char m_storage[InlineSize];
+  };
+  static_assert(sizeof(void*) != 8 || sizeof(Entry) == 64, "An Entry should fill a cache line");
+
+  // Returns the entry for the token, adding an empty one if needed
+  Entry& Insert(Token token);
+  // Finds the entry for a token, trying the one at hint first. Updates hint to the index after the entry found.
+  Entry* Find(Token token, size_t& hint);
+
+  ArenaVector<Entry> m_members;
 };
 
 //! @brief Automatically use std::string instead of const char*
@@ -0,0 +1,219 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#pragma once
+
+/** @file
+ *  Contains LogWriter and LogReader, which store many independent records in one append-only file.
+ */
+
+#include <TokenStream/Executor.h>
+#include <TokenStream/TokenStream.h>
+#include <TokenStream/Writer.h>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <vector>
+
+namespace TokenStream {
+
+/** @brief Appends records to a framed log
+ *
+ * Each record is a complete TokenStream, e.g. the output of a MemoryWriter. Records are collected
+ * into blocks, and each block goes to the stream in one write, behind a sync marker and followed by
+ * a CRC-32C checksum. Close() ends the log with an index of the blocks, so that a LogReader can go
+ * straight to any record. The log itself is a TokenStream; FORMAT.md describes its chunks.
+ *
+ * @code
+ *  std::ofstream file{"events.tslog", std::ios::binary};
+ *  TokenStream::LogWriter log{file};
+ *  TokenStream::MemoryWriter record;
+ *  for (const auto& event : events) {
+ *    record.clear();
+ *    record.Put(Event::Token::time, event.time).Put(Event::Token::name, event.name);
+ *    log.Append(record);
+ *  }
+ *  log.Close();
+ * @endcode
+ *
+ * @see LogReader
+ */
+class LogWriter {
+ public:
+  //! Default number of bytes of records in a block
+  static constexpr size_t DefaultBlockSize = 0x10000;
+
+  //! @brief Starts a log at the current position of \p stream
+  //! @param stream Must stay valid until the log is closed.
+  //! @param blockSize A block is written once its records take at least this many bytes.
+  //! @param writeIndex If \e false, Close() leaves out the index and LogReader finds the blocks by their sync markers.
+  explicit LogWriter(std::ostream& stream, size_t blockSize = DefaultBlockSize, bool writeIndex = true);
+
+  //! @brief Closes the log if Close() was not called
+  ~LogWriter() {
+    Close();
+  }
+
+  // no copying
+  LogWriter(const LogWriter&) = delete;
+  LogWriter& operator=(const LogWriter&) = delete;
+
+  //@{
+  //! @brief Adds a record. Records are numbered from 0 in the order they are appended.
+  //! @returns \e false if the log is closed or the stream failed
+  bool Append(const void* data, size_t size);
+  bool Append(BlockView record) {
+    return Append(record.data(), record.size());
+  }
+  bool Append(const MemoryWriter& record) {
+    return Append(record.data(), record.size());
+  }
+  //@}
+
+  //! @brief Writes the records appended so far as a block, even if it is not full yet
+  //! @returns \e false if the stream failed
+  bool Flush();
+
+  //! @brief Writes the last block and the index, then flushes the stream. Nothing can be appended afterwards.
+  //! @returns \e false if the stream failed
+  bool Close();
+
+  //! @brief Returns the number of records appended so far
+  uint64_t GetRecordCount() const {
+    return m_recordCount;
+  }
+
+ private:
+  bool WriteFrame();
+
+  std::ostream* m_stream;
+  size_t m_blockSize;
+  bool m_writeIndex;
+  bool m_closed = false;
+  bool m_failed = false;
+  // Records of the block being collected, and the block with its sync marker and checksum
+  MemoryWriter m_block;
+  MemoryWriter m_frame;
+  uint64_t m_recordCount = 0;
+  // Bytes written to m_stream
+  uint64_t m_offset = 0;
+  // Where each block starts and the number of its first record, for the index
+  std::vector<uint64_t> m_blockOffsets;
+  std::vector<uint64_t> m_blockFirstRecords;
+};
+
+/** @brief Reads the records of a log written by LogWriter
+ *
+ * The log is read from memory, e.g. a MappedFile. If it ends with an index, the blocks are known
+ * straight away. Otherwise, e.g. if the writer never got to Close(), they are found by scanning for
+ * sync markers, which also steps over damaged parts of the file. The checksum of a block is checked
+ * before any of its records are handed out, and the records of damaged blocks are left out.
+ *
+ * @code
+ *  TokenStream::MappedFile file{"events.tslog", TokenStream::MappedFile::Access::Random};
+ *  TokenStream::LogReader log{file.data(), file.size()};
+ *  TokenStream::BlockView record;
+ *  if (log.GetRecord(123456, record)) {
+ *    TokenStream::Reader reader{record.data(), record.size()};
+ *    ...
+ *  }
+ *  log.ForEachRecordParallel([](uint64_t index, TokenStream::BlockView record) { ... });
+ * @endcode
+ *
+ * @note The memory must stay valid for the lifetime of the LogReader and the records it returns.
+ * @see LogWriter
+ */
+class LogReader {
+ public:
+  //! @brief Finds the blocks of the log in \p size bytes at \p data
+  LogReader(const uint8_t* data, size_t size);
+
+  //! @brief Finds the blocks of the log in \p data, which must stay valid for the lifetime of the LogReader.
+  explicit LogReader(const Binary& data) : LogReader(data.data(), data.size()) {}
+
+  //! @brief Do not allow move semantics for the buffer. We need it to stick around externally.
+  explicit LogReader(Binary&&) = delete;
+
+  //! @brief Returns \e true if the blocks were taken from the index at the end of the log rather than found by scanning.
+  bool HasIndex() const {
+    return m_hasIndex;
+  }
+
+  //! @brief Returns the number of blocks, damaged ones included.
+  size_t GetBlockCount() const {
+    return m_blocks.size();
+  }
+
+  //! @brief Returns one more than the number of the last record.
+  uint64_t GetRecordCount() const {
+    return m_recordCount;
+  }
+
+  //! @brief Returns the number of blocks found to be damaged so far.
+  //! @note Without an index, every block is checked when it is found. With one, blocks are checked when they are first read.
+  size_t GetDamagedBlockCount() const;
+
+  //! @brief Finds record \p index
+  //! @returns \e false if there is no such record or its block is damaged
+  bool GetRecord(uint64_t index, BlockView& record);
+
+  //! @brief Calls \p visit for every record of the blocks that are not damaged, in order.
+  void ForEachRecord(const std::function<void(uint64_t index, BlockView record)>& visit);
+
+  //! @brief Calls \p visit for every record of the blocks that are not damaged, one block per task.
+  //! The records of a block are visited in order, but different blocks are visited concurrently.
+  //! @param threadCount Number of threads. 0 uses std::thread::hardware_concurrency().
+  void ForEachRecordParallel(const std::function<void(uint64_t index, BlockView record)>& visit, size_t threadCount = 0);
+  void ForEachRecordParallel(const std::function<void(uint64_t index, BlockView record)>& visit, const Executor& executor);
+
+ private:
+  enum class State : uint8_t { Unchecked, Good, Damaged };
+  struct Block {
+    // The sync marker in front of the block
+    size_t m_offset = 0;
+    // The records of the block, after its header
+    size_t m_dataOffset = 0;
+    size_t m_dataSize = 0;
+    uint64_t m_firstRecord = 0;
+    uint64_t m_recordCount = 0;
+    State m_state = State::Unchecked;
+  };
+
+  bool ReadIndex();
+  void Scan();
+  // Returns the offset of the first sync marker at or after \p offset, or m_size if there is none
+  size_t FindSyncMarker(size_t offset) const;
+  // Finds the block whose sync marker is at \p offset and returns the offset after its checksum, or 0
+  size_t ParseFrame(size_t offset, Block& block) const;
+  // Verifies the checksum and counts the records the first time \p block is used
+  bool Check(Block& block) const;
+  void VisitBlock(Block& block, const std::function<void(uint64_t, BlockView)>& visit) const;
+
+  const uint8_t* m_data;
+  size_t m_size;
+  bool m_hasIndex = false;
+  uint64_t m_recordCount = 0;
+  std::vector<Block> m_blocks;
+};
+
+} // namespace TokenStream
@@ -0,0 +1,179 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <TokenStream/Reader.h>
+#include <TokenStream/Writer.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace TokenStream {
+
+/** @brief Read-only memory mapping of a whole file
+ *
+ * Use it with a Reader or a TokenIndex to parse a file without copying it through an iostream.
+ *
+ * @code
+ *  TokenStream::MappedFile file{"records.ts", TokenStream::MappedFile::Access::Random};
+ *  TokenStream::TokenIndex index{file.data(), file.size()};
+ * @endcode
+ *
+ * @see MappedFileReader
+ * @see MappedFileWriter
+ */
+class MappedFile {
+ public:
+  //! @brief How the mapping will be read, passed on to the OS as a hint
+  enum class Access {
+    Normal,
+    //! From start to end, e.g. with a Reader. Pages are read ahead aggressively.
+    Sequential,
+    //! Jumping around, e.g. through a TokenIndex. Pages are not read ahead.
+    Random
+  };
+
+  MappedFile() = default;
+
+  //! @brief Maps the file at \p path. Check IsOpen() to see if it worked.
+  explicit MappedFile(const std::string& path, Access access = Access::Sequential);
+
+  ~MappedFile() {
+    Close();
+  }
+
+  // no copying
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  //! @brief Returns \e true if the file was opened. An empty file is open but has no data.
+  bool IsOpen() const;
+
+  const uint8_t* data() const {
+    return m_data;
+  }
+
+  size_t size() const {
+    return m_size;
+  }
+
+  //! @brief Changes the access hint for the mapping
+  //! @note On Windows the hint can only be given when the file is opened, so this does nothing.
+  void Advise(Access access);
+
+  //! @brief Unmaps and closes the file
+  void Close();
+
+ private:
+  friend class MappedFileWriter;
+
+  // Creates or truncates the file at \p path and maps \p size writable bytes of it
+  bool Create(const std::string& path, size_t size);
+  // Unmaps the file and cuts it to \p size bytes. If \p data is not the mapping, it is written instead.
+  bool Finish(const uint8_t* data, size_t size);
+
+  uint8_t* m_data = nullptr;
+  size_t m_size = 0;
+#if _WIN32
+  void* m_file = nullptr;
+  void* m_mapping = nullptr;
+#else
+  int m_fd = -1;
+#endif
+};
+
+/** @brief Reader over a memory-mapped file
+ *
+ * The file is parsed straight from the mapping, as with Reader(const uint8_t*, size_t).
+ *
+ * @code
+ *  TokenStream::MappedFileReader reader{"records.ts"};
+ *  while (!reader.EOS()) {
+ *    reader.GetToken();
+ *    Record record;
+ *    reader >> record;
+ *  }
+ * @endcode
+ */
+class MappedFileReader : private MappedFile, public Reader {
+ public:
+  //! @brief Maps the file at \p path. If it cannot be opened, the Reader is empty and IsOpen() returns \e false.
+  explicit MappedFileReader(const std::string& path, Access access = Access::Sequential) :
+      MappedFile{path, access},
+      Reader{MappedFile::data() ? MappedFile::data() : reinterpret_cast<const uint8_t*>(""), MappedFile::size()} {}
+
+  using MappedFile::Access;
+  using MappedFile::Advise;
+  using MappedFile::IsOpen;
+
+  //! @brief Returns the mapping, e.g. to build a TokenIndex over the same file
+  const MappedFile& GetFile() const {
+    return *this;
+  }
+};
+
+/** @brief Writer that writes into a memory-mapped file
+ *
+ * The file is mapped with room for \e capacity bytes up front. The exact size can be found with a
+ * SizeCounter. Close() cuts the file to the number of bytes written. If more than \e capacity is
+ * written, the output moves to the heap and Close() writes it to the file instead.
+ *
+ * @code
+ *  TokenStream::SizeCounter counter;
+ *  record.Write(counter);
+ *  TokenStream::MappedFileWriter writer{"record.ts", counter.size()};
+ *  record.Write(writer);
+ *  writer.Close();
+ * @endcode
+ */
+class MappedFileWriter : public Writer {
+ public:
+  //! @brief Creates or truncates the file at \p path
+  //! @param capacity Number of bytes to map up front
+  //! @param trimDefaults If \e true, default values will not be written. If \e false, tokens with 0-len will be written for default values.
+  MappedFileWriter(const std::string& path, size_t capacity, bool trimDefaults = true);
+
+  //! @brief Closes the file if Close() was not called
+  ~MappedFileWriter() {
+    Close();
+  }
+
+  //! @brief Returns \e true if the file was created and has not been closed
+  bool IsOpen() const {
+    return m_file.IsOpen();
+  }
+
+  //! @brief Returns the number of bytes written so far.
+  size_t size() const {
+    return m_size;
+  }
+
+  //! @brief Finishes the file. Nothing more can be written afterwards.
+  //! @returns \e false if the file could not be written.
+  bool Close();
+
+ private:
+  MappedFile m_file;
+};
+
+} // namespace TokenStream
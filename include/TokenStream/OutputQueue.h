@@ -0,0 +1,170 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <TokenStream/TokenStream.h>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <streambuf>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define TOKENSTREAM_COROUTINES 1
+#endif
+#endif
+
+namespace TokenStream {
+
+/** @brief Queues the output of a stream Writer for a non-blocking sink, e.g. a socket
+ *
+ * Create a Writer on GetStream(). A stream Writer only writes top-level chunks once they are
+ * complete, so each of them is queued as soon as it is done and handed to the sink once SendSize
+ * bytes are waiting, or when Flush() is called. The sink takes what it can without blocking. The
+ * rest stays queued until the event loop reports that the socket is writable again and calls
+ * Flush().
+ *
+ * Backpressure comes from the water marks. IsFull() turns \e true once the queued bytes reach the
+ * high-water mark. Stop writing messages then, and carry on once the queue has drained down to the
+ * low-water mark, which is reported to the callback given to SetOnDrained(). With C++20
+ * coroutines, you can also `co_await queue.Drained()`.
+ *
+ * @code
+ *  TokenStream::OutputQueue queue{[&](const uint8_t* data, size_t size) {
+ *    const auto sent = ::send(socket, data, size, MSG_DONTWAIT);
+ *    return sent > 0 ? static_cast<size_t>(sent) : 0;
+ *  }};
+ *  queue.SetOnDrained([&] { connection.ResumeWriting(); });
+ *
+ *  // Whenever there is a message to send and !queue.IsFull()
+ *  TokenStream::Writer writer{queue.GetStream()};
+ *  message.Write(writer);
+ *  queue.Flush();
+ *
+ *  // Whenever the socket is writable
+ *  queue.Flush();
+ * @endcode
+ *
+ * @note OutputQueue is not thread-safe. Use it from the thread that runs the connection.
+ * @see PushParser for the reading side
+ */
+class OutputQueue : private std::streambuf {
+ public:
+  //! @brief Takes up to \p size bytes without blocking and returns how many it took, 0 if none.
+  using Sink = std::function<size_t(const uint8_t* data, size_t size)>;
+
+  //! Default for the number of queued bytes at which IsFull() turns \e true
+  static constexpr size_t DefaultHighWaterMark = 0x100000;
+  //! Default for the number of queued bytes at which a full queue counts as drained
+  static constexpr size_t DefaultLowWaterMark = 0x10000;
+  //! Bytes queued before they are handed to the sink without waiting for Flush()
+  static constexpr size_t SendSize = 0x4000;
+
+  //! @param sink Receives the output. It is called from Flush() and while the Writer writes.
+  //! @param highWaterMark Number of queued bytes at which the queue is full.
+  //! @param lowWaterMark Number of queued bytes at which a full queue has drained. At most \p highWaterMark.
+  explicit OutputQueue(Sink sink, size_t highWaterMark = DefaultHighWaterMark,
+                       size_t lowWaterMark = DefaultLowWaterMark);
+
+  // no copying
+  OutputQueue(const OutputQueue&) = delete;
+  OutputQueue& operator=(const OutputQueue&) = delete;
+
+  ~OutputQueue() override = default;
+
+  //! @brief Returns the stream to create a Writer on.
+  std::ostream& GetStream() {
+    return m_stream;
+  }
+
+  //! @brief Hands as many queued bytes to the sink as it takes, then reports a drained queue.
+  //! @returns \e true if nothing is left in the queue.
+  //! @note Do not call it while a Writer is in the middle of a message, since the callback given to
+  //! SetOnDrained() or a waiting coroutine may start writing the next one.
+  bool Flush();
+
+  //! @brief Returns the number of bytes that the sink has not taken yet.
+  size_t GetQueuedBytes() const {
+    return m_buffer.size() - m_sent;
+  }
+
+  //! @brief Returns \e true from the moment the queue reaches the high-water mark until it drains to the low-water mark.
+  bool IsFull() const {
+    return m_full;
+  }
+
+  //! @brief Calls \p onDrained whenever a full queue has drained to the low-water mark.
+  void SetOnDrained(std::function<void()> onDrained) {
+    m_onDrained = std::move(onDrained);
+  }
+
+#if TOKENSTREAM_COROUTINES
+  //! @brief Awaitable that resumes the coroutine once the queue is not full. Only one coroutine may wait at a time.
+  struct DrainedAwaiter {
+    OutputQueue& m_queue;
+    bool await_ready() const noexcept {
+      return !m_queue.IsFull();
+    }
+    void await_suspend(std::coroutine_handle<> handle) {
+      m_queue.m_resume = [handle] {
+        handle.resume();
+      };
+    }
+    void await_resume() const noexcept {}
+  };
+
+  //! @brief Use `co_await queue.Drained()` before writing a message to wait while the queue is full.
+  DrainedAwaiter Drained() {
+    return DrainedAwaiter{*this};
+  }
+#endif
+
+ private:
+  int_type overflow(int_type c) override;
+  std::streamsize xsputn(const char* data, std::streamsize size) override;
+  int sync() override;
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+  void Queue(const void* data, size_t size);
+  // Hands the queued bytes to the sink, without reporting a drained queue
+  void Send();
+
+  Sink m_sink;
+  size_t m_highWaterMark;
+  size_t m_lowWaterMark;
+  std::function<void()> m_onDrained;
+  // Set by a coroutine waiting in Drained()
+  std::function<void()> m_resume;
+
+  // The bytes the sink has not taken are m_buffer[m_sent, m_buffer.size())
+  Binary m_buffer;
+  size_t m_sent = 0;
+  // Bytes queued since the OutputQueue was created, which is what tellp() reports
+  size_t m_written = 0;
+  bool m_full = false;
+  std::ostream m_stream{this};
+};
+
+} // namespace TokenStream
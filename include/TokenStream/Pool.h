@@ -0,0 +1,144 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <TokenStream/Reader.h>
+#include <TokenStream/Writer.h>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <utility>
+
+namespace TokenStream {
+
+/** @brief Per-thread pool of Readers and Writers that are reused from one message to the next
+ *
+ * Creating a Reader or Writer for every request means growing their buffers again every time.
+ * Pool hands out objects that were returned earlier on the same thread, reset with
+ * Reader::Reset(), Reader::Rebind(), Writer::Rebind() or MemoryWriter::clear(), so their
+ * read-ahead window and output region are already warm. The object goes back to the pool when
+ * the Lease is destroyed.
+ *
+ * @code
+ *  void Handle(const Binary& request, std::ostream& out)
+ *  {
+ *    Request message;
+ *    {
+ *      auto reader = TokenStream::Pool::GetReader(request);
+ *      message.Read(*reader);
+ *    }
+ *    auto writer = TokenStream::Pool::GetWriter();
+ *    Respond(message).Write(*writer);
+ *    out.write(reinterpret_cast<const char*>(writer->data()), static_cast<std::streamsize>(writer->size()));
+ *  }
+ * @endcode
+ *
+ * Each thread has its own pool, so nothing is locked. A Lease must be destroyed on the thread
+ * that got it. Pooled objects always allocate from the heap, never from the Arena of the
+ * current Scope, since they outlive it.
+ *
+ * @note At most MaxIdle objects of each kind are kept per thread, and Writers whose output
+ * region grew beyond MaxIdleCapacity are freed rather than kept.
+ * @see Reader::Reset
+ * @see Writer::Rebind
+ */
+class Pool {
+ public:
+  //! Number of idle objects of each kind kept per thread
+  static constexpr size_t MaxIdle = 4;
+
+  //! Writers with a larger output region are freed when they are returned
+  static constexpr size_t MaxIdleCapacity = 0x100000;
+
+  //! @brief Use of a pooled object. It goes back to the pool of the thread when the Lease is destroyed.
+  template<typename T>
+  class Lease { // NOLINT
+   public:
+    Lease(Lease&& other) noexcept : m_object(std::move(other.m_object)) {}
+
+    // no copying
+    Lease(const Lease&) = delete;
+    Lease& operator=(const Lease&) = delete;
+    Lease& operator=(Lease&&) = delete;
+
+    ~Lease() {
+      if (m_object) {
+        Pool::Return(std::move(m_object));
+      }
+    }
+
+    T& operator*() const {
+      return *m_object;
+    }
+    T* operator->() const {
+      return m_object.get();
+    }
+
+   private:
+    friend class Pool;
+    explicit Lease(std::unique_ptr<T> object) : m_object(std::move(object)) {}
+
+    std::unique_ptr<T> m_object;
+  };
+
+  //! @brief Returns a Reader on \p data, as if created with Reader(data, size). The memory must outlive the Lease.
+  static Lease<Reader> GetReader(const uint8_t* data, size_t size);
+
+  //! @brief Returns a Reader on the contents of \p data. It must outlive the Lease.
+  static Lease<Reader> GetReader(const Binary& data) {
+    return GetReader(data.data(), data.size());
+  }
+
+  //! @brief Do not allow move semantics for the buffer. We need it to stick around externally.
+  static Lease<Reader> GetReader(Binary&&) = delete;
+
+  //! @brief Returns a Reader on \p stream, as if created with Reader(stream). The stream must outlive the Lease.
+  //! The bytes that were read ahead are given back to the stream when the Lease is destroyed.
+  static Lease<Reader> GetReader(std::istream& stream);
+
+  //! @brief Do not allow move semantics for the stream. We need it to stick around externally.
+  static Lease<Reader> GetReader(std::istream&&) = delete;
+
+  //! @brief Returns an empty MemoryWriter, as if created with MemoryWriter(trimDefaults).
+  static Lease<MemoryWriter> GetWriter(bool trimDefaults = true);
+
+  //! @brief Returns a Writer on \p stream, as if created with Writer(stream, trimDefaults).
+  //! The stream must outlive the Lease.
+  static Lease<Writer> GetWriter(std::ostream& stream, bool trimDefaults = true);
+
+  //! @brief Do not allow move semantics for the stream. We need it to stick around externally.
+  static Lease<Writer> GetWriter(std::ostream&& stream, bool trimDefaults = true) = delete;
+
+  //! @brief Frees the idle objects of the calling thread.
+  static void Clear();
+
+ private:
+  static void Return(std::unique_ptr<Reader> reader);
+  static void Return(std::unique_ptr<MemoryWriter> writer);
+  static void Return(std::unique_ptr<Writer> writer);
+};
+
+} // namespace TokenStream
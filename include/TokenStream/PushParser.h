@@ -0,0 +1,223 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <TokenStream/Reader.h>
+#include <TokenStream/TokenStream.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace TokenStream {
+
+/** @brief Parses a TokenStream that arrives in pieces, e.g. from a non-blocking socket
+ *
+ * Give the parser each fragment as it arrives with Feed(). Chunks are reported to a Handler as
+ * soon as all of their bytes are in, and the parser remembers where it stopped, so fragments may
+ * be split anywhere, even in the middle of a header. The nesting of SubStreams is kept on an
+ * explicit stack rather than on the call stack.
+ *
+ * @code
+ *  struct Route : TokenStream::PushParser::Handler {
+ *    bool IsObject(TokenStream::Token token, size_t depth) override {
+ *      return depth == 0 && token == Token::header;
+ *    }
+ *    void OnValue(const TokenStream::PushParser::Value& value) override {
+ *      if (value.m_depth == 1 && value.m_token == Header::Token::destination) {
+ *        value.Get(destination);
+ *      }
+ *    }
+ *    std::string destination;
+ *  };
+ *
+ *  Route route;
+ *  TokenStream::PushParser parser{route};
+ *  while (auto size = socket.Receive(buffer, sizeof buffer)) {
+ *    if (parser.Feed(buffer, size) == TokenStream::PushParser::Status::Error) {
+ *      break;
+ *    }
+ *  }
+ * @endcode
+ *
+ * @note The parser cannot tell where a message ends, so Status::Complete only means that no chunk
+ * is partially received. Use Reset() between messages.
+ * @see Reader
+ */
+class PushParser {
+ public:
+  enum class Status {
+    //! Everything fed so far has been parsed and no chunk is partially received
+    Complete,
+    //! A chunk or a nested object is waiting for more bytes
+    NeedMoreData,
+    //! The data is not a valid TokenStream. Nothing more will be parsed until Reset().
+    Error
+  };
+
+  //! @brief A chunk whose data has arrived completely
+  struct Value {
+    Token m_token;
+    //! The data of the chunk. It is only valid during the call to Handler::OnValue().
+    BlockView m_data;
+    //! Number of enclosing objects
+    size_t m_depth = 0;
+    //! \e true if the data is a packed vector of numbers
+    bool m_packed = false;
+    //! \e true if the data was compressed by Writer::PutCompressed(). ReadInto() and Get() of an object decompress it.
+    bool m_compressed = false;
+
+    //! @brief Reads the data into \p value like Reader does after GetToken()
+    //! @returns \e false if the data is not valid for \p value
+    template<typename T>
+    bool Get(T& value) const {
+      ChunkBuffer chunk{*this};
+      Reader reader{chunk.data(), chunk.size()};
+      reader.GetToken();
+      reader >> value;
+      return reader.VerifyEOS();
+    }
+
+    //! @brief Reads the chunk as a member of \p object, as if it was part of the stream \p object reads.
+    //! @returns \e false if the data is not valid.
+    bool ReadInto(Serializable& object) const;
+  };
+
+  //! @brief Receives the chunks
+  class Handler {
+   public:
+    virtual ~Handler() = default;
+
+    //! @brief Return \e true to parse the data of \p token as nested chunks instead of receiving it in OnValue()
+    //! @note Compressed objects are always received in OnValue(), since they can only be read once complete.
+    //! @param depth Number of enclosing objects
+    virtual bool IsObject(Token token, size_t depth) {
+      (void)token;
+      (void)depth;
+      return false;
+    }
+
+    //! @brief Called for each chunk that is not an object, once all of its data has arrived
+    virtual void OnValue(const Value& value) = 0;
+
+    //! @brief Called when the header of an object has arrived. Its chunks follow at \p depth + 1.
+    virtual void OnBeginObject(Token token, size_t depth) {
+      (void)token;
+      (void)depth;
+    }
+
+    //! @brief Called when all the data of an object has arrived
+    virtual void OnEndObject(Token token, size_t depth) {
+      (void)token;
+      (void)depth;
+    }
+  };
+
+  //! @brief Reports the chunks to \p handler. It must outlive the parser.
+  explicit PushParser(Handler& handler) : m_handler{&handler} {
+    Reset();
+  }
+
+  //! @brief Reads each top-level chunk into \p object as soon as it has arrived. \p object must outlive the parser.
+  //! @note As with Reader, \p object should be cleared before the first Feed().
+  explicit PushParser(Serializable& object);
+
+  // no copying
+  PushParser(const PushParser&) = delete;
+  PushParser& operator=(const PushParser&) = delete;
+
+  //! @brief Parses as much of \p data as possible. Nothing in \p data has to stay valid after the call.
+  Status Feed(const uint8_t* data, size_t size);
+
+  //! @brief Returns the status after the last Feed()
+  Status GetStatus() const;
+
+  //! @brief Returns how many objects the parser is currently inside of
+  size_t GetDepth() const {
+    return m_frames.size() - 1;
+  }
+
+  //! @brief Forgets any partial chunk and any error so that a new message can be parsed
+  void Reset();
+
+ private:
+  //! Largest possible header: 0xf8, an element count, a token and a length
+  static constexpr size_t MaxHeaderSize = 1 + 3 * 9;
+
+  // Holds a Value as a standalone chunk that a Reader can parse
+  class ChunkBuffer {
+   public:
+    explicit ChunkBuffer(const Value& value);
+    const uint8_t* data() const {
+      return m_data;
+    }
+    size_t size() const {
+      return m_size;
+    }
+
+   private:
+    uint8_t m_small[0x100];
+    Binary m_large;
+    const uint8_t* m_data;
+    size_t m_size;
+  };
+
+  // One level of nesting. This is what Reader keeps in its SubStreamContext.
+  struct Frame {
+    Token m_token;
+    uint64_t m_end;
+    Token m_containerToken;
+    uint64_t m_containerRemaining = 0;
+    explicit Frame(Token token = Token::InvalidTokenValue, uint64_t end = UINT64_MAX) :
+        m_token(token), m_end(end) {}
+  };
+
+  enum class HeaderResult { Incomplete, Invalid, Done };
+
+  HeaderResult DecodeHeader();
+  void StartChunk(Token token, uint64_t length, bool packed, bool compressed);
+  void EmitValue(const uint8_t* data, size_t size);
+  bool EndFrames();
+  Status Fail();
+
+  Handler* m_handler;
+  std::unique_ptr<Handler> m_objectHandler;
+  std::vector<Frame> m_frames;
+  uint64_t m_offset = 0;
+
+  // The header being received
+  uint8_t m_header[MaxHeaderSize];
+  size_t m_headerSize = 0;
+
+  // The value being received
+  bool m_inValue = false;
+  Token m_token;
+  uint64_t m_remaining = 0;
+  bool m_packed = false;
+  bool m_compressed = false;
+  Binary m_value;
+
+  bool m_badStream = false;
+};
+
+} // namespace TokenStream
@@ -29,11 +29,15 @@
  *  persistent data.
  */
 
+#include <TokenStream/Arena.h>
+#include <TokenStream/Compression.h>
+#include <TokenStream/Executor.h>
 #include <TokenStream/TokenStream.h>
 #include <functional>
 #include <istream>
 #include <list>
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
 #include <unordered_map>
@@ -133,6 +137,16 @@ class Reader { // NOLINT
       typename has_emplace_back_method_Void<decltype(std::declval<T&>().emplace_back())>::type>
       : std::true_type {};
 
+  template<typename>
+  struct has_clear_method_Void {
+    typedef void type;
+  };
+  template<typename T, typename Sfinae = void>
+  struct has_clear_method : std::false_type {};
+  template<typename T>
+  struct has_clear_method<T, typename has_clear_method_Void<decltype(std::declval<T&>().clear())>::type>
+      : std::true_type {};
+
   // Find out whether T has `void ReadFromTokenStream(Reader&)` method or a Helper<T> with a Read method
   template<typename>
   struct has_read_from_token_stream_method_Void {
@@ -168,20 +182,74 @@ class Reader { // NOLINT
       T,
       typename has_value_reader_helper_Void<decltype(Helper<T>::ReadSingleValue(
           *static_cast<T*>(nullptr), *static_cast<Reader*>(nullptr)))>::type> : std::true_type {};
+  template<typename T>
+  struct has_custom_reader {
+    static constexpr bool value = std::is_base_of<Serializable, T>::value ||
+        has_read_from_token_stream_method<T>::value || has_object_reader_helper<T>::value;
+  };
 
   //! @brief Creates Reader that will operate on the specified stream
   //! @param stream A generic stream that contains the binary data to parse
   //! std::istream is a base class that you can override to stream data into the Reader.
   //! If you simply want to read data from a buffer, use the AZ::IO::MemoryStream class.
+  //! @note The Reader reads ahead in blocks of ReadAheadSize bytes, so that small reads and skips
+  //! do not go to the stream one by one. The bytes it did not use are given back when it is destroyed.
   explicit Reader(std::istream& stream);
 
+  //! Size of the window that stream Readers read ahead into
+  static constexpr size_t ReadAheadSize = 0x10000;
+
+  //! @brief Creates Reader that will operate directly on a block of memory
+  //! @param data Pointer to the start of the binary data to parse
+  //! @param size Number of bytes available at \p data
+  //! @note The memory must stay valid for the lifetime of the Reader. Tokens, lengths and values are
+  //! read straight from the buffer and SubStream and Skip become offset arithmetic.
+  Reader(const uint8_t* data, size_t size);
+
+  //! @brief Creates Reader that will operate directly on the contents of \p data
+  //! @param data The binary data to parse. It must stay valid for the lifetime of the Reader.
+  explicit Reader(const Binary& data) : Reader(data.data(), data.size()) {}
+
   //! @brief Do not allow move semantics for the stream. We need it to stick around externally.
   explicit Reader(std::istream&&) = delete;
 
+  //! @brief Do not allow move semantics for the buffer. We need it to stick around externally.
+  explicit Reader(Binary&&) = delete;
+
   // no copying
   Reader(const Reader&) = delete;
   Reader& operator=(const Reader&) = delete;
 
+  //! @brief Moves the stream back to the end of the last chunk that was read
+  ~Reader();
+
+  /*! @brief Points the Reader at a block of memory, as if it had just been created with Reader(data, size).
+   *
+   * Everything about the previous input is forgotten, including a failed read, but the buffers
+   * used for read-ahead and decompression are kept, as is the Codec given to SetCodec().
+   * A stream the Reader was using first gets back the bytes that were read ahead.
+   *
+   * @pre No SubStream of this Reader is alive.
+   * @see Pool
+   */
+  void Reset(const uint8_t* data, size_t size);
+
+  //! @brief Points the Reader at the contents of \p data, as if it had just been created with Reader(data).
+  void Reset(const Binary& data) {
+    Reset(data.data(), data.size());
+  }
+
+  //! @brief Do not allow move semantics for the buffer. We need it to stick around externally.
+  void Reset(Binary&&) = delete;
+
+  //! @brief Points the Reader at \p stream, as if it had just been created with Reader(stream).
+  //! The read-ahead window is reused, so a Reader that is rebound for every message only allocates it once.
+  //! @pre No SubStream of this Reader is alive.
+  void Rebind(std::istream& stream);
+
+  //! @brief Do not allow move semantics for the stream. We need it to stick around externally.
+  void Rebind(std::istream&&) = delete;
+
   //! @brief Retrieves the next token and updates the stream pointer
   //! @post Stream pointer will be updated.
   Token GetToken();
@@ -420,6 +488,32 @@ class Reader { // NOLINT
   void GetSerializable(Serializable& object, const TokenMap& tokenMap);
   //@}
 
+  //! @brief Applies a member written by Writer::PutDelta(). Used by the \e MAP_TOKEN and \e ENUMERATED_TOKEN
+  //! macros to implement Serializable::ApplyDelta().
+  //! @note Containers are replaced rather than appended to, and objects with a token map, and vectors of
+  //! them that did not change size, have their own deltas applied.
+  //! @pre EOS() == false
+  //! @pre Last method must have been GetToken() or a \b const method.
+  //! @post EOS() || stream points to the next token
+  template<typename T>
+  void GetDelta(T& member) {
+    GetMemberDelta(member, std::is_base_of<Serializable, T>{});
+  }
+
+  //@{
+  //! @brief Sets a member back to its default when a delta lists it in a Serializable::DeltaResetToken chunk.
+  //! @note Without \p defaultValue, containers and strings are cleared and anything else is assigned a
+  //! value-initialized object.
+  template<typename T>
+  static void ResetMember(T& member) {
+    ClearOrAssign(member, has_clear_method<T>{});
+  }
+  template<typename T, typename D>
+  static void ResetMember(T& member, const D& defaultValue) {
+    member = static_cast<T>(defaultValue);
+  }
+  //@}
+
   //! @brief Retrieves a vector of values.
   //! @pre EOS() == false
   //! @pre Last method must have been GetToken() or a \b const method.
@@ -431,7 +525,7 @@ class Reader { // NOLINT
   GetContainer(Container<T, Params...>& vec) {
     const auto containerToken = m_lastToken;
     if (m_nextContainerElementCount) {
-      vec.reserve(static_cast<size_t>(m_nextContainerElementCount));
+      vec.reserve(ReserveCount());
     }
     do {
       vec.emplace_back();
@@ -476,12 +570,12 @@ class Reader { // NOLINT
   GetContainer(Container<T, Params...>& vec) {
     const auto containerToken = m_lastToken;
     if (m_nextContainerElementCount) {
-      vec.reserve(static_cast<size_t>(m_nextContainerElementCount));
+      vec.reserve(ReserveCount());
     }
     do {
       T item;
       *this >> item;
-      vec.insert(item);
+      vec.insert(vec.end(), std::move(item));
       if (EOS()) {
         return;
       }
@@ -502,7 +596,7 @@ class Reader { // NOLINT
     do {
       T item;
       *this >> item;
-      vec.insert(item);
+      vec.insert(vec.end(), std::move(item));
       if (EOS()) {
         return;
       }
@@ -512,20 +606,91 @@ class Reader { // NOLINT
 
   //@{
   //! @brief Retrieves a vector of values.
+  //! @note Vectors of numbers accept both the normal list encoding and the packed encoding, and vectors of
+  //! objects accept the columnar encoding of Writer::PutColumns().
   //! @pre EOS() == false
   //! @pre Last method must have been GetToken() or a \b const method.
   //! @post EOS() || stream points to the next token
   template<class T, typename... Params>
   void GetContainer(std::vector<T, Params...>& vec) {
-    GetContainer<std::vector, T, Params...>(vec);
+    GetVector(vec, is_packable<T>{});
   }
   template<class T, typename... Params>
   Reader& operator>>(std::vector<T, Params...>& vec) {
-    GetContainer<std::vector, T, Params...>(vec);
+    GetVector(vec, is_packable<T>{});
     return *this;
   }
   //@}
 
+  /*! @brief Retrieves only the values of member \p column from a vector of objects written by Writer::PutColumns().
+        *
+        * The other columns are skipped without being decoded.
+        * @code
+        * std::vector<uint32_t> salaries;
+        * if (reader.GetToken() == Token::employees && reader.NextContainerIsPacked()) {
+        *     reader.GetColumn(Employee::Token::salary, salaries);
+        * }
+        * @endcode
+        * @param column The token of the member.
+        * @param values The values are appended to \p values, which has the type of the member.
+        * @returns \e false if the objects were not written a column at a time or the member is not one of the columns.
+        * @pre Last method must have been GetToken().
+        * @post EOS() || stream points to the next token
+        */
+  template<typename M, typename... Params>
+  bool GetColumn(Token column, std::vector<M, Params...>& values) {
+    static_assert(is_columnar<M>::value, "Only is_columnar members are written as columns");
+    if (!m_nextContainerPacked) {
+      Skip();
+      return false;
+    }
+    SubStream batch{*this};
+    size_t rowCount;
+    if (!GetColumnsHeader(rowCount)) {
+      return false;
+    }
+    while (!EOS()) {
+      if (GetToken() == column) {
+        *this >> values;
+        return !m_badStream;
+      }
+    }
+    return false;
+  }
+
+  //! @brief Reads a chunk written by Writer::PutMemberColumn() into the member that \p member returns for
+  //! every row. Used by the \e MAP_TOKEN and \e ENUMERATED_TOKEN macros.
+  template<typename Member>
+  void GetMemberColumn(const ColumnRows& rows, Member member) {
+    using M = typename std::decay<decltype(member(rows[0]))>::type;
+    GetMemberColumn<M>(rows, member, is_columnar<M>{});
+  }
+
+  //@{
+  //! @brief Retrieves a vector of objects like operator>>() does, but decodes the objects on several threads.
+  //! @param vec The objects are appended to \p vec.
+  //! @param threadCount Number of threads to use. 0 uses std::thread::hardware_concurrency().
+  //! @param executor Runs the batches, e.g. on an existing thread pool.
+  //! @note The boundaries of the objects are found first, so that each batch can be decoded by its
+  //! own Reader. Only memory-backed Readers can do that. Streams, small containers and
+  //! containers of other types are read on the calling thread.
+  //! @pre EOS() == false
+  //! @pre Last method must have been GetToken() or a \b const method.
+  //! @post EOS() || stream points to the next token
+  template<typename T, typename... Params>
+  void GetContainerParallel(std::vector<T, Params...>& vec, size_t threadCount = 0) {
+    const auto executor = [threadCount](size_t taskCount, const std::function<void(size_t)>& task) {
+      RunOnThreads(taskCount, task, threadCount);
+    };
+    // A few batches per thread even out objects of different sizes
+    GetContainerParallel(vec, executor, GetThreadCount(threadCount) * 4);
+  }
+  template<typename T, typename... Params>
+  void GetContainerParallel(std::vector<T, Params...>& vec, const Executor& executor, size_t batchCount) {
+    GetContainerParallel(vec, executor, batchCount, std::integral_constant<bool, has_custom_reader<T>::value>{});
+  }
+  //@}
+
   //@{
   //! @brief Retrieves a list of values.
   //! @pre EOS() == false
@@ -533,11 +698,11 @@ class Reader { // NOLINT
   //! @post EOS() || stream points to the next token
   template<class T, typename... Params>
   void GetContainer(std::list<T, Params...>& lst) {
-    GetContainer<std::list, T, Params...>(lst);
+    GetElements<SequenceContainerTraits<std::list<T, Params...>>>(lst);
   }
   template<class T, typename... Params>
   Reader& operator>>(std::list<T, Params...>& lst) {
-    GetContainer<std::list, T, Params...>(lst);
+    GetElements<SequenceContainerTraits<std::list<T, Params...>>>(lst);
     return *this;
   }
   //@}
@@ -549,11 +714,11 @@ class Reader { // NOLINT
   //! @post EOS() || stream points to the next token
   template<class T, typename... Params>
   void GetContainer(std::set<T, Params...>& lst) {
-    GetContainer<std::set, T, Params...>(lst);
+    GetElements<SetContainerTraits<std::set<T, Params...>>>(lst);
   }
   template<class T, typename... Params>
   Reader& operator>>(std::set<T, Params...>& lst) {
-    GetContainer<std::set, T, Params...>(lst);
+    GetElements<SetContainerTraits<std::set<T, Params...>>>(lst);
     return *this;
   }
   //@}
@@ -565,11 +730,11 @@ class Reader { // NOLINT
   //! @post EOS() || stream points to the next token
   template<class T, typename... Params>
   void GetContainer(std::unordered_set<T, Params...>& lst) {
-    GetContainer<std::unordered_set, T, Params...>(lst);
+    GetElements<SetContainerTraits<std::unordered_set<T, Params...>>>(lst);
   }
   template<class T, typename... Params>
   Reader& operator>>(std::unordered_set<T, Params...>& lst) {
-    GetContainer<std::unordered_set, T, Params...>(lst);
+    GetElements<SetContainerTraits<std::unordered_set<T, Params...>>>(lst);
     return *this;
   }
   //@}
@@ -616,11 +781,38 @@ class Reader { // NOLINT
            typename Value,
            typename... Params>
   void GetPairMap(Map<Key, Value, Params...>& container) {
+    GetElements<MapContainerTraits<Map<Key, Value, Params...>>>(container);
+  }
+
+  //@{
+  //! @brief Retrieves a container that ContainerTraits has been specialized for.
+  //! @pre EOS() == false
+  //! @pre Last method must have been GetToken() or a \b const method.
+  //! @post EOS() || stream points to the next token
+  template<typename Container>
+  typename std::enable_if<has_container_traits<Container>::value, void>::type GetContainer(Container& container) {
+    GetElements<ContainerTraits<Container>>(container);
+  }
+  template<typename Container>
+  typename std::enable_if<has_container_traits<Container>::value, Reader&>::type operator>>(Container& container) {
+    GetElements<ContainerTraits<Container>>(container);
+    return *this;
+  }
+  //@}
+
+  //! @brief Retrieves the elements of a container, using \p Traits to add them.
+  //! @tparam Traits SequenceContainerTraits, SetContainerTraits, MapContainerTraits or anything with the same members.
+  //! @pre EOS() == false
+  //! @pre Last method must have been GetToken() or a \b const method.
+  //! @post EOS() || stream points to the next token
+  template<typename Traits, typename Container>
+  void GetElements(Container& container) {
     const auto containerToken = m_lastToken;
+    if (m_nextContainerElementCount) {
+      Traits::Reserve(container, ReserveCount());
+    }
     do {
-      auto item = std::pair<Key, Value>();
-      *this >> item;
-      container.emplace(std::move(item));
+      GetElement<Traits>(container, 0);
       if (EOS()) {
         return;
       }
@@ -670,6 +862,19 @@ class Reader { // NOLINT
   Reader& operator>>(std::string& rhs);
   //@}
 
+  //@{
+  //! @brief Retrieves a string with a custom allocator, e.g. an ArenaString.
+  //! @pre EOS() == false
+  //! @pre Last method must have been GetToken() or a \b const method.
+  //! @post EOS() || stream points to the next token
+  template<typename Traits, typename Alloc>
+  Reader& operator>>(std::basic_string<char, Traits, Alloc>& rhs) {
+    const auto view = GetStringView();
+    rhs.assign(view.data(), view.size());
+    return *this;
+  }
+  //@}
+
   //@{
   //! @brief Retrieves a string.
   //! @returns String object containing or referring to data
@@ -693,11 +898,65 @@ class Reader { // NOLINT
   }
   //@}
 
+  //@{
+  //! @brief Retrieves a string without copying it.
+  //! @returns View of the string data. On a memory-backed Reader it points into the source buffer and is
+  //! valid for the lifetime of that buffer. On a stream-backed Reader, or inside a compressed object whose
+  //! decompressed data is freed when its SubStream ends, it points into a scratch buffer that is only valid
+  //! until the next view is retrieved.
+  //! @pre EOS() == false
+  //! @pre Last method must have been GetToken() or a \b const method.
+  //! @post EOS() || stream points to the next token
+  StringView GetStringView() {
+    const auto len = m_remainingInElement;
+    const auto* data = FetchView(true);
+    return data ? StringView{reinterpret_cast<const char*>(data), len} : StringView{};
+  }
+  Reader& operator>>(StringView& rhs) {
+    rhs = GetStringView();
+    return *this;
+  }
+  //@}
+
+  //@{
+  //! @brief Retrieves a block without copying it.
+  //! @returns View of the block. The lifetime rules are the same as for GetStringView().
+  //! @pre EOS() == false
+  //! @pre Last method must have been GetToken() or a \b const method.
+  //! @post EOS() || stream points to the next token
+  BlockView GetBlockView() {
+    const auto len = m_remainingInElement;
+    const auto* data = FetchView(true);
+    return data ? BlockView{data, len} : BlockView{};
+  }
+  Reader& operator>>(BlockView& rhs) {
+    rhs = GetBlockView();
+    return *this;
+  }
+  //@}
+
   //@{
   size_t NextContainerElementCount() const {
     return m_nextContainerElementCount;
   }
 
+  //! @brief Returns \e true if the data of the token just retrieved is a packed vector of numbers.
+  //! @see Writer::PutPacked
+  bool NextContainerIsPacked() const {
+    return m_nextContainerPacked;
+  }
+
+  //! @brief Returns \e true if the data of the token just retrieved was compressed by Writer::PutCompressed().
+  //! SubStream decompresses it, so objects are read as usual.
+  bool IsCompressed() const {
+    return m_compressed;
+  }
+
+  //! @brief Makes \p codec available for compressed chunks, besides Lz4Codec. It must outlive the Reader.
+  void SetCodec(const Codec& codec) {
+    m_codec = &codec;
+  }
+
   //! @brief Skips the data associated with the token just retrieved
   //! @pre Last method must have been GetToken() or a \b const method.
   //! @post EOS() || stream points to the next token
@@ -769,6 +1028,13 @@ class Reader { // NOLINT
    private:
     Reader& m_reader;
     SubStreamContext m_oldContext;
+    // The data being read before a compressed chunk was decompressed into m_inflated
+    bool m_isInflated = false;
+    const uint8_t* m_oldData = nullptr;
+    size_t m_oldSize = 0;
+    size_t m_oldOffset = 0;
+    bool m_oldInflated = false;
+    Binary m_inflated;
   };
   friend class SubStream;
 
@@ -803,15 +1069,276 @@ class Reader { // NOLINT
   void SkipBytes(size_t bytes);
 
  private:
+  struct PackedChunk {
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+    size_t m_count = 0;
+    uint8_t m_format = 0;
+  };
+
+  // Where the data of a container element is
+  struct ElementRange {
+    size_t m_offset;
+    size_t m_length;
+    bool m_compressed;
+  };
+  // Fewest objects worth handing to another thread
+  static constexpr size_t MinParallelBatch = 64;
+
+  template<typename T, typename... Params>
+  void GetContainerParallel(std::vector<T, Params...>& vec, const Executor&, size_t, std::false_type) {
+    *this >> vec;
+  }
+  template<typename T, typename... Params>
+  void GetContainerParallel(std::vector<T, Params...>& vec, const Executor& executor, size_t batchCount, std::true_type) {
+    const auto containerToken = m_lastToken;
+    if (!m_data || m_nextContainerElementCount < 2 * MinParallelBatch || batchCount < 2) {
+      *this >> vec;
+      return;
+    }
+    const auto ranges = ScanContainer(containerToken);
+    if (m_badStream) {
+      return;
+    }
+    const auto start = vec.size();
+    const auto count = ranges.size();
+    vec.resize(start + count);
+    batchCount = std::max<size_t>(std::min(batchCount, count / MinParallelBatch), 1);
+    std::unique_ptr<bool[]> failed{new bool[batchCount]()};
+    executor(batchCount, [&](size_t batch) {
+      // Created on the thread that uses it, so that it picks up that thread's Arena
+      Reader reader{m_data, m_size};
+      reader.m_codec = m_codec;
+      for (auto i = count * batch / batchCount; i < count * (batch + 1) / batchCount; i++) {
+        reader.SetElement(containerToken, ranges[i]);
+        reader >> vec[start + i];
+      }
+      failed[batch] = reader.m_badStream;
+    });
+    for (size_t batch = 0; batch < batchCount; batch++) {
+      VERIFY_TOKENSTREAM(!failed[batch], );
+    }
+  }
+  // Finds the data of every element of the container whose first element was just retrieved, like
+  // GetContainer() reads them
+  std::vector<ElementRange> ScanContainer(Token containerToken);
+  // Makes the Reader look like \p element was just retrieved with GetToken()
+  void SetElement(Token token, const ElementRange& element);
+
+  // Elements are read in place if the traits can emplace them, and moved in otherwise
+  template<typename Traits, typename Container>
+  auto GetElement(Container& container, int) -> decltype(Traits::Emplace(container), void()) {
+    *this >> Traits::Emplace(container);
+  }
+  template<typename Traits, typename Container>
+  void GetElement(Container& container, long) {
+    typename Traits::value_type value{};
+    *this >> value;
+    Traits::Insert(container, std::move(value));
+  }
+  // Most elements to reserve room for when the end of the data is not known
+  static constexpr size_t MaxUnboundedReserve = 0x10000;
+  // The element count of the container being read, limited to what the rest of the data can hold, so that a
+  // corrupt count cannot make us reserve huge amounts of memory. Every element takes at least one byte.
+  size_t ReserveCount() const {
+    const size_t limit = m_context.m_end ? m_context.m_end - m_offset + 1 : MaxUnboundedReserve;
+    return m_nextContainerElementCount < limit ? m_nextContainerElementCount : limit;
+  }
+
+  template<typename T>
+  static void ClearOrAssign(T& member, std::true_type) {
+    member.clear();
+  }
+  template<typename T>
+  static void ClearOrAssign(T& member, std::false_type) {
+    AssignValueInitialized(
+        member,
+        std::integral_constant<bool, std::is_default_constructible<T>::value && std::is_move_assignable<T>::value>{});
+  }
+  template<typename T>
+  static void AssignValueInitialized(T& member, std::true_type) {
+    member = T();
+  }
+  template<typename T>
+  static void AssignValueInitialized(T&, std::false_type) {}
+
+  void GetSerializableDelta(Serializable& object);
+  template<typename T>
+  void GetMemberDelta(T& object, std::true_type) {
+    // Objects without a token map are written whole
+    if (object.GetTokenMap().empty()) {
+      ResetMember(object);
+      *this >> object;
+    } else {
+      GetSerializableDelta(object);
+    }
+  }
+  template<typename T>
+  void GetMemberDelta(T& member, std::false_type) {
+    // Defaults are not written, so nothing of the old value may be left over
+    ResetMember(member);
+    *this >> member;
+  }
+  template<typename T, typename... Params>
+  void GetMemberDelta(std::vector<T, Params...>& vec, std::false_type) {
+    GetVectorDelta(vec, std::is_base_of<Serializable, T>{});
+  }
+  template<typename T, typename... Params>
+  void GetVectorDelta(std::vector<T, Params...>& vec, std::true_type) {
+    const auto containerToken = m_lastToken;
+    const auto count = m_nextContainerElementCount ? m_nextContainerElementCount : 1;
+    // The writer only sends the changes of each object if there are as many as before
+    if (vec.size() != count || vec.front().GetTokenMap().empty()) {
+      vec.clear();
+      *this >> vec;
+      return;
+    }
+    size_t index = 0;
+    do {
+      if (index < vec.size()) {
+        GetSerializableDelta(vec[index]);
+      } else {
+        vec.emplace_back();
+        *this >> vec.back();
+      }
+      index++;
+      if (EOS()) {
+        return;
+      }
+    } while (GetToken() == containerToken);
+    PushLastToken();
+  }
+  template<typename T, typename... Params>
+  void GetVectorDelta(std::vector<T, Params...>& vec, std::false_type) {
+    vec.clear();
+    *this >> vec;
+  }
+
+  template<typename T, typename... Params>
+  void GetVector(std::vector<T, Params...>& vec, std::true_type) {
+    const auto containerToken = m_lastToken;
+    if (m_nextContainerElementCount) {
+      vec.reserve(ReserveCount());
+    }
+    do {
+      if (m_nextContainerPacked) {
+        GetPacked(vec);
+      } else {
+        vec.emplace_back();
+        *this >> vec.back();
+      }
+      if (EOS()) {
+        return;
+      }
+    } while (GetToken() == containerToken);
+    PushLastToken();
+  }
+  template<typename T, typename... Params>
+  void GetVector(std::vector<T, Params...>& vec, std::false_type) {
+    GetObjectVector(vec, std::is_base_of<Serializable, T>{});
+  }
+  template<typename T, typename... Params>
+  void GetObjectVector(std::vector<T, Params...>& vec, std::true_type) {
+    if (!m_nextContainerPacked) {
+      GetContainer<std::vector, T, Params...>(vec);
+      return;
+    }
+    SubStream batch{*this};
+    size_t rowCount;
+    if (!GetColumnsHeader(rowCount)) {
+      return;
+    }
+    const auto start = vec.size();
+    vec.resize(start + rowCount);
+    const ColumnRows rows{vec[start], sizeof(T), rowCount};
+    GetColumns(rows, vec[start].GetTokenMap());
+  }
+  template<typename T, typename... Params>
+  void GetObjectVector(std::vector<T, Params...>& vec, std::false_type) {
+    GetContainer<std::vector, T, Params...>(vec);
+  }
+  // Reads the start of a chunk written by Writer::PutColumns(). The row count is never 0.
+  bool GetColumnsHeader(size_t& rowCount);
+  void GetColumns(const ColumnRows& rows, const TokenMap& tokenMap);
+  template<typename M, typename Member>
+  void GetMemberColumn(const ColumnRows& rows, Member member, std::true_type) {
+    std::vector<M> column;
+    *this >> column;
+    VERIFY_TOKENSTREAM(column.size() == rows.size(), );
+    for (size_t row = 0; row < rows.size(); row++) {
+      member(rows[row]) = std::move(column[row]);
+    }
+  }
+  template<typename M, typename Member>
+  void GetMemberColumn(const ColumnRows&, Member, std::false_type) {
+    Skip();
+  }
+  template<typename T, typename... Params>
+  void GetPacked(std::vector<T, Params...>& vec) {
+    PackedChunk chunk;
+    if (!GetPackedChunk(chunk, sizeof(T))) {
+      return;
+    }
+    const auto start = vec.size();
+    vec.resize(start + chunk.m_count);
+    if (!UnpackElements(chunk, vec.data() + start)) {
+      vec.resize(start);
+    }
+  }
+  bool GetPackedChunk(PackedChunk& chunk, size_t elementSize);
+  bool UnpackElements(const PackedChunk& chunk, int8_t* items);
+  bool UnpackElements(const PackedChunk& chunk, int16_t* items);
+  bool UnpackElements(const PackedChunk& chunk, uint16_t* items);
+  bool UnpackElements(const PackedChunk& chunk, int32_t* items);
+  bool UnpackElements(const PackedChunk& chunk, uint32_t* items);
+  bool UnpackElements(const PackedChunk& chunk, int64_t* items);
+  bool UnpackElements(const PackedChunk& chunk, uint64_t* items);
+  bool UnpackElements(const PackedChunk& chunk, float* items);
+  bool UnpackElements(const PackedChunk& chunk, double* items);
+  template<typename T>
+  bool UnpackItems(const PackedChunk& chunk, T* items);
+
   void SkipBytesByReading(size_t bytes);
+  // Gives the bytes that were read ahead but not used back to m_stream
+  void GiveBackReadAhead();
+  // Forgets everything about the previous input. The input itself is set by the caller.
+  void Rewind(size_t end);
+  bool ReadBytes(void* location, size_t count);
+  size_t ReadAheadBytes() const {
+    return m_readAheadEnd - m_readAheadStart;
+  }
+  // Makes \p count bytes available in the read-ahead window, unless the stream ends first
+  bool FillReadAhead(size_t count);
+  // Returns the data of the current chunk. Stream data is handed out from the read-ahead window, which the
+  // next read may move, unless \p keep is set, in which case it is copied to m_scratch. The same goes for
+  // decompressed data, which only lives as long as its SubStream.
+  const uint8_t* FetchView(bool keep = false);
+  bool Inflate(Binary& buffer);
 
-  std::istream& m_stream;
+  std::istream* m_stream = nullptr;
+  const uint8_t* m_data = nullptr;
+  size_t m_size = 0;
   size_t m_offset = 0;
   size_t m_remainingInElement = 0;
   size_t m_nextContainerElementCount = 0;
+  bool m_nextContainerPacked = false;
+  bool m_compressed = false;
+  // m_data is a decompressed chunk owned by a SubStream
+  bool m_inflated = false;
+  const Codec* m_codec = nullptr;
   Token m_lastToken;
   SubStreamContext m_context;
 
+  // Allocated from the arena that was current when the Reader was created
+  ArenaBinary m_scratch;
+
+  // Bytes read from m_stream but not used yet are m_readAhead[m_readAheadStart, m_readAheadEnd)
+  Binary m_readAhead;
+  size_t m_readAheadStart = 0;
+  size_t m_readAheadEnd = 0;
+  // Bytes left in m_stream that belong to the TokenStream
+  size_t m_streamRemaining = 0;
+
   bool m_tokenPushed = false;
   bool m_badStream = false;
 };
@@ -0,0 +1,184 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+
+#pragma once
+
+/** @file
+ *  Contains StaticCodec and the TS_FIELDS macro, which read and write a structure without
+ *  virtual calls or a TokenMap lookup.
+ */
+
+#include <TokenStream/Reader.h>
+#include <TokenStream/Writer.h>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace TokenStream {
+
+/*! @brief Reads and writes the fields listed with TS_FIELDS.
+ *
+ *  The list is expanded at compile time, so writing is a straight sequence of Put() calls and
+ *  reading compares the token against constants, which the compiler can turn into a jump table.
+ *  Types with TS_FIELDS get WriteToTokenStream() and ReadFromTokenStream() methods, so they work
+ *  wherever other objects do, e.g. in containers. The output is the same as for a TOKEN_MAP with
+ *  the same fields.
+ *
+ *  @code
+ *  struct Telemetry {
+ *    enum class Token : uint64_t { id, temperature, status };
+ *    uint32_t id = 0;
+ *    float temperature = 0;
+ *    uint8_t status = 1;
+ *    TS_FIELDS(Telemetry, TS_FIELD(id), TS_FIELD(temperature), TS_FIELD(status, 1))
+ *  };
+ *  static_assert(TokenStream::StaticCodec<Telemetry>::MaxSize() == 15, "fits in a small buffer");
+ *  @endcode
+ */
+template<typename T>
+class StaticCodec {
+ public:
+  //! @brief Writes the fields of \p object
+  static void Write(Writer& writer, const T& object) {
+    // With a bound on the size, the output region only has to grow once for the whole object
+    if (MaxSize()) {
+      writer.ReserveCapacity(MaxSize());
+    }
+    Writing visitor{writer, object};
+    T::VisitTokenStreamFields(visitor);
+  }
+
+  //! @brief Reads fields into \p object until the end of the stream or SubStream. Unknown tokens are skipped.
+  static void Read(Reader& reader, T& object) {
+    while (!reader.EOS()) {
+      Reading visitor{reader, object, reader.GetToken()};
+      T::VisitTokenStreamFields(visitor);
+    }
+  }
+
+  //! @brief Largest size of the fields of an object, not counting the token and length in front of it.
+  //! @returns 0 if a field has no fixed upper bound, e.g. a string.
+  static constexpr size_t MaxSize() {
+    Sizing visitor;
+    T::VisitTokenStreamFields(visitor);
+    return visitor.m_unbounded ? 0 : visitor.m_size;
+  }
+
+ private:
+  struct Writing {
+    Writer& m_writer;
+    const T& m_object;
+
+    template<typename Tok, typename M>
+    void operator()(Tok token, M T::*member) const {
+      m_writer.Put(token, m_object.*member);
+    }
+    template<typename Tok, typename M, typename D>
+    void operator()(Tok token, M T::*member, const D& defaultValue) const {
+      PutWithDefault(token, m_object.*member, defaultValue, std::integral_constant<bool, std::is_arithmetic<M>::value || std::is_enum<M>::value>{});
+    }
+    template<typename M, typename D>
+    void PutWithDefault(Token token, const M& value, const D& defaultValue, std::true_type) const {
+      m_writer.Put(token, value, static_cast<M>(defaultValue));
+    }
+    template<typename M, typename D>
+    void PutWithDefault(Token token, const M& value, const D& defaultValue, std::false_type) const {
+      m_writer.Put(token, value, defaultValue);
+    }
+  };
+
+  struct Reading {
+    Reader& m_reader;
+    T& m_object;
+    uint64_t m_token;
+    bool m_found = false;
+
+    template<typename Tok, typename M, typename... D>
+    void operator()(Tok token, M T::*member, const D&...) {
+      if (!m_found && static_cast<uint64_t>(Token(token)) == m_token) {
+        m_reader >> m_object.*member;
+        m_found = true;
+      }
+    }
+  };
+
+  struct Sizing {
+    size_t m_size = 0;
+    bool m_unbounded = false;
+
+    template<typename Tok, typename M, typename... D>
+    constexpr void operator()(Tok token, M T::*, const D&...) {
+      // Values are trimmed to at most their own size, so the length always takes one byte
+      m_size += LengthSize(static_cast<uint64_t>(Token(token))) + 1 + ValueSize<M>();
+      m_unbounded = m_unbounded || !ValueSize<M>();
+    }
+    static constexpr size_t LengthSize(uint64_t value) {
+      size_t bytes = 0;
+      while (bytes < 8 && value >> (bytes * 8)) {
+        bytes++;
+      }
+      return value < 0x80 ? 1 : value < 0x7800 ? 2 : 1 + bytes;
+    }
+    template<typename M>
+    static constexpr size_t ValueSize() {
+      return std::is_arithmetic<M>::value || std::is_enum<M>::value ? sizeof(M) : 0;
+    }
+  };
+};
+
+} // namespace TokenStream
+
+// No need to use directly. Just use TS_FIELD and the compiler will figure it out.
+#define TS_FIELD_NO_DEFAULT(mem) visitor(Token::mem, &T::mem)
+#define TS_FIELD_WITH_DEFAULT(mem, def) visitor(Token::mem, &T::mem, def)
+#define TS_MAP_FIELD_NO_DEFAULT(tok, mem) visitor(tok, &T::mem)
+#define TS_MAP_FIELD_WITH_DEFAULT(tok, mem, def) visitor(tok, &T::mem, def)
+
+//! @brief A field of TS_FIELDS. The structure must contain an `enum class Token : uint64_t` with values that match the names of the members.
+//! @param member The undecorated name of the member to serialize. There must be a Token::<name> with the identical name.
+//! @param default (optional) The default value for the member
+#define TS_FIELD(...)                                                                              \
+  TOKEN_MACRO_CHOOSER((__VA_ARGS__, TS_FIELD_WITH_DEFAULT, TS_FIELD_NO_DEFAULT, ))(__VA_ARGS__)
+
+//! @brief A field of TS_FIELDS with an explicit token
+//! @param tok Any 8-64 bit value or a TokenStream::Token instance
+//! @param member The undecorated name of the member to serialize
+//! @param default (optional) The default value for the member
+#define TS_MAP_FIELD(tok, ...)                                                                     \
+  TOKEN_MACRO_CHOOSER((__VA_ARGS__, TS_MAP_FIELD_WITH_DEFAULT, TS_MAP_FIELD_NO_DEFAULT, ))(tok, __VA_ARGS__)
+
+//! @brief Lists the fields to read and write with TokenStream::StaticCodec
+//! @param className The name of the structure
+//! @param fields A series of \e TS_FIELD or \e TS_MAP_FIELD entries
+#define TS_FIELDS(className, ...)                                                                  \
+  template<typename TokenStreamVisitor>                                                            \
+  static constexpr void VisitTokenStreamFields(TokenStreamVisitor& visitor) {                      \
+    using T = className;                                                                           \
+    __VA_ARGS__;                                                                                   \
+  }                                                                                                \
+  void WriteToTokenStream(TokenStream::Writer& writer) const {                                     \
+    TokenStream::StaticCodec<className>::Write(writer, *this);                                     \
+  }                                                                                                \
+  void ReadFromTokenStream(TokenStream::Reader& reader) {                                          \
+    TokenStream::StaticCodec<className>::Read(reader, *this);                                      \
+  }
@@ -0,0 +1,160 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+
+#pragma once
+
+/** @file
+ *  Contains the optional counters and timing hook for Writer and Reader.
+ *
+ *  Build with TOKENSTREAM_STATS defined to 1 (the CMake option of the same name) to turn them on.
+ *  Otherwise the hooks inside the library compile to nothing, and Stats::Local() stays zero.
+ */
+
+#include <chrono>
+#include <cstdint>
+
+namespace TokenStream {
+class Serializable;
+
+//! @brief Counts what the Writers and Readers of one thread have done
+//! @code
+//!  TokenStream::Stats::Local().Reset();
+//!  employee.Write(writer);
+//!  const auto copied = TokenStream::Stats::Local().nestingCopyBytes;
+//! @endcode
+struct Stats {
+  //! True if the library was built with TOKENSTREAM_STATS
+  static const bool Enabled;
+
+  //! Bytes of stream data written, including those only counted by a SizeCounter
+  uint64_t bytesWritten = 0;
+  //! Chunk headers written
+  uint64_t chunksWritten = 0;
+  //! Bytes of stream data read, not including skipped bytes
+  uint64_t bytesRead = 0;
+  //! Chunk headers read
+  uint64_t chunksRead = 0;
+  //! Writers created to write part of the output of another Writer, e.g. MemoryWriter{writer}
+  uint64_t nestedWriters = 0;
+  //! Nested objects written or read
+  uint64_t subStreams = 0;
+  //! Bytes moved again to make room for the header of a nested object or to append the output of a nested Writer
+  uint64_t nestingCopyBytes = 0;
+  //! Bytes skipped in memory, in the read-ahead window of a stream Reader or by seeking the stream
+  uint64_t skippedBySeek = 0;
+  //! Bytes skipped by reading them, because the stream could not seek
+  uint64_t skippedByReading = 0;
+  //! Number of times a Writer grew its buffer
+  uint64_t allocations = 0;
+  //! Bytes allocated when growing buffers
+  uint64_t allocatedBytes = 0;
+
+  //! Returns the counters of the calling thread
+  static Stats& Local();
+
+  void Reset() {
+    *this = Stats{};
+  }
+};
+
+//! @brief Called after each top-level Serializable is written or read, on the thread that did it
+//! @param object The object
+//! @param write \e true if it was written, \e false if it was read
+//! @param duration Time it took
+//! @param bytes Size of the object in the stream
+using MessageHook = void (*)(const Serializable& object, bool write, std::chrono::nanoseconds duration, uint64_t bytes);
+
+//! @brief Sets the hook for all threads. Pass nullptr to remove it. It is only called if Stats::Enabled.
+void SetMessageHook(MessageHook hook);
+
+//! Returns the hook set with SetMessageHook()
+MessageHook GetMessageHook();
+
+// Nesting level of the MessageTimers of the calling thread, shared by all of them
+inline unsigned& MessageDepth() {
+  thread_local unsigned depth = 0;
+  return depth;
+}
+
+//! @brief Times an object for the MessageHook. Only the outermost MessageTimer of a thread calls the hook.
+//! @note Used by the library through TS_STATS_MESSAGE.
+template<typename Bytes>
+class MessageTimer {
+ public:
+  MessageTimer(const Serializable& object, bool write, Bytes bytes) :
+      m_object{object}, m_write{write}, m_bytes{bytes}, m_hook{MessageDepth()++ ? nullptr : GetMessageHook()} {
+    if (m_hook) {
+      m_startBytes = m_bytes();
+      m_start = std::chrono::steady_clock::now();
+    }
+  }
+  MessageTimer(MessageTimer&& other) noexcept :
+      m_object{other.m_object},
+      m_write{other.m_write},
+      m_bytes{other.m_bytes},
+      m_hook{other.m_hook},
+      m_start{other.m_start},
+      m_startBytes{other.m_startBytes},
+      m_moved{other.m_moved} {
+    other.m_moved = true;
+  }
+  MessageTimer(const MessageTimer&) = delete;
+  MessageTimer& operator=(const MessageTimer&) = delete;
+  ~MessageTimer() {
+    if (m_moved) {
+      return;
+    }
+    --MessageDepth();
+    if (m_hook) {
+      const auto duration = std::chrono::steady_clock::now() - m_start;
+      m_hook(m_object, m_write, std::chrono::duration_cast<std::chrono::nanoseconds>(duration), m_bytes() - m_startBytes);
+    }
+  }
+
+ private:
+  const Serializable& m_object;
+  bool m_write;
+  Bytes m_bytes;
+  MessageHook m_hook;
+  std::chrono::steady_clock::time_point m_start;
+  uint64_t m_startBytes = 0;
+  bool m_moved = false;
+};
+
+template<typename Bytes>
+MessageTimer<Bytes> MakeMessageTimer(const Serializable& object, bool write, Bytes bytes) {
+  return {object, write, bytes};
+}
+
+} // namespace TokenStream
+
+#if TOKENSTREAM_STATS
+//! Adds \p n to the Stats counter \p counter of the calling thread
+#define TS_STATS_ADD(counter, n) (::TokenStream::Stats::Local().counter += (n))
+//! Times \p object until the end of the scope. \p bytes gives the current stream position.
+#define TS_STATS_MESSAGE(object, write, bytes)                                                        \
+  auto tsMessageTimer = ::TokenStream::MakeMessageTimer(object, write, [&]() -> uint64_t { return bytes; })
+#else
+#define TS_STATS_ADD(counter, n) static_cast<void>(0)
+#define TS_STATS_MESSAGE(object, write, bytes) static_cast<void>(0)
+#endif
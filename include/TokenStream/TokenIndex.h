@@ -0,0 +1,153 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <TokenStream/Reader.h>
+#include <TokenStream/TokenStream.h>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace TokenStream {
+
+/** @brief Random access to the fields of a serialized message without reading all of it
+ *
+ * The constructor walks the chunks at the top level of a memory buffer once and records where
+ * each token's data is. Looking a token up afterwards is a hash lookup. Nested objects get an
+ * index of their own the first time a path goes through them.
+ *
+ * @code
+ *  TokenStream::TokenIndex index{message};
+ *  std::string destination;
+ *  index.Get(Token::destination, destination);
+ *  uint32_t zone = 0;
+ *  index.GetPath({Token::route, Route::Token::zone}, zone);
+ *
+ *  // Or position a Reader on a field and read it yourself
+ *  if (const auto* field = index.Find(Token::payload)) {
+ *    TokenStream::Reader reader{field->m_begin, field->m_size};
+ *    reader.GetToken();
+ *    reader >> payload;
+ *  }
+ * @endcode
+ *
+ * @note The buffer must stay valid for the lifetime of the index.
+ * @see Reader
+ */
+class TokenIndex {
+ public:
+  //! @brief Location of a field in the buffer
+  struct Field {
+    Token m_token;
+    //! First byte of the field's chunks. Consecutive chunks with the same token, e.g. the
+    //! elements of a container, are recorded as one field.
+    const uint8_t* m_begin = nullptr;
+    //! Size of all the field's chunks, including their tokens and lengths
+    size_t m_size = 0;
+    //! Data of the first chunk or container element
+    const uint8_t* m_data = nullptr;
+    size_t m_length = 0;
+    //! Number of container elements, 1 for a single value. A packed chunk counts as one element.
+    size_t m_count = 0;
+    //! \e true if the data was compressed by Writer::PutCompressed(). Get() and GetSubIndex() decompress it.
+    bool m_compressed = false;
+  };
+
+  //! @brief Indexes the top level of a block of memory
+  //! @param data Pointer to the start of the binary data to index
+  //! @param size Number of bytes available at \p data
+  TokenIndex(const uint8_t* data, size_t size);
+
+  //! @brief Indexes the top level of \p data. It must stay valid for the lifetime of the index.
+  explicit TokenIndex(const Binary& data) : TokenIndex(data.data(), data.size()) {}
+
+  //! @brief Do not allow move semantics for the buffer. We need it to stick around externally.
+  explicit TokenIndex(Binary&&) = delete;
+
+  // no copying
+  TokenIndex(const TokenIndex&) = delete;
+  TokenIndex& operator=(const TokenIndex&) = delete;
+
+  //! @brief Returns \e false if the data is not a valid TokenStream. Fields found before the error are still indexed.
+  bool IsValid() const {
+    return !m_badStream;
+  }
+
+  //! @brief Returns the fields in the order they appear in the buffer
+  const std::vector<Field>& GetFields() const {
+    return m_fields;
+  }
+
+  //! @brief Returns the first field with \p token or nullptr if there is none
+  const Field* Find(Token token) const;
+
+  //! @brief Follows \p path through nested objects and returns the field at the end of it, or nullptr
+  //! @note A path through a container goes through its first element.
+  const Field* FindPath(std::initializer_list<Token> path);
+
+  //! @brief Returns the index of the object stored under \p token, building it on first use, or nullptr if there is none
+  //! @note The index of a compressed object owns the decompressed data. Only Lz4Codec is available here.
+  TokenIndex* GetSubIndex(Token token);
+
+  //! @brief Reads the value of \p field into \p value
+  //! @returns \e false if \p field is nullptr or its data is not valid
+  template<typename T>
+  static bool Get(const Field* field, T& value) {
+    if (!field) {
+      return false;
+    }
+    Reader reader{field->m_begin, field->m_size};
+    reader.GetToken();
+    reader >> value;
+    return reader.VerifyEOS();
+  }
+
+  //! @brief Reads the value stored under \p token into \p value. \p value is left alone if the token is not present.
+  template<typename T>
+  bool Get(Token token, T& value) const {
+    return Get(Find(token), value);
+  }
+
+  //! @brief Reads the value at the end of \p path into \p value. \p value is left alone if the path is not present.
+  template<typename T>
+  bool GetPath(std::initializer_list<Token> path, T& value) {
+    return Get(FindPath(path), value);
+  }
+
+ private:
+  void Scan(const uint8_t* data, size_t size);
+
+  std::vector<Field> m_fields;
+  // Token to the index of its first field
+  std::unordered_map<uint64_t, size_t> m_lookup;
+  // Built on demand, one per field
+  std::vector<std::unique_ptr<TokenIndex>> m_subIndexes;
+  // The decompressed data of a compressed object
+  Binary m_inflated;
+  bool m_badStream = false;
+};
+
+} // namespace TokenStream
@@ -22,8 +22,18 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <map>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <string_view>
+#define TOKENSTREAM_HAS_STRING_VIEW 1
+#endif
 // ReSharper disable once CppUnusedIncludeDirective
 #include <cassert>
 #define TS_ASSERT(condition, message) assert(condition) // NOLINT
@@ -34,6 +44,136 @@ class Writer;
 class Serializable;
 using Binary = std::vector<uint8_t>;
 
+//! @brief True for the element types that can be written with the packed container encoding
+//! @note std::vector<uint8_t> is Binary, which is always written as a single block.
+//! @see Writer::PutPacked
+template<typename T>
+struct is_packable
+    : std::integral_constant<bool,
+                             std::is_same<T, int8_t>::value || std::is_same<T, int16_t>::value ||
+                                 std::is_same<T, uint16_t>::value || std::is_same<T, int32_t>::value ||
+                                 std::is_same<T, uint32_t>::value || std::is_same<T, int64_t>::value ||
+                                 std::is_same<T, uint64_t>::value || std::is_same<T, float>::value ||
+                                 std::is_same<T, double>::value> {};
+
+//! @brief True for the member types that Writer::PutColumns() writes as columns. Other members are written row by row.
+template<typename T>
+struct is_columnar : std::integral_constant<bool,
+                                            is_packable<T>::value || std::is_same<T, uint8_t>::value ||
+                                                std::is_same<T, std::string>::value> {};
+
+#ifdef TOKENSTREAM_HAS_STRING_VIEW
+//! @brief Non-owning view of string data returned by Reader::GetStringView()
+using StringView = std::string_view;
+#else
+/** \brief Non-owning view of string data returned by Reader::GetStringView()
+    *
+    *		A minimal stand-in for std::string_view when compiling as C++14. It only refers to the data, so it
+    *		is valid only as long as the buffer it was taken from.
+    */
+class StringView {
+ public:
+  using value_type = char;
+  using size_type = size_t;
+  using const_iterator = const char*;
+
+  constexpr StringView() = default;
+  constexpr StringView(const char* data, size_t size) : m_data(data), m_size(size) {}
+  StringView(const char* str) : m_data(str), m_size(str ? strlen(str) : 0) {}
+  StringView(const std::string& str) : m_data(str.data()), m_size(str.size()) {}
+
+  constexpr const char* data() const {
+    return m_data;
+  }
+  constexpr size_t size() const {
+    return m_size;
+  }
+  constexpr size_t length() const {
+    return m_size;
+  }
+  constexpr bool empty() const {
+    return !m_size;
+  }
+  constexpr const char* begin() const {
+    return m_data;
+  }
+  constexpr const char* end() const {
+    return m_data + m_size;
+  }
+  constexpr char operator[](size_t index) const {
+    return m_data[index];
+  }
+
+  int compare(StringView rhs) const {
+    const auto result = m_size && rhs.m_size ? memcmp(m_data, rhs.m_data, std::min(m_size, rhs.m_size)) : 0;
+    return result ? result : m_size < rhs.m_size ? -1 : m_size > rhs.m_size ? 1 : 0;
+  }
+
+  explicit operator std::string() const {
+    return {m_data, m_size};
+  }
+
+  friend bool operator==(StringView lhs, StringView rhs) {
+    return lhs.m_size == rhs.m_size && !lhs.compare(rhs);
+  }
+  friend bool operator!=(StringView lhs, StringView rhs) {
+    return !(lhs == rhs);
+  }
+  friend bool operator<(StringView lhs, StringView rhs) {
+    return lhs.compare(rhs) < 0;
+  }
+
+ private:
+  const char* m_data = nullptr;
+  size_t m_size = 0;
+};
+#endif
+
+/** \brief Non-owning view of binary data returned by Reader::GetBlockView()
+    *
+    *		BlockView only refers to the data, so it is valid only as long as the buffer it was taken from.
+    */
+class BlockView {
+ public:
+  using value_type = uint8_t;
+  using size_type = size_t;
+  using const_iterator = const uint8_t*;
+
+  constexpr BlockView() = default;
+  constexpr BlockView(const uint8_t* data, size_t size) : m_data(data), m_size(size) {}
+  BlockView(const Binary& block) : m_data(block.data()), m_size(block.size()) {}
+
+  constexpr const uint8_t* data() const {
+    return m_data;
+  }
+  constexpr size_t size() const {
+    return m_size;
+  }
+  constexpr bool empty() const {
+    return !m_size;
+  }
+  constexpr const uint8_t* begin() const {
+    return m_data;
+  }
+  constexpr const uint8_t* end() const {
+    return m_data + m_size;
+  }
+  constexpr uint8_t operator[](size_t index) const {
+    return m_data[index];
+  }
+
+  friend bool operator==(BlockView lhs, BlockView rhs) {
+    return lhs.m_size == rhs.m_size && (!lhs.m_size || !memcmp(lhs.m_data, rhs.m_data, lhs.m_size));
+  }
+  friend bool operator!=(BlockView lhs, BlockView rhs) {
+    return !(lhs == rhs);
+  }
+
+ private:
+  const uint8_t* m_data = nullptr;
+  size_t m_size = 0;
+};
+
 /** \brief Simple wrapper for an 8-64 bit token
     *
     *		Token is an 8-64 bit value used by the Reader and Writer.
@@ -74,6 +214,30 @@ class Token {
   uint64_t m_token = InvalidTokenValue;
 };
 
+//! @brief The objects of a vector that are written or read a column at a time.
+//! @see Writer::PutColumns
+template<typename S>
+class BasicColumnRows {
+ public:
+  //! @param first The first object. The others follow it \p stride bytes apart.
+  BasicColumnRows(S& first, size_t stride, size_t count) : m_first(&first), m_stride(stride), m_count(count) {}
+
+  S& operator[](size_t row) const {
+    using Byte = typename std::conditional<std::is_const<S>::value, const uint8_t, uint8_t>::type;
+    return *reinterpret_cast<S*>(reinterpret_cast<Byte*>(m_first) + row * m_stride);
+  }
+  size_t size() const {
+    return m_count;
+  }
+
+ private:
+  S* m_first;
+  size_t m_stride;
+  size_t m_count;
+};
+using ColumnRows = BasicColumnRows<Serializable>;
+using ConstColumnRows = BasicColumnRows<const Serializable>;
+
 //! @brief A helper to package up the getter and setter for a single member. Used with \e TokenMap.
 //! @note MemberAccessor is automatically created by the \e MAP_TOKEN and \e ENUMERATED_TOKEN macros.
 //! @see MAP_TOKEN
@@ -81,8 +245,30 @@ class Token {
 struct MemberAccessor {
   using Getter = void (*)(Reader&, Serializable&);
   using Putter = void (*)(Writer&, const Serializable&);
+  //! Writes the member of \e now if it differs from the one of \e old. Returns \e true if the member
+  //! has to be reset instead, because the new value is a default that was trimmed.
+  using DeltaPutter = bool (*)(Writer&, const Serializable& old, const Serializable& now);
+  //! Applies a value written by a DeltaPutter
+  using DeltaGetter = void (*)(Reader&, Serializable&);
+  //! Sets the member back to its default
+  using Resetter = void (*)(Serializable&);
+  //! Writes the member of every row as a single chunk. Returns \e false if the member has to be written row by row.
+  using ColumnPutter = bool (*)(Writer&, Token, const ConstColumnRows&);
+  //! Reads a chunk written by a ColumnPutter into the member of every row
+  using ColumnGetter = void (*)(Reader&, const ColumnRows&);
   Getter Get;
   Putter Put;
+  //@{
+  //! Used by Serializable::WriteDelta() and Serializable::ApplyDelta(). May be nullptr.
+  DeltaPutter PutDelta = nullptr;
+  DeltaGetter GetDelta = nullptr;
+  Resetter Reset = nullptr;
+  //@}
+  //@{
+  //! Used by Writer::PutColumns() and the Reader of its output. May be nullptr.
+  ColumnPutter PutColumn = nullptr;
+  ColumnGetter GetColumn = nullptr;
+  //@}
 };
 
 //! @brief A helper you can define per type to serialize and deserialize externally to the type.
@@ -119,25 +305,159 @@ struct MemberAccessor {
 template<typename T>
 struct Helper;
 
+/*! @brief A helper you can specialize so that the Reader and Writer handle a container type they do not know, such
+    as \e boost::container::flat_map or a small vector.
+    *
+    * Derive it from SequenceContainerTraits, SetContainerTraits or MapContainerTraits, or provide the same members:
+    * - \e value_type, the type that each element is read as.
+    * - \e Reserve(container, count), called with the number of elements that follow when the stream has it.
+    * - Either \e Emplace(container), which adds an element to read in place and returns it, or
+    *   \e Insert(container, value_type&&), which adds an element that was read.
+    *
+    * @code
+    * namespace TokenStream {
+    *     template<typename T, size_t N>
+    *     struct ContainerTraits<boost::container::small_vector<T, N>>
+    *         : SequenceContainerTraits<boost::container::small_vector<T, N>> {};
+    *     template<typename Key, typename Value>
+    *     struct ContainerTraits<boost::container::flat_map<Key, Value>>
+    *         : MapContainerTraits<boost::container::flat_map<Key, Value>> {};
+    * }
+    * @endcode
+    */
+template<typename Container>
+struct ContainerTraits;
+
+//! @brief The Reserve() of the ContainerTraits helpers. Calls \e reserve() if the container has one.
+struct ReservingContainerTraits {
+  template<typename Container>
+  static void Reserve(Container& container, size_t count) {
+    Reserve(container, count, 0);
+  }
+
+ private:
+  template<typename Container>
+  static auto Reserve(Container& container, size_t count, int) -> decltype(container.reserve(count), void()) {
+    container.reserve(count);
+  }
+  template<typename Container>
+  static void Reserve(Container&, size_t, long) {}
+};
+
+//! @brief ContainerTraits for containers with \e emplace_back() and \e back(). The elements are read in place.
+template<typename Container>
+struct SequenceContainerTraits : ReservingContainerTraits {
+  using value_type = typename Container::value_type;
+  static value_type& Emplace(Container& container) {
+    container.emplace_back();
+    return container.back();
+  }
+};
+
+//! @brief ContainerTraits for sets. Elements are moved in with the end as the hint, which is where they go when
+//! the set was written in order.
+template<typename Container>
+struct SetContainerTraits : ReservingContainerTraits {
+  using value_type = typename Container::value_type;
+  static void Insert(Container& container, value_type&& value) {
+    container.insert(container.end(), std::move(value));
+  }
+};
+
+//! @brief ContainerTraits for maps, which are written as lists of key/value pairs. Elements are moved in with the
+//! end as the hint, which is where they go when the map was written in order.
+template<typename Container>
+struct MapContainerTraits : ReservingContainerTraits {
+  using value_type = std::pair<typename Container::key_type, typename Container::mapped_type>;
+  static void Insert(Container& container, value_type&& value) {
+    container.emplace_hint(container.end(), std::move(value));
+  }
+};
+
+template<typename>
+struct has_container_traits_Void {
+  typedef void type;
+};
+//! @brief \e true if ContainerTraits has been specialized for \e T
+template<typename T, typename Sfinae = void>
+struct has_container_traits : std::false_type {};
+template<typename T>
+struct has_container_traits<T, typename has_container_traits_Void<typename ContainerTraits<T>::value_type>::type>
+    : std::true_type {};
+
 //! @brief A helper used to create the const static token map for a structure. We need this instead of a raw map so that we can merge in parent maps.
 //! @note TokenMap is automatically created by the \e TOKEN_MAP and \e ENUMERATED_TOKEN_MAP macros.
+//! @note The entries are kept in a flat array sorted by token. When the tokens are dense, as they are for
+//! an enum, lookups index straight into a table. Otherwise they use a binary search, starting with the
+//! entry after the previous match since tokens are normally read in the order they were written.
 //! @see TOKEN_MAP
 //! @see MAP_TOKEN
 //! @see ENUMERATED_TOKEN
-class TokenMap : public std::map<uint64_t, MemberAccessor> {
+class TokenMap {
  public:
+  using value_type = std::pair<uint64_t, MemberAccessor>;
+  using const_iterator = std::vector<value_type>::const_iterator;
+  using iterator = const_iterator;
+
   TokenMap() = default;
-  TokenMap(const TokenMap& parent, std::initializer_list<value_type> initializer) :
-      map<uint64_t, MemberAccessor>(initializer) {
-#ifdef AZ_ENABLE_TRACING
-    for (auto item : parent) {
-      TS_ASSERT(find(item.first) == end(), "Duplicate token found in parent's TokenMap");
+  TokenMap(const TokenMap& parent, std::initializer_list<value_type> initializer);
+  TokenMap(std::initializer_list<value_type> initializer);
+
+  //@{
+  //! @brief Iterates over the entries in token order
+  const_iterator begin() const {
+    return m_entries.begin();
+  }
+  const_iterator end() const {
+    return m_entries.end();
+  }
+  //@}
+
+  size_t size() const {
+    return m_entries.size();
+  }
+
+  bool empty() const {
+    return m_entries.empty();
+  }
+
+  const_iterator find(uint64_t token) const {
+    size_t hint = 0;
+    const auto* accessor = Find(token, hint);
+    return accessor ? begin() + static_cast<std::ptrdiff_t>(hint - 1) : end();
+  }
+
+  size_t count(uint64_t token) const {
+    size_t hint = 0;
+    return Find(token, hint) ? 1 : 0;
+  }
+
+  //! @brief Finds the accessor for a token.
+  //! @param token The token to look up.
+  //! @param hint On input, the index of the entry to try first. On output, the index after the match.
+  //! @returns The accessor or nullptr if the token is not in the map.
+  const MemberAccessor* Find(uint64_t token, size_t& hint) const {
+    if (token < m_direct.size()) {
+      hint = m_direct[token];
+      return hint ? &m_entries[hint - 1].second : nullptr;
     }
-#endif
-    insert(parent.begin(), parent.end());
+    if (m_isDense) {
+      return nullptr;
+    }
+    if (hint < m_entries.size() && m_entries[hint].first == token) {
+      return &m_entries[hint++].second;
+    }
+    return FindSorted(token, hint);
   }
-  TokenMap(std::initializer_list<value_type> initializer) :
-      map<uint64_t, MemberAccessor>(initializer) {}
+
+ private:
+  void Index();
+  const MemberAccessor* FindSorted(uint64_t token, size_t& hint) const;
+
+  std::vector<value_type> m_entries;
+  // For dense tokens, 1 + the entry index for each token, or 0 if it is not mapped
+  std::vector<uint32_t> m_direct;
+  bool m_isDense = false;
 };
 
 //! @brief Any type that needs to be serialized must derive from this. You can then either provide your own \e Read and \e Write methods, or define a token map.
@@ -203,6 +523,40 @@ class Serializable // NOLINT
   void Write(Writer& writer, const TokenMap& tokenMap) const;
   void Read(Reader& reader, const TokenMap& tokenMap);
 
+  //! @brief Token of the chunk that lists the members a delta resets to their defaults.
+  //! @see WriteDelta
+  static constexpr uint64_t DeltaResetToken = Token::InvalidTokenValue - 1;
+
+  //! @brief Token of the chunks of a columnar list that hold the members that are not columns, one object per row.
+  //! @see Writer::PutColumns
+  static constexpr uint64_t ColumnRowsToken = Token::InvalidTokenValue - 2;
+
+  /*! @brief Writes only the members that differ from \p old, so that ApplyDelta() can turn a copy of \p old into this object.
+        *
+        * A member that did not change is left out. A changed member is written as usual, except that
+        * nested objects with a token map are written as a delta of their own, and so are the objects
+        * of a vector whose size did not change. Members that are now a trimmed default are listed in
+        * a DeltaResetToken chunk at the end, since leaving them out would mean that they did not change.
+        *
+        * @code
+        * TokenStream::MemoryWriter delta;
+        * now.WriteDelta(delta, old);
+        * TokenStream::Reader reader{delta.data(), delta.size()};
+        * copyOfOld.ApplyDelta(reader);
+        * @endcode
+        *
+        * @pre \p old has the same type as this object.
+        * @note Objects without a token map are written whole if their output differs.
+        */
+  virtual void WriteDelta(Writer& writer, const Serializable& old) const;
+
+  //! @brief Applies a delta written by WriteDelta() to this object, which must be equal to the \e old object of the delta.
+  //! @note Objects without a token map are read with Read(), so it has to clear them first.
+  virtual void ApplyDelta(Reader& reader);
+
+  void WriteDelta(Writer& writer, const Serializable& old, const TokenMap& tokenMap) const;
+  void ApplyDelta(Reader& reader, const TokenMap& tokenMap);
+
   //! @brief Returns the TokenMap used by the default implementations of \e Read and \e Write. Build this with the TOKEN_MAP macro.
   virtual const TokenMap& GetTokenMap() const {
     const static TokenMap dummy;
@@ -211,6 +565,21 @@ class Serializable // NOLINT
 };
 } // namespace TokenStream
 
+// The column accessors of MAP_TOKEN and ENUMERATED_TOKEN. Defaults are not trimmed from columns.
+#define COLUMN_ACCESSORS(mem)                                                                      \
+  [](TokenStream::Writer& writer,                                                                  \
+     TokenStream::Token token,                                                                     \
+     const TokenStream::ConstColumnRows& rows) {                                                   \
+    return writer.PutMemberColumn(token, rows, [](const Serializable& o) -> const auto& {          \
+      return reinterpret_cast<const T&>(o).mem;                                                    \
+    });                                                                                            \
+  },                                                                                               \
+      [](TokenStream::Reader& reader, const TokenStream::ColumnRows& rows) {                       \
+        reader.GetMemberColumn(rows, [](Serializable& o) -> auto& {                                \
+          return reinterpret_cast<T&>(o).mem;                                                      \
+        });                                                                                        \
+      }
+
 // No need to use directly. Just use MAP_TOKEN and the compiler will figure it out.
 #define MAP_TOKEN_NO_DEFAULT(tok, mem)                                                             \
   {                                                                                                \
@@ -218,7 +587,16 @@ class Serializable // NOLINT
       [](TokenStream::Reader& reader, Serializable& o) { reader >> reinterpret_cast<T&>(o).mem; }, \
           [](TokenStream::Writer& writer, const Serializable& o) {                                 \
             writer << reinterpret_cast<const T&>(o).mem;                                           \
-          }                                                                                        \
+          },                                                                                       \
+          [](TokenStream::Writer& writer, const Serializable& old, const Serializable& now) {      \
+            return writer.PutDelta(reinterpret_cast<const T&>(old).mem,                            \
+                                   reinterpret_cast<const T&>(now).mem);                           \
+          },                                                                                       \
+          [](TokenStream::Reader& reader, Serializable& o) {                                       \
+            reader.GetDelta(reinterpret_cast<T&>(o).mem);                                          \
+          },                                                                                       \
+          [](Serializable& o) { TokenStream::Reader::ResetMember(reinterpret_cast<T&>(o).mem); },  \
+          COLUMN_ACCESSORS(mem)                                                                    \
     }                                                                                              \
   }
 
@@ -229,7 +607,19 @@ class Serializable // NOLINT
       [](TokenStream::Reader& reader, Serializable& o) { reader >> reinterpret_cast<T&>(o).mem; }, \
           [](TokenStream::Writer& writer, const Serializable& o) {                                 \
             writer << TokenStream::ValueWithDefault(reinterpret_cast<const T&>(o).mem, def);       \
-          }                                                                                        \
+          },                                                                                       \
+          [](TokenStream::Writer& writer, const Serializable& old, const Serializable& now) {      \
+            return writer.PutDelta(reinterpret_cast<const T&>(old).mem,                            \
+                                   reinterpret_cast<const T&>(now).mem,                            \
+                                   def);                                                           \
+          },                                                                                       \
+          [](TokenStream::Reader& reader, Serializable& o) {                                       \
+            reader.GetDelta(reinterpret_cast<T&>(o).mem);                                          \
+          },                                                                                       \
+          [](Serializable& o) {                                                                    \
+            TokenStream::Reader::ResetMember(reinterpret_cast<T&>(o).mem, def);                    \
+          },                                                                                       \
+          COLUMN_ACCESSORS(mem)                                                                    \
     }                                                                                              \
   }
 
@@ -240,7 +630,16 @@ class Serializable // NOLINT
       [](TokenStream::Reader& reader, Serializable& o) { reader >> reinterpret_cast<T&>(o).mem; }, \
           [](TokenStream::Writer& writer, const Serializable& o) {                                 \
             writer << reinterpret_cast<const T&>(o).mem;                                           \
-          }                                                                                        \
+          },                                                                                       \
+          [](TokenStream::Writer& writer, const Serializable& old, const Serializable& now) {      \
+            return writer.PutDelta(reinterpret_cast<const T&>(old).mem,                            \
+                                   reinterpret_cast<const T&>(now).mem);                           \
+          },                                                                                       \
+          [](TokenStream::Reader& reader, Serializable& o) {                                       \
+            reader.GetDelta(reinterpret_cast<T&>(o).mem);                                          \
+          },                                                                                       \
+          [](Serializable& o) { TokenStream::Reader::ResetMember(reinterpret_cast<T&>(o).mem); },  \
+          COLUMN_ACCESSORS(mem)                                                                    \
     }                                                                                              \
   }
 
@@ -251,7 +650,19 @@ class Serializable // NOLINT
       [](TokenStream::Reader& reader, Serializable& o) { reader >> reinterpret_cast<T&>(o).mem; }, \
           [](TokenStream::Writer& writer, const Serializable& o) {                                 \
             writer << TokenStream::ValueWithDefault(reinterpret_cast<const T&>(o).mem, def);       \
-          }                                                                                        \
+          },                                                                                       \
+          [](TokenStream::Writer& writer, const Serializable& old, const Serializable& now) {      \
+            return writer.PutDelta(reinterpret_cast<const T&>(old).mem,                            \
+                                   reinterpret_cast<const T&>(now).mem,                            \
+                                   def);                                                           \
+          },                                                                                       \
+          [](TokenStream::Reader& reader, Serializable& o) {                                       \
+            reader.GetDelta(reinterpret_cast<T&>(o).mem);                                          \
+          },                                                                                       \
+          [](Serializable& o) {                                                                    \
+            TokenStream::Reader::ResetMember(reinterpret_cast<T&>(o).mem, def);                    \
+          },                                                                                       \
+          COLUMN_ACCESSORS(mem)                                                                    \
     }                                                                                              \
   }
 
@@ -279,7 +690,17 @@ class Serializable // NOLINT
           [](TokenStream::Writer& writer, const Serializable& o) {                                 \
             writer.Put(reinterpret_cast<const T&>(o),                                              \
                        reinterpret_cast<const T&>(o).baseClassName::GetTokenMap());                \
-          }                                                                                        \
+          },                                                                                       \
+          [](TokenStream::Writer& writer, const Serializable& old, const Serializable& now) {      \
+            return writer.PutDelta(                                                                \
+                old, now, reinterpret_cast<const T&>(now).baseClassName::GetTokenMap());           \
+          },                                                                                       \
+          [](TokenStream::Reader& reader, Serializable& o) {                                       \
+            TokenStream::Reader::SubStream subStream{reader};                                      \
+            reinterpret_cast<T&>(o).ApplyDelta(                                                    \
+                reader, reinterpret_cast<T&>(o).baseClassName::GetTokenMap());                     \
+          },                                                                                       \
+          nullptr, nullptr, nullptr                                                                \
     }                                                                                              \
   }
 
@@ -0,0 +1,81 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+
+#pragma once
+
+/** @file
+ *  Contains Validate(), which checks the structure of untrusted input before it is read.
+ */
+
+#include <TokenStream/TokenStream.h>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace TokenStream {
+
+//! @brief Returns \e true if the data of \p token holds nested chunks. \p depth is the number of enclosing objects.
+//! @see PushParser::Handler::IsObject
+using IsObjectFunction = std::function<bool(Token token, size_t depth)>;
+
+//! Most levels of nested objects that Validate() accepts unless told otherwise
+constexpr size_t DefaultMaxDepth = 64;
+
+/*! @brief Checks that \p data is a well-formed TokenStream, without reading any values.
+ *
+ * Every chunk header is decoded in one pass and every length is checked against the end of the
+ * enclosing object, so a frame that would fail halfway through being read can be rejected
+ * before anything is constructed for it. Lists, packed lists and compressed chunks are checked
+ * too, as far as that is possible without knowing the type of the values.
+ *
+ * The data of a chunk is opaque to the format, so only the chunks that \p isObject names are
+ * checked as nested objects. Without \p isObject only the top level is checked. The columns of
+ * Writer::PutColumns() are always checked, as one level of nesting.
+ *
+ * @code
+ *  const auto isObject = [](TokenStream::Token token, size_t depth) {
+ *    return depth == 0 && token == Token::header;
+ *  };
+ *  if (!TokenStream::Validate(frame.data(), frame.size(), 4, 10000, isObject)) {
+ *    return Reject(frame);
+ *  }
+ * @endcode
+ *
+ * @param maxDepth Most levels of nested objects. Deeper objects make the data invalid.
+ * @param maxContainerCount Most elements allowed in one list or packed list.
+ * @param isObject Says which chunks hold an object, or nullptr if none do.
+ * @returns \e false if the data is malformed or exceeds a limit.
+ * @note The data of compressed chunks is not decompressed, so the objects in it are not checked.
+ * Validate() does not duplicate the Reader's checks, which stay in place: a valid frame can still
+ * hold a value that does not fit the member it is read into.
+ */
+bool Validate(const uint8_t* data, size_t size, size_t maxDepth = DefaultMaxDepth,
+              uint64_t maxContainerCount = UINT64_MAX, const IsObjectFunction& isObject = nullptr);
+
+//! @brief Checks that the contents of \p data are a well-formed TokenStream. See the other overload.
+inline bool Validate(const Binary& data, size_t maxDepth = DefaultMaxDepth, uint64_t maxContainerCount = UINT64_MAX,
+                     const IsObjectFunction& isObject = nullptr) {
+  return Validate(data.data(), data.size(), maxDepth, maxContainerCount, isObject);
+}
+
+} // namespace TokenStream
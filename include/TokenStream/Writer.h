@@ -28,9 +28,18 @@
 *  Reader save objects' persistent data.
 */
 
+#include <TokenStream/Arena.h>
+#include <TokenStream/Compression.h>
+#include <TokenStream/Executor.h>
+#include <TokenStream/Stats.h>
 #include <TokenStream/TokenStream.h>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <iterator>
 #include <list>
 #include <map>
+#include <memory>
 #include <ostream>
 #include <set>
 #include <sstream>
@@ -39,11 +48,13 @@
 #include <unordered_set>
 #include <vector>
 
-#define ASSERT_TOKEN_SET() TS_ASSERT(m_nextToken.IsValid() || !m_stream->tellp(), "Token not set")
+#define ASSERT_TOKEN_SET() TS_ASSERT(m_nextToken.IsValid() || IsAtStart(), "Token not set")
 
 namespace TokenStream {
 
 class MemoryWriter;
+class SizeCounter;
+class GatherWriter;
 
 template<typename T>
 struct ValueWithDefaultStruct {
@@ -80,6 +91,16 @@ inline StringValueWithDefaultStruct<std::string> ValueWithDefault(const std::str
   return {value, defaultValue};
 }
 
+//! @brief Create a helper pair for writing values to a stream with defaults.
+//! @param value The value to write, e.g. an ArenaString.
+//! @param defaultValue The default for this field.
+//! @note When you write this to a stream, if value==defaultValue && trimDefaults==true, nothing will be written.
+template<typename Traits, typename Alloc>
+StringValueWithDefaultStruct<std::basic_string<char, Traits, Alloc>> ValueWithDefault(
+    const std::basic_string<char, Traits, Alloc>& value, const char* defaultValue) {
+  return {value, defaultValue};
+}
+
 //! @brief Create a helper pair for writing values to a stream with defaults.
 //! @param value The value to write.
 //! @param defaultValue The default for this field.
@@ -163,12 +184,24 @@ class Writer { // NOLINT
     static constexpr bool value = std::is_base_of<Serializable, T>::value ||
         has_write_to_token_stream_method<T>::value || has_object_writer_helper<T>::value;
   };
+  // Types that PutDelta() compares directly rather than by their output. Numbers are compared bit for
+  // bit, so that e.g. -0.0 and 0.0 differ like they do in the stream.
+  template<typename T>
+  struct is_delta_comparable : std::integral_constant<bool, std::is_arithmetic<T>::value || std::is_enum<T>::value> {};
+  template<typename Char, typename Traits, typename Alloc>
+  struct is_delta_comparable<std::basic_string<Char, Traits, Alloc>> : std::true_type {};
+  template<typename T, typename... Params>
+  struct is_delta_comparable<std::vector<T, Params...>>
+      : std::integral_constant<bool, is_delta_comparable<T>::value && !std::is_floating_point<T>::value> {};
 
   //! @brief Creates Writer that will output to the specified stream.
   //! @param stream Any generic stream object.
   //! @param writer Inherit parameters from other writer.
   explicit Writer(std::ostream& stream, const Writer& writer) :
-      m_userData(writer.m_userData), m_stream(&stream), m_trimDefaults(writer.m_trimDefaults) {}
+      m_userData(writer.m_userData),
+      m_stream(&stream),
+      m_trimDefaults(writer.m_trimDefaults),
+      m_packContainers(writer.m_packContainers) {}
 
   //! @brief Creates Writer that will output to the specified stream.
   //! @param stream Any generic stream object.
@@ -181,7 +214,10 @@ class Writer { // NOLINT
   //! @param writer Inherit parameters from other writer.
   //! @param trimDefaults If \e true, default values will not be written. If false, tokens with 0-len will be written for default values.
   explicit Writer(std::ostream& stream, const Writer& writer, bool trimDefaults) :
-      m_userData(writer.m_userData), m_stream(&stream), m_trimDefaults(trimDefaults) {}
+      m_userData(writer.m_userData),
+      m_stream(&stream),
+      m_trimDefaults(trimDefaults),
+      m_packContainers(writer.m_packContainers) {}
 
   //! @brief Do not allow move semantics for the stream. We need it to stick around externally.
   explicit Writer(std::ostream&& stream, bool trimDefaults = true) = delete;
@@ -601,6 +637,31 @@ class Writer { // NOLINT
     return Put(token, str.c_str(), defaultValue.c_str());
   }
 
+  //! @brief Writes a string with a custom allocator, e.g. an ArenaString, to the stream.
+  //! @param token A Token
+  //! @param str The string.
+  //! @param defaultValue nullptr or a pointer to a 0-terminated string.
+  //! @note If str==defaultValue && trimDefaults==true, nothing will be written to the stream.
+  template<typename Traits, typename Alloc>
+  Writer& Put(Token token,
+              const std::basic_string<char, Traits, Alloc>& str,
+              const char* defaultValue = nullptr) {
+    if (defaultValue && defaultValue[0]) {
+      return Put(token, str.c_str(), defaultValue);
+    }
+    return Put(token, StringView{str.data(), str.size()});
+  }
+
+  //! @brief Writes a string with a custom allocator, e.g. an ArenaString, to the stream.
+  //! @param str The string.
+  //! @pre You must have written a token immediately preceding this
+  //! @note If str is empty && trimDefaults==true, nothing will be written to the stream.
+  template<typename Traits, typename Alloc>
+  Writer& operator<<(const std::basic_string<char, Traits, Alloc>& str) {
+    ASSERT_TOKEN_SET();
+    return Put(m_nextToken, str);
+  }
+
   //! @brief Writes a string to the stream.
   //! @param str An std::string.
   //! @pre You must have written a token immediately preceding this
@@ -645,6 +706,40 @@ class Writer { // NOLINT
     return Put(m_nextToken, block);
   }
 
+  //! @brief Writes a string view to the stream.
+  //! @param token A Token
+  //! @param str A StringView, e.g. one returned by Reader::GetStringView().
+  //! @note If str is empty && trimDefaults==true, nothing will be written to the stream.
+  Writer& Put(Token token, StringView str) {
+    return Put(token, str.data(), static_cast<uint64_t>(str.size()));
+  }
+
+  //! @brief Writes a string view to the stream.
+  //! @param str A StringView.
+  //! @pre You must have written a token immediately preceding this
+  //! @note If str is empty && trimDefaults==true, nothing will be written to the stream.
+  Writer& operator<<(StringView str) {
+    ASSERT_TOKEN_SET();
+    return Put(m_nextToken, str);
+  }
+
+  //! @brief Writes a binary string to the stream.
+  //! @param token A Token
+  //! @param block A BlockView, e.g. one returned by Reader::GetBlockView().
+  //! @note If block is empty && trimDefaults==true, nothing will be written to the stream.
+  Writer& Put(Token token, BlockView block) {
+    return Put(token, block.data(), static_cast<uint64_t>(block.size()));
+  }
+
+  //! @brief Writes a binary string to the stream.
+  //! @param block A BlockView.
+  //! @pre You must have written a token immediately preceding this
+  //! @note If block is empty && trimDefaults==true, nothing will be written to the stream.
+  Writer& operator<<(BlockView block) {
+    ASSERT_TOKEN_SET();
+    return Put(m_nextToken, block);
+  }
+
   //! @brief Copies data from a std::istream to the stream.
   //! @param token A Token
   //! @param stream A std::ostream
@@ -848,6 +943,21 @@ class Writer { // NOLINT
     return *this;
   }
 
+  //@{
+  //! @brief Writes a container of objects like Put() does, but encodes the objects on several threads.
+  //! @param token A Token
+  //! @param objects A container of objects that can be written concurrently.
+  //! @param threadCount Number of threads to use. 0 uses std::thread::hardware_concurrency().
+  //! @param executor Runs the batches, e.g. on an existing thread pool.
+  //! @note The output is the same as that of Put(token, objects). The objects are split into
+  //! batches that are encoded into separate buffers and then appended in order. Small containers
+  //! and containers of other types are written on the calling thread.
+  template<typename Container>
+  Writer& PutContainerParallel(Token token, const Container& objects, size_t threadCount = 0);
+  template<typename Container>
+  Writer& PutContainerParallel(Token token, const Container& objects, const Executor& executor, size_t batchCount);
+  //@}
+
   //! @brief Writes a vector to the stream.
   //! @param token A Token
   //! @param items A vector of normal data (not Serializable objects).
@@ -873,17 +983,143 @@ class Writer { // NOLINT
   //! @param token A Token
   //! @param objects A vector of serializable objects.
   //! @note If objects.size() == 0 && trimDefaults==true, nothing will be written to the stream.
+  //! @note Vectors of numbers use the packed encoding if SetPackContainers(true) was called.
+  template<typename T, typename... Params>
+  Writer& Put(Token token, const std::vector<T, Params...>& objects) {
+    return PutVector(token, objects, is_packable<T>{});
+  }
+
+  /*! @brief Writes a vector of objects a member at a time instead of an object at a time.
+        *
+        * The values of each member of \p objects are gathered into one chunk, so a column of numbers is
+        * a single packed list (see PutPacked()) and a column of strings is a single list. Members of
+        * other types, and members of base classes, are written row by row after the columns. The
+        * objects are read back with operator>>() as usual, and Reader::GetColumn() reads just one column.
+        *
+        * @code
+        * writer.PutColumns(Token::employees, employees);
+        * @endcode
+        *
+        * @param token A Token
+        * @param objects Objects with a token map. Defaults are not trimmed from columns.
+        * @note Vectors with fewer than two objects or without a token map are written as usual, and so
+        * are the elements of another container. Readers older than the columnar encoding skip the chunk.
+        */
+  template<typename T, typename... Params>
+  Writer& PutColumns(Token token, const std::vector<T, Params...>& objects) {
+    static_assert(std::is_base_of<Serializable, T>::value, "Only vectors of Serializable objects have columns");
+    if (objects.size() < 2 || !token.IsValid() || m_context.m_containerToken.IsValid() ||
+        objects.front().GetTokenMap().empty()) {
+      return Put(token, objects);
+    }
+    const ConstColumnRows rows{objects.front(), sizeof(T), objects.size()};
+    return PutColumns(token, rows, objects.front().GetTokenMap());
+  }
+
+  //! @brief Writes the member that \p member returns for every row as a single chunk. Used by the \e MAP_TOKEN and
+  //! \e ENUMERATED_TOKEN macros to implement PutColumns().
+  //! @returns \e false without writing anything if the member is not is_columnar, so it has to be written row by row.
+  template<typename Member>
+  bool PutMemberColumn(Token token, const ConstColumnRows& rows, Member member) {
+    using M = typename std::decay<decltype(member(rows[0]))>::type;
+    return PutMemberColumn<M>(token, rows, member, is_columnar<M>{});
+  }
+
+  //@{
+  //! @brief Writes an array of numbers to the stream as a single packed chunk.
+  //! @param token A Token
+  //! @param items Pointer to the first number.
+  //! @param count Number of items.
+  //! @note Every element uses the same width, or the TokenStream length encoding if that is smaller.
+  //! Inside another container, where the packed header cannot be used, this falls back to the
+  //! normal list encoding. Readers older than the packed encoding skip the chunk entirely.
+  //! @note If count==0 && trimDefaults==true, nothing will be written to the stream.
+  Writer& PutPacked(Token token, const int8_t* items, size_t count);
+  Writer& PutPacked(Token token, const int16_t* items, size_t count);
+  Writer& PutPacked(Token token, const uint16_t* items, size_t count);
+  Writer& PutPacked(Token token, const int32_t* items, size_t count);
+  Writer& PutPacked(Token token, const uint32_t* items, size_t count);
+  Writer& PutPacked(Token token, const int64_t* items, size_t count);
+  Writer& PutPacked(Token token, const uint64_t* items, size_t count);
+  Writer& PutPacked(Token token, const float* items, size_t count);
+  Writer& PutPacked(Token token, const double* items, size_t count);
+  //@}
+
+  //! @brief Writes an object to the stream compressed with \p codec.
+  //! @param token A Token
+  //! @param object A Serializable, or a type with a WriteToTokenStream() method or a Helper, which Put() writes as
+  //! a SubStream. Strings, blobs and containers cannot be compressed on their own, since only Reader::SubStream
+  //! decompresses; put them in an object instead.
+  //! @param codec Compression algorithm. Readers need the same codec, which is automatic for Lz4Codec.
+  //! @note The object is written in the normal encoding if compressing does not make it smaller,
+  //! or inside another container, where the compressed header cannot be used.
+  //! Reader::SubStream decompresses the chunk, so \p object is read back as usual. Readers older
+  //! than the compressed encoding skip the chunk entirely.
   template<typename T>
-  Writer& Put(Token token, const std::vector<T>& objects) {
-    return PutContainer<std::vector, T>(token, objects);
+  Writer& PutCompressed(Token token, const T& object, const Codec& codec = Lz4Codec::Get());
+
+  //@{
+  //! @brief Writes \p now only if it differs from \p old. Used by the \e MAP_TOKEN and \e ENUMERATED_TOKEN
+  //! macros to implement Serializable::WriteDelta().
+  //! @param old The value the reader already has.
+  //! @param now The value to write.
+  //! @param defaultValue The default for this field.
+  //! @param tokenMap The token map of a base class, for \e MAP_BASE_TOKEN.
+  //! @pre You must have written a token immediately preceding this
+  //! @returns \e true if \p now is a default that was trimmed, so the reader has to be told to reset the member.
+  //! @note Objects with a token map, and vectors of them that did not change size, are written as deltas of their own.
+  template<typename T>
+  bool PutDelta(const T& old, const T& now) {
+    ASSERT_TOKEN_SET();
+    return PutMemberDelta(old, now, std::is_base_of<Serializable, T>{});
+  }
+  template<typename T, typename D>
+  bool PutDelta(const T& old, const T& now, const D& defaultValue) {
+    ASSERT_TOKEN_SET();
+    if (IsSameValue(old, now)) {
+      m_nextToken.Clear();
+      return false;
+    }
+    const auto written = GetWrittenBytes();
+    *this << ValueWithDefault(now, defaultValue);
+    return GetWrittenBytes() == written;
+  }
+  bool PutDelta(const Serializable& old, const Serializable& now, const TokenMap& tokenMap) {
+    ASSERT_TOKEN_SET();
+    SubStream subStream{*this, m_nextToken};
+    now.WriteDelta(*this, old, tokenMap);
+    return false;
+  }
+  //@}
+
+  //! @brief Writes a vector of numbers to the stream as a single packed chunk.
+  //! @param token A Token
+  //! @param items A vector of numbers.
+  //! @note If items.size() == 0 && trimDefaults==true, nothing will be written to the stream.
+  template<typename T, typename... Params>
+  typename std::enable_if<is_packable<T>::value, Writer&>::type
+  PutPacked(Token token, const std::vector<T, Params...>& items) {
+    return PutPacked(token, items.data(), items.size());
+  }
+
+  //! @brief Use the packed encoding for every vector of numbers written from now on.
+  //! @param pack \e true to pack, \e false for the normal list encoding.
+  //! @note This is off by default since older readers cannot read packed vectors.
+  void SetPackContainers(bool pack) {
+    m_packContainers = pack;
+  }
+
+  //! @brief Returns \e true if vectors of numbers are written with the packed encoding.
+  bool GetPackContainers() const {
+    return m_packContainers;
   }
 
   //! @brief Writes a vector to the stream.
   //! @param itemsOrObjects A vector of normal data or Serializable objects.
   //! @pre You must have written a token immediately preceding this
   //! @note If objects.size() == 0 && trimDefaults==true, nothing will be written to the stream.
-  template<typename T>
-  Writer& operator<<(const std::vector<T>& itemsOrObjects) {
+  template<typename T, typename... Params>
+  Writer& operator<<(const std::vector<T, Params...>& itemsOrObjects) {
     ASSERT_TOKEN_SET();
     return Put(m_nextToken, itemsOrObjects);
   }
@@ -892,17 +1128,17 @@ class Writer { // NOLINT
   //! @param token Token to write.
   //! @param objects A list of serializable objects.
   //! @note If objects.size() == 0 && trimDefaults==true, nothing will be written to the stream.
-  template<typename T>
-  Writer& Put(Token token, const std::list<T>& objects) {
-    return PutContainer<std::list, T>(token, objects);
+  template<typename T, typename... Params>
+  Writer& Put(Token token, const std::list<T, Params...>& objects) {
+    return PutContainer<std::list, T, Params...>(token, objects);
   }
 
   //! @brief Writes a list to the stream.
   //! @param itemsOrObjects A list of normal data or Serializable objects.
   //! @pre You must have written a token immediately preceding this
   //! @note If objects.size() == 0 && trimDefaults==true, nothing will be written to the stream.
-  template<typename T>
-  Writer& operator<<(const std::list<T>& itemsOrObjects) {
+  template<typename T, typename... Params>
+  Writer& operator<<(const std::list<T, Params...>& itemsOrObjects) {
     ASSERT_TOKEN_SET();
     return Put(m_nextToken, itemsOrObjects);
   }
@@ -911,17 +1147,17 @@ class Writer { // NOLINT
   //! @param token Token to write.
   //! @param objects A list of serializable objects.
   //! @note If objects.size() == 0 && trimDefaults==true, nothing will be written to the stream.
-  template<typename T>
-  Writer& Put(Token token, const std::set<T>& objects) {
-    return PutContainer<std::set, T>(token, objects);
+  template<typename T, typename... Params>
+  Writer& Put(Token token, const std::set<T, Params...>& objects) {
+    return PutContainer<std::set, T, Params...>(token, objects);
   }
 
   //! @brief Writes a list to the stream.
   //! @param itemsOrObjects A list of normal data or Serializable objects.
   //! @pre You must have written a token immediately preceding this
   //! @note If objects.size() == 0 && trimDefaults==true, nothing will be written to the stream.
-  template<typename T>
-  Writer& operator<<(const std::set<T>& itemsOrObjects) {
+  template<typename T, typename... Params>
+  Writer& operator<<(const std::set<T, Params...>& itemsOrObjects) {
     ASSERT_TOKEN_SET();
     return Put(m_nextToken, itemsOrObjects);
   }
@@ -930,17 +1166,17 @@ class Writer { // NOLINT
   //! @param token Token to write.
   //! @param objects A list of serializable objects.
   //! @note If objects.size() == 0 && trimDefaults==true, nothing will be written to the stream.
-  template<typename T>
-  Writer& Put(Token token, const std::unordered_set<T>& objects) {
-    return PutContainer<std::unordered_set, T>(token, objects);
+  template<typename T, typename... Params>
+  Writer& Put(Token token, const std::unordered_set<T, Params...>& objects) {
+    return PutContainer<std::unordered_set, T, Params...>(token, objects);
   }
 
   //! @brief Writes a list to the stream.
   //! @param itemsOrObjects A list of normal data or Serializable objects.
   //! @pre You must have written a token immediately preceding this
   //! @note If objects.size() == 0 && trimDefaults==true, nothing will be written to the stream.
-  template<typename T>
-  Writer& operator<<(const std::unordered_set<T>& itemsOrObjects) {
+  template<typename T, typename... Params>
+  Writer& operator<<(const std::unordered_set<T, Params...>& itemsOrObjects) {
     ASSERT_TOKEN_SET();
     return Put(m_nextToken, itemsOrObjects);
   }
@@ -949,17 +1185,17 @@ class Writer { // NOLINT
   //! @param token A Token
   //! @param objects A set of serializable objects.
   //! @note If objects.size() == 0 && trimDefaults==true, nothing will be written to the stream.
-  template<typename Key, typename T>
-  Writer& Put(Token token, const std::map<Key, T>& objects) {
-    return PutMap<std::map, Key, T>(token, objects);
+  template<typename Key, typename T, typename... Params>
+  Writer& Put(Token token, const std::map<Key, T, Params...>& objects) {
+    return PutMap<std::map, Key, T, Params...>(token, objects);
   }
 
   //! @brief Writes a set to the stream.
   //! @param itemsOrObjects A set of normal data or Serializable objects.
   //! @pre You must have written a token immediately preceding this
   //! @note If objects.size() == 0 && trimDefaults==true, nothing will be written to the stream.
-  template<typename Key, typename T>
-  Writer& operator<<(const std::map<Key, T>& itemsOrObjects) {
+  template<typename Key, typename T, typename... Params>
+  Writer& operator<<(const std::map<Key, T, Params...>& itemsOrObjects) {
     ASSERT_TOKEN_SET();
     return Put(m_nextToken, itemsOrObjects);
   }
@@ -968,17 +1204,48 @@ class Writer { // NOLINT
   //! @param token A Token
   //! @param objects A set of serializable objects.
   //! @note If objects.size() == 0 && trimDefaults==true, nothing will be written to the stream.
-  template<typename Key, typename T>
-  Writer& Put(Token token, const std::unordered_map<Key, T>& objects) {
-    return PutMap<std::unordered_map, Key, T>(token, objects);
+  template<typename Key, typename T, typename... Params>
+  Writer& Put(Token token, const std::unordered_map<Key, T, Params...>& objects) {
+    return PutMap<std::unordered_map, Key, T, Params...>(token, objects);
   }
 
   //! @brief Writes a set to the stream.
   //! @param itemsOrObjects A set of normal data or Serializable objects.
   //! @pre You must have written a token immediately preceding this
   //! @note If objects.size() == 0 && trimDefaults==true, nothing will be written to the stream.
-  template<typename Key, typename T>
-  Writer& operator<<(const std::unordered_map<Key, T>& itemsOrObjects) {
+  template<typename Key, typename T, typename... Params>
+  Writer& operator<<(const std::unordered_map<Key, T, Params...>& itemsOrObjects) {
+    ASSERT_TOKEN_SET();
+    return Put(m_nextToken, itemsOrObjects);
+  }
+
+  //! @brief Writes a container that ContainerTraits has been specialized for.
+  //! @param token Token to write.
+  //! @param itemsOrObjects The container. Maps are written as key/value pairs, like std::map.
+  //! @note If itemsOrObjects.size() == 0 && trimDefaults==true, nothing will be written to the stream.
+  template<typename Container>
+  typename std::enable_if<has_container_traits<Container>::value, Writer&>::type
+  Put(Token token, const Container& itemsOrObjects) {
+    const auto size = itemsOrObjects.size();
+    if (size) {
+      PutContainerElementCount(token, size);
+      for (const auto& i : itemsOrObjects) {
+        PutElement(token, i);
+      }
+    } else if (!m_trimDefaults) {
+      PutData(token);
+    }
+    m_nextToken.Clear();
+    return *this;
+  }
+
+  //! @brief Writes a container that ContainerTraits has been specialized for.
+  //! @param itemsOrObjects The container. Maps are written as key/value pairs, like std::map.
+  //! @pre You must have written a token immediately preceding this
+  //! @note If itemsOrObjects.size() == 0 && trimDefaults==true, nothing will be written to the stream.
+  template<typename Container>
+  typename std::enable_if<has_container_traits<Container>::value, Writer&>::type
+  operator<<(const Container& itemsOrObjects) {
     ASSERT_TOKEN_SET();
     return Put(m_nextToken, itemsOrObjects);
   }
@@ -1003,10 +1270,64 @@ class Writer { // NOLINT
     return Put(m_nextToken, value.m_value, value.m_default);
   }
 
+  //! @brief Returns the number of bytes written so far. Inside a SubStream, only the bytes of the SubStream are counted.
   size_t GetLength() const {
+    if (m_knownSizes) {
+      return m_streamOffset - m_context.m_start;
+    }
+    if (m_depth || !m_stream) {
+      return m_size - m_context.m_start + static_cast<size_t>(m_referencedBytes - m_context.m_referenced);
+    }
     return static_cast<size_t>(m_stream->tellp());
   }
 
+  /*! @brief Writes nested data straight to the stream, using the sizes collected by \p counter.
+        *
+        * Normally a stream Writer has to hold the data of each nested object in memory until its
+        * length is known. After this call, every SubStream takes its length from \p counter instead,
+        * so the header goes out first and nothing is buffered. The same objects must be written in
+        * the same order, with the same settings, as they were to \p counter.
+        *
+        * @code
+        * TokenStream::SizeCounter counter;
+        * record.Write(counter);
+        * TokenStream::Writer writer{file};
+        * writer.SetPrecomputedSizes(counter);
+        * record.Write(writer);
+        * @endcode
+        *
+        * @param counter Must stay valid until everything has been written.
+        * @pre This is a stream Writer and is not inside a SubStream.
+        * @see SizeCounter
+        */
+  void SetPrecomputedSizes(const SizeCounter& counter);
+
+  /*! @brief Points a stream Writer at \p stream, as if it had just been created with Writer(stream, trimDefaults).
+   *
+   * Whatever was written to the old stream stays there. The memory used for nested objects is kept,
+   * so a Writer that is reused for many messages stops allocating once it has seen the largest one.
+   *
+   * @pre This is a stream Writer and is not inside a SubStream.
+   * @see Pool
+   */
+  void Rebind(std::ostream& stream, bool trimDefaults = true);
+
+  //! @brief Do not allow move semantics for the stream. We need it to stick around externally.
+  void Rebind(std::ostream&& stream, bool trimDefaults = true) = delete;
+
+  //! @brief Returns the number of bytes the output region can hold before it has to grow.
+  size_t capacity() const {
+    return m_capacity;
+  }
+
+  //! @brief Makes room for \p len more bytes in the output region, so that they can be written without growing it.
+  //! Does nothing for stream writers and SizeCounter, which have no output region.
+  void ReserveCapacity(size_t len) {
+    if (!IsStreaming() && !m_countedSizes && len > m_capacity - m_size) {
+      Grow(len);
+    }
+  }
+
   //! @brief Used to switch the TrimDefault state of a stream.
   //! This will allow you to change the state for the life of the TrimDefault object.
   class TrimDefault { // NOLINT
@@ -1038,25 +1359,372 @@ class Writer { // NOLINT
   };
 
  private:
+  // This data is saved and restored by the SubStream class to handle nesting
+  struct SubStreamContext {
+    Token m_containerToken;
+    uint64_t m_containerElementCount = 0;
+    uint64_t m_containerElementIndex = 0;
+    size_t m_start;
+    // m_referencedBytes when the context started
+    uint64_t m_referenced = 0;
+    explicit SubStreamContext(size_t start = 0, uint64_t referenced = 0) : m_start(start), m_referenced(referenced) {}
+  };
+
+ public:
+  /*! @brief Used to write nested data. Everything written to the \e Writer while the SubStream is in scope becomes the data of a single chunk for \e token.
+        *
+        * The nested data is written in place into a single buffer shared by all nesting levels. The
+        * length is patched in when the SubStream goes out of scope, so each byte is only written once
+        * no matter how deeply it is nested.
+        *
+        * @code
+        * void Employee::Write(Writer& writer) const
+        * {
+        *   writer << Token::name << m_name;
+        *   Writer::SubStream subStream{ writer, Token::home };
+        *   writer << Address::Token::street << m_homeStreet;
+        *   writer << Address::Token::city << m_homeCity;
+        * }
+        * @endcode
+        *
+        * @see Reader::SubStream
+        */
+  class SubStream { // NOLINT
+   public:
+    //! @brief Start a nested chunk on \p writer
+    //! @param writer A \e Writer to nest. Everything written until the SubStream is destroyed will be wrapped in one chunk.
+    //! @param token The token for the nested chunk.
+    //! @param keepStubOnEmpty If true, keep the 0-byte stub if nothing is written. We need these as placeholders in vectors.
+    SubStream(Writer& writer, Token token, bool keepStubOnEmpty = false);
+
+    // no copying
+    SubStream(const SubStream&) = delete;
+    SubStream& operator=(const SubStream&) = delete;
+
+    //! @brief Writes the header for the nested data and restores the state of the enclosing stream.
+    ~SubStream();
+
+   private:
+    Writer& m_writer;
+    Token m_token;
+    bool m_keepStubOnEmpty;
+    size_t m_headerStart;
+    size_t m_reservedHeaderSize;
+    // Index into the sizes collected by a SizeCounter or used by SetPrecomputedSizes()
+    size_t m_sizeIndex = 0;
+    // Index of the first payload referenced by a GatherWriter inside the SubStream
+    size_t m_firstReference = 0;
+    SubStreamContext m_oldContext;
+  };
+  friend class SubStream;
+
+ protected:
+  //! @brief Creates Writer that collects its output in memory rather than writing to a stream.
+  //! @param writer nullptr or other writer to inherit parameters from.
+  //! @param trimDefaults If \e true, default values will not be written. If false, tokens with 0-len will be written for default values.
+  Writer(const Writer* writer, bool trimDefaults) :
+      m_userData(writer ? writer->m_userData : nullptr),
+      m_stream(nullptr),
+      m_trimDefaults(trimDefaults),
+      m_packContainers(writer && writer->m_packContainers) {}
+
+  //! @brief Creates Writer that collects its output in memory rather than writing to a stream.
+  //! @param writer Inherit parameters from other writer.
+  explicit Writer(const Writer* writer) :
+      m_userData(writer->m_userData),
+      m_stream(nullptr),
+      m_trimDefaults(writer->m_trimDefaults),
+      m_packContainers(writer->m_packContainers) {}
+
+  //! @brief Use \p data as the output region. Once it is full, the output moves to the heap.
+  void SetBuffer(uint8_t* data, size_t capacity) {
+    m_data = data;
+    m_capacity = capacity;
+  }
+
+  //! @brief Use the memory of \p buffer as the output region. Its contents are discarded.
+  void SetBuffer(Binary&& buffer) {
+    m_buffer = std::move(buffer);
+    m_buffer.resize(m_buffer.capacity());
+    SetBuffer(m_buffer.data(), m_buffer.size());
+  }
+
+  //! @brief Throws away everything written, but keeps the memory for reuse
+  void Reset() {
+    TS_ASSERT(!m_depth, "Cannot reset a Writer inside a SubStream");
+    m_nextToken.Clear();
+    m_badStream = false;
+    m_context = SubStreamContext{};
+    m_size = 0;
+    m_referencedBytes = 0;
+    if (m_references) {
+      m_references->clear();
+    }
+  }
+
+  //! @brief Restores the settings that a new Writer starts out with
+  void ResetSettings(bool trimDefaults) {
+    m_userData = nullptr;
+    m_trimDefaults = trimDefaults;
+    m_packContainers = false;
+  }
+
+  //! @brief Moves the memory output into a Binary and leaves the Writer empty
+  Binary ReleaseBuffer();
+
+  // The output region. For a stream Writer this only holds nested data until the outermost
+  // SubStream is complete. For a memory Writer (m_stream == nullptr) it holds everything.
+  uint8_t* m_data = nullptr;
+  size_t m_size = 0;
+  size_t m_capacity = 0;
+
+  // Set by SizeCounter. Nothing is stored, m_size just counts the bytes, and the length of each
+  // SubStream is recorded in the order they were started.
+  std::vector<uint64_t>* m_countedSizes = nullptr;
+
+  // A payload that GatherWriter left in the caller's memory instead of copying it
+  struct Reference {
+    // Where the payload belongs in the output region
+    size_t m_position;
+    const uint8_t* m_data;
+    size_t m_size;
+  };
+  // Set by GatherWriter. Payloads of at least m_referenceThreshold bytes are referenced.
+  std::vector<Reference>* m_references = nullptr;
+  size_t m_referenceThreshold = 0;
+  // Total size of the referenced payloads
+  uint64_t m_referencedBytes = 0;
+
+ private:
+  //! Largest possible header: a length-encoded token followed by a length-encoded length
+  static constexpr size_t MaxHeaderSize = 18;
+
+  bool IsAtStart() const {
+    return IsAtStart(m_knownSizes ? m_streamOffset : m_size);
+  }
+  bool IsAtStart(size_t position) const {
+    return position == m_context.m_start && (m_depth || !m_stream || !m_stream->tellp());
+  }
   void PutData(Token t) {
     PutData(t, nullptr, 0);
   }
-  void PutData(Token t,
-               const void* data,
-               uint64_t len,
-               bool removeLeadingZeros = false,
-               bool handleExtendedSign = false);
-  void PutDataHeader(Token t, uint64_t len);
-  void WriteLengthEncoded(uint64_t value);
+  // Writes bytes owned by the caller, which a GatherWriter may reference rather than copy
+  void PutPayload(Token t, const void* data, uint64_t len) {
+    if (m_references && len >= m_referenceThreshold && len && !IsStreaming() && !m_countedSizes) {
+      PutReference(t, data, len);
+    } else {
+      PutData(t, data, len);
+    }
+  }
+  void PutReference(Token t, const void* data, uint64_t len);
+  void PutData(Token t, const void* data, uint64_t len);
+  // Writes the header and the low \p width bytes of \p wire as one chunk, in a single write
+  void PutScalar(Token t, uint64_t wire, size_t width);
+  void PutDataHeader(Token t, uint64_t len) {
+    uint8_t header[MaxHeaderSize];
+    const auto size = EncodeDataHeader(t, len, m_knownSizes ? m_streamOffset : m_size, header);
+    if (size && !WriteBytes(header, size)) {
+      TS_ASSERT(false, "Failed to write to TokenStream");
+      m_badStream = true;
+    }
+  }
+  size_t EncodeDataHeader(Token t, uint64_t len, size_t position, uint8_t* header);
+  size_t TokenHeaderSize(Token t) const;
+  template<typename T, typename... Params>
+  Writer& PutVector(Token token, const std::vector<T, Params...>& items, std::true_type) {
+    if (m_packContainers) {
+      return PutPacked(token, items.data(), items.size());
+    }
+    return PutContainer<std::vector, T, Params...>(token, items);
+  }
+  template<typename T, typename... Params>
+  Writer& PutVector(Token token, const std::vector<T, Params...>& objects, std::false_type) {
+    return PutContainer<std::vector, T, Params...>(token, objects);
+  }
+  template<typename T>
+  Writer& PutPackedItems(Token token, const T* items, size_t count);
+  Writer& PutColumns(Token token, const ConstColumnRows& rows, const TokenMap& tokenMap);
+  template<typename M, typename Member>
+  bool PutMemberColumn(Token token, const ConstColumnRows& rows, Member member, std::true_type) {
+    std::vector<M> column;
+    column.reserve(rows.size());
+    for (size_t row = 0; row < rows.size(); row++) {
+      column.push_back(member(rows[row]));
+    }
+    PutColumnValues(token, column, is_packable<M>{});
+    return true;
+  }
+  template<typename M, typename Member>
+  bool PutMemberColumn(Token, const ConstColumnRows&, Member, std::false_type) {
+    return false;
+  }
+  template<typename M>
+  void PutColumnValues(Token token, const std::vector<M>& column, std::true_type) {
+    PutPacked(token, column.data(), column.size());
+  }
+  template<typename M>
+  void PutColumnValues(Token token, const std::vector<M>& column, std::false_type) {
+    Put(token, column);
+  }
+  // Writes the chunk in \p plain compressed, or as it is if that is not smaller
+  Writer& PutCompressedChunk(Token token, const Writer& plain, const Codec& codec);
+  // Fewest objects worth handing to another thread
+  static constexpr size_t MinParallelBatch = 64;
+  template<typename Container>
+  Writer& PutContainerParallel(Token token, const Container& objects, const Executor& executor, size_t batchCount, std::true_type);
+  template<typename Container>
+  Writer& PutContainerParallel(Token token, const Container& objects, const Executor&, size_t, std::false_type) {
+    return Put(token, objects);
+  }
+  // Writes one element of a container the way PutContainer() and PutMap() do
+  template<typename T>
+  void PutElement(Token token, const T& item) {
+    PutElement(token, item, std::integral_constant<bool, has_custom_writer<T>::value>{});
+  }
+  template<typename First, typename Second>
+  void PutElement(Token token, const std::pair<First, Second>& item) {
+    Put(token, item, true);
+  }
+  template<typename T>
+  void PutElement(Token token, const T& object, std::true_type) {
+    Put(token, object, true);
+  }
+  template<typename T>
+  void PutElement(Token token, const T& item, std::false_type) {
+    TrimDefault state(*this, false);
+    Put(token, item);
+  }
+  // Writes a member that changed. Returns true if nothing was written because it is a trimmed default.
+  template<typename T>
+  bool PutChanged(const T& now) {
+    const auto written = GetWrittenBytes();
+    *this << now;
+    return GetWrittenBytes() == written;
+  }
+  // Every byte produced so far, including those already sent to m_stream. Unlike GetLength(), this
+  // does not need a seekable stream.
+  size_t GetWrittenBytes() const {
+    return m_streamOffset + m_size + static_cast<size_t>(m_referencedBytes);
+  }
+  template<typename T>
+  bool PutMemberDelta(const T& old, const T& now, std::true_type);
+  template<typename T>
+  bool PutMemberDelta(const T& old, const T& now, std::false_type) {
+    return PutValueDelta(old, now, is_delta_comparable<T>{});
+  }
+  template<typename T, typename... Params>
+  bool PutMemberDelta(const std::vector<T, Params...>& old, const std::vector<T, Params...>& now, std::false_type) {
+    return PutVectorDelta(old, now, std::is_base_of<Serializable, T>{});
+  }
+  template<typename T>
+  static bool IsSameValue(const T& lhs, const T& rhs) {
+    return lhs == rhs;
+  }
+  static bool IsSameValue(float lhs, float rhs) {
+    return !memcmp(&lhs, &rhs, sizeof(lhs));
+  }
+  static bool IsSameValue(double lhs, double rhs) {
+    return !memcmp(&lhs, &rhs, sizeof(lhs));
+  }
+  template<typename T>
+  bool PutValueDelta(const T& old, const T& now, std::true_type) {
+    if (IsSameValue(old, now)) {
+      m_nextToken.Clear();
+      return false;
+    }
+    return PutChanged(now);
+  }
+  template<typename T>
+  bool PutValueDelta(const T& old, const T& now, std::false_type);
+  template<typename T, typename... Params>
+  bool PutVectorDelta(const std::vector<T, Params...>& old, const std::vector<T, Params...>& now, std::true_type);
+  template<typename T, typename... Params>
+  bool PutVectorDelta(const std::vector<T, Params...>& old, const std::vector<T, Params...>& now, std::false_type) {
+    return PutValueDelta(old, now, is_delta_comparable<std::vector<T, Params...>>{});
+  }
+  // Writes the elements of a container without a header, as if they followed the first one
+  void BeginContainerElements(Token token, uint64_t count) {
+    m_context.m_containerToken = token;
+    m_context.m_containerElementIndex = 1;
+    m_context.m_containerElementCount = count + 1;
+  }
+  // Writes the container header followed by the elements that were written to \p batches
+  Writer& PutContainerBatches(Token token, uint64_t count, const std::vector<const Writer*>& batches);
+  // True if bytes go straight to m_stream rather than to the output region
+  bool IsStreaming() const {
+    return m_stream && (!m_depth || m_knownSizes);
+  }
+  uint8_t* Reserve(size_t len) {
+    TS_STATS_ADD(bytesWritten, len);
+    if (len > m_capacity - m_size) {
+      Grow(len);
+    }
+    auto* data = m_data + m_size;
+    m_size += len;
+    return data;
+  }
+  void WriteLengthEncoded(uint64_t value) {
+    if (m_badStream) {
+      return;
+    }
+    uint8_t encoded[MaxHeaderSize / 2];
+    if (!WriteBytes(encoded, EncodeLength(value, encoded))) {
+      TS_ASSERT(false, "Failed to write to TokenStream");
+      m_badStream = true;
+    }
+  }
+  static size_t EncodeLength(uint64_t value, uint8_t* out) {
+    if (value < 0x80) {
+      out[0] = static_cast<uint8_t>(value);
+      return 1;
+    }
+    if (value < 0x7800) {
+      out[0] = static_cast<uint8_t>(value >> 8u) | 0x80u;
+      out[1] = static_cast<uint8_t>(value);
+      return 2;
+    }
+    return EncodeLongLength(value, out);
+  }
+  static size_t EncodeLongLength(uint64_t value, uint8_t* out);
+  bool WriteBytes(const void* data, size_t len) {
+    TS_STATS_ADD(bytesWritten, len);
+    if (IsStreaming()) {
+      return WriteToStream(data, len);
+    }
+    if (m_countedSizes) {
+      m_size += len;
+      return true;
+    }
+    if (len > m_capacity - m_size) {
+      Grow(len);
+    }
+    if (len) {
+      memcpy(m_data + m_size, data, len);
+      m_size += len;
+    }
+    return true;
+  }
+  bool WriteToStream(const void* data, size_t len);
+  void Grow(size_t len);
+  void Flush();
 
   std::ostream* m_stream;
   Token m_nextToken;
   bool m_trimDefaults = true;
+  bool m_packContainers = false;
   bool m_badStream = false;
-
-  Token m_containerToken;
-  uint64_t m_containerElementCount = 0;
-  uint64_t m_containerElementIndex = 0;
+  SubStreamContext m_context;
+
+  // Heap storage behind m_data, unless the output region was supplied with SetBuffer() or comes from m_arena
+  Binary m_buffer;
+  Arena* m_arena = Arena::Current();
+  size_t m_depth = 0;
+
+  // Set by SetPrecomputedSizes()
+  const std::vector<uint64_t>* m_knownSizes = nullptr;
+  size_t m_nextKnownSize = 0;
+  // Bytes written to m_stream. Only used for positions while m_knownSizes is set, and by GetWrittenBytes().
+  size_t m_streamOffset = 0;
 };
 
 /*! @brief Writes objects into a TokenStream using an internal memory buffer, with minimal allocations
@@ -1092,66 +1760,346 @@ class MemoryWriter : public Writer {
  public:
   //! @brief Creates MemoryWriter that will output to an internal memory buffer.
   //! @param trimDefaults If \e true, default values will not be written. If \e false, tokens with 0-len will be written for default values.
-  explicit MemoryWriter(bool trimDefaults = true) : Writer{m_internalStream, trimDefaults} {}
+  explicit MemoryWriter(bool trimDefaults = true) : Writer{nullptr, trimDefaults} {}
 
   //! @brief Creates MemoryWriter that will output to an internal memory buffer.
   //! @param writer Inherit parameters from other writer.
-  explicit MemoryWriter(const Writer& writer) : Writer{m_internalStream, writer} {}
+  explicit MemoryWriter(const Writer& writer) : Writer{&writer} {
+    TS_STATS_ADD(nestedWriters, 1);
+  }
 
   //! @brief Creates MemoryWriter that will output to an internal memory buffer.
   //! @param writer Inherit parameters from other writer.
   //! @param trimDefaults If \e true, default values will not be written. If \e false, tokens with 0-len will be written for default values.
-  explicit MemoryWriter(const Writer& writer, bool trimDefaults) :
-      Writer{m_internalStream, writer, trimDefaults} {}
+  explicit MemoryWriter(const Writer& writer, bool trimDefaults) : Writer{&writer, trimDefaults} {
+    TS_STATS_ADD(nestedWriters, 1);
+  }
+
+  //! @brief Creates MemoryWriter that reuses the memory of \p buffer, e.g. one returned by Release().
+  //! @param buffer Its contents are discarded, but its capacity is kept.
+  //! @param trimDefaults If \e true, default values will not be written. If \e false, tokens with 0-len will be written for default values.
+  explicit MemoryWriter(Binary&& buffer, bool trimDefaults = true) : Writer{nullptr, trimDefaults} {
+    SetBuffer(std::move(buffer));
+  }
+
+  //! @brief Creates MemoryWriter that will output to a caller-supplied buffer.
+  //! @param buffer Memory to write to. It must stay valid for the lifetime of the MemoryWriter.
+  //! @param capacity Size of \p buffer. If more than this is written, the output is moved to the heap.
+  //! @param trimDefaults If \e true, default values will not be written. If \e false, tokens with 0-len will be written for default values.
+  MemoryWriter(void* buffer, size_t capacity, bool trimDefaults = true) : Writer{nullptr, trimDefaults} {
+    SetBuffer(static_cast<uint8_t*>(buffer), capacity);
+  }
+
+  //! @brief Returns a pointer to the data written so far. It is invalidated by further writes.
+  const uint8_t* data() const {
+    return m_data;
+  }
+
+  //! @brief Returns the number of bytes written so far.
+  size_t size() const {
+    return m_size;
+  }
+
+  //! @brief Returns \e true if nothing has been written.
+  bool empty() const {
+    return !m_size;
+  }
+
+  //! @brief Throws away everything written so that the MemoryWriter can be reused without reallocating.
+  void clear() {
+    Reset();
+  }
+
+  //! @brief Like clear(), and also restores the settings of MemoryWriter(trimDefaults): user data and
+  //! SetPackContainers() are cleared.
+  void clear(bool trimDefaults) {
+    Reset();
+    ResetSettings(trimDefaults);
+  }
+
+  //! @brief Moves the data written into a Binary and leaves the MemoryWriter empty.
+  //! @note No copy is made unless the data is still in a caller-supplied buffer.
+  Binary Release() {
+    return ReleaseBuffer();
+  }
+
+  //! @brief Returns a view of the data written so far. It is invalidated by further writes.
+  BlockView GetBlockView() const {
+    return {m_data, m_size};
+  }
 
-  //! @brief Get an AZ::IO::Reader to access the stream.
+  //! @brief Get a copy of the data as a std::stringstream.
+  //! @note Prefer data()/size() or Release(), which do not copy.
   std::stringstream GetReader() const {
-    std::stringstream tmp;
-    tmp << m_internalStream.str();
-    return tmp;
+    return std::stringstream{std::string{reinterpret_cast<const char*>(m_data), m_size}};
+  }
+};
+
+/*! @brief Runs the same Write code as any other Writer but only adds up the size of the output
+     *
+     * Nothing is stored. The length of every nested object is kept so that a stream Writer can
+     * write the same objects afterwards without buffering them.
+     *
+     * @see Writer::SetPrecomputedSizes
+     */
+class SizeCounter : public Writer {
+ public:
+  //! @brief Creates SizeCounter that counts the output of a Writer with the same settings.
+  //! @param trimDefaults If \e true, default values will not be written. If \e false, tokens with 0-len will be written for default values.
+  explicit SizeCounter(bool trimDefaults = true) : Writer{nullptr, trimDefaults} {
+    m_countedSizes = &m_sizes;
+  }
+
+  //! @brief Creates SizeCounter that counts the output of a Writer with the same settings.
+  //! @param writer Inherit parameters from other writer.
+  explicit SizeCounter(const Writer& writer) : Writer{&writer} {
+    m_countedSizes = &m_sizes;
+  }
+
+  //! @brief Returns the number of bytes that would have been written so far.
+  size_t size() const {
+    return m_size;
+  }
+
+  //! @brief Returns the length of each nested object in the order they were started.
+  const std::vector<uint64_t>& GetSizes() const {
+    return m_sizes;
+  }
+
+  //! @brief Forgets everything counted so far.
+  void clear() {
+    Reset();
+    m_sizes.clear();
   }
 
  private:
-  std::stringstream m_internalStream;
+  std::vector<uint64_t> m_sizes;
 };
 
+/*! @brief Writer that leaves large payloads in the caller's memory
+     *
+     * Headers and small values are collected in an internal buffer. Blocks and strings of at least
+     * the threshold size are only referenced, and GetSegments() returns the pieces in order, ready
+     * for writev(), sendmsg() or WSASend().
+     *
+     * @code
+     * TokenStream::GatherWriter writer;
+     * writer.Put(Token::name, name).Put(Token::image, imageData);
+     * std::vector<iovec> iov;
+     * for (const auto& segment : writer.GetSegments()) {
+     *   iov.push_back({const_cast<uint8_t*>(segment.data()), segment.size()});
+     * }
+     * writev(socket, iov.data(), static_cast<int>(iov.size()));
+     * @endcode
+     *
+     * @warning The referenced memory must stay valid and unchanged until the segments have been sent.
+     * Values that are converted while writing, like numbers and wide strings, are always copied.
+     */
+class GatherWriter : public Writer {
+ public:
+  //! Default size from which payloads are referenced rather than copied
+  static constexpr size_t DefaultThreshold = 0x1000;
+
+  //! @brief Creates GatherWriter that references payloads of at least \p threshold bytes.
+  //! @param trimDefaults If \e true, default values will not be written. If \e false, tokens with 0-len will be written for default values.
+  explicit GatherWriter(size_t threshold = DefaultThreshold, bool trimDefaults = true) :
+      Writer{nullptr, trimDefaults} {
+    m_references = &m_payloads;
+    m_referenceThreshold = threshold;
+  }
+
+  //! @brief Creates GatherWriter that references payloads of at least \p threshold bytes.
+  //! @param writer Inherit parameters from other writer.
+  explicit GatherWriter(const Writer& writer, size_t threshold = DefaultThreshold) : Writer{&writer} {
+    TS_STATS_ADD(nestedWriters, 1);
+    m_references = &m_payloads;
+    m_referenceThreshold = threshold;
+  }
+
+  //! @brief Returns the total number of bytes written so far, including the referenced payloads.
+  size_t size() const {
+    return m_size + static_cast<size_t>(m_referencedBytes);
+  }
+
+  //! @brief Returns the output as a list of pieces in order. They are invalidated by further writes.
+  std::vector<BlockView> GetSegments() const;
+
+  //! @brief Throws away everything written so that the GatherWriter can be reused without reallocating.
+  void clear() {
+    Reset();
+  }
+
+ private:
+  std::vector<Reference> m_payloads;
+};
+
+inline void Writer::SetPrecomputedSizes(const SizeCounter& counter) {
+  TS_ASSERT(m_stream && !m_depth, "Precomputed sizes need a stream Writer outside of any SubStream");
+  m_knownSizes = &counter.GetSizes();
+  m_nextKnownSize = 0;
+  m_streamOffset = 0;
+}
+
 inline Writer& Writer::Put(Token token, const MemoryWriter& memoryWriter) {
-  return Put(token, memoryWriter.GetReader());
+  TS_STATS_ADD(nestingCopyBytes, memoryWriter.size());
+  return Put(token, memoryWriter.data(), static_cast<uint64_t>(memoryWriter.size()));
 }
 
 template<typename First, typename Second>
 Writer& Writer::Put(Token token, const std::pair<First, Second>& object, bool keepStubOnEmpty) {
-  // ReSharper disable once CppClassIsIncomplete
-  MemoryWriter subWriter{*this, m_trimDefaults};
-  subWriter.Put(0, object.first);
-  subWriter.Put(1, object.second);
-  TrimDefault handleStub{*this, m_trimDefaults && !keepStubOnEmpty};
-  Put(token, subWriter);
+  SubStream subStream{*this, token, keepStubOnEmpty};
+  Put(0, object.first);
+  Put(1, object.second);
   return *this;
 }
 
 template<typename T>
 typename std::enable_if<Writer::has_object_writer_helper<T>::value, Writer&>::type
 Writer::Put(Token token, const T& object, bool keepStubOnEmpty) {
-  // ReSharper disable once CppClassIsIncomplete
-  MemoryWriter subWriter{*this, m_trimDefaults};
-  Helper<T>::Write(object, subWriter);
-  TrimDefault handleStub{*this, m_trimDefaults && !keepStubOnEmpty};
-  Put(token, subWriter);
+  SubStream subStream{*this, token, keepStubOnEmpty};
+  Helper<T>::Write(object, *this);
   return *this;
 }
 
 template<typename T>
 typename std::enable_if<Writer::has_write_to_token_stream_method<T>::value, Writer&>::type
 Writer::Put(Token token, const T& object, bool keepStubOnEmpty) {
-  // ReSharper disable once CppClassIsIncomplete
-  MemoryWriter subWriter{*this, m_trimDefaults};
-  object.WriteToTokenStream(subWriter);
-  TrimDefault handleStub{*this, m_trimDefaults && !keepStubOnEmpty};
-  Put(token, subWriter);
+  SubStream subStream{*this, token, keepStubOnEmpty};
+  object.WriteToTokenStream(*this);
   return *this;
 }
 
+template<typename Container>
+Writer& Writer::PutContainerParallel(Token token, const Container& objects, size_t threadCount) {
+  const auto executor = [threadCount](size_t taskCount, const std::function<void(size_t)>& task) {
+    RunOnThreads(taskCount, task, threadCount);
+  };
+  // A few batches per thread even out objects of different sizes
+  return PutContainerParallel(token, objects, executor, GetThreadCount(threadCount) * 4);
+}
+
+template<typename Container>
+Writer& Writer::PutContainerParallel(Token token,
+                                     const Container& objects,
+                                     const Executor& executor,
+                                     size_t batchCount) {
+  return PutContainerParallel(
+      token, objects, executor, batchCount, std::integral_constant<bool, has_custom_writer<typename Container::value_type>::value>{});
+}
+
+template<typename Container>
+Writer& Writer::PutContainerParallel(
+    Token token, const Container& objects, const Executor& executor, size_t batchCount, std::true_type) {
+  const auto count = objects.size();
+  batchCount = std::min(batchCount, count / MinParallelBatch);
+  if (batchCount < 2 || !token.IsValid() || m_context.m_containerToken.IsValid()) {
+    return Put(token, objects);
+  }
+  // Where each batch starts
+  std::vector<typename Container::const_iterator> starts;
+  starts.reserve(batchCount + 1);
+  auto it = objects.begin();
+  for (size_t batch = 0; batch < batchCount; batch++) {
+    starts.push_back(it);
+    std::advance(it, count * (batch + 1) / batchCount - count * batch / batchCount);
+  }
+  starts.push_back(objects.end());
+
+  // Each writer is created on the thread that uses it, so that it picks up that thread's Arena
+  std::vector<std::unique_ptr<MemoryWriter>> writers(batchCount);
+  executor(batchCount, [&](size_t batch) {
+    writers[batch].reset(new MemoryWriter{*this});
+    Writer& writer = *writers[batch];
+    writer.BeginContainerElements(token, count);
+    for (auto element = starts[batch]; element != starts[batch + 1]; ++element) {
+      writer.Put(token, *element, true);
+    }
+  });
+
+  std::vector<const Writer*> batches;
+  batches.reserve(batchCount);
+  for (const auto& writer : writers) {
+    if (!writer) {
+      TS_ASSERT(false, "The executor did not run every batch");
+      m_badStream = true;
+      return *this;
+    }
+    batches.push_back(writer.get());
+  }
+  return PutContainerBatches(token, count, batches);
+}
+
+template<typename T>
+Writer& Writer::PutCompressed(Token token, const T& object, const Codec& codec) {
+  static_assert(has_custom_writer<T>::value, "Only objects that are read with a SubStream can be compressed");
+  if (!token.IsValid() || m_context.m_containerToken.IsValid()) {
+    return Put(token, object);
+  }
+  // The codec needs the whole object, so it is written to memory first
+  MemoryWriter plain{*this};
+  plain.Put(token, object);
+  return PutCompressedChunk(token, plain, codec);
+}
+
+template<typename T>
+bool Writer::PutMemberDelta(const T& old, const T& now, std::true_type) {
+  // Without a token map there are no members to compare
+  if (now.GetTokenMap().empty()) {
+    return PutValueDelta(old, now, std::false_type{});
+  }
+  SubStream subStream{*this, m_nextToken};
+  now.WriteDelta(*this, old);
+  return false;
+}
+
+template<typename T>
+bool Writer::PutValueDelta(const T& old, const T& now, std::false_type) {
+  MemoryWriter before{*this};
+  before.PutToken(m_nextToken);
+  before << old;
+  MemoryWriter after{*this};
+  after.PutToken(m_nextToken);
+  after << now;
+  if (before.GetBlockView() == after.GetBlockView()) {
+    m_nextToken.Clear();
+    return false;
+  }
+  return PutChanged(now);
+}
+
+template<typename T, typename... Params>
+bool Writer::PutVectorDelta(const std::vector<T, Params...>& old,
+                            const std::vector<T, Params...>& now,
+                            std::true_type) {
+  // The reader can only match the objects up if there are as many as before
+  if (old.size() != now.size()) {
+    return PutChanged(now);
+  }
+  if (now.empty() || now.front().GetTokenMap().empty()) {
+    return PutValueDelta(old, now, std::false_type{});
+  }
+  // Nothing is written if none of the objects changed
+  MemoryWriter changes{*this};
+  size_t index = 0;
+  while (index < now.size() && changes.empty()) {
+    now[index].WriteDelta(changes, old[index]);
+    index++;
+  }
+  if (changes.empty()) {
+    m_nextToken.Clear();
+    return false;
+  }
+  // Objects that did not change keep an empty placeholder
+  const auto token = m_nextToken;
+  PutContainerElementCount(token, now.size());
+  for (index = 0; index < now.size(); index++) {
+    SubStream element{*this, token, true};
+    now[index].WriteDelta(*this, old[index]);
+  }
+  m_nextToken.Clear();
+  return false;
+}
+
 } // namespace TokenStream
 
 #undef ASSERT_TOKEN_SET
@@ -0,0 +1,107 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include <TokenStream/Arena.h>
+#include <algorithm>
+
+namespace TokenStream {
+
+namespace {
+thread_local Arena* s_currentArena = nullptr;
+}
+
+Arena::Arena(void* buffer, size_t size, size_t blockSize) :
+    m_blockSize(blockSize),
+    m_current(static_cast<uint8_t*>(buffer)),
+    m_end(static_cast<uint8_t*>(buffer) + size),
+    m_initial(static_cast<uint8_t*>(buffer)),
+    m_initialSize(size) {}
+
+Arena::~Arena() {
+  FreeBlocks();
+}
+
+void* Arena::AllocateBlock(size_t size, size_t alignment) {
+  // Enough room for the worst-case padding, so the retry below cannot fail
+  const auto needed = size + alignment;
+  auto* spare = m_spare;
+  m_spare = nullptr;
+  UseBlock(spare && spare->m_size >= needed ? spare : NewBlock(std::max(m_blockSize, needed)));
+  return Allocate(size, alignment);
+}
+
+Arena::Block* Arena::NewBlock(size_t size) {
+  auto* block = static_cast<Block*>(::operator new(sizeof(Block) + size));
+  block->m_next = m_blocks;
+  block->m_size = size;
+  m_blocks = block;
+  m_reserved += size;
+  return block;
+}
+
+void Arena::UseBlock(Block* block) {
+  m_current = reinterpret_cast<uint8_t*>(block + 1);
+  m_end = m_current + block->m_size;
+}
+
+void Arena::FreeBlocks() {
+  while (m_blocks) {
+    auto* next = m_blocks->m_next;
+    ::operator delete(m_blocks);
+    m_blocks = next;
+  }
+  m_spare = nullptr;
+  m_reserved = 0;
+}
+
+void Arena::Reset() {
+  m_used = 0;
+  // If it took more than one block, replace them all with a single block big enough for next time
+  if (m_blocks && m_blocks->m_next) {
+    const auto size = m_reserved;
+    FreeBlocks();
+    NewBlock(size);
+  }
+  if (m_initial) {
+    m_current = m_initial;
+    m_end = m_initial + m_initialSize;
+    m_spare = m_blocks;
+  } else if (m_blocks) {
+    UseBlock(m_blocks);
+  }
+}
+
+Arena* Arena::Current() {
+  return s_currentArena;
+}
+
+Arena::Scope::Scope(Arena& arena) : Scope(&arena) {}
+
+Arena::Scope::Scope(Arena* arena) : m_previous(s_currentArena) {
+  s_currentArena = arena;
+}
+
+Arena::Scope::~Scope() {
+  s_currentArena = m_previous;
+}
+
+} // namespace TokenStream
@@ -0,0 +1,236 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+
+#include <TokenStream/Compression.h>
+#include "Packed.h"
+#include <cstring>
+
+// LZ4 block format: a sequence of (token, literals, offset, match) groups. The high nibble of the
+// token is the literal count and the low nibble the match length minus 4, with 15 meaning that
+// more length bytes follow. The last sequence only has literals.
+
+namespace TokenStream {
+
+namespace {
+
+constexpr size_t MinMatch = 4;
+// The last 5 bytes are always literals and the last match has to start 12 bytes before the end
+constexpr size_t LastLiterals = 5;
+constexpr size_t MatchStartLimit = 12;
+constexpr size_t MaxOffset = 0xffff;
+constexpr unsigned HashBits = 12;
+
+uint32_t Read32(const uint8_t* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof value);
+  return value;
+}
+
+uint32_t Hash(uint32_t sequence) {
+  return (sequence * 2654435761u) >> (32 - HashBits);
+}
+
+size_t LengthBytes(size_t len) {
+  return len >= 15 ? (len - 15) / 255 + 1 : 0;
+}
+
+uint8_t* WriteLength(uint8_t* op, size_t len) {
+  for (len -= 15; len >= 255; len -= 255) {
+    *op++ = 255;
+  }
+  *op++ = static_cast<uint8_t>(len);
+  return op;
+}
+
+// Returns nullptr if the sequence does not fit
+uint8_t* WriteSequence(uint8_t* op,
+                       const uint8_t* end,
+                       const uint8_t* literals,
+                       size_t literalCount,
+                       size_t offset,
+                       size_t matchLength) {
+  const auto matchCode = matchLength ? matchLength - MinMatch : 0;
+  const auto size = 1 + LengthBytes(literalCount) + literalCount + (matchLength ? 2 + LengthBytes(matchCode) : 0);
+  if (size > static_cast<size_t>(end - op)) {
+    return nullptr;
+  }
+  auto* token = op++;
+  *token = static_cast<uint8_t>((literalCount < 15 ? literalCount : 15) << 4u);
+  if (literalCount >= 15) {
+    op = WriteLength(op, literalCount);
+  }
+  if (literalCount) {
+    memcpy(op, literals, literalCount);
+    op += literalCount;
+  }
+  if (matchLength) {
+    *op++ = static_cast<uint8_t>(offset);
+    *op++ = static_cast<uint8_t>(offset >> 8u);
+    *token |= static_cast<uint8_t>(matchCode < 15 ? matchCode : 15);
+    if (matchCode >= 15) {
+      op = WriteLength(op, matchCode);
+    }
+  }
+  return op;
+}
+
+// Adds up a length that continues in extra bytes. Returns false if the data ends first.
+bool ReadLength(const uint8_t*& ip, const uint8_t* end, size_t& len) {
+  uint8_t byte;
+  do {
+    if (ip == end) {
+      return false;
+    }
+    byte = *ip++;
+    len += byte;
+  } while (byte == 255);
+  return true;
+}
+
+} // namespace
+
+const Lz4Codec& Lz4Codec::Get() {
+  static const Lz4Codec codec;
+  return codec;
+}
+
+size_t Lz4Codec::Compress(const uint8_t* in, size_t size, uint8_t* out, size_t capacity) const {
+  auto* op = out;
+  const auto* end = out + capacity;
+  size_t anchor = 0;
+  if (size >= MatchStartLimit && size <= UINT32_MAX) {
+    // Positions + 1, so that 0 is empty
+    uint32_t table[1u << HashBits] = {};
+    const auto matchLimit = size - LastLiterals;
+    size_t i = 0;
+    while (i <= size - MatchStartLimit) {
+      const auto sequence = Read32(in + i);
+      auto& entry = table[Hash(sequence)];
+      const size_t candidate = entry;
+      entry = static_cast<uint32_t>(i + 1);
+      if (!candidate || i - (candidate - 1) > MaxOffset || Read32(in + candidate - 1) != sequence) {
+        // Step faster through data that does not compress
+        i += 1 + ((i - anchor) >> 6u);
+        continue;
+      }
+      auto match = candidate - 1;
+      while (i > anchor && match && in[i - 1] == in[match - 1]) {
+        i--;
+        match--;
+      }
+      auto length = MinMatch;
+      while (i + length < matchLimit && in[i + length] == in[match + length]) {
+        length++;
+      }
+      op = WriteSequence(op, end, in + anchor, i - anchor, i - match, length);
+      if (!op) {
+        return 0;
+      }
+      i += length;
+      anchor = i;
+    }
+  }
+  op = WriteSequence(op, end, in + anchor, size - anchor, 0, 0);
+  return op ? static_cast<size_t>(op - out) : 0;
+}
+
+bool Lz4Codec::Decompress(const uint8_t* in, size_t size, uint8_t* out, size_t outSize) const {
+  const auto* ip = in;
+  const auto* end = in + size;
+  size_t op = 0;
+  for (;;) {
+    if (ip == end) {
+      return false;
+    }
+    const auto token = *ip++;
+    size_t literalCount = token >> 4u;
+    if (literalCount == 15 && !ReadLength(ip, end, literalCount)) {
+      return false;
+    }
+    if (literalCount > static_cast<size_t>(end - ip) || literalCount > outSize - op) {
+      return false;
+    }
+    if (literalCount) {
+      memcpy(out + op, ip, literalCount);
+      ip += literalCount;
+      op += literalCount;
+    }
+    if (ip == end) {
+      return op == outSize;
+    }
+
+    if (end - ip < 2) {
+      return false;
+    }
+    const size_t offset = ip[0] | static_cast<size_t>(ip[1]) << 8u;
+    ip += 2;
+    if (!offset || offset > op) {
+      return false;
+    }
+    size_t length = token & 15u;
+    if (length == 15 && !ReadLength(ip, end, length)) {
+      return false;
+    }
+    length += MinMatch;
+    if (length > outSize - op) {
+      return false;
+    }
+    // Matches can overlap the bytes they produce, which repeats them
+    const auto* match = out + op - offset;
+    if (offset >= length) {
+      memcpy(out + op, match, length);
+    } else {
+      for (size_t i = 0; i < length; i++) {
+        out[op + i] = match[i];
+      }
+    }
+    op += length;
+  }
+}
+
+size_t Lz4Codec::GetMaxDecompressedSize(size_t compressedSize) const {
+  // Every length byte adds at most 255 bytes
+  return compressedSize > SIZE_MAX / 255 ? SIZE_MAX : compressedSize * 255;
+}
+
+bool DecompressChunk(const uint8_t* data, size_t size, const Codec* codec, Binary& out) {
+  if (!size) {
+    return false;
+  }
+  if (data[0] == Codec::Lz4Id) {
+    codec = &Lz4Codec::Get();
+  } else if (!codec || codec->GetId() != data[0]) {
+    return false;
+  }
+  uint64_t rawSize;
+  const auto used = Packed::DecodeVarint(data + 1, size - 1, rawSize);
+  const auto compressedSize = size - 1 - used;
+  // Empty objects are never compressed, so a size of 0 is as invalid as one that cannot be reached
+  if (!used || !rawSize || rawSize > codec->GetMaxDecompressedSize(compressedSize)) {
+    return false;
+  }
+  out.resize(static_cast<size_t>(rawSize));
+  return codec->Decompress(data + 1 + used, compressedSize, out.data(), out.size());
+}
+
+} // namespace TokenStream
@@ -0,0 +1,76 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+
+#include <TokenStream/Executor.h>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace TokenStream {
+
+size_t GetThreadCount(size_t threadCount) {
+  return threadCount ? threadCount : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+}
+
+void RunOnThreads(size_t taskCount, const std::function<void(size_t)>& task, size_t threadCount) {
+  threadCount = std::min(GetThreadCount(threadCount), taskCount);
+  std::atomic<size_t> next{0};
+  std::mutex mutex;
+  std::exception_ptr error;
+  const auto run = [&]() {
+    try {
+      for (auto i = next++; i < taskCount; i = next++) {
+        task(i);
+      }
+    } catch (...) {
+      // Start no more tasks and keep the first exception for the calling thread
+      next = taskCount;
+      std::lock_guard<std::mutex> lock{mutex};
+      if (!error) {
+        error = std::current_exception();
+      }
+    }
+  };
+  // The calling thread does its share too
+  std::vector<std::thread> threads;
+  try {
+    threads.reserve(threadCount ? threadCount - 1 : 0);
+    for (size_t i = 1; i < threadCount; i++) {
+      threads.emplace_back(run);
+    }
+  } catch (...) {
+    // Threads take the next task until there are none left, so fewer threads still run every task
+  }
+  run();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+} // namespace TokenStream
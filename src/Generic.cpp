@@ -23,31 +23,104 @@
 #include <TokenStream/Generic.h>
 #include <TokenStream/Reader.h>
 #include <TokenStream/Writer.h>
+#include <algorithm>
 
 namespace TokenStream {
 
+Generic::Entry::Entry(const Entry& other) : m_token(other.m_token), m_arena(Arena::Current()) {
+  if (other.m_member) {
+    m_member = other.m_member->CopyTo(m_storage, m_arena);
+  }
+}
+
+Generic::Entry::Entry(Entry&& other) noexcept : m_token(other.m_token) {
+  MoveFrom(other);
+}
+
+Generic::Entry& Generic::Entry::operator=(const Entry& other) {
+  if (this != &other) {
+    Reset();
+    m_token = other.m_token;
+    m_arena = Arena::Current();
+    if (other.m_member) {
+      m_member = other.m_member->CopyTo(m_storage, m_arena);
+    }
+  }
+  return *this;
+}
+
+Generic::Entry& Generic::Entry::operator=(Entry&& other) noexcept {
+  if (this != &other) {
+    Reset();
+    m_token = other.m_token;
+    MoveFrom(other);
+  }
+  return *this;
+}
+
+void Generic::Entry::Reset() {
+  if (m_member) {
+    m_member->Destroy(m_arena);
+    m_member = nullptr;
+  }
+}
+
+void Generic::Entry::MoveFrom(Entry& other) {
+  m_arena = other.m_arena;
+  if (other.m_member) {
+    m_member = other.m_member->MoveTo(m_storage);
+    other.m_member = nullptr;
+  }
+}
+
+Generic::Entry& Generic::Insert(Token token) {
+  // Members are usually added in token order
+  if (m_members.empty() || m_members.back().GetToken() < token) {
+    m_members.emplace_back(token);
+    return m_members.back();
+  }
+  const auto i = std::lower_bound(
+      m_members.begin(), m_members.end(), token, [](const Entry& entry, Token t) { return entry.GetToken() < t; });
+  if (i != m_members.end() && i->GetToken() == token) {
+    return *i;
+  }
+  return *m_members.emplace(i, token);
+}
+
+Generic::Entry* Generic::Find(Token token, size_t& hint) {
+  // Members are usually read in token order
+  if (hint < m_members.size() && m_members[hint].GetToken() == token) {
+    return &m_members[hint++];
+  }
+  const auto i = std::lower_bound(
+      m_members.begin(), m_members.end(), token, [](const Entry& entry, Token t) { return entry.GetToken() < t; });
+  if (i == m_members.end() || i->GetToken() != token) {
+    return nullptr;
+  }
+  hint = static_cast<size_t>(i - m_members.begin()) + 1;
+  return &*i;
+}
+
 void Generic::Read(Reader& reader) {
+  size_t hint = 0;
   while (!reader.EOS()) {
-    const auto t = reader.GetToken();
-    auto member = m_members.find(t);
-    if (member != m_members.end()) {
-      member->second->Get(reader);
+    auto* entry = Find(reader.GetToken(), hint);
+    if (entry) {
+      entry->GetMember()->Get(reader);
     }
   }
 }
 
 void Generic::Write(Writer& writer) const {
-  for (const auto& i : m_members) {
-    i.second->Put(i.first, writer);
+  for (const auto& entry : m_members) {
+    entry.GetMember()->Put(entry.GetToken(), writer);
   }
 }
 
 Generic::MemberBase* Generic::operator[](Token t) {
-  const auto member = m_members.find(t);
-  if (member != m_members.end()) {
-    return member->second.get();
-  }
-  return nullptr;
+  size_t hint = 0;
+  auto* entry = Find(t, hint);
+  return entry ? entry->GetMember() : nullptr;
 }
 
 } // namespace TokenStream
@@ -0,0 +1,374 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+
+#include "EndianTypes.h"
+#include "Packed.h"
+#include "Simd.h"
+#include <TokenStream/Log.h>
+#include <TokenStream/Reader.h>
+#include <algorithm>
+#include <cstring>
+
+namespace TokenStream {
+
+namespace {
+
+// Chunks at the top level of a log
+enum : uint64_t { SyncToken, BlockToken, ChecksumToken, IndexToken, TrailerToken };
+// Chunks inside a block
+enum : uint64_t { FirstRecordToken, RecordToken };
+// Chunks inside the index
+enum : uint64_t { OffsetsToken, FirstRecordsToken, RecordCountToken };
+
+// The data of a sync marker. The CR LF catches files that went through a text-mode conversion.
+const uint8_t SyncMagic[] = {0xf1, 'T', 'S', 'L', 'o', 'g', 0x0d, 0x0a};
+// A sync marker as it appears in the log, with its token and length
+const uint8_t SyncMarker[] = {SyncToken, sizeof SyncMagic, 0xf1, 'T', 'S', 'L', 'o', 'g', 0x0d, 0x0a};
+// The checksum chunk after a block: token, length and a big-endian CRC-32C
+constexpr size_t ChecksumSize = 2 + sizeof(uint32_t);
+const uint8_t TrailerMagic[] = {'T', 'S', 'L', 'o', 'g', 'E', 'n', 'd'};
+// The trailer holds the offset and checksum of the index, followed by TrailerMagic
+constexpr size_t TrailerDataSize = sizeof(uint64_t) + sizeof(uint32_t) + sizeof TrailerMagic;
+constexpr size_t TrailerSize = 2 + TrailerDataSize;
+
+template<typename T>
+T LoadBigEndian(const uint8_t* in) {
+  T value = 0;
+  for (size_t i = 0; i < sizeof value; i++) {
+    value = static_cast<T>(value << 8u) | in[i];
+  }
+  return value;
+}
+
+} // namespace
+
+LogWriter::LogWriter(std::ostream& stream, size_t blockSize, bool writeIndex) :
+    m_stream{&stream}, m_blockSize{blockSize}, m_writeIndex{writeIndex} {}
+
+bool LogWriter::Append(const void* data, size_t size) {
+  if (m_closed || m_failed) {
+    return false;
+  }
+  if (m_block.empty()) {
+    m_blockFirstRecords.push_back(m_recordCount);
+    m_block.Put(FirstRecordToken, m_recordCount);
+  }
+  {
+    // Empty records are kept too, so that every record keeps its number
+    Writer::TrimDefault keepEmpty{m_block, false};
+    m_block.Put(RecordToken, data, size);
+  }
+  ++m_recordCount;
+  return m_block.size() < m_blockSize || Flush();
+}
+
+bool LogWriter::Flush() {
+  if (m_failed || m_block.empty()) {
+    return !m_failed;
+  }
+  m_frame.clear();
+  m_frame.Put(SyncToken, SyncMagic, sizeof SyncMagic);
+  const auto blockStart = m_frame.size();
+  m_frame.Put(BlockToken, m_block);
+  const uint32_be checksum = Simd::Crc32c(m_frame.data() + blockStart, m_frame.size() - blockStart);
+  m_frame.Put(ChecksumToken, &checksum, sizeof checksum);
+  m_blockOffsets.push_back(m_offset);
+  m_block.clear();
+  return WriteFrame();
+}
+
+bool LogWriter::Close() {
+  if (m_closed) {
+    return !m_failed;
+  }
+  Flush();
+  m_closed = true;
+  if (m_writeIndex && !m_failed) {
+    MemoryWriter index;
+    index.PutPacked(OffsetsToken, m_blockOffsets.data(), m_blockOffsets.size())
+        .PutPacked(FirstRecordsToken, m_blockFirstRecords.data(), m_blockFirstRecords.size())
+        .Put(RecordCountToken, m_recordCount);
+    m_frame.clear();
+    m_frame.Put(IndexToken, index);
+    // The trailer has a fixed size, so that a reader can find the index from the end of the log
+    const uint64_be indexOffset = m_offset;
+    const uint32_be indexChecksum = Simd::Crc32c(m_frame.data(), m_frame.size());
+    uint8_t trailer[TrailerDataSize];
+    memcpy(trailer, &indexOffset, sizeof indexOffset);
+    memcpy(trailer + sizeof indexOffset, &indexChecksum, sizeof indexChecksum);
+    memcpy(trailer + sizeof indexOffset + sizeof indexChecksum, TrailerMagic, sizeof TrailerMagic);
+    m_frame.Put(TrailerToken, trailer, sizeof trailer);
+    WriteFrame();
+  }
+  if (!m_failed) {
+    m_stream->flush();
+    m_failed = m_stream->fail();
+  }
+  return !m_failed;
+}
+
+bool LogWriter::WriteFrame() {
+  m_stream->write(reinterpret_cast<const char*>(m_frame.data()), static_cast<std::streamsize>(m_frame.size()));
+  m_offset += m_frame.size();
+  m_failed = m_stream->fail();
+  return !m_failed;
+}
+
+LogReader::LogReader(const uint8_t* data, size_t size) : m_data{data}, m_size{size} {
+  if (!ReadIndex()) {
+    m_blocks.clear();
+    m_recordCount = 0;
+    Scan();
+  }
+}
+
+size_t LogReader::GetDamagedBlockCount() const {
+  return static_cast<size_t>(std::count_if(m_blocks.begin(), m_blocks.end(), [](const Block& block) {
+    return block.m_state == State::Damaged;
+  }));
+}
+
+bool LogReader::GetRecord(uint64_t index, BlockView& record) {
+  // The last block that starts at or before the record
+  auto block = std::upper_bound(m_blocks.begin(), m_blocks.end(), index, [](uint64_t i, const Block& b) {
+    return i < b.m_firstRecord;
+  });
+  if (block == m_blocks.begin()) {
+    return false;
+  }
+  --block;
+  if (index - block->m_firstRecord >= block->m_recordCount || !Check(*block)) {
+    return false;
+  }
+  auto skip = index - block->m_firstRecord;
+  Reader reader{m_data + block->m_dataOffset, block->m_dataSize};
+  while (!reader.EOS()) {
+    if (reader.GetToken() == RecordToken && !skip--) {
+      record = reader.GetBlockView();
+      return true;
+    }
+    reader.Skip();
+  }
+  return false;
+}
+
+void LogReader::ForEachRecord(const std::function<void(uint64_t, BlockView)>& visit) {
+  for (auto& block : m_blocks) {
+    VisitBlock(block, visit);
+  }
+}
+
+void LogReader::ForEachRecordParallel(const std::function<void(uint64_t, BlockView)>& visit, size_t threadCount) {
+  const auto executor = [threadCount](size_t taskCount, const std::function<void(size_t)>& task) {
+    RunOnThreads(taskCount, task, threadCount);
+  };
+  ForEachRecordParallel(visit, executor);
+}
+
+void LogReader::ForEachRecordParallel(const std::function<void(uint64_t, BlockView)>& visit, const Executor& executor) {
+  // Each task only touches its own block
+  executor(m_blocks.size(), [this, &visit](size_t i) {
+    VisitBlock(m_blocks[i], visit);
+  });
+}
+
+bool LogReader::ReadIndex() {
+  if (m_size < TrailerSize) {
+    return false;
+  }
+  const auto* trailer = m_data + m_size - TrailerSize;
+  if (trailer[0] != TrailerToken || trailer[1] != TrailerDataSize ||
+      memcmp(trailer + TrailerSize - sizeof TrailerMagic, TrailerMagic, sizeof TrailerMagic) != 0) {
+    return false;
+  }
+  const auto indexOffset = LoadBigEndian<uint64_t>(trailer + 2);
+  const auto indexChecksum = LoadBigEndian<uint32_t>(trailer + 2 + sizeof indexOffset);
+  const auto indexEnd = m_size - TrailerSize;
+  if (indexOffset > indexEnd) {
+    return false;
+  }
+  const auto indexStart = static_cast<size_t>(indexOffset);
+  if (Simd::Crc32c(m_data + indexStart, indexEnd - indexStart) != indexChecksum) {
+    return false;
+  }
+  // The checksum matched, so the index can be parsed like any other TokenStream
+  std::vector<uint64_t> offsets;
+  std::vector<uint64_t> firstRecords;
+  if (indexEnd > indexStart) {
+    Reader reader{m_data + indexStart, indexEnd - indexStart};
+    if (reader.GetToken() != IndexToken) {
+      return false;
+    }
+    Reader::SubStream index{reader};
+    while (!reader.EOS()) {
+      switch (reader.GetToken()) {
+        case OffsetsToken:
+          reader >> offsets;
+          break;
+        case FirstRecordsToken:
+          reader >> firstRecords;
+          break;
+        case RecordCountToken:
+          reader >> m_recordCount;
+          break;
+        default:
+          reader.Skip();
+          break;
+      }
+    }
+  }
+  if (offsets.size() != firstRecords.size()) {
+    return false;
+  }
+  m_blocks.resize(offsets.size());
+  for (size_t i = 0; i < m_blocks.size(); i++) {
+    const auto next = i + 1 < m_blocks.size() ? firstRecords[i + 1] : m_recordCount;
+    if (offsets[i] >= indexStart || firstRecords[i] >= next || !ParseFrame(static_cast<size_t>(offsets[i]), m_blocks[i])) {
+      return false;
+    }
+    m_blocks[i].m_firstRecord = firstRecords[i];
+    m_blocks[i].m_recordCount = next - firstRecords[i];
+  }
+  m_hasIndex = true;
+  return true;
+}
+
+void LogReader::Scan() {
+  auto offset = FindSyncMarker(0);
+  while (offset < m_size) {
+    Block block;
+    const auto end = ParseFrame(offset, block);
+    if (end && Check(block) && block.m_firstRecord >= m_recordCount) {
+      m_recordCount = block.m_firstRecord + block.m_recordCount;
+      m_blocks.push_back(block);
+      offset = FindSyncMarker(end);
+      continue;
+    }
+    // The length may be damaged too, so look for the next marker right after this one
+    block.m_offset = offset;
+    block.m_firstRecord = m_recordCount;
+    block.m_recordCount = 0;
+    block.m_state = State::Damaged;
+    m_blocks.push_back(block);
+    offset = FindSyncMarker(offset + 1);
+  }
+}
+
+size_t LogReader::FindSyncMarker(size_t offset) const {
+  // The first byte of the magic is rarer than the token and length in front of it
+  constexpr size_t MagicStart = sizeof SyncMarker - sizeof SyncMagic;
+  while (offset <= m_size && m_size - offset >= sizeof SyncMarker) {
+    const auto* magic = static_cast<const uint8_t*>(
+        memchr(m_data + offset + MagicStart, SyncMagic[0], m_size - offset - MagicStart));
+    if (!magic) {
+      break;
+    }
+    const auto start = static_cast<size_t>(magic - m_data) - MagicStart;
+    if (m_size - start >= sizeof SyncMarker && memcmp(m_data + start, SyncMarker, sizeof SyncMarker) == 0) {
+      return start;
+    }
+    offset = start + 1;
+  }
+  return m_size;
+}
+
+size_t LogReader::ParseFrame(size_t offset, Block& block) const {
+  if (m_size - offset < sizeof SyncMarker + ChecksumSize ||
+      memcmp(m_data + offset, SyncMarker, sizeof SyncMarker) != 0) {
+    return 0;
+  }
+  const auto* chunk = m_data + offset + sizeof SyncMarker;
+  const auto available = m_size - offset - sizeof SyncMarker - ChecksumSize;
+  uint64_t token;
+  uint64_t len;
+  const auto tokenSize = Packed::DecodeVarint(chunk, available, token);
+  if (!tokenSize || token != BlockToken) {
+    return 0;
+  }
+  const auto lengthSize = Packed::DecodeVarint(chunk + tokenSize, available - tokenSize, len);
+  if (!lengthSize || len > available - tokenSize - lengthSize) {
+    return 0;
+  }
+  const auto end = offset + sizeof SyncMarker + tokenSize + lengthSize + static_cast<size_t>(len);
+  if (m_data[end] != ChecksumToken || m_data[end + 1] != sizeof(uint32_t)) {
+    return 0;
+  }
+  block.m_offset = offset;
+  block.m_dataOffset = end - static_cast<size_t>(len);
+  block.m_dataSize = static_cast<size_t>(len);
+  return end + ChecksumSize;
+}
+
+bool LogReader::Check(Block& block) const {
+  if (block.m_state != State::Unchecked) {
+    return block.m_state == State::Good;
+  }
+  block.m_state = State::Damaged;
+  const auto chunkStart = block.m_offset + sizeof SyncMarker;
+  const auto chunkEnd = block.m_dataOffset + block.m_dataSize;
+  const auto checksum = LoadBigEndian<uint32_t>(m_data + chunkEnd + 2);
+  if (Simd::Crc32c(m_data + chunkStart, chunkEnd - chunkStart) != checksum) {
+    return false;
+  }
+  // The checksum matched, so the records can be walked with a Reader
+  uint64_t firstRecord = 0;
+  uint64_t recordCount = 0;
+  Reader reader{m_data + block.m_dataOffset, block.m_dataSize};
+  while (!reader.EOS()) {
+    const auto token = reader.GetToken();
+    if (token == FirstRecordToken) {
+      reader >> firstRecord;
+    } else {
+      recordCount += token == RecordToken ? 1 : 0;
+      reader.Skip();
+    }
+  }
+  if (m_hasIndex) {
+    // The block has to agree with the index
+    if (firstRecord != block.m_firstRecord || recordCount != block.m_recordCount) {
+      return false;
+    }
+  } else {
+    block.m_firstRecord = firstRecord;
+    block.m_recordCount = recordCount;
+  }
+  block.m_state = State::Good;
+  return true;
+}
+
+void LogReader::VisitBlock(Block& block, const std::function<void(uint64_t, BlockView)>& visit) const {
+  if (!Check(block)) {
+    return;
+  }
+  auto index = block.m_firstRecord;
+  Reader reader{m_data + block.m_dataOffset, block.m_dataSize};
+  while (!reader.EOS()) {
+    if (reader.GetToken() == RecordToken) {
+      visit(index++, reader.GetBlockView());
+    } else {
+      reader.Skip();
+    }
+  }
+}
+
+} // namespace TokenStream
@@ -0,0 +1,258 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#if _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <TokenStream/MappedFile.h>
+#include <algorithm>
+
+namespace TokenStream {
+
+#if _WIN32
+
+MappedFile::MappedFile(const std::string& path, Access access) {
+  const DWORD flags = access == Access::Sequential ? FILE_FLAG_SEQUENTIAL_SCAN
+      : access == Access::Random                   ? FILE_FLAG_RANDOM_ACCESS
+                                                   : FILE_ATTRIBUTE_NORMAL;
+  const auto file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, flags, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return;
+  }
+  m_file = file;
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size)) {
+    Close();
+    return;
+  }
+  m_size = static_cast<size_t>(size.QuadPart);
+  if (!m_size) {
+    return;
+  }
+  m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (m_mapping) {
+    m_data = static_cast<uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+  }
+  if (!m_data) {
+    Close();
+  }
+}
+
+bool MappedFile::IsOpen() const {
+  return m_file != nullptr;
+}
+
+void MappedFile::Advise(Access) {}
+
+void MappedFile::Close() {
+  if (m_data) {
+    UnmapViewOfFile(m_data);
+  }
+  if (m_mapping) {
+    CloseHandle(m_mapping);
+  }
+  if (m_file) {
+    CloseHandle(m_file);
+  }
+  m_data = nullptr;
+  m_size = 0;
+  m_mapping = nullptr;
+  m_file = nullptr;
+}
+
+bool MappedFile::Create(const std::string& path, size_t size) {
+  const auto file = CreateFileA(
+      path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  m_file = file;
+  if (!size) {
+    return true;
+  }
+  const auto size64 = static_cast<uint64_t>(size);
+  m_mapping = CreateFileMappingA(
+      file, nullptr, PAGE_READWRITE, static_cast<DWORD>(size64 >> 32u), static_cast<DWORD>(size64), nullptr);
+  if (m_mapping) {
+    m_data = static_cast<uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_WRITE, 0, 0, size));
+  }
+  if (!m_data) {
+    Close();
+    return false;
+  }
+  m_size = size;
+  return true;
+}
+
+bool MappedFile::Finish(const uint8_t* data, size_t size) {
+  if (!m_file) {
+    return false;
+  }
+  const bool mapped = m_data && data == m_data;
+  if (m_data) {
+    UnmapViewOfFile(m_data);
+    m_data = nullptr;
+  }
+  if (m_mapping) {
+    CloseHandle(m_mapping);
+    m_mapping = nullptr;
+  }
+  LARGE_INTEGER position;
+  position.QuadPart = static_cast<LONGLONG>(mapped ? size : 0);
+  bool ok = SetFilePointerEx(m_file, position, nullptr, FILE_BEGIN) && SetEndOfFile(m_file);
+  // The output outgrew the mapping, so write it the normal way
+  while (ok && !mapped && size) {
+    const auto chunk = static_cast<DWORD>(std::min<size_t>(size, 0x40000000));
+    DWORD written = 0;
+    ok = WriteFile(m_file, data, chunk, &written, nullptr) && written;
+    data += written;
+    size -= written;
+  }
+  Close();
+  return ok;
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& path, Access access) {
+  m_fd = open(path.c_str(), O_RDONLY);
+  if (m_fd < 0) {
+    return;
+  }
+  struct stat info {};
+  if (fstat(m_fd, &info)) {
+    Close();
+    return;
+  }
+  m_size = static_cast<size_t>(info.st_size);
+  if (!m_size) {
+    return;
+  }
+  auto* data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+  if (data == MAP_FAILED) {
+    Close();
+    return;
+  }
+  m_data = static_cast<uint8_t*>(data);
+  Advise(access);
+}
+
+bool MappedFile::IsOpen() const {
+  return m_fd >= 0;
+}
+
+void MappedFile::Advise(Access access) {
+  if (!m_data) {
+    return;
+  }
+  const int advice = access == Access::Sequential ? MADV_SEQUENTIAL
+      : access == Access::Random                  ? MADV_RANDOM
+                                                  : MADV_NORMAL;
+  madvise(m_data, m_size, advice);
+}
+
+void MappedFile::Close() {
+  if (m_data) {
+    munmap(m_data, m_size);
+  }
+  if (m_fd >= 0) {
+    close(m_fd);
+  }
+  m_data = nullptr;
+  m_size = 0;
+  m_fd = -1;
+}
+
+bool MappedFile::Create(const std::string& path, size_t size) {
+  m_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (m_fd < 0) {
+    return false;
+  }
+  if (!size) {
+    return true;
+  }
+  if (ftruncate(m_fd, static_cast<off_t>(size))) {
+    Close();
+    return false;
+  }
+  auto* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+  if (data == MAP_FAILED) {
+    Close();
+    return false;
+  }
+  m_data = static_cast<uint8_t*>(data);
+  m_size = size;
+  Advise(Access::Sequential);
+  return true;
+}
+
+bool MappedFile::Finish(const uint8_t* data, size_t size) {
+  if (m_fd < 0) {
+    return false;
+  }
+  const bool mapped = m_data && data == m_data;
+  if (m_data) {
+    munmap(m_data, m_size);
+    m_data = nullptr;
+  }
+  bool ok = !ftruncate(m_fd, static_cast<off_t>(mapped ? size : 0));
+  // The output outgrew the mapping, so write it the normal way
+  while (ok && !mapped && size) {
+    const auto written = write(m_fd, data, size);
+    ok = written > 0;
+    if (ok) {
+      data += written;
+      size -= static_cast<size_t>(written);
+    }
+  }
+  Close();
+  return ok;
+}
+
+#endif
+
+MappedFileWriter::MappedFileWriter(const std::string& path, size_t capacity, bool trimDefaults) :
+    Writer{nullptr, trimDefaults} {
+  if (m_file.Create(path, capacity)) {
+    SetBuffer(m_file.m_data, m_file.m_size);
+  }
+}
+
+bool MappedFileWriter::Close() {
+  if (!m_file.IsOpen()) {
+    return false;
+  }
+  const auto ok = m_file.Finish(m_data, m_size);
+  // Stop writing to the memory that was unmapped
+  SetBuffer(nullptr, 0);
+  Reset();
+  return ok;
+}
+
+} // namespace TokenStream
@@ -0,0 +1,115 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+
+#include <TokenStream/OutputQueue.h>
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+namespace TokenStream {
+
+constexpr size_t OutputQueue::DefaultHighWaterMark;
+constexpr size_t OutputQueue::DefaultLowWaterMark;
+constexpr size_t OutputQueue::SendSize;
+
+OutputQueue::OutputQueue(Sink sink, size_t highWaterMark, size_t lowWaterMark) :
+    m_sink(std::move(sink)), m_highWaterMark(highWaterMark), m_lowWaterMark(std::min(lowWaterMark, highWaterMark)) {}
+
+bool OutputQueue::Flush() {
+  Send();
+  if (m_full && GetQueuedBytes() <= m_lowWaterMark) {
+    m_full = false;
+    if (m_onDrained) {
+      m_onDrained();
+    }
+    if (m_resume) {
+      // The coroutine may write again and wait again, which sets m_resume anew
+      auto resume = std::move(m_resume);
+      m_resume = nullptr;
+      resume();
+    }
+  }
+  return m_buffer.empty();
+}
+
+void OutputQueue::Send() {
+  while (m_sent < m_buffer.size()) {
+    const auto sent = m_sink(m_buffer.data() + m_sent, m_buffer.size() - m_sent);
+    if (!sent) {
+      break;
+    }
+    m_sent += std::min(sent, m_buffer.size() - m_sent);
+  }
+  // Move what is left to the front once most of the buffer has been sent, so it does not keep growing
+  if (m_sent == m_buffer.size()) {
+    m_buffer.clear();
+    m_sent = 0;
+  } else if (m_sent >= m_buffer.size() / 2) {
+    const auto left = m_buffer.size() - m_sent;
+    memmove(m_buffer.data(), m_buffer.data() + m_sent, left);
+    m_buffer.resize(left);
+    m_sent = 0;
+  }
+}
+
+void OutputQueue::Queue(const void* data, size_t size) {
+  const auto* bytes = static_cast<const uint8_t*>(data);
+  m_buffer.insert(m_buffer.end(), bytes, bytes + size);
+  m_written += size;
+  if (GetQueuedBytes() >= SendSize) {
+    Send();
+  }
+  if (GetQueuedBytes() >= m_highWaterMark) {
+    m_full = true;
+  }
+}
+
+OutputQueue::int_type OutputQueue::overflow(int_type c) {
+  if (!traits_type::eq_int_type(c, traits_type::eof())) {
+    const auto byte = static_cast<uint8_t>(traits_type::to_char_type(c));
+    Queue(&byte, 1);
+  }
+  return traits_type::not_eof(c);
+}
+
+std::streamsize OutputQueue::xsputn(const char* data, std::streamsize size) {
+  Queue(data, static_cast<size_t>(size));
+  return size;
+}
+
+// std::flush may come in the middle of a message, so it only sends
+int OutputQueue::sync() {
+  Send();
+  return 0;
+}
+
+OutputQueue::pos_type OutputQueue::seekoff(off_type off, std::ios_base::seekdir dir,
+                                           std::ios_base::openmode which) {
+  // Only tellp() is supported, since queued bytes may already have been sent
+  if (off || dir != std::ios_base::cur || !(which & std::ios_base::out)) {
+    return pos_type(off_type(-1));
+  }
+  return pos_type(static_cast<off_type>(m_written));
+}
+
+} // namespace TokenStream
@@ -0,0 +1,309 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#pragma once
+
+// Kernels for the packed container encoding. See "Packed numeric lists" in FORMAT.md.
+
+#include "EndianTypes.h"
+#include "Simd.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace TokenStream {
+namespace Packed {
+
+//! Format byte for elements written with the TokenStream length encoding
+constexpr uint8_t VarintFormat = 0x80;
+
+//! Format byte of a packed chunk of objects written a column at a time by Writer::PutColumns()
+constexpr uint8_t ColumnarFormat = 0x40;
+
+// Maps each element type to the unsigned integer whose big-endian bytes are the element's normal
+// (untrimmed) TokenStream data. Integers map to themselves. Floating point values are stored in
+// little-endian order (see f32_le/f64_le), so they map to their byte-swapped bits.
+template<typename T>
+struct Traits;
+
+template<typename T, typename W, bool S>
+struct IntegerTraits {
+  using Wire = W;
+  static constexpr bool IsSigned = S;
+  // The wire value is the value itself, so no bytes have to be swapped in memory
+  static Wire Swap(Wire bits) {
+    return bits;
+  }
+  static Wire ToWire(T value) {
+    return static_cast<Wire>(value);
+  }
+  static T FromWire(Wire wire) {
+    return static_cast<T>(wire);
+  }
+};
+
+template<>
+struct Traits<uint8_t> : IntegerTraits<uint8_t, uint8_t, false> {};
+template<>
+struct Traits<int8_t> : IntegerTraits<int8_t, uint8_t, true> {};
+template<>
+struct Traits<uint16_t> : IntegerTraits<uint16_t, uint16_t, false> {};
+template<>
+struct Traits<int16_t> : IntegerTraits<int16_t, uint16_t, true> {};
+template<>
+struct Traits<uint32_t> : IntegerTraits<uint32_t, uint32_t, false> {};
+template<>
+struct Traits<int32_t> : IntegerTraits<int32_t, uint32_t, true> {};
+template<>
+struct Traits<uint64_t> : IntegerTraits<uint64_t, uint64_t, false> {};
+template<>
+struct Traits<int64_t> : IntegerTraits<int64_t, uint64_t, true> {};
+
+template<>
+struct Traits<float> {
+  using Wire = uint32_t;
+  static constexpr bool IsSigned = false;
+  static Wire Swap(Wire bits) {
+    return UInt32_Swap::Swap(bits);
+  }
+  static Wire ToWire(float value) {
+    f32_le le = value;
+    Wire wire;
+    memcpy(&wire, &le, sizeof wire);
+    return UInt32_Swap::Swap(wire);
+  }
+  static float FromWire(Wire wire) {
+    wire = UInt32_Swap::Swap(wire);
+    f32_le le;
+    memcpy(&le, &wire, sizeof le);
+    return le;
+  }
+};
+
+template<>
+struct Traits<double> {
+  using Wire = uint64_t;
+  static constexpr bool IsSigned = false;
+  static Wire Swap(Wire bits) {
+    return UInt64_Swap::Swap(bits);
+  }
+  static Wire ToWire(double value) {
+    f64_le le = value;
+    Wire wire;
+    memcpy(&wire, &le, sizeof wire);
+    return UInt64_Swap::Swap(wire);
+  }
+  static double FromWire(Wire wire) {
+    wire = UInt64_Swap::Swap(wire);
+    f64_le le;
+    memcpy(&le, &wire, sizeof le);
+    return le;
+  }
+};
+
+//! Number of significant bits in \p value
+inline size_t BitLength(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+  return value ? 64 - static_cast<size_t>(__builtin_clzll(value)) : 0;
+#else
+  size_t bits = 0;
+  while (value) {
+    value >>= 1u;
+    bits++;
+  }
+  return bits;
+#endif
+}
+
+//! Smallest fixed width in bytes that holds every element, matching the trimming of single values
+template<typename T>
+size_t FixedWidth(const T* values, size_t count) {
+  using Tr = Traits<T>;
+  // ORing commutes with swapping bytes, so the bits of floating point values are swapped once at the end
+  const auto bits =
+      Tr::Swap(static_cast<typename Tr::Wire>(Simd::OrReduce(values, count, sizeof(T), Tr::IsSigned)));
+  // Signed values need room for the sign bit
+  const auto width = (BitLength(bits) + (Tr::IsSigned ? 1 : 0) + 7) / 8;
+  return width ? width : 1;
+}
+
+//! Fewest bytes that hold a single value: leading zero bytes are dropped, and for signed types leading sign bytes too
+template<typename T>
+size_t TrimmedWidth(typename Traits<T>::Wire wire) {
+  using Wire = typename Traits<T>::Wire;
+  // Only the bits that differ from the sign bit are significant, plus the sign bit itself
+  const auto negative = Traits<T>::IsSigned && (wire >> (sizeof(Wire) * 8 - 1)) != 0;
+  const auto bits = negative ? static_cast<Wire>(~wire) : wire;
+  const auto width = (BitLength(bits) + (Traits<T>::IsSigned ? 1 : 0) + 7) / 8;
+  return width ? width : 1;
+}
+
+//! Writes the low \p width bytes of each element in big-endian order
+template<typename T>
+void EncodeFixed(const T* values, size_t count, size_t width, uint8_t* out) {
+  // Integers are in host order and have to be swapped. Floating point values are already
+  // little-endian, so their wire bytes are the high bytes in memory order.
+  Simd::PackBytes(values, count, sizeof(T), width, !std::is_floating_point<T>::value, out);
+}
+
+//! Reads \p count elements of \p width bytes each, sign-extending signed types
+template<typename T>
+void DecodeFixed(const uint8_t* in, size_t count, size_t width, T* values) {
+  Simd::UnpackBytes(in, count, sizeof(T), width, !std::is_floating_point<T>::value, values);
+  if (Traits<T>::IsSigned) {
+    Simd::SignExtend(values, count, sizeof(T), width);
+  }
+}
+
+//! ZigZag-encodes a signed wire value so that small magnitudes become small numbers
+template<typename W>
+uint64_t ZigZag(W wire) {
+  return static_cast<W>(static_cast<W>(wire << 1u) ^ static_cast<W>(0 - (wire >> (sizeof(W) * 8 - 1))));
+}
+
+template<typename W>
+W UnZigZag(uint64_t value) {
+  return static_cast<W>((value >> 1u) ^ (0 - (value & 1u)));
+}
+
+//! Size of \p value in the TokenStream length encoding
+inline size_t VarintSize(uint64_t value) {
+  if (value < 0x80) {
+    return 1;
+  }
+  if (value < 0x7800) {
+    return 2;
+  }
+  return 1 + (BitLength(value) + 7) / 8;
+}
+
+//! Writes \p value in the TokenStream length encoding and returns the number of bytes written
+inline size_t EncodeVarint(uint64_t value, uint8_t* out) {
+  if (value < 0x80) {
+    out[0] = static_cast<uint8_t>(value);
+    return 1;
+  }
+  if (value < 0x7800) {
+    out[0] = static_cast<uint8_t>(value >> 8u) | 0x80u;
+    out[1] = static_cast<uint8_t>(value);
+    return 2;
+  }
+  const auto len = (BitLength(value) + 7) / 8;
+  out[0] = static_cast<uint8_t>(len + 0xf7);
+  for (size_t i = 0; i < len; i++) {
+    out[len - i] = static_cast<uint8_t>(value >> (i * 8u));
+  }
+  return len + 1;
+}
+
+//! Reads one value in the TokenStream length encoding. Returns the number of bytes used or 0 if invalid.
+inline size_t DecodeVarint(const uint8_t* in, size_t available, uint64_t& value) {
+  if (!available) {
+    return 0;
+  }
+  const auto v = in[0];
+  if (v < 0x80) {
+    value = v;
+    return 1;
+  }
+  if (v < 0xf8) {
+    if (available < 2) {
+      return 0;
+    }
+    value = (static_cast<uint64_t>(v & 0x7fu) << 8u) | in[1];
+    return 2;
+  }
+  const size_t len = v - 0xf7u;
+  if (v == 0xf8 || len >= available) {
+    return 0;
+  }
+  value = 0;
+  for (size_t i = 1; i <= len; i++) {
+    value = (value << 8u) | in[i];
+  }
+  return len + 1;
+}
+
+template<typename T>
+uint64_t ToVarint(T value) {
+  using Tr = Traits<T>;
+  const auto wire = Tr::ToWire(value);
+  return Tr::IsSigned ? ZigZag(wire) : static_cast<uint64_t>(wire);
+}
+
+//! Total size of the elements in the varint form, or \p limit if it would not be smaller than that
+template<typename T>
+size_t VarintSize(const T* values, size_t count, size_t limit = SIZE_MAX) {
+  size_t size = 0;
+  for (size_t i = 0; i < count; i++) {
+    size += VarintSize(ToVarint(values[i]));
+    if (size >= limit) {
+      return limit;
+    }
+  }
+  return size;
+}
+
+template<typename T>
+void EncodeVarints(const T* values, size_t count, uint8_t* out) {
+  for (size_t i = 0; i < count; i++) {
+    out += EncodeVarint(ToVarint(values[i]), out);
+  }
+}
+
+//! Counts the varint elements in \p in. Returns false if the data is malformed.
+inline bool CountVarints(const uint8_t* in, size_t size, size_t& count) {
+  count = 0;
+  uint64_t value;
+  while (size) {
+    const auto used = DecodeVarint(in, size, value);
+    if (!used) {
+      return false;
+    }
+    in += used;
+    size -= used;
+    count++;
+  }
+  return true;
+}
+
+//! Decodes \p count varint elements. Returns false if a value does not fit in \p T.
+template<typename T>
+bool DecodeVarints(const uint8_t* in, size_t size, size_t count, T* values) {
+  using Tr = Traits<T>;
+  using Wire = typename Tr::Wire;
+  for (size_t i = 0; i < count; i++) {
+    uint64_t value;
+    const auto used = DecodeVarint(in, size, value);
+    if (!used || static_cast<Wire>(value) != value) {
+      return false;
+    }
+    in += used;
+    size -= used;
+    values[i] = Tr::FromWire(Tr::IsSigned ? UnZigZag<Wire>(value) : static_cast<Wire>(value));
+  }
+  return true;
+}
+
+} // namespace Packed
+} // namespace TokenStream
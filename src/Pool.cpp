@@ -0,0 +1,134 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+
+
+#include <TokenStream/Arena.h>
+#include <TokenStream/Pool.h>
+#include <vector>
+
+namespace TokenStream {
+
+namespace {
+
+struct IdleObjects {
+  std::vector<std::unique_ptr<Reader>> m_readers;
+  std::vector<std::unique_ptr<MemoryWriter>> m_memoryWriters;
+  std::vector<std::unique_ptr<Writer>> m_writers;
+};
+
+IdleObjects& GetIdleObjects() {
+  thread_local IdleObjects idle;
+  return idle;
+}
+
+template<typename T>
+std::unique_ptr<T> TakeIdle(std::vector<std::unique_ptr<T>>& idle) {
+  if (idle.empty()) {
+    return nullptr;
+  }
+  auto object = std::move(idle.back());
+  idle.pop_back();
+  return object;
+}
+
+template<typename T>
+void KeepIdle(std::vector<std::unique_ptr<T>>& idle, std::unique_ptr<T> object) {
+  if (idle.size() < Pool::MaxIdle && object->capacity() <= Pool::MaxIdleCapacity) {
+    idle.push_back(std::move(object));
+  }
+}
+
+} // namespace
+
+constexpr size_t Pool::MaxIdle;
+constexpr size_t Pool::MaxIdleCapacity;
+
+Pool::Lease<Reader> Pool::GetReader(const uint8_t* data, size_t size) {
+  auto reader = TakeIdle(GetIdleObjects().m_readers);
+  if (reader) {
+    reader->Reset(data, size);
+  } else {
+    Arena::Scope heap{nullptr};
+    reader.reset(new Reader(data, size));
+  }
+  return Lease<Reader>{std::move(reader)};
+}
+
+Pool::Lease<Reader> Pool::GetReader(std::istream& stream) {
+  auto reader = TakeIdle(GetIdleObjects().m_readers);
+  if (reader) {
+    reader->Rebind(stream);
+  } else {
+    Arena::Scope heap{nullptr};
+    reader.reset(new Reader(stream));
+  }
+  return Lease<Reader>{std::move(reader)};
+}
+
+Pool::Lease<MemoryWriter> Pool::GetWriter(bool trimDefaults) {
+  auto writer = TakeIdle(GetIdleObjects().m_memoryWriters);
+  if (writer) {
+    writer->clear(trimDefaults);
+  } else {
+    Arena::Scope heap{nullptr};
+    writer.reset(new MemoryWriter(trimDefaults));
+  }
+  return Lease<MemoryWriter>{std::move(writer)};
+}
+
+Pool::Lease<Writer> Pool::GetWriter(std::ostream& stream, bool trimDefaults) {
+  auto writer = TakeIdle(GetIdleObjects().m_writers);
+  if (writer) {
+    writer->Rebind(stream, trimDefaults);
+  } else {
+    Arena::Scope heap{nullptr};
+    writer.reset(new Writer(stream, trimDefaults));
+  }
+  return Lease<Writer>{std::move(writer)};
+}
+
+void Pool::Clear() {
+  auto& idle = GetIdleObjects();
+  idle.m_readers.clear();
+  idle.m_memoryWriters.clear();
+  idle.m_writers.clear();
+}
+
+void Pool::Return(std::unique_ptr<Reader> reader) {
+  // Forget the input now, so that a stream gets its read-ahead bytes back when the Lease ends
+  reader->Reset(nullptr, 0);
+  auto& idle = GetIdleObjects().m_readers;
+  if (idle.size() < MaxIdle) {
+    idle.push_back(std::move(reader));
+  }
+}
+
+void Pool::Return(std::unique_ptr<MemoryWriter> writer) {
+  KeepIdle(GetIdleObjects().m_memoryWriters, std::move(writer));
+}
+
+void Pool::Return(std::unique_ptr<Writer> writer) {
+  KeepIdle(GetIdleObjects().m_writers, std::move(writer));
+}
+
+} // namespace TokenStream
@@ -0,0 +1,249 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include "Packed.h"
+#include <TokenStream/PushParser.h>
+#include <algorithm>
+#include <cstring>
+
+namespace TokenStream {
+
+namespace {
+
+// Reads each top-level chunk into an object
+class ObjectHandler : public PushParser::Handler {
+ public:
+  explicit ObjectHandler(Serializable& object) : m_object(object) {}
+
+  void OnValue(const PushParser::Value& value) override {
+    value.ReadInto(m_object);
+  }
+
+ private:
+  Serializable& m_object;
+};
+
+} // namespace
+
+PushParser::ChunkBuffer::ChunkBuffer(const Value& value) {
+  auto* out = m_small;
+  if (MaxHeaderSize + value.m_data.size() > sizeof m_small) {
+    m_large.resize(MaxHeaderSize + value.m_data.size());
+    out = m_large.data();
+  }
+  m_data = out;
+  if (value.m_packed || value.m_compressed) {
+    *out++ = 0xf8;
+    *out++ = value.m_compressed ? 1 : 0;
+  }
+  out += Packed::EncodeVarint(value.m_token, out);
+  out += Packed::EncodeVarint(value.m_data.size(), out);
+  if (!value.m_data.empty()) {
+    memcpy(out, value.m_data.data(), value.m_data.size());
+    out += value.m_data.size();
+  }
+  m_size = static_cast<size_t>(out - m_data);
+}
+
+bool PushParser::Value::ReadInto(Serializable& object) const {
+  ChunkBuffer chunk{*this};
+  Reader reader{chunk.data(), chunk.size()};
+  object.Read(reader);
+  return reader.VerifyEOS();
+}
+
+PushParser::PushParser(Serializable& object) : m_objectHandler{new ObjectHandler{object}} {
+  m_handler = m_objectHandler.get();
+  Reset();
+}
+
+void PushParser::Reset() {
+  m_frames.clear();
+  m_frames.emplace_back();
+  m_offset = 0;
+  m_headerSize = 0;
+  m_inValue = false;
+  m_value.clear();
+  m_badStream = false;
+}
+
+PushParser::Status PushParser::GetStatus() const {
+  if (m_badStream) {
+    return Status::Error;
+  }
+  const bool between = !m_inValue && !m_headerSize && m_frames.size() == 1;
+  return between && !m_frames.back().m_containerRemaining ? Status::Complete : Status::NeedMoreData;
+}
+
+PushParser::Status PushParser::Fail() {
+  TS_ASSERT(false, "Invalid TokenStream");
+  m_badStream = true;
+  return Status::Error;
+}
+
+PushParser::HeaderResult PushParser::DecodeHeader() {
+  auto& frame = m_frames.back();
+  // The header itself must fit in the enclosing object
+  if (m_offset > frame.m_end) {
+    return HeaderResult::Invalid;
+  }
+  size_t pos = 0;
+  // Reads one value in the length encoding. Only 0xf8 can make it invalid.
+  uint64_t value = 0;
+  const auto decode = [&]() {
+    const auto used = Packed::DecodeVarint(m_header + pos, m_headerSize - pos, value);
+    if (!used) {
+      return pos < m_headerSize && m_header[pos] == 0xf8 ? HeaderResult::Invalid : HeaderResult::Incomplete;
+    }
+    pos += used;
+    return HeaderResult::Done;
+  };
+
+  Token token;
+  uint64_t count = 1;
+  bool packed = false;
+  bool compressed = false;
+  // The elements of a container after the first one only have a length
+  const bool element = frame.m_containerRemaining != 0;
+  if (element) {
+    token = frame.m_containerToken;
+  } else {
+    if (m_header[0] == 0xf8) {
+      // A list starts with 0xf8 and the element count. A count of 0 marks a packed chunk and a
+      // count of 1 a compressed one.
+      pos = 1;
+      const auto result = decode();
+      if (result != HeaderResult::Done) {
+        return result;
+      }
+      count = value;
+      packed = !count;
+      compressed = count == 1;
+    }
+    const auto result = decode();
+    if (result != HeaderResult::Done) {
+      return result;
+    }
+    token = Token{value};
+  }
+  const auto result = decode();
+  if (result != HeaderResult::Done) {
+    return result;
+  }
+  if (value > frame.m_end - m_offset) {
+    return HeaderResult::Invalid;
+  }
+
+  if (element) {
+    --frame.m_containerRemaining;
+  } else if (count > 1) {
+    frame.m_containerToken = token;
+    frame.m_containerRemaining = count - 1;
+  }
+  m_headerSize = 0;
+  StartChunk(token, value, packed, compressed);
+  return HeaderResult::Done;
+}
+
+void PushParser::StartChunk(Token token, uint64_t length, bool packed, bool compressed) {
+  const auto depth = GetDepth();
+  // Compressed objects arrive as one value, since their data cannot be parsed as it arrives
+  if (!packed && !compressed && m_handler->IsObject(token, depth)) {
+    m_frames.emplace_back(token, m_offset + length);
+    m_handler->OnBeginObject(token, depth);
+    return;
+  }
+  m_token = token;
+  m_packed = packed;
+  m_compressed = compressed;
+  m_remaining = length;
+  m_inValue = true;
+  if (!length) {
+    EmitValue(nullptr, 0);
+  }
+}
+
+void PushParser::EmitValue(const uint8_t* data, size_t size) {
+  m_inValue = false;
+  Value value;
+  value.m_token = m_token;
+  value.m_data = BlockView{data, size};
+  value.m_depth = GetDepth();
+  value.m_packed = m_packed;
+  value.m_compressed = m_compressed;
+  m_handler->OnValue(value);
+}
+
+bool PushParser::EndFrames() {
+  while (m_frames.size() > 1 && m_offset == m_frames.back().m_end) {
+    const auto frame = m_frames.back();
+    if (frame.m_containerRemaining) {
+      return false;
+    }
+    m_frames.pop_back();
+    m_handler->OnEndObject(frame.m_token, GetDepth());
+  }
+  return true;
+}
+
+PushParser::Status PushParser::Feed(const uint8_t* data, size_t size) {
+  if (m_badStream) {
+    return Status::Error;
+  }
+  while (true) {
+    if (!m_inValue && !m_headerSize && !EndFrames()) {
+      return Fail();
+    }
+    if (!size) {
+      break;
+    }
+    if (!m_inValue) {
+      // Headers are only a few bytes, so collect them one byte at a time
+      m_header[m_headerSize++] = *data++;
+      --size;
+      ++m_offset;
+      const auto result = DecodeHeader();
+      if (result == HeaderResult::Invalid || (result == HeaderResult::Incomplete && m_headerSize == MaxHeaderSize)) {
+        return Fail();
+      }
+      continue;
+    }
+    const auto take = static_cast<size_t>(std::min<uint64_t>(size, m_remaining));
+    m_remaining -= take;
+    m_offset += take;
+    if (!m_remaining && m_value.empty()) {
+      // The whole value is in this fragment, so it does not need to be copied
+      EmitValue(data, take);
+    } else {
+      m_value.insert(m_value.end(), data, data + take);
+      if (!m_remaining) {
+        EmitValue(m_value.data(), m_value.size());
+        m_value.clear();
+      }
+    }
+    data += take;
+    size -= take;
+  }
+  return GetStatus();
+}
+
+} // namespace TokenStream
@@ -20,21 +20,19 @@
 * IN THE SOFTWARE.
 */
 
-#if _WIN32
-#define NOMINMAX
-#include <Windows.h>
-#endif
-
 #include "EndianTypes.h"
+#include "Packed.h"
+#include "Utf8.h"
 #include <TokenStream/Reader.h>
+#include <TokenStream/Stats.h>
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
 
 #define VERIFIED_READ(byte_count, location)                                                        \
   do {                                                                                             \
-    m_stream.read(reinterpret_cast<char*>(location), byte_count);                                  \
-    auto read = static_cast<size_t>(m_stream.gcount());                                            \
-    if (read != (byte_count)) {                                                                    \
-      TS_ASSERT(read == (byte_count), "Failed to read from TokenStream");                          \
+    if (!ReadBytes(location, byte_count)) {                                                        \
+      TS_ASSERT(false, "Failed to read from TokenStream");                                         \
       m_lastToken = Token::InvalidTokenValue;                                                      \
       m_badStream = true;                                                                          \
     }                                                                                              \
@@ -42,11 +40,126 @@
 
 namespace TokenStream {
 
-Reader::Reader(std::istream& stream) : m_stream{stream} {
-  const auto currentPosition = m_stream.tellg();
-  m_stream.seekg(0, std::ios::end);
-  m_context.m_end = static_cast<size_t>(m_stream.tellg() - currentPosition);
-  m_stream.seekg(currentPosition, std::ios::beg);
+Reader::Reader(std::istream& stream) {
+  Rebind(stream);
+}
+
+Reader::~Reader() {
+  GiveBackReadAhead();
+}
+
+Reader::Reader(const uint8_t* data, size_t size) : m_data{data}, m_size{size}, m_context{size} {}
+
+void Reader::Reset(const uint8_t* data, size_t size) {
+  GiveBackReadAhead();
+  Rewind(size);
+  m_stream = nullptr;
+  m_data = data;
+  m_size = size;
+  m_streamRemaining = 0;
+}
+
+void Reader::Rebind(std::istream& stream) {
+  GiveBackReadAhead();
+  const auto currentPosition = stream.tellg();
+  stream.seekg(0, std::ios::end);
+  Rewind(static_cast<size_t>(stream.tellg() - currentPosition));
+  stream.seekg(currentPosition, std::ios::beg);
+  m_stream = &stream;
+  m_data = nullptr;
+  m_size = 0;
+  // A stream that cannot tell its size is read until it runs out
+  m_streamRemaining = m_context.m_end ? m_context.m_end : SIZE_MAX;
+  // FillReadAhead() only sizes an empty window, so let a window that is too small for this stream grow
+  if (m_readAhead.size() < std::min(static_cast<size_t>(ReadAheadSize), m_streamRemaining)) {
+    m_readAhead.clear();
+  }
+}
+
+void Reader::GiveBackReadAhead() {
+  if (!m_stream || !ReadAheadBytes()) {
+    return;
+  }
+  try {
+    m_stream->seekg(-static_cast<std::streamoff>(ReadAheadBytes()), std::ios_base::cur);
+  } catch (std::ios_base::failure&) {
+    // The stream cannot seek, so the bytes that were read ahead are lost
+  }
+  m_readAheadStart = m_readAheadEnd;
+}
+
+void Reader::Rewind(size_t end) {
+  m_offset = 0;
+  m_remainingInElement = 0;
+  m_nextContainerElementCount = 0;
+  m_nextContainerPacked = false;
+  m_compressed = false;
+  m_inflated = false;
+  m_lastToken.Clear();
+  m_context = SubStreamContext{end};
+  m_readAheadStart = 0;
+  m_readAheadEnd = 0;
+  m_tokenPushed = false;
+  m_badStream = false;
+}
+
+bool Reader::ReadBytes(void* location, size_t count) {
+  TS_STATS_ADD(bytesRead, count);
+  if (m_data) {
+    if (count > m_size - m_offset) {
+      return false;
+    }
+    memcpy(location, m_data + m_offset, count);
+    return true;
+  }
+  auto* out = static_cast<uint8_t*>(location);
+  const auto buffered = std::min(count, ReadAheadBytes());
+  if (buffered) {
+    memcpy(out, m_readAhead.data() + m_readAheadStart, buffered);
+    m_readAheadStart += buffered;
+    out += buffered;
+    count -= buffered;
+  }
+  if (!count) {
+    return true;
+  }
+  // Large blocks go straight to their destination
+  if (count >= ReadAheadSize) {
+    m_stream->read(reinterpret_cast<char*>(out), static_cast<std::streamsize>(count));
+    const auto read = static_cast<size_t>(m_stream->gcount());
+    m_streamRemaining = read == count ? m_streamRemaining - std::min(m_streamRemaining, read) : 0;
+    return read == count;
+  }
+  if (!FillReadAhead(count)) {
+    return false;
+  }
+  memcpy(out, m_readAhead.data() + m_readAheadStart, count);
+  m_readAheadStart += count;
+  return true;
+}
+
+bool Reader::FillReadAhead(size_t count) {
+  const auto buffered = ReadAheadBytes();
+  if (count <= buffered) {
+    return true;
+  }
+  if (m_readAhead.empty()) {
+    // Small messages only need room for themselves
+    m_readAhead.resize(std::min(static_cast<size_t>(ReadAheadSize), m_streamRemaining));
+  } else if (buffered) {
+    memmove(m_readAhead.data(), m_readAhead.data() + m_readAheadStart, buffered);
+  }
+  m_readAheadStart = 0;
+  m_readAheadEnd = buffered;
+  // Stop at the end of the TokenStream, so that the stream never hits its end by reading ahead
+  const auto wanted = std::min(m_readAhead.size() - buffered, m_streamRemaining);
+  if (wanted) {
+    m_stream->read(reinterpret_cast<char*>(m_readAhead.data() + buffered), static_cast<std::streamsize>(wanted));
+    const auto read = static_cast<size_t>(m_stream->gcount());
+    m_readAheadEnd += read;
+    m_streamRemaining = read == wanted ? m_streamRemaining - read : 0;
+  }
+  return count <= ReadAheadBytes();
 }
 
 uint64_t Reader::ReadLengthEncoded(bool forToken) {
@@ -56,9 +169,15 @@ uint64_t Reader::ReadLengthEncoded(bool forToken) {
   if (m_badStream) {
     return 0;
   }
-  VERIFIED_READ(1, &v);
-  if (m_badStream) {
-    return 0;
+  if (m_data) {
+    // Memory-backed: just bump the offset
+    VERIFY_TOKENSTREAM(m_offset < m_size, 0);
+    v = m_data[m_offset];
+  } else {
+    VERIFIED_READ(1, &v);
+    if (m_badStream) {
+      return 0;
+    }
   }
   ++m_offset;
   // Handle the special 0xf8 value
@@ -68,6 +187,8 @@ uint64_t Reader::ReadLengthEncoded(bool forToken) {
       return 0;
     }
     m_nextContainerElementCount = DecodeLength();
+    // A count of 0 marks a packed vector of numbers
+    m_nextContainerPacked = !m_nextContainerElementCount;
     return DecodeToken();
   }
 
@@ -81,9 +202,14 @@ uint64_t Reader::ReadLengthEncoded(bool forToken) {
     VERIFY_TOKENSTREAM(!PastEOS(1), 0);
     uint16_t v16 = v & 0x7fu;
     v16 <<= 8u;
-    VERIFIED_READ(1, &v);
-    if (m_badStream) {
-      return 0;
+    if (m_data) {
+      VERIFY_TOKENSTREAM(m_offset < m_size, 0);
+      v = m_data[m_offset];
+    } else {
+      VERIFIED_READ(1, &v);
+      if (m_badStream) {
+        return 0;
+      }
     }
     m_offset += 1;
     v16 |= v;
@@ -116,6 +242,8 @@ Token Reader::GetToken() {
   }
 
   m_nextContainerElementCount = 0;
+  m_nextContainerPacked = false;
+  m_compressed = false;
   bool updateContainerElementEnd = false;
 
   // If we are in the middle of reading items in a container, and we just reached the end of the current item
@@ -140,6 +268,8 @@ Token Reader::GetToken() {
     VERIFY_TOKENSTREAM(!PastEOS(2), Token::InvalidTokenValue);
 
     m_lastToken = Token(DecodeToken());
+    // A count of 1 marks a compressed chunk
+    m_compressed = m_nextContainerElementCount == 1;
     // But if that is the first item in a container, set up the container tracking fields
     if (m_nextContainerElementCount > 1) {
       m_context.m_containerToken = m_lastToken;
@@ -167,6 +297,7 @@ Token Reader::GetToken() {
 
   VERIFY_TOKENSTREAM(!PastEOS(m_remainingInElement), Token::InvalidTokenValue);
 
+  TS_STATS_ADD(chunksRead, 1);
   return {m_lastToken};
 }
 
@@ -257,29 +388,12 @@ std::wstring Reader::GetWideString() {
 Reader& Reader::operator>>(std::wstring& rhs) {
   const auto len = m_remainingInElement;
   if (len) {
-    std::string buffer;
-    buffer.resize(len);
-    Fetch(reinterpret_cast<uint8_t*>(const_cast<char*>(buffer.data())));
-    if (m_badStream) {
+    const auto* data = FetchView();
+    if (!data) {
       rhs.resize(0);
       return *this;
     }
-#if _WIN32
-    const auto w_len = MultiByteToWideChar(CP_UTF8, 0, buffer.c_str(), -1, 0, 0);
-    rhs.resize(static_cast<std::wstring::size_type>(w_len) - 1);
-    MultiByteToWideChar(
-        CP_UTF8, 0, buffer.c_str(), -1, const_cast<wchar_t*>(rhs.data()), w_len - 1);
-#else
-    auto* oldLocaleStr = setlocale(LC_ALL, nullptr);
-    const std::string oldLocale = oldLocaleStr ? oldLocaleStr : "";
-    setlocale(LC_ALL, "en_US.utf8");
-    size_t w_len = mbstowcs(nullptr, buffer.c_str(), len);
-    rhs.resize(w_len);
-    mbstowcs(const_cast<wchar_t*>(rhs.data()), buffer.data(), len);
-    if (!oldLocale.empty()) {
-      setlocale(LC_ALL, oldLocale.c_str());
-    }
-#endif
+    Utf8::Decode(data, len, rhs);
   } else {
     rhs.clear();
   }
@@ -288,6 +402,7 @@ Reader& Reader::operator>>(std::wstring& rhs) {
 }
 
 void Reader::GetSerializable(Serializable& object) {
+  TS_STATS_MESSAGE(object, false, m_offset);
   if (!m_offset) {
     m_remainingInElement = DecodeLength();
     if (m_badStream) {
@@ -299,6 +414,7 @@ void Reader::GetSerializable(Serializable& object) {
 }
 
 void Reader::GetSerializable(Serializable& object, const TokenMap& tokenMap) {
+  TS_STATS_MESSAGE(object, false, m_offset);
   if (!m_offset) {
     m_remainingInElement = DecodeLength();
     if (m_badStream) {
@@ -309,6 +425,18 @@ void Reader::GetSerializable(Serializable& object, const TokenMap& tokenMap) {
   object.Read(*this, tokenMap);
 }
 
+void Reader::GetSerializableDelta(Serializable& object) {
+  TS_STATS_MESSAGE(object, false, m_offset);
+  if (!m_offset) {
+    m_remainingInElement = DecodeLength();
+    if (m_badStream) {
+      return;
+    }
+  }
+  SubStream sub{*this};
+  object.ApplyDelta(*this);
+}
+
 Binary Reader::GetBlock() {
   Binary ret;
   if (m_remainingInElement) {
@@ -321,15 +449,168 @@ Binary Reader::GetBlock() {
   return ret;
 }
 
+const uint8_t* Reader::FetchView(bool keep) {
+  const auto len = m_remainingInElement;
+  if (!len || m_badStream) {
+    return nullptr;
+  }
+  // Memory-backed: hand out a pointer into the buffer
+  if (m_data && !(keep && m_inflated)) {
+    VERIFY_TOKENSTREAM(len <= m_size - m_offset, nullptr);
+    const auto* data = m_data + m_offset;
+    m_offset += len;
+    m_remainingInElement = 0;
+    TS_STATS_ADD(bytesRead, len);
+    return data;
+  }
+  // Chunks that fit in the read-ahead window are handed out from there without a copy, unless they have to
+  // outlive the next refill of the window
+  if (!keep && len <= ReadAheadSize && FillReadAhead(len)) {
+    const auto* data = m_readAhead.data() + m_readAheadStart;
+    m_readAheadStart += len;
+    m_offset += len;
+    m_remainingInElement = 0;
+    TS_STATS_ADD(bytesRead, len);
+    return data;
+  }
+  m_scratch.resize(len);
+  Fetch(m_scratch.data());
+  return m_badStream ? nullptr : m_scratch.data();
+}
+
+bool Reader::GetColumnsHeader(size_t& rowCount) {
+  VERIFY_TOKENSTREAM(!PastEOS(2), false);
+  const auto format = DecodeLength();
+  if (m_badStream) {
+    return false;
+  }
+  VERIFY_TOKENSTREAM(format == Packed::ColumnarFormat, false);
+  rowCount = DecodeLength();
+  if (m_badStream) {
+    return false;
+  }
+  // Every row takes at least a byte of the chunk
+  VERIFY_TOKENSTREAM(rowCount && !PastEOS(rowCount), false);
+  return true;
+}
+
+void Reader::GetColumns(const ColumnRows& rows, const TokenMap& tokenMap) {
+  size_t hint = 0;
+  size_t row = 0;
+  while (!EOS()) {
+    const auto token = GetToken();
+    // The members that are not columns follow the columns, an object per row
+    if (token == Serializable::ColumnRowsToken) {
+      if (row < rows.size()) {
+        SubStream element{*this};
+        rows[row++].Read(*this, tokenMap);
+      }
+      continue;
+    }
+    const auto* accessor = tokenMap.Find(token, hint);
+    if (accessor && accessor->GetColumn) {
+      accessor->GetColumn(*this, rows);
+    }
+  }
+}
+
+bool Reader::GetPackedChunk(PackedChunk& chunk, size_t elementSize) {
+  VERIFY_TOKENSTREAM(m_remainingInElement, false);
+  const auto size = m_remainingInElement;
+  const auto* data = FetchView();
+  if (!data) {
+    return false;
+  }
+  // The first byte is the format, followed by the elements
+  chunk.m_format = data[0];
+  chunk.m_data = data + 1;
+  chunk.m_size = size - 1;
+  if (chunk.m_format == Packed::VarintFormat) {
+    VERIFY_TOKENSTREAM(Packed::CountVarints(chunk.m_data, chunk.m_size, chunk.m_count), false);
+  } else {
+    VERIFY_TOKENSTREAM(chunk.m_format && chunk.m_format <= elementSize, false);
+    VERIFY_TOKENSTREAM(chunk.m_size % chunk.m_format == 0, false);
+    chunk.m_count = chunk.m_size / chunk.m_format;
+  }
+  return true;
+}
+
+template<typename T>
+bool Reader::UnpackItems(const PackedChunk& chunk, T* items) {
+  if (chunk.m_format == Packed::VarintFormat) {
+    VERIFY_TOKENSTREAM(Packed::DecodeVarints(chunk.m_data, chunk.m_size, chunk.m_count, items), false);
+  } else {
+    Packed::DecodeFixed(chunk.m_data, chunk.m_count, chunk.m_format, items);
+  }
+  return true;
+}
+
+bool Reader::UnpackElements(const PackedChunk& chunk, int8_t* items) {
+  return UnpackItems(chunk, items);
+}
+
+bool Reader::UnpackElements(const PackedChunk& chunk, int16_t* items) {
+  return UnpackItems(chunk, items);
+}
+
+bool Reader::UnpackElements(const PackedChunk& chunk, uint16_t* items) {
+  return UnpackItems(chunk, items);
+}
+
+bool Reader::UnpackElements(const PackedChunk& chunk, int32_t* items) {
+  return UnpackItems(chunk, items);
+}
+
+bool Reader::UnpackElements(const PackedChunk& chunk, uint32_t* items) {
+  return UnpackItems(chunk, items);
+}
+
+bool Reader::UnpackElements(const PackedChunk& chunk, int64_t* items) {
+  return UnpackItems(chunk, items);
+}
+
+bool Reader::UnpackElements(const PackedChunk& chunk, uint64_t* items) {
+  return UnpackItems(chunk, items);
+}
+
+bool Reader::UnpackElements(const PackedChunk& chunk, float* items) {
+  return UnpackItems(chunk, items);
+}
+
+bool Reader::UnpackElements(const PackedChunk& chunk, double* items) {
+  return UnpackItems(chunk, items);
+}
+
 void Reader::SkipBytes(size_t bytes) {
   m_tokenPushed = false;
   m_remainingInElement = 0;
   if (m_badStream || !bytes) {
     return;
   }
+  if (m_data) {
+    VERIFY_TOKENSTREAM(bytes <= m_size - m_offset, );
+    m_offset += bytes;
+    TS_STATS_ADD(skippedBySeek, bytes);
+    return;
+  }
+  // Runs of small skips are served from the read-ahead window and never touch the stream
+  if (bytes <= ReadAheadBytes() || (bytes < ReadAheadSize && FillReadAhead(bytes))) {
+    m_readAheadStart += bytes;
+    m_offset += bytes;
+    TS_STATS_ADD(skippedBySeek, bytes);
+    return;
+  }
+  // Seek past the rest of a large chunk
+  const auto buffered = ReadAheadBytes();
+  m_readAheadStart = m_readAheadEnd;
+  m_offset += buffered;
+  bytes -= buffered;
+  TS_STATS_ADD(skippedBySeek, buffered);
   try {
-    m_stream.seekg(bytes, std::ios_base::cur);
+    m_stream->seekg(static_cast<std::streamoff>(bytes), std::ios_base::cur);
     m_offset += bytes;
+    m_streamRemaining -= std::min(m_streamRemaining, bytes);
+    TS_STATS_ADD(skippedBySeek, bytes);
   } catch (std::ios_base::failure&) {
     SkipBytesByReading(bytes);
   }
@@ -340,18 +621,75 @@ void Reader::SkipBytesByReading(size_t bytes) {
   while (bytes && !m_badStream) {
     const auto count = std::min(bytes, sizeof buffer);
     VERIFIED_READ(count, buffer);
+    TS_STATS_ADD(skippedByReading, count);
     m_offset += count;
     bytes -= count;
   }
 }
 
+std::vector<Reader::ElementRange> Reader::ScanContainer(Token containerToken) {
+  std::vector<ElementRange> ranges;
+  // Every element takes at least a byte, which limits what a bad count can reserve
+  ranges.reserve(std::min(m_nextContainerElementCount, m_context.m_end - m_offset + 1));
+  do {
+    ranges.push_back(ElementRange{m_offset, m_remainingInElement, m_compressed});
+    SkipBytes(m_remainingInElement);
+    if (EOS()) {
+      return ranges;
+    }
+  } while (GetToken() == containerToken);
+  PushLastToken();
+  return ranges;
+}
+
+void Reader::SetElement(Token token, const ElementRange& element) {
+  m_lastToken = token;
+  m_offset = element.m_offset;
+  m_remainingInElement = element.m_length;
+  m_compressed = element.m_compressed;
+  m_tokenPushed = false;
+}
+
+bool Reader::Inflate(Binary& buffer) {
+  const auto len = m_remainingInElement;
+  const auto* data = FetchView();
+  VERIFY_TOKENSTREAM(data && DecompressChunk(data, len, m_codec, buffer), false);
+  return true;
+}
+
 Reader::SubStream::SubStream(Reader& reader) : m_reader{reader}, m_oldContext{reader.m_context} {
+  TS_STATS_ADD(subStreams, 1);
+  if (reader.m_compressed) {
+    reader.m_compressed = false;
+    if (!reader.Inflate(m_inflated)) {
+      reader.m_context = SubStreamContext{reader.m_offset};
+      return;
+    }
+    // Read from the decompressed data until the SubStream ends
+    m_isInflated = true;
+    m_oldData = reader.m_data;
+    m_oldSize = reader.m_size;
+    m_oldOffset = reader.m_offset;
+    m_oldInflated = reader.m_inflated;
+    reader.m_data = m_inflated.data();
+    reader.m_size = m_inflated.size();
+    reader.m_offset = 0;
+    reader.m_inflated = true;
+    reader.m_context = SubStreamContext{reader.m_size};
+    return;
+  }
   reader.m_context = SubStreamContext{reader.m_offset + reader.m_remainingInElement};
   reader.m_remainingInElement = 0;
 }
 
 Reader::SubStream::~SubStream() {
   m_reader.SkipBytes(m_reader.m_context.m_end - m_reader.m_offset);
+  if (m_isInflated) {
+    m_reader.m_data = m_oldData;
+    m_reader.m_size = m_oldSize;
+    m_reader.m_offset = m_oldOffset;
+    m_reader.m_inflated = m_oldInflated;
+  }
   m_reader.m_context = m_oldContext;
 }
 
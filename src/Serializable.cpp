@@ -23,9 +23,63 @@
 #include <TokenStream/Reader.h>
 #include <TokenStream/TokenStream.h>
 #include <TokenStream/Writer.h>
+#include <algorithm>
 
 namespace TokenStream {
 
+TokenMap::TokenMap(const TokenMap& parent, std::initializer_list<value_type> initializer) :
+    m_entries(initializer) {
+#ifdef AZ_ENABLE_TRACING
+  for (auto item : parent) {
+    TS_ASSERT(std::none_of(m_entries.begin(),
+                           m_entries.end(),
+                           [&item](const value_type& entry) { return entry.first == item.first; }),
+              "Duplicate token found in parent's TokenMap");
+  }
+#endif
+  m_entries.insert(m_entries.end(), parent.begin(), parent.end());
+  Index();
+}
+
+TokenMap::TokenMap(std::initializer_list<value_type> initializer) : m_entries(initializer) {
+  Index();
+}
+
+void TokenMap::Index() {
+  // Sort by token and, like std::map, keep the first entry for each token
+  std::stable_sort(m_entries.begin(), m_entries.end(), [](const value_type& lhs, const value_type& rhs) {
+    return lhs.first < rhs.first;
+  });
+  m_entries.erase(std::unique(m_entries.begin(),
+                              m_entries.end(),
+                              [](const value_type& lhs, const value_type& rhs) { return lhs.first == rhs.first; }),
+                  m_entries.end());
+  if (m_entries.empty()) {
+    return;
+  }
+  // Use a direct table if no more than about half of it would be unused
+  const auto maxToken = m_entries.back().first;
+  m_isDense = maxToken < m_entries.size() * 2 + 8;
+  if (m_isDense) {
+    m_direct.resize(static_cast<size_t>(maxToken) + 1);
+    for (size_t i = 0; i < m_entries.size(); i++) {
+      m_direct[static_cast<size_t>(m_entries[i].first)] = static_cast<uint32_t>(i + 1);
+    }
+  }
+}
+
+const MemberAccessor* TokenMap::FindSorted(uint64_t token, size_t& hint) const {
+  const auto i = std::lower_bound(m_entries.begin(),
+                                  m_entries.end(),
+                                  token,
+                                  [](const value_type& entry, uint64_t t) { return entry.first < t; });
+  if (i == m_entries.end() || i->first != token) {
+    return nullptr;
+  }
+  hint = static_cast<size_t>(i - m_entries.begin()) + 1;
+  return &i->second;
+}
+
 void Serializable::Write(Writer& writer, const TokenMap& tokenMap) const {
   for (auto& kv : tokenMap) {
     writer.PutToken(kv.first);
@@ -33,13 +87,80 @@ void Serializable::Write(Writer& writer, const TokenMap& tokenMap) const {
   }
 }
 
+constexpr uint64_t Serializable::DeltaResetToken;
+constexpr uint64_t Serializable::ColumnRowsToken;
+
+void Serializable::WriteDelta(Writer& writer, const Serializable& old) const {
+  const auto& tokenMap = GetTokenMap();
+  if (!tokenMap.empty()) {
+    WriteDelta(writer, old, tokenMap);
+    return;
+  }
+  // Without a token map, the whole object is written if its output changed
+  MemoryWriter before{writer};
+  old.Write(before);
+  MemoryWriter after{writer};
+  Write(after);
+  if (before.GetBlockView() != after.GetBlockView()) {
+    Write(writer);
+  }
+}
+
+void Serializable::WriteDelta(Writer& writer, const Serializable& old, const TokenMap& tokenMap) const {
+  // Members that are now a trimmed default, which the reader could not tell from unchanged ones
+  std::vector<uint64_t> resets;
+  for (auto& kv : tokenMap) {
+    writer.PutToken(kv.first);
+    if (!kv.second.PutDelta) {
+      kv.second.Put(writer, *this);
+    } else if (kv.second.PutDelta(writer, old, *this)) {
+      resets.push_back(kv.first);
+    }
+  }
+  if (!resets.empty()) {
+    writer.PutPacked(DeltaResetToken, resets);
+  }
+}
+
+void Serializable::ApplyDelta(Reader& reader) {
+  const auto& tokenMap = GetTokenMap();
+  if (tokenMap.empty()) {
+    Read(reader);
+  } else {
+    ApplyDelta(reader, tokenMap);
+  }
+}
+
+void Serializable::ApplyDelta(Reader& reader, const TokenMap& tokenMap) {
+  size_t hint = 0;
+  while (!reader.EOS()) {
+    const auto token = reader.GetToken();
+    if (token == DeltaResetToken) {
+      std::vector<uint64_t> resets;
+      reader >> resets;
+      for (auto reset : resets) {
+        size_t resetHint = 0;
+        const auto* accessor = tokenMap.Find(reset, resetHint);
+        if (accessor && accessor->Reset) {
+          accessor->Reset(*this);
+        }
+      }
+      continue;
+    }
+    const auto* accessor = tokenMap.Find(token, hint);
+    if (accessor) {
+      (accessor->GetDelta ? accessor->GetDelta : accessor->Get)(reader, *this);
+    }
+  }
+}
+
 void Serializable::Read(Reader& reader, const TokenMap& tokenMap) {
   if (!tokenMap.empty()) {
+    size_t hint = 0;
     while (!reader.EOS()) {
-      const auto token = reader.GetToken();
-      const auto i = tokenMap.find(token);
-      if (i != tokenMap.end()) {
-        i->second.Get(reader, *this);
+      const auto* accessor = tokenMap.Find(reader.GetToken(), hint);
+      if (accessor) {
+        accessor->Get(reader, *this);
       }
     }
   }
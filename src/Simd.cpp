@@ -0,0 +1,707 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include "Simd.h"
+#include "EndianTypes.h"
+#include <array>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__AVX2__)
+#define TOKENSTREAM_SIMD_AVX2
+#endif
+#if defined(__SSSE3__) || defined(__AVX2__)
+#define TOKENSTREAM_SIMD_SSSE3
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TOKENSTREAM_SIMD_SSE2
+#endif
+#if (defined(__aarch64__) && defined(__ARM_NEON)) || defined(_M_ARM64)
+#define TOKENSTREAM_SIMD_NEON
+#endif
+
+#if defined(__SSE4_2__)
+#define TOKENSTREAM_CRC32_SSE42
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#define TOKENSTREAM_CRC32_ARM
+#include <arm_acle.h>
+#endif
+
+#if defined(TOKENSTREAM_SIMD_AVX2)
+#include <immintrin.h>
+#elif defined(TOKENSTREAM_SIMD_SSSE3)
+#include <tmmintrin.h>
+#elif defined(TOKENSTREAM_SIMD_SSE2)
+#include <emmintrin.h>
+#elif defined(TOKENSTREAM_SIMD_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace TokenStream {
+namespace Simd {
+
+namespace {
+
+// Host order is little-endian (see IS_LITTLE_ENDIAN), so the first bytes of an element are its low bytes
+uint64_t Load(const uint8_t* in, size_t size) {
+  uint64_t value = 0;
+  memcpy(&value, in, size);
+  return value;
+}
+
+void Store(uint8_t* out, uint64_t value, size_t size) {
+  memcpy(out, &value, size);
+}
+
+// Calls kernel with the element size as a compile-time constant, so that the loads and stores of the
+// scalar loops become single moves instead of calls to memcpy
+template<typename Kernel>
+void WithSize(size_t size, Kernel&& kernel) {
+  switch (size) {
+    case 1:
+      kernel(std::integral_constant<size_t, 1>{});
+      break;
+    case 2:
+      kernel(std::integral_constant<size_t, 2>{});
+      break;
+    case 4:
+      kernel(std::integral_constant<size_t, 4>{});
+      break;
+    default:
+      kernel(std::integral_constant<size_t, 8>{});
+      break;
+  }
+}
+
+uint64_t SignBit(size_t size) {
+  return uint64_t{1} << (size * 8 - 1);
+}
+
+uint64_t Mask(size_t size) {
+  return size < sizeof(uint64_t) ? (uint64_t{1} << (size * 8)) - 1 : ~uint64_t{0};
+}
+
+// Folds the elements packed into a 64-bit word together
+uint64_t FoldWord(uint64_t word, size_t size) {
+  for (auto bits = static_cast<unsigned>(size * 8); bits < 64; bits *= 2) {
+    word |= word >> bits;
+  }
+  return word & Mask(size);
+}
+
+#if defined(TOKENSTREAM_SIMD_SSSE3) || defined(TOKENSTREAM_SIMD_NEON)
+// Shuffle control of 16 bytes. Entries of 0x80 produce a zero byte.
+struct ShuffleMask {
+  uint8_t m_bytes[16];
+
+  ShuffleMask() {
+    memset(m_bytes, 0x80, sizeof m_bytes);
+  }
+
+  static ShuffleMask Swap(size_t size) {
+    ShuffleMask mask;
+    for (size_t i = 0; i < sizeof mask.m_bytes; i++) {
+      mask.m_bytes[i] = static_cast<uint8_t>(i - i % size + size - 1 - i % size);
+    }
+    return mask;
+  }
+
+  static ShuffleMask Pack(size_t size, size_t width, bool swap) {
+    ShuffleMask mask;
+    for (size_t element = 0; element < 16 / size; element++) {
+      for (size_t b = 0; b < width; b++) {
+        mask.m_bytes[element * width + b] =
+            static_cast<uint8_t>(element * size + (swap ? width - 1 - b : size - width + b));
+      }
+    }
+    return mask;
+  }
+
+  static ShuffleMask Unpack(size_t size, size_t width, bool swap) {
+    ShuffleMask mask;
+    for (size_t element = 0; element < 16 / size; element++) {
+      for (size_t b = 0; b < width; b++) {
+        mask.m_bytes[element * size + (swap ? width - 1 - b : size - width + b)] =
+            static_cast<uint8_t>(element * width + b);
+      }
+    }
+    return mask;
+  }
+};
+#endif
+
+#if defined(TOKENSTREAM_SIMD_SSSE3)
+__m128i Load128(const ShuffleMask& mask) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask.m_bytes));
+}
+
+__m128i Shuffle(__m128i value, __m128i mask) {
+  return _mm_shuffle_epi8(value, mask);
+}
+#elif defined(TOKENSTREAM_SIMD_NEON)
+uint8x16_t Load128(const ShuffleMask& mask) {
+  return vld1q_u8(mask.m_bytes);
+}
+
+uint8x16_t Shuffle(uint8x16_t value, uint8x16_t mask) {
+  return vqtbl1q_u8(value, mask);
+}
+#endif
+
+#if defined(TOKENSTREAM_SIMD_SSE2)
+__m128i Load128(const uint8_t* in) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+}
+
+void Store128(uint8_t* out, __m128i value) {
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(out), value);
+}
+
+// All ones in the elements that are negative
+__m128i SignMask(__m128i value, size_t size) {
+  switch (size) {
+    case 1:
+      return _mm_cmpgt_epi8(_mm_setzero_si128(), value);
+    case 2:
+      return _mm_srai_epi16(value, 15);
+    case 4:
+      return _mm_srai_epi32(value, 31);
+    default:
+      return _mm_shuffle_epi32(_mm_srai_epi32(value, 31), _MM_SHUFFLE(3, 3, 1, 1));
+  }
+}
+
+uint64_t Fold128(__m128i value) {
+  uint64_t words[2];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(words), value);
+  return words[0] | words[1];
+}
+#endif
+
+#if defined(TOKENSTREAM_SIMD_SSE2) && !defined(TOKENSTREAM_SIMD_SSSE3)
+// Without a byte shuffle, swap the 16-bit words and then the bytes within them
+__m128i SwapWords(__m128i value) {
+  return _mm_or_si128(_mm_slli_epi16(value, 8), _mm_srli_epi16(value, 8));
+}
+
+__m128i Swap128(__m128i value, size_t size) {
+  switch (size) {
+    case 2:
+      return SwapWords(value);
+    case 4:
+      value = _mm_shufflelo_epi16(value, _MM_SHUFFLE(2, 3, 0, 1));
+      return SwapWords(_mm_shufflehi_epi16(value, _MM_SHUFFLE(2, 3, 0, 1)));
+    default:
+      value = _mm_shufflelo_epi16(value, _MM_SHUFFLE(0, 1, 2, 3));
+      return SwapWords(_mm_shufflehi_epi16(value, _MM_SHUFFLE(0, 1, 2, 3)));
+  }
+}
+#endif
+
+#if defined(TOKENSTREAM_SIMD_AVX2)
+__m256i Load256(const uint8_t* in) {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+}
+
+void Store256(uint8_t* out, __m256i value) {
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), value);
+}
+
+__m256i SignMask(__m256i value, size_t size) {
+  switch (size) {
+    case 1:
+      return _mm256_cmpgt_epi8(_mm256_setzero_si256(), value);
+    case 2:
+      return _mm256_srai_epi16(value, 15);
+    case 4:
+      return _mm256_srai_epi32(value, 31);
+    default:
+      return _mm256_shuffle_epi32(_mm256_srai_epi32(value, 31), _MM_SHUFFLE(3, 3, 1, 1));
+  }
+}
+#endif
+
+#if defined(TOKENSTREAM_SIMD_NEON)
+uint8x16_t SignMask(uint8x16_t value, size_t size) {
+  switch (size) {
+    case 1:
+      return vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(value), 7));
+    case 2:
+      return vreinterpretq_u8_s16(vshrq_n_s16(vreinterpretq_s16_u8(value), 15));
+    case 4:
+      return vreinterpretq_u8_s32(vshrq_n_s32(vreinterpretq_s32_u8(value), 31));
+    default:
+      return vreinterpretq_u8_s64(vshrq_n_s64(vreinterpretq_s64_u8(value), 63));
+  }
+}
+
+uint8x16_t Swap128(uint8x16_t value, size_t size) {
+  switch (size) {
+    case 2:
+      return vrev16q_u8(value);
+    case 4:
+      return vrev32q_u8(value);
+    default:
+      return vrev64q_u8(value);
+  }
+}
+#endif
+
+// Reverses each element of size bytes. Works on unaligned buffers.
+void SwapBytes(const uint8_t* in, size_t count, size_t size, uint8_t* out) {
+  const auto total = count * size;
+  size_t i = 0;
+#if defined(TOKENSTREAM_SIMD_AVX2)
+  const auto mask256 = _mm256_broadcastsi128_si256(Load128(ShuffleMask::Swap(size)));
+  for (; i + 32 <= total; i += 32) {
+    Store256(out + i, _mm256_shuffle_epi8(Load256(in + i), mask256));
+  }
+#endif
+#if defined(TOKENSTREAM_SIMD_SSSE3)
+  const auto mask = Load128(ShuffleMask::Swap(size));
+  for (; i + 16 <= total; i += 16) {
+    Store128(out + i, Shuffle(Load128(in + i), mask));
+  }
+#elif defined(TOKENSTREAM_SIMD_SSE2)
+  for (; i + 16 <= total; i += 16) {
+    Store128(out + i, Swap128(Load128(in + i), size));
+  }
+#elif defined(TOKENSTREAM_SIMD_NEON)
+  for (; i + 16 <= total; i += 16) {
+    vst1q_u8(out + i, Swap128(vld1q_u8(in + i), size));
+  }
+#endif
+  WithSize(size, [&](auto constant) {
+    constexpr size_t Size = decltype(constant)::value;
+    for (; i < total; i += Size) {
+      Store(out + i, UInt64_Swap::Swap(Load(in + i, Size)) >> (64 - Size * 8), Size);
+    }
+  });
+}
+
+} // namespace
+
+const char* Backend() {
+#if defined(TOKENSTREAM_SIMD_AVX2)
+  return "avx2";
+#elif defined(TOKENSTREAM_SIMD_SSSE3)
+  return "ssse3";
+#elif defined(TOKENSTREAM_SIMD_SSE2)
+  return "sse2";
+#elif defined(TOKENSTREAM_SIMD_NEON)
+  return "neon";
+#else
+  return "scalar";
+#endif
+}
+
+void ByteSwap(const uint16_t* in, size_t count, uint16_t* out) {
+  SwapBytes(reinterpret_cast<const uint8_t*>(in), count, sizeof *in, reinterpret_cast<uint8_t*>(out));
+}
+
+void ByteSwap(const uint32_t* in, size_t count, uint32_t* out) {
+  SwapBytes(reinterpret_cast<const uint8_t*>(in), count, sizeof *in, reinterpret_cast<uint8_t*>(out));
+}
+
+void ByteSwap(const uint64_t* in, size_t count, uint64_t* out) {
+  SwapBytes(reinterpret_cast<const uint8_t*>(in), count, sizeof *in, reinterpret_cast<uint8_t*>(out));
+}
+
+uint64_t OrReduce(const void* values, size_t count, size_t size, bool foldSign) {
+  const auto* in = static_cast<const uint8_t*>(values);
+  const auto total = count * size;
+  size_t i = 0;
+  uint64_t word = 0;
+#if defined(TOKENSTREAM_SIMD_AVX2)
+  if (total >= 32) {
+    auto acc = _mm256_setzero_si256();
+    for (; i + 32 <= total; i += 32) {
+      auto value = Load256(in + i);
+      if (foldSign) {
+        value = _mm256_xor_si256(value, SignMask(value, size));
+      }
+      acc = _mm256_or_si256(acc, value);
+    }
+    word |= Fold128(_mm_or_si128(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)));
+  }
+#endif
+#if defined(TOKENSTREAM_SIMD_SSE2)
+  auto acc = _mm_setzero_si128();
+  for (; i + 16 <= total; i += 16) {
+    auto value = Load128(in + i);
+    if (foldSign) {
+      value = _mm_xor_si128(value, SignMask(value, size));
+    }
+    acc = _mm_or_si128(acc, value);
+  }
+  word |= Fold128(acc);
+#elif defined(TOKENSTREAM_SIMD_NEON)
+  auto acc = vdupq_n_u8(0);
+  for (; i + 16 <= total; i += 16) {
+    auto value = vld1q_u8(in + i);
+    if (foldSign) {
+      value = veorq_u8(value, SignMask(value, size));
+    }
+    acc = vorrq_u8(acc, value);
+  }
+  const auto words = vreinterpretq_u64_u8(acc);
+  word |= vgetq_lane_u64(words, 0) | vgetq_lane_u64(words, 1);
+#endif
+  auto result = FoldWord(word, size);
+  WithSize(size, [&](auto constant) {
+    constexpr size_t Size = decltype(constant)::value;
+    const auto signBit = SignBit(Size);
+    for (; i < total; i += Size) {
+      auto value = Load(in + i, Size);
+      if (foldSign && (value & signBit)) {
+        value = ~value & Mask(Size);
+      }
+      result |= value;
+    }
+  });
+  return result;
+}
+
+void PackBytes(const void* values, size_t count, size_t size, size_t width, bool swap, uint8_t* out) {
+  const auto* in = static_cast<const uint8_t*>(values);
+  if (width == size) {
+    if (swap && size > 1) {
+      SwapBytes(in, count, size, out);
+    } else if (count) {
+      memcpy(out, in, count * size);
+    }
+    return;
+  }
+  size_t i = 0;
+#if defined(TOKENSTREAM_SIMD_SSSE3) || defined(TOKENSTREAM_SIMD_NEON)
+  const auto perBlock = 16 / size;
+  const auto mask = Load128(ShuffleMask::Pack(size, width, swap));
+  // Each store writes 16 bytes but only advances by the packed size, so stay 16 bytes from the end
+  for (; i + perBlock <= count && (i * width + 16) <= count * width; i += perBlock) {
+#if defined(TOKENSTREAM_SIMD_SSSE3)
+    Store128(out + i * width, Shuffle(Load128(in + i * size), mask));
+#else
+    vst1q_u8(out + i * width, Shuffle(vld1q_u8(in + i * size), mask));
+#endif
+  }
+#endif
+  WithSize(size, [&](auto constant) {
+    constexpr size_t Size = decltype(constant)::value;
+    const auto shift = 64 - width * 8;
+    const auto drop = (Size - width) * 8;
+    // Store whole words while there is room after the element, since width is not a constant
+    for (; i < count && i * width + sizeof(uint64_t) <= count * width; i++) {
+      const auto value = Load(in + i * Size, Size);
+      Store(out + i * width, swap ? UInt64_Swap::Swap(value << shift) : value >> drop, sizeof(uint64_t));
+    }
+    for (; i < count; i++) {
+      const auto value = Load(in + i * Size, Size);
+      Store(out + i * width, swap ? UInt64_Swap::Swap(value << shift) : value >> drop, width);
+    }
+  });
+}
+
+void UnpackBytes(const uint8_t* in, size_t count, size_t size, size_t width, bool swap, void* values) {
+  auto* out = static_cast<uint8_t*>(values);
+  if (width == size) {
+    if (swap && size > 1) {
+      SwapBytes(in, count, size, out);
+    } else if (count) {
+      memcpy(out, in, count * size);
+    }
+    return;
+  }
+  size_t i = 0;
+#if defined(TOKENSTREAM_SIMD_SSSE3) || defined(TOKENSTREAM_SIMD_NEON)
+  const auto perBlock = 16 / size;
+  const auto mask = Load128(ShuffleMask::Unpack(size, width, swap));
+  // Each load reads 16 bytes but only advances by the packed size, so stay 16 bytes from the end
+  for (; i + perBlock <= count && (i * width + 16) <= count * width; i += perBlock) {
+#if defined(TOKENSTREAM_SIMD_SSSE3)
+    Store128(out + i * size, Shuffle(Load128(in + i * width), mask));
+#else
+    vst1q_u8(out + i * size, Shuffle(vld1q_u8(in + i * width), mask));
+#endif
+  }
+#endif
+  WithSize(size, [&](auto constant) {
+    constexpr size_t Size = decltype(constant)::value;
+    const auto shift = 64 - width * 8;
+    const auto fill = (Size - width) * 8;
+    const auto low = Mask(width);
+    // Load whole words while there is room after the element, since width is not a constant
+    for (; i < count && i * width + sizeof(uint64_t) <= count * width; i++) {
+      const auto value = Load(in + i * width, sizeof(uint64_t));
+      Store(out + i * Size, swap ? UInt64_Swap::Swap(value) >> shift : (value & low) << fill, Size);
+    }
+    for (; i < count; i++) {
+      const auto value = Load(in + i * width, width);
+      Store(out + i * Size, swap ? UInt64_Swap::Swap(value) >> shift : value << fill, Size);
+    }
+  });
+}
+
+void SignExtend(void* values, size_t count, size_t size, size_t width) {
+  if (width >= size) {
+    return;
+  }
+  auto* data = static_cast<uint8_t*>(values);
+  const auto total = count * size;
+  // (value ^ sign) - sign spreads the sign bit of the low width bytes over the whole element
+  const auto sign = SignBit(width);
+  size_t i = 0;
+#if defined(TOKENSTREAM_SIMD_SSE2)
+  __m128i signs;
+  switch (size) {
+    case 2:
+      signs = _mm_set1_epi16(static_cast<int16_t>(sign));
+      break;
+    case 4:
+      signs = _mm_set1_epi32(static_cast<int32_t>(sign));
+      break;
+    default:
+      signs = _mm_set1_epi64x(static_cast<int64_t>(sign));
+      break;
+  }
+  for (; i + 16 <= total; i += 16) {
+    const auto value = _mm_xor_si128(Load128(data + i), signs);
+    switch (size) {
+      case 2:
+        Store128(data + i, _mm_sub_epi16(value, signs));
+        break;
+      case 4:
+        Store128(data + i, _mm_sub_epi32(value, signs));
+        break;
+      default:
+        Store128(data + i, _mm_sub_epi64(value, signs));
+        break;
+    }
+  }
+#elif defined(TOKENSTREAM_SIMD_NEON)
+  for (; i + 16 <= total; i += 16) {
+    switch (size) {
+      case 2: {
+        const auto signs = vdupq_n_u16(static_cast<uint16_t>(sign));
+        const auto value = veorq_u16(vld1q_u16(reinterpret_cast<const uint16_t*>(data + i)), signs);
+        vst1q_u16(reinterpret_cast<uint16_t*>(data + i), vsubq_u16(value, signs));
+        break;
+      }
+      case 4: {
+        const auto signs = vdupq_n_u32(static_cast<uint32_t>(sign));
+        const auto value = veorq_u32(vld1q_u32(reinterpret_cast<const uint32_t*>(data + i)), signs);
+        vst1q_u32(reinterpret_cast<uint32_t*>(data + i), vsubq_u32(value, signs));
+        break;
+      }
+      default: {
+        const auto signs = vdupq_n_u64(sign);
+        const auto value = veorq_u64(vld1q_u64(reinterpret_cast<const uint64_t*>(data + i)), signs);
+        vst1q_u64(reinterpret_cast<uint64_t*>(data + i), vsubq_u64(value, signs));
+        break;
+      }
+    }
+  }
+#endif
+  WithSize(size, [&](auto constant) {
+    constexpr size_t Size = decltype(constant)::value;
+    for (; i < total; i += Size) {
+      Store(data + i, (Load(data + i, Size) ^ sign) - sign, Size);
+    }
+  });
+}
+
+size_t AsciiLength(const uint8_t* in, size_t size) {
+  size_t i = 0;
+#if defined(TOKENSTREAM_SIMD_AVX2)
+  for (; i + 32 <= size && !_mm256_movemask_epi8(Load256(in + i)); i += 32) {
+  }
+#endif
+#if defined(TOKENSTREAM_SIMD_SSE2)
+  for (; i + 16 <= size && !_mm_movemask_epi8(Load128(in + i)); i += 16) {
+  }
+#elif defined(TOKENSTREAM_SIMD_NEON)
+  for (; i + 16 <= size && vmaxvq_u8(vld1q_u8(in + i)) < 0x80; i += 16) {
+  }
+#endif
+  for (; i + 8 <= size && !(Load(in + i, 8) & 0x8080808080808080u); i += 8) {
+  }
+  while (i < size && in[i] < 0x80) {
+    i++;
+  }
+  return i;
+}
+
+void WidenBytes(const uint8_t* in, size_t count, size_t size, void* values) {
+  auto* out = static_cast<uint8_t*>(values);
+  size_t i = 0;
+#if defined(TOKENSTREAM_SIMD_SSE2)
+  const auto zero = _mm_setzero_si128();
+  for (; i + 16 <= count; i += 16) {
+    const auto bytes = Load128(in + i);
+    const auto low = _mm_unpacklo_epi8(bytes, zero);
+    const auto high = _mm_unpackhi_epi8(bytes, zero);
+    auto* o = out + i * size;
+    if (size == 2) {
+      Store128(o, low);
+      Store128(o + 16, high);
+    } else {
+      Store128(o, _mm_unpacklo_epi16(low, zero));
+      Store128(o + 16, _mm_unpackhi_epi16(low, zero));
+      Store128(o + 32, _mm_unpacklo_epi16(high, zero));
+      Store128(o + 48, _mm_unpackhi_epi16(high, zero));
+    }
+  }
+#elif defined(TOKENSTREAM_SIMD_NEON)
+  for (; i + 16 <= count; i += 16) {
+    const auto bytes = vld1q_u8(in + i);
+    const auto low = vmovl_u8(vget_low_u8(bytes));
+    const auto high = vmovl_u8(vget_high_u8(bytes));
+    auto* o = out + i * size;
+    if (size == 2) {
+      vst1q_u8(o, vreinterpretq_u8_u16(low));
+      vst1q_u8(o + 16, vreinterpretq_u8_u16(high));
+    } else {
+      vst1q_u8(o, vreinterpretq_u8_u32(vmovl_u16(vget_low_u16(low))));
+      vst1q_u8(o + 16, vreinterpretq_u8_u32(vmovl_u16(vget_high_u16(low))));
+      vst1q_u8(o + 32, vreinterpretq_u8_u32(vmovl_u16(vget_low_u16(high))));
+      vst1q_u8(o + 48, vreinterpretq_u8_u32(vmovl_u16(vget_high_u16(high))));
+    }
+  }
+#endif
+  WithSize(size, [&](auto constant) {
+    constexpr size_t Size = decltype(constant)::value;
+    for (; i < count; i++) {
+      Store(out + i * Size, in[i], Size);
+    }
+  });
+}
+
+size_t NarrowAscii(const void* values, size_t count, size_t size, uint8_t* out) {
+  const auto* in = static_cast<const uint8_t*>(values);
+  size_t i = 0;
+#if defined(TOKENSTREAM_SIMD_SSE2)
+  const auto zero = _mm_setzero_si128();
+  // Everything but the low 7 bits of each element
+  const auto high = size == 2 ? _mm_set1_epi16(static_cast<int16_t>(0xff80))
+                              : _mm_set1_epi32(static_cast<int32_t>(0xffffff80));
+  const auto isAscii = [&](__m128i bits) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(bits, high), zero)) == 0xffff;
+  };
+  for (; i + 16 <= count; i += 16) {
+    const auto* p = in + i * size;
+    __m128i words[2];
+    if (size == 2) {
+      words[0] = Load128(p);
+      words[1] = Load128(p + 16);
+    } else {
+      const auto a = Load128(p);
+      const auto b = Load128(p + 16);
+      const auto c = Load128(p + 32);
+      const auto d = Load128(p + 48);
+      if (!isAscii(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)))) {
+        break;
+      }
+      // The values are below 0x80, so the signed saturation does not change them
+      words[0] = _mm_packs_epi32(a, b);
+      words[1] = _mm_packs_epi32(c, d);
+    }
+    if (size == 2 && !isAscii(_mm_or_si128(words[0], words[1]))) {
+      break;
+    }
+    Store128(out + i, _mm_packus_epi16(words[0], words[1]));
+  }
+#elif defined(TOKENSTREAM_SIMD_NEON)
+  for (; i + 16 <= count; i += 16) {
+    const auto* p = in + i * size;
+    uint16x8_t words[2];
+    if (size == 2) {
+      words[0] = vreinterpretq_u16_u8(vld1q_u8(p));
+      words[1] = vreinterpretq_u16_u8(vld1q_u8(p + 16));
+    } else {
+      const auto a = vreinterpretq_u32_u8(vld1q_u8(p));
+      const auto b = vreinterpretq_u32_u8(vld1q_u8(p + 16));
+      const auto c = vreinterpretq_u32_u8(vld1q_u8(p + 32));
+      const auto d = vreinterpretq_u32_u8(vld1q_u8(p + 48));
+      if (vmaxvq_u32(vorrq_u32(vorrq_u32(a, b), vorrq_u32(c, d))) >= 0x80) {
+        break;
+      }
+      words[0] = vcombine_u16(vmovn_u32(a), vmovn_u32(b));
+      words[1] = vcombine_u16(vmovn_u32(c), vmovn_u32(d));
+    }
+    if (vmaxvq_u16(vorrq_u16(words[0], words[1])) >= 0x80) {
+      break;
+    }
+    vst1q_u8(out + i, vcombine_u8(vmovn_u16(words[0]), vmovn_u16(words[1])));
+  }
+#endif
+  WithSize(size, [&](auto constant) {
+    constexpr size_t Size = decltype(constant)::value;
+    for (; i < count; i++) {
+      const auto value = Load(in + i * Size, Size);
+      if (value >= 0x80) {
+        break;
+      }
+      out[i] = static_cast<uint8_t>(value);
+    }
+  });
+  return i;
+}
+
+uint32_t Crc32c(const void* data, size_t size, uint32_t crc) {
+  const auto* in = static_cast<const uint8_t*>(data);
+  crc = ~crc;
+  size_t i = 0;
+#if defined(TOKENSTREAM_CRC32_SSE42) && (defined(__x86_64__) || defined(_M_X64))
+  uint64_t crc64 = crc;
+  for (; i + 8 <= size; i += 8) {
+    crc64 = _mm_crc32_u64(crc64, Load(in + i, 8));
+  }
+  crc = static_cast<uint32_t>(crc64);
+#elif defined(TOKENSTREAM_CRC32_SSE42)
+  for (; i + 4 <= size; i += 4) {
+    crc = _mm_crc32_u32(crc, static_cast<uint32_t>(Load(in + i, 4)));
+  }
+#elif defined(TOKENSTREAM_CRC32_ARM)
+  for (; i + 8 <= size; i += 8) {
+    crc = __crc32cd(crc, Load(in + i, 8));
+  }
+#endif
+  // Reflected Castagnoli polynomial, one byte at a time
+  static const auto table = [] {
+    std::array<uint32_t, 256> entries{};
+    for (uint32_t n = 0; n < entries.size(); n++) {
+      auto entry = n;
+      for (int bit = 0; bit < 8; bit++) {
+        entry = (entry >> 1u) ^ (0x82f63b78u & (0 - (entry & 1u)));
+      }
+      entries[n] = entry;
+    }
+    return entries;
+  }();
+  for (; i < size; i++) {
+    crc = table[(crc ^ in[i]) & 0xffu] ^ (crc >> 8u);
+  }
+  return ~crc;
+}
+
+} // namespace Simd
+} // namespace TokenStream
@@ -0,0 +1,79 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#pragma once
+
+// Bulk kernels for arrays of numbers. The instruction set is picked at compile time from the
+// compiler's target flags (e.g. -mavx2 or -mssse3): AVX2, SSSE3, SSE2 or AArch64 NEON, with a
+// scalar fallback for everything else. Elements are passed as raw bytes in host order so that
+// float and double arrays can share the integer kernels.
+
+#include <cstddef>
+#include <cstdint>
+
+namespace TokenStream {
+namespace Simd {
+
+//! Name of the instruction set the kernels were built for
+const char* Backend();
+
+//@{
+//! Reverses the bytes of each element. \p in and \p out may be the same.
+void ByteSwap(const uint16_t* in, size_t count, uint16_t* out);
+void ByteSwap(const uint32_t* in, size_t count, uint32_t* out);
+void ByteSwap(const uint64_t* in, size_t count, uint64_t* out);
+//@}
+
+//! @brief ORs together \p count elements of \p size bytes (1, 2, 4 or 8).
+//! @param foldSign Flip the bits of negative elements first, so that only the bits that differ
+//! from the sign bit remain.
+uint64_t OrReduce(const void* values, size_t count, size_t size, bool foldSign);
+
+//! @brief Copies \p width bytes of each element of \p size bytes to \p out, without gaps.
+//! @param swap \e true to write the low \p width bytes in reverse order (integers, which are
+//! stored big-endian), \e false to copy the high \p width bytes as they are (floating point
+//! values, which are stored little-endian).
+void PackBytes(const void* values, size_t count, size_t size, size_t width, bool swap, uint8_t* out);
+
+//! @brief Reverses PackBytes(), filling the bytes that were not stored with zeros.
+void UnpackBytes(const uint8_t* in, size_t count, size_t size, size_t width, bool swap, void* values);
+
+//! @brief Sign-extends elements of \p size bytes whose low \p width bytes hold a signed value.
+void SignExtend(void* values, size_t count, size_t size, size_t width);
+
+//! @brief Returns the number of bytes at the start of \p in that are ASCII (below 0x80).
+size_t AsciiLength(const uint8_t* in, size_t size);
+
+//! @brief Zero-extends \p count bytes to elements of \p size bytes (2 or 4).
+void WidenBytes(const uint8_t* in, size_t count, size_t size, void* out);
+
+//! @brief Copies the elements of \p size bytes (2 or 4) at the start of \p values that are ASCII
+//! to \p out, one byte each.
+//! @return The number of elements copied
+size_t NarrowAscii(const void* values, size_t count, size_t size, uint8_t* out);
+
+//! @brief CRC-32C (Castagnoli) of \p size bytes, continuing from \p crc, the result for the bytes before them.
+//! Uses the crc32 instructions of SSE 4.2 or ARMv8 when the compiler targets them.
+uint32_t Crc32c(const void* data, size_t size, uint32_t crc = 0);
+
+} // namespace Simd
+} // namespace TokenStream
@@ -0,0 +1,54 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+
+#include <TokenStream/Stats.h>
+#include <atomic>
+
+namespace TokenStream {
+
+namespace {
+
+std::atomic<MessageHook> messageHook{nullptr};
+
+} // namespace
+
+#if TOKENSTREAM_STATS
+const bool Stats::Enabled = true;
+#else
+const bool Stats::Enabled = false;
+#endif
+
+Stats& Stats::Local() {
+  thread_local Stats stats;
+  return stats;
+}
+
+void SetMessageHook(MessageHook hook) {
+  messageHook.store(hook, std::memory_order_relaxed);
+}
+
+MessageHook GetMessageHook() {
+  return messageHook.load(std::memory_order_relaxed);
+}
+
+} // namespace TokenStream
@@ -0,0 +1,132 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include "Packed.h"
+#include <TokenStream/TokenIndex.h>
+
+#define VERIFY_INDEX(x)                                                                            \
+  do {                                                                                             \
+    if (!(x)) {                                                                                    \
+      TS_ASSERT(x, "Invalid TokenStream");                                                         \
+      m_badStream = true;                                                                          \
+      return;                                                                                      \
+    }                                                                                              \
+  } while (false) // NOLINT
+
+namespace TokenStream {
+
+TokenIndex::TokenIndex(const uint8_t* data, size_t size) {
+  Scan(data, size);
+  m_subIndexes.resize(m_fields.size());
+}
+
+void TokenIndex::Scan(const uint8_t* data, size_t size) {
+  size_t offset = 0;
+  // Reads one value in the length encoding and moves past it
+  const auto decode = [&](uint64_t& value) {
+    const auto used = Packed::DecodeVarint(data + offset, size - offset, value);
+    offset += used;
+    return used != 0;
+  };
+  while (offset < size) {
+    Field field;
+    field.m_begin = data + offset;
+    uint64_t count = 1;
+    // A list starts with 0xf8 and the element count. A count of 0 marks a packed chunk and a
+    // count of 1 a compressed one.
+    if (data[offset] == 0xf8) {
+      ++offset;
+      VERIFY_INDEX(decode(count));
+      field.m_compressed = count == 1;
+      count = count ? count : 1;
+    }
+    uint64_t token;
+    VERIFY_INDEX(decode(token));
+    field.m_token = Token{token};
+    field.m_count = static_cast<size_t>(count);
+    // Every element has a length, but only the first one has a token
+    for (uint64_t i = 0; i < count; i++) {
+      uint64_t length;
+      VERIFY_INDEX(decode(length));
+      VERIFY_INDEX(length <= size - offset);
+      if (!i) {
+        field.m_data = data + offset;
+        field.m_length = static_cast<size_t>(length);
+      }
+      offset += static_cast<size_t>(length);
+    }
+    field.m_size = static_cast<size_t>(data + offset - field.m_begin);
+
+    // Readers treat consecutive chunks with the same token as one container
+    if (!m_fields.empty() && m_fields.back().m_token == field.m_token) {
+      auto& previous = m_fields.back();
+      previous.m_size += field.m_size;
+      previous.m_count += field.m_count;
+      continue;
+    }
+    m_lookup.emplace(token, m_fields.size());
+    m_fields.push_back(field);
+  }
+}
+
+const TokenIndex::Field* TokenIndex::Find(Token token) const {
+  const auto i = m_lookup.find(token);
+  return i == m_lookup.end() ? nullptr : &m_fields[i->second];
+}
+
+const TokenIndex::Field* TokenIndex::FindPath(std::initializer_list<Token> path) {
+  if (!path.size()) {
+    return nullptr;
+  }
+  auto* index = this;
+  const auto* last = path.end() - 1;
+  for (const auto* token = path.begin(); token != last && index; ++token) {
+    index = index->GetSubIndex(*token);
+  }
+  return index ? index->Find(*last) : nullptr;
+}
+
+TokenIndex* TokenIndex::GetSubIndex(Token token) {
+  const auto i = m_lookup.find(token);
+  if (i == m_lookup.end()) {
+    return nullptr;
+  }
+  auto& subIndex = m_subIndexes[i->second];
+  if (!subIndex) {
+    const auto& field = m_fields[i->second];
+    if (!field.m_compressed) {
+      subIndex.reset(new TokenIndex{field.m_data, field.m_length});
+    } else {
+      subIndex.reset(new TokenIndex{nullptr, 0});
+      auto& inflated = subIndex->m_inflated;
+      if (!DecompressChunk(field.m_data, field.m_length, nullptr, inflated)) {
+        subIndex.reset();
+        return nullptr;
+      }
+      subIndex->Scan(inflated.data(), inflated.size());
+      subIndex->m_subIndexes.resize(subIndex->m_fields.size());
+    }
+  }
+  return subIndex.get();
+}
+
+} // namespace TokenStream
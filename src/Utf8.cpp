@@ -0,0 +1,162 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+
+#include "Utf8.h"
+#include "Simd.h"
+
+namespace TokenStream {
+namespace Utf8 {
+
+namespace {
+
+constexpr uint32_t Replacement = 0xfffd;
+constexpr bool IsUtf16 = sizeof(wchar_t) == 2;
+
+bool IsSurrogate(uint32_t c) {
+  return c >= 0xd800 && c <= 0xdfff;
+}
+
+// Reads the code point at str[i] and moves i past it
+uint32_t Next(const wchar_t* str, size_t count, size_t& i) {
+  uint32_t c = static_cast<uint32_t>(str[i++]);
+  if (IsUtf16) {
+    c &= 0xffffu;
+    if (c >= 0xd800 && c <= 0xdbff && i < count) {
+      const auto low = static_cast<uint32_t>(str[i]) & 0xffffu;
+      if (low >= 0xdc00 && low <= 0xdfff) {
+        i++;
+        return 0x10000 + ((c - 0xd800) << 10u) + (low - 0xdc00);
+      }
+    }
+  }
+  return IsSurrogate(c) || c > 0x10ffff ? Replacement : c;
+}
+
+size_t Size(uint32_t c) {
+  return c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+}
+
+bool IsContinuation(uint8_t byte) {
+  return (byte & 0xc0u) == 0x80;
+}
+
+} // namespace
+
+size_t EncodedSize(const wchar_t* str, size_t count) {
+  size_t size = 0;
+  for (size_t i = 0; i < count;) {
+    size += Size(Next(str, count, i));
+  }
+  return size;
+}
+
+void Encode(const wchar_t* str, size_t count, uint8_t* out) {
+  size_t i = 0;
+  while (i < count) {
+    const auto ascii = Simd::NarrowAscii(str + i, count - i, sizeof(wchar_t), out);
+    i += ascii;
+    out += ascii;
+    if (i == count) {
+      break;
+    }
+    const auto c = Next(str, count, i);
+    switch (Size(c)) {
+      case 1:
+        *out++ = static_cast<uint8_t>(c);
+        break;
+      case 2:
+        *out++ = static_cast<uint8_t>(0xc0u | c >> 6u);
+        *out++ = static_cast<uint8_t>(0x80u | (c & 0x3fu));
+        break;
+      case 3:
+        *out++ = static_cast<uint8_t>(0xe0u | c >> 12u);
+        *out++ = static_cast<uint8_t>(0x80u | (c >> 6u & 0x3fu));
+        *out++ = static_cast<uint8_t>(0x80u | (c & 0x3fu));
+        break;
+      default:
+        *out++ = static_cast<uint8_t>(0xf0u | c >> 18u);
+        *out++ = static_cast<uint8_t>(0x80u | (c >> 12u & 0x3fu));
+        *out++ = static_cast<uint8_t>(0x80u | (c >> 6u & 0x3fu));
+        *out++ = static_cast<uint8_t>(0x80u | (c & 0x3fu));
+        break;
+    }
+  }
+}
+
+void Decode(const uint8_t* in, size_t size, std::wstring& out) {
+  // Every character takes at least as many bytes as it needs wchar_t's
+  out.resize(size);
+  auto* data = &out[0];
+  size_t o = 0;
+  size_t i = 0;
+  while (i < size) {
+    const auto ascii = Simd::AsciiLength(in + i, size - i);
+    Simd::WidenBytes(in + i, ascii, sizeof(wchar_t), data + o);
+    i += ascii;
+    o += ascii;
+    if (i == size) {
+      break;
+    }
+
+    const auto lead = in[i];
+    size_t length = 0;
+    uint32_t c = 0;
+    // The second byte is limited to rule out overlong forms, surrogates and values above U+10FFFF
+    uint8_t low = 0x80;
+    uint8_t high = 0xbf;
+    if (lead >= 0xc2 && lead <= 0xdf) {
+      length = 2;
+      c = lead & 0x1fu;
+    } else if (lead >= 0xe0 && lead <= 0xef) {
+      length = 3;
+      c = lead & 0x0fu;
+      low = lead == 0xe0 ? 0xa0 : 0x80;
+      high = lead == 0xed ? 0x9f : 0xbf;
+    } else if (lead >= 0xf0 && lead <= 0xf4) {
+      length = 4;
+      c = lead & 0x07u;
+      low = lead == 0xf0 ? 0x90 : 0x80;
+      high = lead == 0xf4 ? 0x8f : 0xbf;
+    }
+    bool valid = length && length <= size - i && in[i + 1] >= low && in[i + 1] <= high;
+    for (size_t k = 1; valid && k < length; k++) {
+      valid = IsContinuation(in[i + k]);
+      c = c << 6u | (in[i + k] & 0x3fu);
+    }
+    if (!valid) {
+      c = Replacement;
+      length = 1;
+    }
+    i += length;
+    if (IsUtf16 && c >= 0x10000) {
+      data[o++] = static_cast<wchar_t>(0xd800 + ((c - 0x10000) >> 10u));
+      data[o++] = static_cast<wchar_t>(0xdc00 + ((c - 0x10000) & 0x3ffu));
+    } else {
+      data[o++] = static_cast<wchar_t>(c);
+    }
+  }
+  out.resize(o);
+}
+
+} // namespace Utf8
+} // namespace TokenStream
@@ -0,0 +1,49 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+
+#pragma once
+
+// Conversion between UTF-8 and wide strings, which hold UTF-16 where wchar_t has 16 bits (Windows)
+// and UTF-32 elsewhere. Unlike mbstowcs() and wcstombs() it does not depend on the locale, so it is
+// safe to use from several threads.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace TokenStream {
+namespace Utf8 {
+
+//! Number of UTF-8 bytes needed for the \p count characters at \p str
+size_t EncodedSize(const wchar_t* str, size_t count);
+
+//! @brief Writes the \p count characters at \p str to \p out as EncodedSize() bytes of UTF-8.
+//! Unpaired surrogates and values that are not Unicode become U+FFFD.
+void Encode(const wchar_t* str, size_t count, uint8_t* out);
+
+//! @brief Replaces \p out with the characters of \p size bytes of UTF-8.
+//! Every byte that is not part of a valid sequence becomes U+FFFD.
+void Decode(const uint8_t* in, size_t size, std::wstring& out);
+
+} // namespace Utf8
+} // namespace TokenStream
@@ -0,0 +1,217 @@
+/*
+* Copyright 2005-2022 Scott Maxwell
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM,OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+
+#include "Packed.h"
+#include <TokenStream/Compression.h>
+#include <TokenStream/Validate.h>
+#include <vector>
+
+namespace TokenStream {
+
+namespace {
+
+// One level of nesting, like Reader's SubStreamContext
+struct Frame {
+  size_t m_end;
+  Token m_containerToken;
+  uint64_t m_containerRemaining = 0;
+  explicit Frame(size_t end) : m_end(end) {}
+};
+
+bool IsPackedChunkValid(const uint8_t* data, size_t size, uint64_t maxContainerCount) {
+  if (!size) {
+    return false;
+  }
+  // The first byte is the format, followed by the elements
+  const auto format = data[0];
+  size_t count;
+  if (format == Packed::VarintFormat) {
+    if (!Packed::CountVarints(data + 1, size - 1, count)) {
+      return false;
+    }
+  } else if (format && format <= sizeof(uint64_t) && (size - 1) % format == 0) {
+    count = (size - 1) / format;
+  } else {
+    return false;
+  }
+  return count <= maxContainerCount;
+}
+
+// Moves past \p count elements of a list that are not objects
+bool SkipElements(const uint8_t* data, size_t& offset, size_t end, uint64_t count) {
+  for (; count; count--) {
+    uint64_t length;
+    // Lengths under 0x80 are a single byte, which is the common case for lists of numbers
+    if (offset < end && data[offset] < 0x80) {
+      length = data[offset++];
+    } else {
+      const auto used = Packed::DecodeVarint(data + offset, end - offset, length);
+      if (!used) {
+        return false;
+      }
+      offset += used;
+    }
+    if (length > end - offset) {
+      return false;
+    }
+    offset += static_cast<size_t>(length);
+  }
+  return true;
+}
+
+bool IsCompressedChunkValid(const uint8_t* data, size_t size) {
+  if (!size) {
+    return false;
+  }
+  // The codec id, then the decompressed size, which is never 0
+  uint64_t rawSize;
+  const auto used = Packed::DecodeVarint(data + 1, size - 1, rawSize);
+  if (!used || !rawSize) {
+    return false;
+  }
+  // Other codecs are only known to the Reader they are given to
+  return data[0] != Codec::Lz4Id || rawSize <= Lz4Codec::Get().GetMaxDecompressedSize(size - 1 - used);
+}
+
+} // namespace
+
+bool Validate(const uint8_t* data, size_t size, size_t maxDepth, uint64_t maxContainerCount,
+              const IsObjectFunction& isObject) {
+  size_t offset = 0;
+  Frame frame{size};
+  // The frames that enclose the current one. Nothing is allocated unless there are objects.
+  std::vector<Frame> parents;
+
+  // Reads one value in the length encoding and moves past it
+  const auto decode = [&](uint64_t& value) {
+    const auto used = Packed::DecodeVarint(data + offset, frame.m_end - offset, value);
+    offset += used;
+    return used != 0;
+  };
+  // Makes the next \p length bytes the current frame
+  const auto push = [&](uint64_t length) {
+    if (parents.size() >= maxDepth) {
+      return false;
+    }
+    parents.push_back(frame);
+    frame = Frame{offset + static_cast<size_t>(length)};
+    return true;
+  };
+  // Moves past the data of \p token, or into it if it is an object
+  const auto enter = [&](Token token, uint64_t length) {
+    if (length > frame.m_end - offset) {
+      return false;
+    }
+    if (isObject && isObject(token, parents.size())) {
+      return push(length);
+    }
+    offset += static_cast<size_t>(length);
+    return true;
+  };
+
+  for (;;) {
+    // Every element of a list has a length, but only the first one has a token
+    if (frame.m_containerRemaining) {
+      --frame.m_containerRemaining;
+      uint64_t length;
+      if (!decode(length) || !enter(frame.m_containerToken, length)) {
+        return false;
+      }
+      continue;
+    }
+    if (offset == frame.m_end) {
+      if (parents.empty()) {
+        return true;
+      }
+      frame = parents.back();
+      parents.pop_back();
+      continue;
+    }
+
+    // Most chunks have a 1-byte token and a 1-byte length, so test both high bits at once
+    if (frame.m_end - offset >= 2 && !((data[offset] | data[offset + 1]) & 0x80u)) {
+      const Token token{data[offset]};
+      const uint64_t length = data[offset + 1];
+      offset += 2;
+      if (!enter(token, length)) {
+        return false;
+      }
+      continue;
+    }
+
+    // A list starts with 0xf8 and the element count. A count of 0 marks a packed chunk and a
+    // count of 1 a compressed one.
+    const auto isList = data[offset] == 0xf8;
+    uint64_t count = 1;
+    if (isList) {
+      ++offset;
+      if (!decode(count)) {
+        return false;
+      }
+    }
+    uint64_t token;
+    uint64_t length;
+    if (!decode(token) || !decode(length) || length > frame.m_end - offset) {
+      return false;
+    }
+    if (isList && !count && length && data[offset] == Packed::ColumnarFormat) {
+      // Objects written a column at a time, which holds the row count and then a chunk per column
+      const auto end = offset + static_cast<size_t>(length);
+      ++offset;
+      uint64_t rowCount;
+      if (!decode(rowCount) || offset > end || !rowCount || rowCount > end - offset ||
+          rowCount > maxContainerCount || !push(end - offset)) {
+        return false;
+      }
+      continue;
+    }
+    if (isList && count < 2) {
+      const auto* chunk = data + offset;
+      const auto chunkSize = static_cast<size_t>(length);
+      const auto valid = count ? IsCompressedChunkValid(chunk, chunkSize)
+                               : IsPackedChunkValid(chunk, chunkSize, maxContainerCount);
+      if (!valid) {
+        return false;
+      }
+      offset += chunkSize;
+      continue;
+    }
+    if (count > maxContainerCount) {
+      return false;
+    }
+    if (!isObject || !isObject(Token{token}, parents.size())) {
+      offset += static_cast<size_t>(length);
+      if (!SkipElements(data, offset, frame.m_end, count - 1)) {
+        return false;
+      }
+      continue;
+    }
+    frame.m_containerToken = Token{token};
+    frame.m_containerRemaining = count - 1;
+    if (!push(length)) {
+      return false;
+    }
+  }
+}
+
+} // namespace TokenStream
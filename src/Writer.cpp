@@ -21,30 +21,28 @@
 */
 
 #include "EndianTypes.h"
+#include "Packed.h"
+#include "Utf8.h"
 #include <TokenStream/Writer.h>
 #include <algorithm>
-#if _WIN32
-#define NOMINMAX
-#include <Windows.h>
-#else
+#include <cstring>
 #include <cwchar>
-#endif
 
 #define VERIFIED_WRITE(byte_count, location, ...)                                                  \
   do {                                                                                             \
-    m_stream->write(reinterpret_cast<const char*>(location), byte_count);                          \
-    if (!m_stream) {                                                                               \
-      TS_ASSERT(m_stream, "Failed to write to TokenStream");                                       \
+    if (!WriteBytes(location, byte_count)) {                                                       \
+      TS_ASSERT(false, "Failed to write to TokenStream");                                          \
       m_badStream = true;                                                                          \
       return __VA_ARGS__;                                                                          \
     }                                                                                              \
   } while (false)
 #define ASSERT(test) TS_ASSERT(test, "Failed: " #test)
-#define PUTNUMBER(token, value, defaultValue, conversionType, extendedSign)                        \
+#define PUTNUMBER(token, value, defaultValue)                                                      \
   do {                                                                                             \
     if (!m_trimDefaults || (value) != (defaultValue)) {                                            \
-      conversionType conv = value;                                                                 \
-      PutData(token, &conv, sizeof conv, true, extendedSign);                                      \
+      using Tr = Packed::Traits<decltype(value)>;                                                  \
+      const auto wire = Tr::ToWire(value);                                                         \
+      PutScalar(token, wire, Packed::TrimmedWidth<decltype(value)>(wire));                         \
     } else {                                                                                       \
       m_nextToken = Token::InvalidTokenValue;                                                      \
     }                                                                                              \
@@ -53,52 +51,52 @@
 namespace TokenStream {
 
 Writer& Writer::Put(Token token, uint8_t value, uint8_t defaultValue) {
-  PUTNUMBER(token, value, defaultValue, uint8_t, false);
+  PUTNUMBER(token, value, defaultValue);
   return *this;
 }
 
 Writer& Writer::Put(Token token, int8_t value, int8_t defaultValue) {
-  PUTNUMBER(token, value, defaultValue, uint8_t, false);
+  PUTNUMBER(token, value, defaultValue);
   return *this;
 }
 
 Writer& Writer::Put(Token token, uint16_t value, uint16_t defaultValue) {
-  PUTNUMBER(token, value, defaultValue, uint16_be, false);
+  PUTNUMBER(token, value, defaultValue);
   return *this;
 }
 
 Writer& Writer::Put(Token token, int16_t value, int16_t defaultValue) {
-  PUTNUMBER(token, value, defaultValue, int16_be, true);
+  PUTNUMBER(token, value, defaultValue);
   return *this;
 }
 
 Writer& Writer::Put(Token token, uint32_t value, uint32_t defaultValue) {
-  PUTNUMBER(token, value, defaultValue, uint32_be, false);
+  PUTNUMBER(token, value, defaultValue);
   return *this;
 }
 
 Writer& Writer::Put(Token token, int32_t value, int32_t defaultValue) {
-  PUTNUMBER(token, value, defaultValue, int32_be, true);
+  PUTNUMBER(token, value, defaultValue);
   return *this;
 }
 
 Writer& Writer::Put(Token token, uint64_t value, uint64_t defaultValue) {
-  PUTNUMBER(token, value, defaultValue, uint64_be, false);
+  PUTNUMBER(token, value, defaultValue);
   return *this;
 }
 
 Writer& Writer::Put(Token token, int64_t value, int64_t defaultValue) {
-  PUTNUMBER(token, value, defaultValue, int64_be, true);
+  PUTNUMBER(token, value, defaultValue);
   return *this;
 }
 
 Writer& Writer::Put(Token token, float value, float defaultValue) {
-  PUTNUMBER(token, value, defaultValue, f32_le, false);
+  PUTNUMBER(token, value, defaultValue);
   return *this;
 }
 
 Writer& Writer::Put(Token token, double value, double defaultValue) {
-  PUTNUMBER(token, value, defaultValue, f64_le, false);
+  PUTNUMBER(token, value, defaultValue);
   return *this;
 }
 
@@ -117,7 +115,7 @@ Writer& Writer::Put(Token token, const char* str, const char* defaultValue) {
       PutData(token);
     } else {
       const auto len = strlen(str);
-      PutData(token, str, len);
+      PutPayload(token, str, len);
     }
   }
   m_nextToken = Token::InvalidTokenValue;
@@ -138,38 +136,17 @@ Writer& Writer::Put(Token token, const wchar_t* str, const wchar_t* defaultValue
       TrimDefault force{*this, false};
       PutData(token);
     } else {
-#if _WIN32
-      char fixedBuffer[0x400];
-      std::string dynamicBuffer;
-      auto* buffer = fixedBuffer;
-      const size_t len = WideCharToMultiByte(CP_UTF8, 0, str, -1, nullptr, 0, nullptr, nullptr);
-      if (len > sizeof fixedBuffer) {
-        dynamicBuffer.resize(len - 1);
-        buffer = const_cast<char*>(dynamicBuffer.data());
-      }
-      WideCharToMultiByte(CP_UTF8, 0, str, -1, buffer, static_cast<int>(len), nullptr, nullptr);
-      PutData(token, buffer, len - 1);
-#else
-      auto* oldLocaleStr = setlocale(LC_ALL, nullptr);
-      const std::string oldLocale = oldLocaleStr ? oldLocaleStr : "";
-      setlocale(LC_ALL, "en_US.utf8");
-      mbstate_t state;
-      auto s_str = &str;
-      size_t len = wcsrtombs(nullptr, s_str, 0, &state);
-      char fixedBuffer[0x400];
+      const auto count = wcslen(str);
+      const auto len = Utf8::EncodedSize(str, count);
+      uint8_t fixedBuffer[0x400];
       std::string dynamicBuffer;
       auto* buffer = fixedBuffer;
       if (len > sizeof fixedBuffer) {
         dynamicBuffer.resize(len);
-        buffer = const_cast<char*>(dynamicBuffer.data());
+        buffer = reinterpret_cast<uint8_t*>(&dynamicBuffer[0]);
       }
-      s_str = &str;
-      wcsrtombs(buffer, s_str, len, &state);
+      Utf8::Encode(str, count, buffer);
       PutData(token, buffer, len);
-      if (!oldLocale.empty()) {
-        setlocale(LC_ALL, oldLocale.c_str());
-      }
-#endif
     }
   }
   m_nextToken = Token::InvalidTokenValue;
@@ -177,10 +154,9 @@ Writer& Writer::Put(Token token, const wchar_t* str, const wchar_t* defaultValue
 }
 
 Writer& Writer::Put(Token token, const Serializable& object, bool keepStubOnEmpty) {
-  MemoryWriter subWriter{*this};
-  object.Write(subWriter);
-  TrimDefault handleStub{*this, m_trimDefaults && !keepStubOnEmpty};
-  Put(token, subWriter);
+  TS_STATS_MESSAGE(object, true, m_streamOffset + m_size + m_referencedBytes);
+  SubStream subStream{*this, token, keepStubOnEmpty};
+  object.Write(*this);
   return *this;
 }
 
@@ -188,16 +164,15 @@ Writer& Writer::Put(Token token,
                     const Serializable& object,
                     const TokenMap& tokenMap,
                     bool keepStubOnEmpty) {
-  MemoryWriter subWriter{*this};
-  object.Write(subWriter, tokenMap);
-  TrimDefault handleStub{*this, m_trimDefaults && !keepStubOnEmpty};
-  Put(token, subWriter);
+  TS_STATS_MESSAGE(object, true, m_streamOffset + m_size + m_referencedBytes);
+  SubStream subStream{*this, token, keepStubOnEmpty};
+  object.Write(*this, tokenMap);
   return *this;
 }
 
 Writer& Writer::Put(Token token, const void* block, uint64_t len) {
   ASSERT(block || !len);
-  PutData(token, block, len);
+  PutPayload(token, block, len);
   return *this;
 }
 
@@ -205,9 +180,9 @@ Writer& Writer::PutContainerElementCount(Token token, uint64_t size) {
   if (m_badStream || size < 2) {
     return *this;
   }
-  m_containerToken = token;
-  m_containerElementCount = size;
-  m_containerElementIndex = 0;
+  m_context.m_containerToken = token;
+  m_context.m_containerElementCount = size;
+  m_context.m_containerElementIndex = 0;
   auto len = static_cast<uint8_t>(0xf8);
 
   VERIFIED_WRITE(sizeof len, &len, *this);
@@ -215,64 +190,335 @@ Writer& Writer::PutContainerElementCount(Token token, uint64_t size) {
   return *this;
 }
 
-void Writer::WriteLengthEncoded(uint64_t value) {
+template<typename T>
+Writer& Writer::PutPackedItems(Token token, const T* items, size_t count) {
+  ASSERT(items || !count);
+  // Single items are smaller in the normal encoding. The packed header cannot be used for the
+  // elements of another container or for the first item when it has no token.
+  if (count < 2 || !token.IsValid() || m_context.m_containerToken.IsValid()) {
+    if (count) {
+      TrimDefault state(*this, false);
+      PutContainerElementCount(token, count);
+      for (size_t i = 0; i < count; i++) {
+        Put(token, items[i]);
+      }
+    } else if (!m_trimDefaults) {
+      PutData(token);
+    }
+    m_nextToken.Clear();
+    return *this;
+  }
+  m_nextToken.Clear();
   if (m_badStream) {
-    return;
+    return *this;
   }
-  if (value < 0x80) {
-    auto byteLen = static_cast<uint8_t>(value);
-    VERIFIED_WRITE(sizeof byteLen, &byteLen, );
-    return;
+
+  // Use whichever of a fixed width and the length encoding is smaller
+  const auto width = Packed::FixedWidth(items, count);
+  const auto fixedSize = width * count;
+  // Every element takes at least a byte in the length encoding, so it cannot beat a width of 1
+  const auto varintSize = width > 1 ? Packed::VarintSize(items, count, fixedSize) : fixedSize;
+  const bool varint = varintSize < fixedSize;
+  const auto dataSize = varint ? varintSize : fixedSize;
+
+  // A container element count of 0 marks a packed chunk
+  uint8_t header[2 + MaxHeaderSize + 1] = {0xf8, 0};
+  auto headerSize = 2 + EncodeLength(token, header + 2);
+  headerSize += EncodeLength(dataSize + 1, header + headerSize);
+  header[headerSize++] = static_cast<uint8_t>(varint ? Packed::VarintFormat : width);
+  VERIFIED_WRITE(headerSize, header, *this);
+
+  if (m_countedSizes) {
+    m_size += dataSize;
+    return *this;
   }
-  if (value < 0x7800) {
-    uint16_be wordLen = static_cast<uint16_t>(value) | 0x8000u;
-    VERIFIED_WRITE(sizeof wordLen, &wordLen, );
-    return;
+  if (!IsStreaming()) {
+    auto* out = Reserve(dataSize);
+    if (varint) {
+      Packed::EncodeVarints(items, count, out);
+    } else {
+      Packed::EncodeFixed(items, count, width, out);
+    }
+    return *this;
   }
+  // Encode straight to the stream a block at a time
+  uint8_t buffer[0x1000];
+  constexpr size_t MaxElementSize = 1 + sizeof(uint64_t);
+  constexpr size_t BlockCount = sizeof buffer / MaxElementSize;
+  for (size_t i = 0; i < count; i += BlockCount) {
+    const auto blockCount = std::min(BlockCount, count - i);
+    size_t blockSize;
+    if (varint) {
+      blockSize = Packed::VarintSize(items + i, blockCount);
+      Packed::EncodeVarints(items + i, blockCount, buffer);
+    } else {
+      blockSize = blockCount * width;
+      Packed::EncodeFixed(items + i, blockCount, width, buffer);
+    }
+    VERIFIED_WRITE(blockSize, buffer, *this);
+  }
+  return *this;
+}
 
-  uint64_be beValue = value;
-  auto block = reinterpret_cast<const uint8_t*>(&beValue);
-  uint8_t len = sizeof beValue;
-  while (len > 1 && !*block) {
-    len--;
-    block++;
+Writer& Writer::PutContainerBatches(Token token, uint64_t count, const std::vector<const Writer*>& batches) {
+  m_nextToken.Clear();
+  for (const auto* batch : batches) {
+    if (batch->m_badStream) {
+      m_badStream = true;
+    }
   }
-  uint8_t markedLen = len + 0xf7;
-  VERIFIED_WRITE(sizeof markedLen, &markedLen, );
-  VERIFIED_WRITE(len, block, );
+  PutContainerElementCount(token, count);
+  WriteLengthEncoded(token);
+  for (const auto* batch : batches) {
+    if (m_badStream) {
+      break;
+    }
+    if (batch->m_size) {
+      TS_STATS_ADD(nestingCopyBytes, batch->m_size);
+      VERIFIED_WRITE(batch->m_size, batch->m_data, *this);
+    }
+  }
+  m_context.m_containerToken = Token::InvalidTokenValue;
+  m_context.m_containerElementIndex = m_context.m_containerElementCount;
+  return *this;
 }
 
-void Writer::PutDataHeader(Token token, uint64_t len) {
-  m_nextToken = Token::InvalidTokenValue;
-  if (len || !m_trimDefaults) {
-    // If we are writing elements of a container
-    if (m_containerToken != Token::InvalidTokenValue) {
-      // Make sure the token matches
-      if (token != m_containerToken) {
-        m_badStream = true;
-        return;
-      }
-      // Write the token for the first item only
-      if (m_containerElementIndex == 0) {
-        WriteLengthEncoded(token);
-      }
-      // Clear the token for the last item
-      if (++m_containerElementIndex == m_containerElementCount) {
-        m_containerToken = Token::InvalidTokenValue;
-      }
+Writer& Writer::PutCompressedChunk(Token token, const Writer& plain, const Codec& codec) {
+  m_nextToken.Clear();
+  if (m_badStream || plain.m_badStream) {
+    m_badStream = true;
+    return *this;
+  }
+  if (!plain.m_size) {
+    return *this;
+  }
+  // Only the data of the chunk is compressed. Anything but a single token/length/data chunk is written as it is.
+  uint64_t value;
+  const auto tokenSize = Packed::DecodeVarint(plain.m_data, plain.m_size, value);
+  const auto lengthSize = tokenSize ? Packed::DecodeVarint(plain.m_data + tokenSize, plain.m_size - tokenSize, value) : 0;
+  const auto plainHeaderSize = tokenSize + lengthSize;
+  if (!lengthSize || value != plain.m_size - plainHeaderSize) {
+    TS_ASSERT(false, "PutCompressed() expects a single chunk");
+    VERIFIED_WRITE(plain.m_size, plain.m_data, *this);
+    return *this;
+  }
+  const auto* data = plain.m_data + plainHeaderSize;
+  const auto size = plain.m_size - plainHeaderSize;
+
+  // The data starts with the codec id and the decompressed size
+  uint8_t prefix[1 + MaxHeaderSize / 2] = {codec.GetId()};
+  const auto prefixSize = 1 + EncodeLength(size, prefix + 1);
+  Binary compressed(codec.GetMaxCompressedSize(size));
+  const auto compressedSize = size ? codec.Compress(data, size, compressed.data(), compressed.size()) : 0;
+
+  // A container element count of 1 marks a compressed chunk
+  uint8_t header[2 + MaxHeaderSize] = {0xf8, 1};
+  auto headerSize = 2 + EncodeLength(token, header + 2);
+  headerSize += EncodeLength(prefixSize + compressedSize, header + headerSize);
+  if (!compressedSize || headerSize + prefixSize + compressedSize >= plain.m_size) {
+    VERIFIED_WRITE(plain.m_size, plain.m_data, *this);
+    return *this;
+  }
+  VERIFIED_WRITE(headerSize, header, *this);
+  VERIFIED_WRITE(prefixSize, prefix, *this);
+  VERIFIED_WRITE(compressedSize, compressed.data(), *this);
+  return *this;
+}
+
+Writer& Writer::PutColumns(Token token, const ConstColumnRows& rows, const TokenMap& tokenMap) {
+  m_nextToken.Clear();
+  if (m_badStream) {
+    return *this;
+  }
+  // A packed chunk of objects holds the format, the row count and then a chunk per column
+  const uint8_t marker[] = {0xf8, 0};
+  VERIFIED_WRITE(sizeof marker, marker, *this);
+  SubStream batch{*this, token};
+  const auto format = Packed::ColumnarFormat;
+  VERIFIED_WRITE(sizeof format, &format, *this);
+  WriteLengthEncoded(rows.size());
+
+  std::vector<const TokenMap::value_type*> rowMembers;
+  for (const auto& kv : tokenMap) {
+    if (!kv.second.PutColumn || !kv.second.PutColumn(*this, kv.first, rows)) {
+      rowMembers.push_back(&kv);
     }
-    // If we have an invalid token and this is not the first item, we have a problem
-    else if (token == Token::InvalidTokenValue && m_stream->tellp()) {
+  }
+  if (rowMembers.empty()) {
+    return *this;
+  }
+  // Every row keeps its element, even if it is empty, so that a row takes at least a byte
+  PutContainerElementCount(Serializable::ColumnRowsToken, rows.size());
+  for (size_t row = 0; row < rows.size(); row++) {
+    SubStream element{*this, Serializable::ColumnRowsToken, true};
+    for (const auto* kv : rowMembers) {
+      PutToken(kv->first);
+      kv->second.Put(*this, rows[row]);
+    }
+  }
+  return *this;
+}
+
+Writer& Writer::PutPacked(Token token, const int8_t* items, size_t count) {
+  return PutPackedItems(token, items, count);
+}
+
+Writer& Writer::PutPacked(Token token, const int16_t* items, size_t count) {
+  return PutPackedItems(token, items, count);
+}
+
+Writer& Writer::PutPacked(Token token, const uint16_t* items, size_t count) {
+  return PutPackedItems(token, items, count);
+}
+
+Writer& Writer::PutPacked(Token token, const int32_t* items, size_t count) {
+  return PutPackedItems(token, items, count);
+}
+
+Writer& Writer::PutPacked(Token token, const uint32_t* items, size_t count) {
+  return PutPackedItems(token, items, count);
+}
+
+Writer& Writer::PutPacked(Token token, const int64_t* items, size_t count) {
+  return PutPackedItems(token, items, count);
+}
+
+Writer& Writer::PutPacked(Token token, const uint64_t* items, size_t count) {
+  return PutPackedItems(token, items, count);
+}
+
+Writer& Writer::PutPacked(Token token, const float* items, size_t count) {
+  return PutPackedItems(token, items, count);
+}
+
+Writer& Writer::PutPacked(Token token, const double* items, size_t count) {
+  return PutPackedItems(token, items, count);
+}
+
+size_t Writer::EncodeLongLength(uint64_t value, uint8_t* out) {
+  // Big-endian with the leading zeros removed, preceded by the byte count + 0xf7
+  uint8_t len = 1;
+  while (len < sizeof value && value >> (len * 8u)) {
+    len++;
+  }
+  out[0] = len + 0xf7;
+  for (uint8_t i = 0; i < len; i++) {
+    out[len - i] = static_cast<uint8_t>(value >> (i * 8u));
+  }
+  return len + 1u;
+}
+
+size_t Writer::TokenHeaderSize(Token token) const {
+  uint8_t encoded[MaxHeaderSize / 2];
+  if (m_context.m_containerToken != Token::InvalidTokenValue) {
+    return m_context.m_containerElementIndex == 0 ? EncodeLength(token, encoded) : 0;
+  }
+  return token != Token::InvalidTokenValue ? EncodeLength(token, encoded) : 0;
+}
+
+size_t Writer::EncodeDataHeader(Token token, uint64_t len, size_t position, uint8_t* header) {
+  m_nextToken = Token::InvalidTokenValue;
+  if (m_badStream || (!len && m_trimDefaults)) {
+    return 0;
+  }
+  size_t size = 0;
+  // If we are writing elements of a container
+  if (m_context.m_containerToken != Token::InvalidTokenValue) {
+    // Make sure the token matches
+    if (token != m_context.m_containerToken) {
       m_badStream = true;
-      return;
+      return 0;
+    }
+    // Write the token for the first item only
+    if (m_context.m_containerElementIndex == 0) {
+      size += EncodeLength(token, header);
+    }
+    // Clear the token for the last item
+    if (++m_context.m_containerElementIndex == m_context.m_containerElementCount) {
+      m_context.m_containerToken = Token::InvalidTokenValue;
     }
-    // Write the token if valid.
-    // This check should only fail if we are writing the first item in the stream with no token.
-    else if (token != Token::InvalidTokenValue) {
-      WriteLengthEncoded(token);
+  }
+  // If we have an invalid token and this is not the first item, we have a problem
+  else if (token == Token::InvalidTokenValue && !IsAtStart(position)) {
+    m_badStream = true;
+    return 0;
+  }
+  // Write the token if valid.
+  // This check should only fail if we are writing the first item in the stream with no token.
+  else if (token != Token::InvalidTokenValue) {
+    size += EncodeLength(token, header);
+  }
+  TS_STATS_ADD(chunksWritten, 1);
+  return size + EncodeLength(len, header + size);
+}
+
+bool Writer::WriteToStream(const void* data, size_t len) {
+  m_stream->write(static_cast<const char*>(data), static_cast<std::streamsize>(len));
+  m_streamOffset += len;
+  return !m_stream->fail();
+}
+
+void Writer::Grow(size_t len) {
+  const auto capacity = std::max({m_capacity * 2, m_size + len, static_cast<size_t>(0x100)});
+  TS_STATS_ADD(allocations, 1);
+  TS_STATS_ADD(allocatedBytes, capacity);
+  if (m_arena) {
+    auto* data = static_cast<uint8_t*>(m_arena->Allocate(capacity, 1));
+    if (m_size) {
+      memcpy(data, m_data, m_size);
+    }
+    m_data = data;
+    m_capacity = capacity;
+    return;
+  }
+  // Move out of a caller-supplied buffer the first time it fills up
+  if (m_data && m_data != m_buffer.data()) {
+    Binary buffer(capacity);
+    memcpy(buffer.data(), m_data, m_size);
+    m_buffer.swap(buffer);
+  } else {
+    m_buffer.resize(capacity);
+  }
+  m_data = m_buffer.data();
+  m_capacity = m_buffer.size();
+}
+
+void Writer::Flush() {
+  if (!m_stream) {
+    return;
+  }
+  if (m_size && !m_badStream) {
+    if (!WriteToStream(m_data, m_size)) {
+      TS_ASSERT(false, "Failed to write to TokenStream");
+      m_badStream = true;
     }
-    WriteLengthEncoded(len);
   }
+  m_size = 0;
+}
+
+void Writer::Rebind(std::ostream& stream, bool trimDefaults) {
+  TS_ASSERT(m_stream && !m_depth, "Only a stream Writer outside of any SubStream can be rebound");
+  Reset();
+  ResetSettings(trimDefaults);
+  m_stream = &stream;
+  m_knownSizes = nullptr;
+  m_nextKnownSize = 0;
+  m_streamOffset = 0;
+}
+
+Binary Writer::ReleaseBuffer() {
+  TS_ASSERT(!m_depth, "Cannot release a Writer inside a SubStream");
+  Binary result;
+  if (m_data == m_buffer.data()) {
+    m_buffer.resize(m_size);
+    result.swap(m_buffer);
+  } else {
+    result.assign(m_data, m_data + m_size);
+  }
+  m_data = nullptr;
+  m_capacity = 0;
+  Reset();
+  return result;
 }
 
 Writer& Writer::Put(Token token, std::istream& stream) {
@@ -283,6 +529,21 @@ Writer& Writer::Put(Token token, std::istream& stream) {
   auto len = stream.tellg();
   stream.seekg(0, std::ios::beg);
   PutDataHeader(token, len);
+  if (len && !m_badStream && !IsStreaming()) {
+    // Read straight into the output
+    const auto size = static_cast<size_t>(len);
+    if (m_countedSizes) {
+      m_size += size;
+      return *this;
+    }
+    auto* out = Reserve(size);
+    stream.read(reinterpret_cast<char*>(out), static_cast<std::streamsize>(size));
+    if (static_cast<size_t>(stream.gcount()) != size) {
+      TS_ASSERT(false, "Failed to read ostream for copy to TokenStream");
+      m_badStream = true;
+    }
+    return *this;
+  }
   if (len) {
     char buffer[0x1000];
     while (len) {
@@ -294,45 +555,184 @@ Writer& Writer::Put(Token token, std::istream& stream) {
         m_badStream = true;
         return *this;
       }
-      m_stream->write(buffer, read);
-      if (!m_stream) {
-        TS_ASSERT(m_stream, "Failed to write to TokenStream");
-        m_badStream = true;
-        return *this;
-      }
+      VERIFIED_WRITE(static_cast<size_t>(read), buffer, *this);
       len -= read;
     }
   }
   return *this;
 }
 
-void Writer::PutData(
-    Token token, const void* data, uint64_t len, bool removeLeadingZeros, bool handleExtendedSign) {
+void Writer::PutReference(Token token, const void* data, uint64_t len) {
+  PutDataHeader(token, len);
   if (m_badStream) {
     return;
   }
-  auto block = static_cast<const uint8_t*>(data);
-  if (len && removeLeadingZeros) {
-    if (handleExtendedSign && *block == 0xff) {
-      while (len > 1 && *block == 0xff && (block[1] & 0x80u) == 0x80u) {
-        len--;
-        block++;
-      }
+  m_references->push_back(Reference{m_size, static_cast<const uint8_t*>(data), static_cast<size_t>(len)});
+  m_referencedBytes += len;
+  TS_STATS_ADD(bytesWritten, len);
+}
+
+std::vector<BlockView> GatherWriter::GetSegments() const {
+  std::vector<BlockView> segments;
+  segments.reserve(m_payloads.size() * 2 + 1);
+  size_t position = 0;
+  for (const auto& payload : m_payloads) {
+    if (payload.m_position > position) {
+      segments.emplace_back(m_data + position, payload.m_position - position);
+    }
+    segments.emplace_back(payload.m_data, payload.m_size);
+    position = payload.m_position;
+  }
+  if (m_size > position) {
+    segments.emplace_back(m_data + position, m_size - position);
+  }
+  return segments;
+}
+
+void Writer::PutData(Token token, const void* data, uint64_t len) {
+  if (m_badStream) {
+    return;
+  }
+  PutDataHeader(token, len);
+  if (len) {
+    ASSERT(data);
+    VERIFIED_WRITE(len, data, );
+  }
+}
+
+void Writer::PutScalar(Token token, uint64_t wire, size_t width) {
+  if (m_badStream) {
+    return;
+  }
+  uint8_t chunk[MaxHeaderSize + sizeof(uint64_t)];
+  const auto headerSize = EncodeDataHeader(token, width, m_knownSizes ? m_streamOffset : m_size, chunk);
+  if (!headerSize) {
+    return;
+  }
+  // Shift the bytes to keep to the top, so that all eight can be stored big-endian in one go
+  const uint64_be value = wire << (64 - width * 8);
+  memcpy(chunk + headerSize, &value, sizeof value);
+  VERIFIED_WRITE(headerSize + width, chunk, );
+}
+
+Writer::SubStream::SubStream(Writer& writer, Token token, bool keepStubOnEmpty) :
+    m_writer{writer},
+    m_token{token},
+    m_keepStubOnEmpty{keepStubOnEmpty},
+    m_headerStart{writer.m_size},
+    m_reservedHeaderSize{0},
+    m_oldContext{writer.m_context} {
+  ++writer.m_depth;
+  TS_STATS_ADD(subStreams, 1);
+  if (writer.m_knownSizes) {
+    // The length is known, so the header can go out first and the data can follow it straight to the stream
+    uint64_t len = 0;
+    m_sizeIndex = writer.m_nextKnownSize++;
+    if (m_sizeIndex < writer.m_knownSizes->size()) {
+      len = (*writer.m_knownSizes)[m_sizeIndex];
     } else {
-      while (len > 1 && !*block) {
-        len--;
-        block++;
+      TS_ASSERT(false, "More SubStreams were written than were counted");
+      writer.m_badStream = true;
+    }
+    uint8_t header[MaxHeaderSize];
+    size_t headerSize;
+    {
+      TrimDefault handleStub{writer, writer.m_trimDefaults && !m_keepStubOnEmpty};
+      headerSize = writer.EncodeDataHeader(m_token, len, writer.m_streamOffset, header);
+    }
+    // Writing the header updates the container state of the enclosing stream
+    m_oldContext = writer.m_context;
+    TS_STATS_ADD(bytesWritten, headerSize);
+    if (headerSize && !writer.WriteToStream(header, headerSize)) {
+      TS_ASSERT(false, "Failed to write to TokenStream");
+      writer.m_badStream = true;
+    }
+    writer.m_context = SubStreamContext{writer.m_streamOffset};
+    writer.m_nextToken.Clear();
+    return;
+  }
+  if (writer.m_countedSizes) {
+    m_sizeIndex = writer.m_countedSizes->size();
+    writer.m_countedSizes->push_back(0);
+  }
+  if (writer.m_references) {
+    m_firstReference = writer.m_references->size();
+  }
+  // Leave room for the most likely header. It is patched in when the SubStream is destroyed.
+  m_reservedHeaderSize = writer.TokenHeaderSize(token) + 1;
+  if (!writer.m_countedSizes && m_reservedHeaderSize > writer.m_capacity - writer.m_size) {
+    writer.Grow(m_reservedHeaderSize);
+  }
+  writer.m_size += m_reservedHeaderSize;
+  writer.m_context = SubStreamContext{writer.m_size, writer.m_referencedBytes};
+  writer.m_nextToken.Clear();
+}
+
+Writer::SubStream::~SubStream() {
+  auto& writer = m_writer;
+  if (writer.m_knownSizes) {
+    const auto len = writer.m_streamOffset - writer.m_context.m_start;
+    writer.m_context = m_oldContext;
+    --writer.m_depth;
+    if (!writer.m_badStream && m_sizeIndex < writer.m_knownSizes->size() &&
+        len != (*writer.m_knownSizes)[m_sizeIndex]) {
+      TS_ASSERT(false, "Object wrote a different size than was counted");
+      writer.m_badStream = true;
+    }
+    return;
+  }
+
+  const auto dataStart = writer.m_context.m_start;
+  const auto referenced = writer.m_referencedBytes - writer.m_context.m_referenced;
+  // Referenced payloads are part of the data but not of the output region
+  const auto inlineLen = writer.m_size - dataStart;
+  const auto len = inlineLen + static_cast<size_t>(referenced);
+  writer.m_context = m_oldContext;
+
+  --writer.m_depth;
+
+  uint8_t header[MaxHeaderSize];
+  size_t headerSize;
+  {
+    TrimDefault handleStub{writer, writer.m_trimDefaults && !m_keepStubOnEmpty};
+    headerSize = writer.EncodeDataHeader(m_token, len, m_headerStart, header);
+  }
+
+  if (writer.m_countedSizes) {
+    (*writer.m_countedSizes)[m_sizeIndex] = len;
+    writer.m_size = headerSize ? m_headerStart + headerSize + len : m_headerStart;
+    return;
+  }
+
+  if (!headerSize) {
+    // Nothing to write or a bad stream, so throw away anything that was written
+    writer.m_size = m_headerStart;
+    if (writer.m_references) {
+      writer.m_references->resize(m_firstReference);
+      writer.m_referencedBytes -= referenced;
+    }
+  } else {
+    // Only move the data if the header did not turn out to be the size we reserved
+    if (headerSize != m_reservedHeaderSize) {
+      const auto newDataStart = m_headerStart + headerSize;
+      if (newDataStart + inlineLen > writer.m_capacity) {
+        writer.Grow(newDataStart + inlineLen - writer.m_size);
       }
-      if (handleExtendedSign && len && block != data && (*block & 0x80u) == 0x80u) {
-        block--;
-        len++;
+      memmove(writer.m_data + newDataStart, writer.m_data + dataStart, inlineLen);
+      TS_STATS_ADD(nestingCopyBytes, inlineLen);
+      writer.m_size = newDataStart + inlineLen;
+      if (writer.m_references) {
+        for (auto i = m_firstReference; i < writer.m_references->size(); i++) {
+          (*writer.m_references)[i].m_position = (*writer.m_references)[i].m_position - dataStart + newDataStart;
+        }
       }
     }
+    memcpy(writer.m_data + m_headerStart, header, headerSize);
+    TS_STATS_ADD(bytesWritten, headerSize);
   }
-  PutDataHeader(token, len);
-  if (len) {
-    ASSERT(block);
-    VERIFIED_WRITE(len, block, );
+
+  if (!writer.m_depth) {
+    writer.Flush();
   }
 }
 
@@ -1,8 +1,22 @@
 ﻿#include "PackageData.h"
 #include <TokenStream/Generic.h>
+#include <TokenStream/Log.h>
+#include <TokenStream/MappedFile.h>
+#include <TokenStream/OutputQueue.h>
+#include <TokenStream/Pool.h>
+#include <TokenStream/PushParser.h>
+#include <TokenStream/TokenIndex.h>
+#include <TokenStream/Validate.h>
 #include <TokenStream/Reader.h>
+#include <TokenStream/StaticCodec.h>
+#include <TokenStream/Stats.h>
 #include <TokenStream/Writer.h>
 #include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <stdexcept>
+#include <thread>
 
 using namespace InstallationExample;
 
@@ -297,3 +311,2045 @@ TEST(TokenStreamTest, GenericSerializationTest) {
 
   EXPECT_EQ(writer.GetLength(), 42u);
 }
+
+namespace {
+
+struct Blob : TokenStream::Serializable {
+  std::string data;
+  uint32_t flags = 0;
+
+  enum class Token { data, flags };
+
+  TOKEN_MAP(ENUMERATED_TOKEN(data), ENUMERATED_TOKEN(flags))
+};
+
+struct Holder : TokenStream::Serializable {
+  Blob blob;
+  std::vector<Blob> blobs;
+  std::pair<std::string, Blob> pair;
+
+  enum class Token { blob, blobs, pair };
+
+  TOKEN_MAP(ENUMERATED_TOKEN(blob), ENUMERATED_TOKEN(blobs), ENUMERATED_TOKEN(pair))
+};
+
+struct ArenaRecord : TokenStream::Serializable {
+  TokenStream::ArenaString name;
+  TokenStream::ArenaString label = "none";
+  TokenStream::ArenaVector<TokenStream::ArenaString> tags;
+  TokenStream::ArenaMap<TokenStream::ArenaString, uint32_t> counts;
+
+  enum class Token { name, label, tags, counts };
+
+  TOKEN_MAP(ENUMERATED_TOKEN(name),
+            ENUMERATED_TOKEN(label, "none"),
+            ENUMERATED_TOKEN(tags),
+            ENUMERATED_TOKEN(counts))
+};
+
+struct Samples : TokenStream::Serializable {
+  std::vector<int32_t> values;
+  std::vector<uint64_t> ids;
+  std::vector<double> readings;
+  std::vector<uint8_t> bytes;
+  std::vector<int16_t> none;
+  std::string name;
+
+  enum class Token { values, ids, readings, bytes, none, name };
+
+  TOKEN_MAP(ENUMERATED_TOKEN(values),
+            ENUMERATED_TOKEN(ids),
+            ENUMERATED_TOKEN(readings),
+            ENUMERATED_TOKEN(bytes),
+            ENUMERATED_TOKEN(none),
+            ENUMERATED_TOKEN(name))
+};
+
+struct SampleSet : TokenStream::Serializable {
+  Samples first;
+  std::vector<Samples> more;
+
+  enum class Token { first, more };
+
+  TOKEN_MAP(ENUMERATED_TOKEN(first), ENUMERATED_TOKEN(more))
+};
+
+struct Sparse : TokenStream::Serializable {
+  uint32_t a = 0;
+  std::string b;
+  uint64_t c = 0;
+
+  // Listed out of order, with a duplicate that must be ignored
+  TOKEN_MAP(MAP_TOKEN(0x1000, c), MAP_TOKEN(7, a), MAP_TOKEN(0x20, b), MAP_TOKEN(7, c))
+};
+
+struct SparseChild : Sparse {
+  uint32_t d = 0;
+
+  DERIVED_TOKEN_MAP(Sparse, MAP_TOKEN(8, d))
+};
+
+// Writes a packed vector and reads it back
+template<typename T>
+std::vector<T> PackedRoundTrip(const std::vector<T>& items) {
+  TokenStream::MemoryWriter writer;
+  writer.PutPacked(1, items);
+  std::vector<T> items2;
+  TokenStream::Reader reader{writer.data(), writer.size()};
+  if (reader.GetToken() == 1) {
+    reader >> items2;
+  }
+  EXPECT_TRUE(reader.VerifyEOS());
+  return items2;
+}
+
+template<typename T>
+void ExpectPackedRoundTrips() {
+  uint64_t seed = 0x9e3779b97f4a7c15ull;
+  // Cover every width and enough elements to reach both the vector loops and the tails
+  for (size_t bits = 1; bits <= sizeof(T) * 8; bits++) {
+    for (const size_t count : {2u, 3u, 7u, 8u, 9u, 15u, 16u, 17u, 33u, 100u}) {
+      std::vector<T> items;
+      for (size_t i = 0; i < count; i++) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        items.push_back(static_cast<T>(seed >> (64 - bits)));
+      }
+      EXPECT_EQ(items, PackedRoundTrip(items)) << bits << " bits, " << count << " items";
+    }
+  }
+}
+
+// Writes a Blob the way nested objects used to be written, through a temporary MemoryWriter
+void PutBlobThroughMemoryWriter(TokenStream::Writer& writer,
+                                TokenStream::Token token,
+                                const Blob& blob,
+                                bool keepStubOnEmpty = false) {
+  TokenStream::MemoryWriter subWriter{writer};
+  blob.Write(subWriter);
+  TokenStream::Writer::TrimDefault handleStub{writer, !keepStubOnEmpty};
+  writer.Put(token, subWriter);
+}
+
+} // namespace
+
+TEST(TokenStreamTest, NestedWriteMatchesMemoryWriterOutput) {
+  // Cover 1-byte, 2-byte and multi-byte length encodings for the nested data
+  for (const size_t size : {0u, 1u, 0x7du, 0x7eu, 0x7fu, 0x80u, 0x77fdu, 0x7800u, 0x12345u}) {
+    Holder holder;
+    holder.blob.data.assign(size, 'x');
+    holder.blob.flags = 7;
+    holder.blobs.resize(3);
+    holder.blobs[1].data.assign(size, 'y');
+    holder.blobs[2].flags = 0x1234;
+
+    TokenStream::MemoryWriter writer;
+    holder.Write(writer);
+
+    TokenStream::MemoryWriter expected;
+    PutBlobThroughMemoryWriter(expected, Holder::Token::blob, holder.blob);
+    expected.PutContainerElementCount(Holder::Token::blobs, holder.blobs.size());
+    for (const auto& blob : holder.blobs) {
+      PutBlobThroughMemoryWriter(expected, Holder::Token::blobs, blob, true);
+    }
+
+    EXPECT_EQ(expected.GetReader().str(), writer.GetReader().str()) << "size " << size;
+
+    Holder holder2;
+    auto memoryReader{writer.GetReader()};
+    TokenStream::Reader reader{memoryReader};
+    holder2.Read(reader);
+    EXPECT_EQ(holder.blob.data, holder2.blob.data);
+    EXPECT_EQ(holder.blob.flags, holder2.blob.flags);
+    ASSERT_EQ(3u, holder2.blobs.size());
+    EXPECT_EQ(holder.blobs[1].data, holder2.blobs[1].data);
+    EXPECT_EQ(holder.blobs[2].flags, holder2.blobs[2].flags);
+    EXPECT_TRUE(reader.VerifyEOS());
+  }
+}
+
+TEST(TokenStreamTest, NestedWriteToStream) {
+  Holder holder;
+  holder.blob.data.assign(0x200, 'z');
+  holder.pair.first = "first";
+  holder.pair.second.data = "second";
+
+  std::stringstream stream;
+  TokenStream::Writer writer{stream};
+  holder.Write(writer);
+  EXPECT_EQ(stream.str().length(), writer.GetLength());
+
+  TokenStream::MemoryWriter memoryWriter;
+  holder.Write(memoryWriter);
+  EXPECT_EQ(memoryWriter.GetReader().str(), stream.str());
+
+  Holder holder2;
+  TokenStream::Reader reader{stream};
+  holder2.Read(reader);
+  EXPECT_EQ(holder.blob.data, holder2.blob.data);
+  EXPECT_EQ(holder.pair.first, holder2.pair.first);
+  EXPECT_EQ(holder.pair.second.data, holder2.pair.second.data);
+}
+
+TEST(TokenStreamTest, MemoryReaderTest) {
+  Holder holder;
+  holder.blob.data.assign(0x90, 'x');
+  holder.blob.flags = 0xfedcba98;
+  holder.blobs.resize(3);
+  holder.blobs[0].data = "first";
+  holder.blobs[2].flags = 0x1234;
+  holder.pair.first = "key";
+  holder.pair.second.data = "value";
+
+  TokenStream::MemoryWriter writer;
+  holder.Write(writer);
+  const auto str = writer.GetReader().str();
+  const TokenStream::Binary data{str.begin(), str.end()};
+
+  Holder holder2;
+  TokenStream::Reader reader{data};
+  holder2.Read(reader);
+  EXPECT_TRUE(reader.VerifyEOS());
+
+  EXPECT_EQ(holder.blob.data, holder2.blob.data);
+  EXPECT_EQ(holder.blob.flags, holder2.blob.flags);
+  ASSERT_EQ(3u, holder2.blobs.size());
+  EXPECT_EQ(holder.blobs[0].data, holder2.blobs[0].data);
+  EXPECT_EQ(holder.blobs[2].flags, holder2.blobs[2].flags);
+  EXPECT_EQ(holder.pair.first, holder2.pair.first);
+  EXPECT_EQ(holder.pair.second.data, holder2.pair.second.data);
+
+  // Skipping must land on the same tokens as reading
+  TokenStream::Reader skipper{reinterpret_cast<const uint8_t*>(str.data()), str.size()};
+  skipper.GetToken();
+  {
+    TokenStream::Reader::SubStream sub{skipper};
+  }
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(static_cast<uint64_t>(Holder::Token::blobs), skipper.GetToken());
+    skipper.Skip();
+  }
+  EXPECT_EQ(static_cast<uint64_t>(Holder::Token::pair), skipper.GetToken());
+  skipper.Skip();
+  EXPECT_TRUE(skipper.VerifyEOS());
+}
+
+TEST(TokenStreamTest, ViewTest) {
+  const TokenStream::Binary block{1, 2, 3, 4, 5};
+  TokenStream::MemoryWriter writer;
+  writer.Put(0, "hello").Put(1, block).Put(2, "").Put(3, TokenStream::StringView{"view"});
+  const auto str = writer.GetReader().str();
+  const TokenStream::Binary data{str.begin(), str.end()};
+
+  // Memory-backed views refer directly to the source buffer
+  TokenStream::Reader reader{data};
+  EXPECT_EQ(0u, reader.GetToken());
+  const auto text = reader.GetStringView();
+  EXPECT_EQ(TokenStream::StringView{"hello"}, text);
+  EXPECT_GE(reinterpret_cast<const uint8_t*>(text.data()), data.data());
+  EXPECT_LT(reinterpret_cast<const uint8_t*>(text.data()), data.data() + data.size());
+  EXPECT_EQ(1u, reader.GetToken());
+  const auto view = reader.GetBlockView();
+  EXPECT_EQ(TokenStream::BlockView{block}, view);
+  EXPECT_EQ(3u, reader.GetToken());
+  EXPECT_EQ(TokenStream::StringView{"view"}, reader.GetStringView());
+  EXPECT_TRUE(reader.VerifyEOS());
+
+  // Stream-backed views go through a scratch buffer
+  auto stream{writer.GetReader()};
+  TokenStream::Reader streamReader{stream};
+  EXPECT_EQ(0u, streamReader.GetToken());
+  EXPECT_EQ(TokenStream::StringView{"hello"}, streamReader.GetStringView());
+  EXPECT_EQ(1u, streamReader.GetToken());
+  EXPECT_EQ(TokenStream::BlockView{block}, streamReader.GetBlockView());
+
+  // Views can be written back out
+  TokenStream::MemoryWriter writer2;
+  writer2.Put(0, text).Put(1, view).Put(3, TokenStream::StringView{"view"});
+  EXPECT_EQ(str, writer2.GetReader().str());
+}
+
+TEST(TokenStreamTest, MemoryWriterBufferTest) {
+  Holder holder;
+  holder.blob.data.assign(0x200, 'x');
+  holder.blobs.resize(2);
+  holder.blobs[1].flags = 0x1234;
+
+  TokenStream::MemoryWriter writer;
+  holder.Write(writer);
+  ASSERT_NE(nullptr, writer.data());
+  EXPECT_EQ(writer.GetLength(), writer.size());
+  const TokenStream::Binary expected{writer.data(), writer.data() + writer.size()};
+  EXPECT_EQ(std::string(expected.begin(), expected.end()), writer.GetReader().str());
+
+  // clear() keeps the memory around for the next message
+  const auto* data = writer.data();
+  writer.clear();
+  EXPECT_TRUE(writer.empty());
+  holder.Write(writer);
+  EXPECT_EQ(data, writer.data());
+  EXPECT_EQ(expected, TokenStream::Binary(writer.data(), writer.data() + writer.size()));
+
+  // Release() hands over the memory without copying
+  auto released = writer.Release();
+  EXPECT_EQ(data, released.data());
+  EXPECT_EQ(expected, released);
+  EXPECT_TRUE(writer.empty());
+
+  // ...and it can be given back to a new writer
+  TokenStream::MemoryWriter reused{std::move(released)};
+  holder.Write(reused);
+  EXPECT_EQ(data, reused.data());
+  EXPECT_EQ(expected, reused.Release());
+
+  // A caller-supplied buffer is used until it fills up
+  uint8_t big[0x400];
+  TokenStream::MemoryWriter fixed{big, sizeof big};
+  holder.Write(fixed);
+  EXPECT_EQ(big, fixed.data());
+  EXPECT_EQ(expected, fixed.Release());
+
+  uint8_t small[0x10];
+  TokenStream::MemoryWriter spill{small, sizeof small};
+  holder.Write(spill);
+  EXPECT_NE(small, spill.data());
+  EXPECT_EQ(expected, spill.Release());
+
+  // The output can be read back without copying
+  TokenStream::MemoryWriter again;
+  holder.Write(again);
+  Holder holder2;
+  TokenStream::Reader reader{again.data(), again.size()};
+  holder2.Read(reader);
+  EXPECT_TRUE(reader.VerifyEOS());
+  EXPECT_EQ(holder.blob.data, holder2.blob.data);
+  ASSERT_EQ(2u, holder2.blobs.size());
+  EXPECT_EQ(holder.blobs[1].flags, holder2.blobs[1].flags);
+}
+
+TEST(TokenStreamTest, ArenaTest) {
+  TokenStream::Binary data;
+  {
+    ArenaRecord record;
+    record.name = "a name that is too long for the small string buffer";
+    record.tags = {"first tag that is too long for the small string buffer", "", "third"};
+    record.counts["one"] = 1;
+    record.counts["two"] = 2;
+    TokenStream::MemoryWriter writer;
+    record.Write(writer);
+    data = writer.Release();
+  }
+
+  uint8_t initial[0x80];
+  TokenStream::Arena arena{initial, sizeof initial, 0x100};
+  for (int pass = 0; pass < 3; pass++) {
+    {
+      TokenStream::Arena::Scope scope{arena};
+      EXPECT_EQ(&arena, TokenStream::Arena::Current());
+
+      ArenaRecord record;
+      TokenStream::Reader reader{data};
+      record.Read(reader);
+      EXPECT_TRUE(reader.VerifyEOS());
+      EXPECT_EQ("a name that is too long for the small string buffer", record.name);
+      EXPECT_EQ("none", record.label);
+      ASSERT_EQ(3u, record.tags.size());
+      EXPECT_EQ("first tag that is too long for the small string buffer", record.tags[0]);
+      EXPECT_EQ("", record.tags[1]);
+      EXPECT_EQ("third", record.tags[2]);
+      EXPECT_EQ(2u, record.counts.size());
+      EXPECT_EQ(2u, record.counts["two"]);
+      EXPECT_EQ(&arena, record.tags[0].get_allocator().GetArena());
+
+      // Writing and Generic members use the arena too
+      TokenStream::MemoryWriter writer;
+      record.Write(writer);
+      EXPECT_EQ(data, TokenStream::Binary(writer.data(), writer.data() + writer.size()));
+
+      TokenStream::Generic generic;
+      generic.Add(0, std::string(100, 'g'));
+      TokenStream::MemoryWriter genericWriter;
+      generic.Write(genericWriter);
+      EXPECT_EQ(102u, genericWriter.size());
+      EXPECT_GT(arena.GetBytesUsed(), 0u);
+    }
+    EXPECT_EQ(nullptr, TokenStream::Arena::Current());
+    arena.Reset();
+    EXPECT_EQ(0u, arena.GetBytesUsed());
+  }
+
+  // Alignment is honored
+  auto* byte = arena.Allocate(1, 1);
+  auto* aligned = arena.Allocate(8, 64);
+  EXPECT_NE(byte, aligned);
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(aligned) % 64);
+}
+
+TEST(TokenStreamTest, PackedContainerTest) {
+  SampleSet set;
+  for (int i = 0; i < 300; i++) {
+    set.first.values.push_back((i % 2 ? -i : i) * 1000);
+    set.first.ids.push_back(0x100000000ull + i);
+    set.first.readings.push_back(i * 0.25);
+    set.first.bytes.push_back(static_cast<uint8_t>(i));
+  }
+  set.first.name = "first";
+  set.more.resize(2);
+  set.more[0].values = {1, -2, 3};
+  set.more[1].ids = {0xffffffffffffffffull, 0};
+  set.more[1].name = "second";
+
+  TokenStream::MemoryWriter plain;
+  set.Write(plain);
+  TokenStream::MemoryWriter packed;
+  packed.SetPackContainers(true);
+  set.Write(packed);
+  EXPECT_LT(packed.size(), plain.size());
+
+  // Both encodings read back the same
+  for (const auto* writer : {&plain, &packed}) {
+    SampleSet set2;
+    TokenStream::Reader reader{writer->data(), writer->size()};
+    set2.Read(reader);
+    EXPECT_TRUE(reader.VerifyEOS());
+    EXPECT_EQ(set.first.values, set2.first.values);
+    EXPECT_EQ(set.first.ids, set2.first.ids);
+    EXPECT_EQ(set.first.readings, set2.first.readings);
+    EXPECT_EQ(set.first.bytes, set2.first.bytes);
+    EXPECT_TRUE(set2.first.none.empty());
+    EXPECT_EQ(set.first.name, set2.first.name);
+    ASSERT_EQ(2u, set2.more.size());
+    EXPECT_EQ(set.more[0].values, set2.more[0].values);
+    EXPECT_EQ(set.more[1].ids, set2.more[1].ids);
+    EXPECT_EQ(set.more[1].name, set2.more[1].name);
+  }
+
+  // Writing to a stream produces the same bytes
+  std::stringstream stream;
+  TokenStream::Writer streamWriter{stream};
+  streamWriter.SetPackContainers(true);
+  set.Write(streamWriter);
+  const auto str = stream.str();
+  EXPECT_EQ(std::string(reinterpret_cast<const char*>(packed.data()), packed.size()), str);
+  SampleSet set3;
+  TokenStream::Reader streamReader{stream};
+  set3.Read(streamReader);
+  EXPECT_EQ(set.first.readings, set3.first.readings);
+
+  // Fixed width wins ties, the length encoding wins when it is smaller
+  TokenStream::MemoryWriter formats;
+  formats.PutPacked(1, std::vector<uint32_t>{1, 2, 3});
+  formats.PutPacked(2, std::vector<uint32_t>{1, 0x10000});
+  formats.PutPacked(3, std::vector<int16_t>{-0x4000, 0x3fff});
+  const TokenStream::Binary expected{0xf8, 0, 1, 4, 1, 1, 2, 3,
+                                     0xf8, 0, 2, 6, 0x80, 1, 0xfa, 1, 0, 0,
+                                     0xf8, 0, 3, 5, 2, 0xc0, 0, 0x3f, 0xff};
+  EXPECT_EQ(expected, TokenStream::Binary(formats.data(), formats.data() + formats.size()));
+
+  // Readers that do not know the token skip the packed chunk like any other
+  TokenStream::Reader skipper{formats.data(), formats.size()};
+  EXPECT_EQ(1u, skipper.GetToken());
+  EXPECT_TRUE(skipper.NextContainerIsPacked());
+  skipper.Skip();
+  EXPECT_EQ(2u, skipper.GetToken());
+  skipper.Skip();
+  EXPECT_EQ(3u, skipper.GetToken());
+  std::vector<int16_t> shorts;
+  skipper >> shorts;
+  EXPECT_EQ((std::vector<int16_t>{-0x4000, 0x3fff}), shorts);
+  EXPECT_TRUE(skipper.VerifyEOS());
+}
+
+TEST(TokenStreamTest, PackedWidthsTest) {
+  ExpectPackedRoundTrips<int8_t>();
+  ExpectPackedRoundTrips<uint16_t>();
+  ExpectPackedRoundTrips<int16_t>();
+  ExpectPackedRoundTrips<uint32_t>();
+  ExpectPackedRoundTrips<int32_t>();
+  ExpectPackedRoundTrips<uint64_t>();
+  ExpectPackedRoundTrips<int64_t>();
+
+  std::vector<double> doubles;
+  std::vector<float> floats;
+  for (int i = 0; i < 50; i++) {
+    doubles.push_back(i * -0.5);
+    floats.push_back(static_cast<float>(i) / 3);
+  }
+  EXPECT_EQ(doubles, PackedRoundTrip(doubles));
+  EXPECT_EQ(floats, PackedRoundTrip(floats));
+
+  // Full width elements are stored big-endian
+  std::vector<uint32_t> words;
+  TokenStream::Binary expected{0xf8, 0, 1, 0x81, 0x45, 4};
+  for (uint32_t i = 0; i < 81; i++) {
+    words.push_back(0x80000000u | i << 16u | i);
+    expected.insert(expected.end(), {0x80, static_cast<uint8_t>(i), 0, static_cast<uint8_t>(i)});
+  }
+  TokenStream::MemoryWriter writer;
+  writer.PutPacked(1, words);
+  EXPECT_EQ(expected, TokenStream::Binary(writer.data(), writer.data() + writer.size()));
+}
+
+TEST(TokenStreamTest, TokenMapTest) {
+  SparseChild child;
+  const auto& tokenMap = child.GetTokenMap();
+  ASSERT_EQ(4u, tokenMap.size());
+  std::vector<uint64_t> tokens;
+  for (const auto& entry : tokenMap) {
+    tokens.push_back(entry.first);
+  }
+  EXPECT_EQ((std::vector<uint64_t>{7, 8, 0x20, 0x1000}), tokens);
+  EXPECT_EQ(0x20u, tokenMap.find(0x20)->first);
+  EXPECT_EQ(tokenMap.end(), tokenMap.find(9));
+  EXPECT_EQ(0u, tokenMap.count(0x1001));
+
+  child.a = 1;
+  child.b = "b";
+  child.c = 0x123456789;
+  child.d = 4;
+  TokenStream::MemoryWriter writer;
+  child.Write(writer);
+  // Tokens out of order and unknown tokens still go through the binary search
+  writer.Put(7, 2u).Put(0x999, 9u).Put(8, 5u);
+
+  SparseChild child2;
+  TokenStream::Reader reader{writer.data(), writer.size()};
+  child2.Read(reader);
+  EXPECT_TRUE(reader.VerifyEOS());
+  EXPECT_EQ(2u, child2.a);
+  EXPECT_EQ("b", child2.b);
+  EXPECT_EQ(0x123456789u, child2.c);
+  EXPECT_EQ(5u, child2.d);
+
+  // Dense enum tokens use the direct table
+  Blob blob;
+  const auto& blobMap = blob.GetTokenMap();
+  size_t hint = 0;
+  EXPECT_NE(nullptr, blobMap.Find(static_cast<uint64_t>(Blob::Token::flags), hint));
+  EXPECT_EQ(nullptr, blobMap.Find(2, hint));
+  EXPECT_EQ(nullptr, blobMap.Find(TokenStream::Token::InvalidTokenValue, hint));
+}
+
+TEST(TokenStreamTest, GenericStorageTest) {
+  TokenStream::Generic generic;
+  // Added out of order, written in token order
+  generic.Add(3, std::string("three"));
+  generic.Add(1, 1u);
+  generic.Add(2, std::vector<int>{1, 2, 3});
+  generic.Add(1, 10u);
+  generic.Add(4, std::string(100, 'x'), std::string());
+  TokenStream::Generic nested;
+  nested.Add(1, true);
+  generic.Add(5, nested);
+  EXPECT_EQ(10u, generic.at<uint32_t>(1));
+  EXPECT_EQ(nullptr, generic[6]);
+
+  TokenStream::MemoryWriter writer;
+  generic.Write(writer);
+  TokenStream::MemoryWriter expected;
+  expected.Put(1, 10u).Put(2, std::vector<int>{1, 2, 3}).Put(3, "three").Put(4, std::string(100, 'x'));
+  expected.Put(5, nested);
+  EXPECT_EQ(TokenStream::Binary(expected.data(), expected.data() + expected.size()),
+      TokenStream::Binary(writer.data(), writer.data() + writer.size()));
+
+  // Copies own their members
+  auto copy = generic;
+  generic.Add(3, std::string("changed"));
+  reinterpret_cast<TokenStream::Generic::Member<std::string>*>(generic[4])->value = "changed";
+  EXPECT_EQ("three", copy.at<std::string>(3));
+  EXPECT_EQ(std::string(100, 'x'), copy.at<std::string>(4));
+  EXPECT_TRUE(copy.at<TokenStream::Generic>(5).at<bool>(1));
+
+  TokenStream::Generic read;
+  read.Add(5, TokenStream::Generic{}.Add(1, false));
+  read.Add(3, std::string());
+  read.Add(4, std::string(), std::string());
+  TokenStream::Reader reader{writer.data(), writer.size()};
+  read.Read(reader);
+  EXPECT_EQ("three", read.at<std::string>(3));
+  EXPECT_EQ(std::string(100, 'x'), read.at<std::string>(4));
+  EXPECT_TRUE(read.at<TokenStream::Generic>(5).at<bool>(1));
+}
+
+TEST(TokenStreamTest, TokenIndexTest) {
+  auto package = MakeTestPackageWithStructure();
+  package.signature = {1, 2, 3};
+  TokenStream::MemoryWriter writer;
+  package.Write(writer);
+
+  TokenStream::TokenIndex index{writer.data(), writer.size()};
+  EXPECT_TRUE(index.IsValid());
+  ASSERT_EQ(2u, index.GetFields().size());
+  TokenStream::Binary signature;
+  EXPECT_TRUE(index.Get(SecurePackageData::Token::signature, signature));
+  EXPECT_EQ(package.signature, signature);
+  EXPECT_EQ(nullptr, index.Find(SecurePackageData::Token::algorithm));
+
+  // Fields of the nested base object
+  std::string description;
+  EXPECT_TRUE(index.GetPath({SecurePackageData::Token::base, PackageData::Token::description}, description));
+  EXPECT_EQ(package.description, description);
+  std::vector<std::string> languages;
+  EXPECT_TRUE(index.GetPath({SecurePackageData::Token::base, PackageData::Token::languages}, languages));
+  EXPECT_EQ(package.languages, languages);
+  const auto* folders = index.FindPath({SecurePackageData::Token::base, PackageData::Token::folders});
+  ASSERT_NE(nullptr, folders);
+  EXPECT_EQ(package.folders.size(), folders->m_count);
+  std::vector<FileData> files;
+  EXPECT_TRUE(index.GetPath(
+      {SecurePackageData::Token::base, PackageData::Token::folders, FolderData::Token::files}, files));
+  ASSERT_EQ(package.folders[0].files.size(), files.size());
+  EXPECT_EQ(package.folders[0].files[1].name, files[1].name);
+  EXPECT_EQ(nullptr, index.FindPath({SecurePackageData::Token::base, PackageData::Token::childPath}));
+  EXPECT_EQ(nullptr, index.FindPath({SecurePackageData::Token::algorithm, PackageData::Token::name}));
+
+  // A Reader positioned on a field
+  const auto* name = index.GetSubIndex(SecurePackageData::Token::base)->Find(PackageData::Token::name);
+  ASSERT_NE(nullptr, name);
+  TokenStream::Reader reader{name->m_begin, name->m_size};
+  EXPECT_EQ(static_cast<uint64_t>(PackageData::Token::name), reader.GetToken());
+  EXPECT_EQ("Quake", reader.GetString());
+  EXPECT_TRUE(reader.VerifyEOS());
+
+  // Packed and split containers are one field each
+  TokenStream::MemoryWriter packed;
+  packed.SetPackContainers(true);
+  packed.Put(1, std::vector<int32_t>{1, 2, 3}).Put(2, 5u).Put(2, 6u);
+  TokenStream::TokenIndex packedIndex{packed.data(), packed.size()};
+  std::vector<int32_t> values;
+  EXPECT_TRUE(packedIndex.Get(1, values));
+  EXPECT_EQ((std::vector<int32_t>{1, 2, 3}), values);
+  std::vector<uint32_t> split;
+  EXPECT_TRUE(packedIndex.Get(2, split));
+  EXPECT_EQ((std::vector<uint32_t>{5, 6}), split);
+}
+
+TEST(TokenStreamTest, SizeCounterTest) {
+  auto package = MakeTestPackageWithStructure();
+  package.signature = {1, 2, 3};
+  auto generic = MakeTestPackageWithGeneric();
+  const auto writeAll = [&](TokenStream::Writer& writer) {
+    package.Write(writer);
+    writer.Put(100, generic);
+    writer.Put(101, std::vector<FolderData>(3));
+    writer.PutPacked(102, std::vector<int32_t>{-1, 300, 70000});
+  };
+
+  TokenStream::MemoryWriter memoryWriter;
+  writeAll(memoryWriter);
+
+  TokenStream::SizeCounter counter;
+  writeAll(counter);
+  EXPECT_EQ(memoryWriter.size(), counter.size());
+  EXPECT_EQ(memoryWriter.size(), counter.GetLength());
+  EXPECT_FALSE(counter.GetSizes().empty());
+
+  // The second pass goes straight to the stream
+  std::stringstream stream;
+  TokenStream::Writer writer{stream};
+  writer.SetPrecomputedSizes(counter);
+  writeAll(writer);
+  EXPECT_EQ(memoryWriter.size(), writer.GetLength());
+  EXPECT_EQ(std::string(reinterpret_cast<const char*>(memoryWriter.data()), memoryWriter.size()), stream.str());
+
+  counter.clear();
+  EXPECT_EQ(0u, counter.size());
+  EXPECT_TRUE(counter.GetSizes().empty());
+}
+
+TEST(TokenStreamTest, PushParserTest) {
+  auto package = MakeTestPackageWithStructure();
+  package.signature = {1, 2, 3};
+  TokenStream::MemoryWriter writer;
+  writer.SetPackContainers(true);
+  package.Write(writer);
+  writer.Put(3, std::vector<int32_t>{-1, 300, 70000});
+
+  // Any fragment size gives the same object
+  for (size_t fragment = 1; fragment <= writer.size(); fragment += fragment < 20 ? 1 : 37) {
+    SecurePackageData package2;
+    TokenStream::PushParser parser{package2};
+    for (size_t offset = 0; offset < writer.size(); offset += fragment) {
+      const auto size = std::min(fragment, writer.size() - offset);
+      // Fragments that end between top-level chunks are complete too
+      EXPECT_NE(TokenStream::PushParser::Status::Error, parser.Feed(writer.data() + offset, size));
+    }
+    EXPECT_EQ(TokenStream::PushParser::Status::Complete, parser.GetStatus());
+    ASSERT_EQ(package.description, package2.description);
+    ASSERT_EQ(package.signature, package2.signature);
+    ASSERT_EQ(package.folders.size(), package2.folders.size());
+    ASSERT_EQ(package.folders[0].files[1].name, package2.folders[0].files[1].name);
+    ASSERT_EQ(package.vars, package2.vars);
+  }
+
+  // Events for nested objects
+  struct Recorder : TokenStream::PushParser::Handler {
+    bool IsObject(TokenStream::Token token, size_t depth) override {
+      return depth == 0 && token == static_cast<uint64_t>(SecurePackageData::Token::base);
+    }
+    void OnValue(const TokenStream::PushParser::Value& value) override {
+      if (value.m_depth == 1 && value.m_token == static_cast<uint64_t>(PackageData::Token::description)) {
+        EXPECT_TRUE(value.Get(description));
+      }
+      if (value.m_depth == 0 && value.m_token == 3) {
+        EXPECT_TRUE(value.m_packed);
+        EXPECT_TRUE(value.Get(numbers));
+      }
+      values++;
+    }
+    void OnBeginObject(TokenStream::Token token, size_t depth) override {
+      EXPECT_EQ(static_cast<uint64_t>(SecurePackageData::Token::base), token);
+      EXPECT_EQ(0u, depth);
+      begins++;
+    }
+    void OnEndObject(TokenStream::Token, size_t depth) override {
+      EXPECT_EQ(0u, depth);
+      ends++;
+    }
+    std::string description;
+    std::vector<int32_t> numbers;
+    size_t values = 0;
+    size_t begins = 0;
+    size_t ends = 0;
+  } recorder;
+  TokenStream::PushParser parser{recorder};
+  const auto half = writer.size() / 2;
+  EXPECT_EQ(TokenStream::PushParser::Status::NeedMoreData, parser.Feed(writer.data(), half));
+  EXPECT_EQ(1u, parser.GetDepth());
+  EXPECT_EQ(TokenStream::PushParser::Status::Complete,
+            parser.Feed(writer.data() + half, writer.size() - half));
+  EXPECT_EQ(package.description, recorder.description);
+  EXPECT_EQ((std::vector<int32_t>{-1, 300, 70000}), recorder.numbers);
+  EXPECT_EQ(1u, recorder.begins);
+  EXPECT_EQ(1u, recorder.ends);
+  EXPECT_GT(recorder.values, 5u);
+}
+
+TEST(TokenStreamTest, MappedFileTest) {
+  auto package = MakeTestPackageWithStructure();
+  package.signature = {1, 2, 3};
+  TokenStream::MemoryWriter expected;
+  package.Write(expected);
+  const auto path = testing::TempDir() + "TokenStreamMappedFileTest.ts";
+
+  TokenStream::SizeCounter counter;
+  package.Write(counter);
+  // Exactly the right size, too small and nothing mapped up front
+  for (const auto capacity : {counter.size(), counter.size() / 3, size_t{0}}) {
+    {
+      TokenStream::MappedFileWriter writer{path, capacity};
+      ASSERT_TRUE(writer.IsOpen());
+      package.Write(writer);
+      EXPECT_EQ(expected.size(), writer.size());
+      EXPECT_TRUE(writer.Close());
+      EXPECT_FALSE(writer.IsOpen());
+    }
+
+    TokenStream::MappedFileReader reader{path};
+    ASSERT_TRUE(reader.IsOpen());
+    ASSERT_EQ(expected.size(), reader.GetFile().size());
+    EXPECT_EQ(0, memcmp(expected.data(), reader.GetFile().data(), expected.size()));
+    SecurePackageData package2;
+    package2.Read(reader);
+    EXPECT_TRUE(reader.VerifyEOS());
+    EXPECT_EQ(package.description, package2.description);
+    EXPECT_EQ(package.signature, package2.signature);
+  }
+
+  TokenStream::MappedFile file{path, TokenStream::MappedFile::Access::Random};
+  ASSERT_TRUE(file.IsOpen());
+  TokenStream::TokenIndex index{file.data(), file.size()};
+  TokenStream::Binary signature;
+  EXPECT_TRUE(index.Get(SecurePackageData::Token::signature, signature));
+  EXPECT_EQ(package.signature, signature);
+  file.Close();
+  EXPECT_EQ(0, std::remove(path.c_str()));
+
+  TokenStream::MappedFileReader missing{path};
+  EXPECT_FALSE(missing.IsOpen());
+  EXPECT_TRUE(missing.EOS());
+}
+
+TEST(TokenStreamTest, GatherWriterTest) {
+  auto package = MakeTestPackageWithStructure();
+  package.description.assign(300, 'd');
+  package.signature.assign(0x3000, 0x5a);
+  TokenStream::MemoryWriter expected;
+  package.Write(expected);
+
+  // The description is inside the nested base object, so its header grows after the payload is referenced
+  TokenStream::GatherWriter writer{200};
+  package.Write(writer);
+  EXPECT_EQ(expected.size(), writer.size());
+  const auto segments = writer.GetSegments();
+  TokenStream::Binary gathered;
+  size_t referenced = 0;
+  for (const auto& segment : segments) {
+    if (segment.data() == package.signature.data() ||
+        segment.data() == reinterpret_cast<const uint8_t*>(package.description.data())) {
+      referenced++;
+    }
+    gathered.insert(gathered.end(), segment.data(), segment.data() + segment.size());
+  }
+  EXPECT_EQ(2u, referenced);
+  ASSERT_EQ(expected.size(), gathered.size());
+  EXPECT_EQ(0, memcmp(expected.data(), gathered.data(), gathered.size()));
+
+  // A stream is read straight into the buffer
+  std::stringstream stream;
+  stream.write(reinterpret_cast<const char*>(package.signature.data()), package.signature.size());
+  TokenStream::MemoryWriter copied;
+  copied.Put(SecurePackageData::Token::signature, stream);
+  TokenStream::Reader reader{copied.data(), copied.size()};
+  TokenStream::Binary signature;
+  EXPECT_EQ(static_cast<uint64_t>(SecurePackageData::Token::signature), reader.GetToken());
+  reader >> signature;
+  EXPECT_EQ(package.signature, signature);
+
+  // Nothing is referenced below the threshold
+  writer.clear();
+  EXPECT_EQ(0u, writer.size());
+  MakeTestPackageWithStructure().Write(writer);
+  EXPECT_EQ(1u, writer.GetSegments().size());
+}
+
+namespace {
+
+// Strings and containers are compressed as members of an object
+struct Notes : TokenStream::Serializable {
+  std::string text;
+  std::vector<std::string> lines;
+
+  enum class Token { text, lines };
+
+  TOKEN_MAP(ENUMERATED_TOKEN(text), ENUMERATED_TOKEN(lines))
+};
+
+} // namespace
+
+TEST(TokenStreamTest, CompressionTest) {
+  // Runs, repeats that overlap their own output and data that does not compress
+  TokenStream::Binary data(0x3000, 7);
+  for (size_t i = 0x1000; i < data.size(); i++) {
+    data[i] = i < 0x2000 ? static_cast<uint8_t>(i % 3) : static_cast<uint8_t>(i * 2654435761u >> 24u);
+  }
+  const auto& codec = TokenStream::Lz4Codec::Get();
+  TokenStream::Binary compressed(codec.GetMaxCompressedSize(data.size()));
+  const auto compressedSize = codec.Compress(data.data(), data.size(), compressed.data(), compressed.size());
+  ASSERT_NE(0u, compressedSize);
+  EXPECT_LT(compressedSize, data.size() / 2);
+  TokenStream::Binary decompressed(data.size());
+  EXPECT_TRUE(codec.Decompress(compressed.data(), compressedSize, decompressed.data(), decompressed.size()));
+  EXPECT_EQ(data, decompressed);
+  EXPECT_FALSE(codec.Decompress(compressed.data(), compressedSize - 1, decompressed.data(), decompressed.size()));
+
+  auto package = MakeTestPackageWithStructure();
+  for (int i = 0; i < 50; i++) {
+    package.description += "A package that is described at length. ";
+  }
+  TokenStream::MemoryWriter plain;
+  plain.Put(1, package);
+  TokenStream::MemoryWriter writer;
+  writer.PutCompressed(1, package).Put(2, 42u);
+  EXPECT_LT(writer.size(), plain.size() / 4);
+
+  // From memory and from a stream
+  std::stringstream stream;
+  stream.write(reinterpret_cast<const char*>(writer.data()), static_cast<std::streamsize>(writer.size()));
+  TokenStream::Reader memoryReader{writer.data(), writer.size()};
+  TokenStream::Reader streamReader{stream};
+  for (auto* reader : {&memoryReader, &streamReader}) {
+    SecurePackageData package2;
+    uint32_t number = 0;
+    EXPECT_EQ(1u, reader->GetToken());
+    EXPECT_TRUE(reader->IsCompressed());
+    *reader >> package2;
+    EXPECT_EQ(2u, reader->GetToken());
+    *reader >> number;
+    EXPECT_TRUE(reader->VerifyEOS());
+    EXPECT_EQ(package.description, package2.description);
+    EXPECT_EQ(package.signature, package2.signature);
+    EXPECT_EQ(42u, number);
+  }
+
+  TokenStream::TokenIndex index{writer.data(), writer.size()};
+  ASSERT_NE(nullptr, index.Find(1));
+  EXPECT_TRUE(index.Find(1)->m_compressed);
+  std::string description;
+  EXPECT_TRUE(index.GetPath({1, SecurePackageData::Token::base, PackageData::Token::description}, description));
+  EXPECT_EQ(package.description, description);
+
+  // Objects that do not get smaller are written as they are
+  SecurePackageData tiny;
+  tiny.signature = {1, 2, 3};
+  TokenStream::MemoryWriter small;
+  small.PutCompressed(1, tiny);
+  TokenStream::MemoryWriter expected;
+  expected.Put(1, tiny);
+  ASSERT_EQ(expected.size(), small.size());
+  EXPECT_EQ(0, memcmp(expected.data(), small.data(), small.size()));
+
+  // A long string and a list of strings
+  Notes notes;
+  notes.text = std::string(5000, 'z');
+  notes.lines.assign(100, "A line that is repeated many times");
+  TokenStream::MemoryWriter notesWriter;
+  notesWriter.PutCompressed(1, notes);
+  TokenStream::Reader notesReader{notesWriter.data(), notesWriter.size()};
+  EXPECT_EQ(1u, notesReader.GetToken());
+  EXPECT_TRUE(notesReader.IsCompressed());
+  Notes notes2;
+  notesReader >> notes2;
+  EXPECT_TRUE(notesReader.VerifyEOS());
+  EXPECT_EQ(notes.text, notes2.text);
+  EXPECT_EQ(notes.lines, notes2.lines);
+
+  // Views into a compressed object outlive its SubStream, even though the decompressed data does not
+  TokenStream::Reader viewReader{notesWriter.data(), notesWriter.size()};
+  EXPECT_EQ(1u, viewReader.GetToken());
+  TokenStream::StringView view;
+  {
+    TokenStream::Reader::SubStream object{viewReader};
+    EXPECT_EQ(static_cast<uint64_t>(Notes::Token::text), viewReader.GetToken());
+    view = viewReader.GetStringView();
+  }
+  EXPECT_TRUE(viewReader.VerifyEOS());
+  EXPECT_EQ(notes.text, std::string(view.data(), view.size()));
+}
+
+TEST(TokenStreamTest, ParallelContainerTest) {
+  std::vector<SecurePackageData> packages(1000);
+  for (size_t i = 0; i < packages.size(); i++) {
+    packages[i].description = std::string(i % 50, 'x');
+    packages[i].signature.assign(i % 7, static_cast<uint8_t>(i));
+  }
+  TokenStream::MemoryWriter expected;
+  expected.Put(1, packages).Put(2, 42u);
+
+  // The batches must not share the calling thread's arena
+  TokenStream::Arena arena;
+  TokenStream::Arena::Scope scope{arena};
+  TokenStream::MemoryWriter writer;
+  writer.PutContainerParallel(1, packages, 4).Put(2, 42u);
+  ASSERT_EQ(expected.size(), writer.size());
+  EXPECT_EQ(0, memcmp(expected.data(), writer.data(), writer.size()));
+
+  // Any executor and any container
+  size_t tasks = 0;
+  const TokenStream::Executor inlineExecutor = [&](size_t taskCount, const std::function<void(size_t)>& task) {
+    for (size_t i = 0; i < taskCount; i++) {
+      task(i);
+    }
+    tasks += taskCount;
+  };
+  const std::list<SecurePackageData> list{packages.begin(), packages.end()};
+  TokenStream::MemoryWriter listWriter;
+  listWriter.PutContainerParallel(1, list, inlineExecutor, 7).Put(2, 42u);
+  EXPECT_EQ(7u, tasks);
+  ASSERT_EQ(expected.size(), listWriter.size());
+  EXPECT_EQ(0, memcmp(expected.data(), listWriter.data(), listWriter.size()));
+
+  // Inside an object and to a stream
+  std::stringstream stream;
+  {
+    TokenStream::Writer streamWriter{stream};
+    TokenStream::Writer::SubStream object{streamWriter, 3};
+    streamWriter.PutContainerParallel(1, packages);
+  }
+  TokenStream::Reader reader{stream};
+  EXPECT_EQ(3u, reader.GetToken());
+  TokenStream::Reader::SubStream object{reader};
+  std::vector<SecurePackageData> packages2;
+  EXPECT_EQ(1u, reader.GetToken());
+  reader >> packages2;
+  ASSERT_EQ(packages.size(), packages2.size());
+  EXPECT_EQ(packages.back().description, packages2.back().description);
+  EXPECT_EQ(packages.back().signature, packages2.back().signature);
+
+  // Too small to split
+  tasks = 0;
+  TokenStream::MemoryWriter small;
+  small.PutContainerParallel(1, std::vector<SecurePackageData>(packages.begin(), packages.begin() + 3), inlineExecutor, 4);
+  EXPECT_EQ(0u, tasks);
+
+  // A task that throws stops the rest, and the exception reaches the calling thread once all threads are joined
+  std::atomic<size_t> started{0};
+  EXPECT_THROW(TokenStream::RunOnThreads(
+                   1000,
+                   [&](size_t task) {
+                     started++;
+                     if (task == 10) {
+                       throw std::runtime_error("task failed");
+                     }
+                     std::this_thread::sleep_for(std::chrono::microseconds(100));
+                   },
+                   4),
+               std::runtime_error);
+  EXPECT_LT(started.load(), 1000u);
+}
+
+TEST(TokenStreamTest, ParallelReadTest) {
+  std::vector<SecurePackageData> packages(1000);
+  for (size_t i = 0; i < packages.size(); i++) {
+    packages[i].description = std::string(i % 50, 'x');
+    packages[i].signature.assign(i % 7, static_cast<uint8_t>(i));
+  }
+  TokenStream::MemoryWriter writer;
+  writer.Put(1, packages).Put(2, 42u);
+
+  size_t tasks = 0;
+  const TokenStream::Executor inlineExecutor = [&](size_t taskCount, const std::function<void(size_t)>& task) {
+    for (size_t i = 0; i < taskCount; i++) {
+      task(i);
+    }
+    tasks += taskCount;
+  };
+  for (const size_t threads : {0, 1, 4}) {
+    TokenStream::Reader reader{writer.data(), writer.size()};
+    std::vector<SecurePackageData> packages2(1);
+    EXPECT_EQ(1u, reader.GetToken());
+    if (threads == 1) {
+      reader.GetContainerParallel(packages2, inlineExecutor, 5);
+      EXPECT_EQ(5u, tasks);
+    } else {
+      reader.GetContainerParallel(packages2, threads);
+    }
+    uint32_t number = 0;
+    EXPECT_EQ(2u, reader.GetToken());
+    reader >> number;
+    EXPECT_TRUE(reader.VerifyEOS());
+    EXPECT_EQ(42u, number);
+    ASSERT_EQ(packages.size() + 1, packages2.size());
+    for (size_t i = 0; i < packages.size(); i++) {
+      EXPECT_EQ(packages[i].description, packages2[i + 1].description);
+      EXPECT_EQ(packages[i].signature, packages2[i + 1].signature);
+    }
+  }
+
+  // Streams are read on the calling thread
+  tasks = 0;
+  std::stringstream stream;
+  stream.write(reinterpret_cast<const char*>(writer.data()), static_cast<std::streamsize>(writer.size()));
+  TokenStream::Reader streamReader{stream};
+  std::vector<SecurePackageData> packages3;
+  EXPECT_EQ(1u, streamReader.GetToken());
+  streamReader.GetContainerParallel(packages3, inlineExecutor, 5);
+  EXPECT_EQ(0u, tasks);
+  EXPECT_EQ(packages.size(), packages3.size());
+}
+
+TEST(TokenStreamTest, WideStringTest) {
+  // ASCII long enough for the vector loops, then 2, 3 and 4 byte UTF-8 characters
+  const std::wstring ascii(100, L'a');
+  const std::wstring mixed = ascii + L"é€\U0001F600z";
+  TokenStream::MemoryWriter writer;
+  writer.Put(1, mixed).Put(2, L"é");
+  const std::string expected = std::string(100, 'a') + "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80z";
+
+  TokenStream::Reader reader{writer.data(), writer.size()};
+  EXPECT_EQ(1u, reader.GetToken());
+  EXPECT_EQ(expected, std::string(reader.GetStringView()));
+  EXPECT_EQ(2u, reader.GetToken());
+  EXPECT_EQ(L"é", reader.GetWideString());
+  EXPECT_TRUE(reader.VerifyEOS());
+
+  // Conversions don't touch the locale, so several threads can decode at once
+  std::vector<std::wstring> results(4);
+  {
+    std::vector<std::thread> threads;
+    for (auto& result : results) {
+      threads.emplace_back([&] {
+        for (size_t i = 0; i < 100; i++) {
+          TokenStream::Reader threadReader{writer.data(), writer.size()};
+          threadReader.GetToken();
+          threadReader >> result;
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+  for (const auto& result : results) {
+    EXPECT_EQ(mixed, result);
+  }
+
+  // Malformed sequences become U+FFFD, one per byte
+  TokenStream::MemoryWriter bad;
+  bad.Put(1, std::string("a\xc0\xaf\xed\xa0\x80" "b\xe2\x82"));
+  TokenStream::Reader badReader{bad.data(), bad.size()};
+  EXPECT_EQ(1u, badReader.GetToken());
+  EXPECT_EQ(L"a�����b��", badReader.GetWideString());
+}
+
+namespace {
+
+size_t messageCount = 0;
+uint64_t messageBytes[2] = {};
+
+void CountMessage(const TokenStream::Serializable&, bool write, std::chrono::nanoseconds, uint64_t bytes) {
+  messageCount++;
+  messageBytes[write ? 1 : 0] = bytes;
+}
+
+} // namespace
+
+TEST(TokenStreamTest, StatsTest) {
+  auto& stats = TokenStream::Stats::Local();
+  stats.Reset();
+  TokenStream::SetMessageHook(CountMessage);
+  const auto package = MakeTestPackageWithStructure();
+  TokenStream::MemoryWriter writer;
+  writer.Put(1, package);
+  const TokenStream::Writer& parent = writer;
+  TokenStream::MemoryWriter nested{parent};
+  nested.Put(1, "nested");
+  writer.Put(2, nested);
+  const auto written = stats;
+
+  SecurePackageData package2;
+  TokenStream::Reader reader{writer.data(), writer.size()};
+  EXPECT_EQ(1u, reader.GetToken());
+  reader >> package2;
+  EXPECT_EQ(2u, reader.GetToken());
+  EXPECT_FALSE(reader.GetToken().IsValid());
+  EXPECT_TRUE(reader.VerifyEOS());
+  TokenStream::SetMessageHook(nullptr);
+
+  if (!TokenStream::Stats::Enabled) {
+    EXPECT_EQ(0u, stats.bytesWritten);
+    EXPECT_EQ(0u, stats.subStreams);
+    EXPECT_EQ(0u, messageCount);
+    return;
+  }
+  EXPECT_EQ(writer.size() + nested.size(), written.bytesWritten);
+  EXPECT_EQ(1u, written.nestedWriters);
+  EXPECT_LE(nested.size(), written.nestingCopyBytes);
+  EXPECT_LT(0u, written.subStreams);
+  EXPECT_EQ(0u, written.bytesRead);
+  // All but the chunk inside the one that was skipped
+  EXPECT_EQ(written.chunksWritten - 1, stats.chunksRead);
+  EXPECT_EQ(written.subStreams * 2, stats.subStreams);
+  EXPECT_LT(0u, stats.bytesRead);
+  // The nested chunk was skipped without reading it
+  EXPECT_EQ(nested.size(), stats.skippedBySeek);
+  EXPECT_EQ(0u, stats.skippedByReading);
+
+  // One call per top-level object, not for the objects inside it
+  EXPECT_EQ(2u, messageCount);
+  EXPECT_EQ(writer.size() - nested.size() - 2, messageBytes[1]);
+  EXPECT_GT(messageBytes[1], messageBytes[0]);
+}
+
+namespace {
+
+struct StaticPoint {
+  enum class Token : uint64_t { x, y };
+  int32_t x = 0;
+  int32_t y = 0;
+  TS_FIELDS(StaticPoint, TS_FIELD(x), TS_FIELD(y))
+};
+
+struct StaticRecord {
+  enum class Token : uint64_t { id, name, status, origin, ratio };
+  uint32_t id = 0;
+  std::string name = "none";
+  CompressionType status = CompressionType::LZMA;
+  StaticPoint origin;
+  double ratio = 0;
+  TS_FIELDS(StaticRecord,
+            TS_FIELD(id),
+            TS_FIELD(name, "none"),
+            TS_FIELD(status, CompressionType::LZMA),
+            TS_FIELD(origin),
+            TS_MAP_FIELD(200, ratio))
+};
+
+// The same fields through a TokenMap
+struct MappedRecord : TokenStream::Serializable {
+  enum class Token : uint64_t { id, name, status, origin };
+  uint32_t id = 0;
+  std::string name = "none";
+  CompressionType status = CompressionType::LZMA;
+  StaticPoint origin;
+  double ratio = 0;
+  TOKEN_MAP(ENUMERATED_TOKEN(id),
+            ENUMERATED_TOKEN(name, "none"),
+            ENUMERATED_TOKEN(status, CompressionType::LZMA),
+            ENUMERATED_TOKEN(origin),
+            MAP_TOKEN(200, ratio))
+};
+
+static_assert(TokenStream::StaticCodec<StaticPoint>::MaxSize() == 12, "Two tokens, lengths and int32_t values");
+static_assert(TokenStream::StaticCodec<StaticRecord>::MaxSize() == 0, "Strings have no bound");
+
+} // namespace
+
+TEST(TokenStreamTest, StaticCodecTest) {
+  StaticRecord record;
+  record.id = 7;
+  record.name = "seven";
+  record.status = CompressionType::None;
+  record.origin.x = -3;
+  record.origin.y = 400;
+  record.ratio = 0.5;
+  MappedRecord mapped;
+  mapped.id = record.id;
+  mapped.name = record.name;
+  mapped.status = record.status;
+  mapped.origin = record.origin;
+  mapped.ratio = record.ratio;
+
+  TokenStream::MemoryWriter writer;
+  writer.Put(1, record).Put(2, std::vector<StaticRecord>(3, record)).Put(3, StaticRecord{});
+  TokenStream::MemoryWriter expected;
+  expected.Put(1, mapped).Put(2, std::vector<MappedRecord>(3, mapped)).Put(3, MappedRecord{});
+  TokenStream::MemoryWriter unknown;
+  unknown.Put(0, -3).Put(5, "ignored").Put(1, 9);
+  writer.Put(4, unknown);
+  expected.Put(4, unknown);
+  EXPECT_EQ(TokenStream::Binary(expected.data(), expected.data() + expected.size()),
+      TokenStream::Binary(writer.data(), writer.data() + writer.size()));
+
+  TokenStream::Reader reader{writer.data(), writer.size()};
+  StaticRecord record2;
+  std::vector<StaticRecord> records;
+  StaticPoint point{};
+  EXPECT_EQ(1u, reader.GetToken());
+  reader >> record2;
+  EXPECT_EQ(2u, reader.GetToken());
+  reader >> records;
+  // Only the tokens that StaticPoint knows are read
+  EXPECT_EQ(4u, reader.GetToken());
+  reader >> point;
+  EXPECT_TRUE(reader.VerifyEOS());
+  EXPECT_EQ(7u, record2.id);
+  EXPECT_EQ("seven", record2.name);
+  EXPECT_EQ(CompressionType::None, record2.status);
+  EXPECT_EQ(-3, record2.origin.x);
+  EXPECT_EQ(400, record2.origin.y);
+  EXPECT_EQ(0.5, record2.ratio);
+  ASSERT_EQ(3u, records.size());
+  EXPECT_EQ("seven", records[2].name);
+  EXPECT_EQ(-3, point.x);
+  EXPECT_EQ(9, point.y);
+}
+
+TEST(TokenStreamTest, ScalarWidthTest) {
+  TokenStream::MemoryWriter writer;
+  writer.Put(1, int32_t{0x80}).Put(2, int16_t{-129}).Put(3, int64_t{-1}).Put(4, INT64_MIN);
+  writer.Put(5, UINT32_MAX).Put(6, uint16_t{0x7f}).Put(7, 0.75f).Put(8, 1.0).Put(9, int8_t{-2});
+  const TokenStream::Binary expected{1, 2, 0x00, 0x80, 2, 2, 0xff, 0x7f, 3, 1, 0xff,
+      4, 8, 0x80, 0, 0, 0, 0, 0, 0, 0, 5, 4, 0xff, 0xff, 0xff, 0xff, 6, 1, 0x7f,
+      7, 2, 0x40, 0x3f, 8, 2, 0xf0, 0x3f, 9, 1, 0xfe};
+  EXPECT_EQ(expected, TokenStream::Binary(writer.data(), writer.data() + writer.size()));
+
+  TokenStream::Reader reader{writer.data(), writer.size()};
+  int32_t i32 = 0;
+  int16_t i16 = 0;
+  int64_t i64 = 0, minimum = 0;
+  uint32_t u32 = 0;
+  uint16_t u16 = 0;
+  float f = 0;
+  double d = 0;
+  int8_t i8 = 0;
+  while (!reader.EOS()) {
+    switch (reader.GetToken()) {
+      case 1: reader >> i32; break;
+      case 2: reader >> i16; break;
+      case 3: reader >> i64; break;
+      case 4: reader >> minimum; break;
+      case 5: reader >> u32; break;
+      case 6: reader >> u16; break;
+      case 7: reader >> f; break;
+      case 8: reader >> d; break;
+      case 9: reader >> i8; break;
+      default: reader.Skip(); break;
+    }
+  }
+  EXPECT_EQ(0x80, i32);
+  EXPECT_EQ(-129, i16);
+  EXPECT_EQ(-1, i64);
+  EXPECT_EQ(INT64_MIN, minimum);
+  EXPECT_EQ(UINT32_MAX, u32);
+  EXPECT_EQ(0x7f, u16);
+  EXPECT_EQ(0.75f, f);
+  EXPECT_EQ(1.0, d);
+  EXPECT_EQ(-2, i8);
+}
+
+TEST(TokenStreamTest, StreamReadAheadTest) {
+  TokenStream::MemoryWriter writer;
+  writer.Put(5, 123);
+  for (int32_t i = 0; i < 2000; i++) {
+    TokenStream::Writer::SubStream nested{writer, 1};
+    writer.Put(0, i).Put(7, "written by a newer version");
+  }
+  // Larger than the read-ahead window, so skipping it seeks
+  const TokenStream::Binary blob(3 * TokenStream::Reader::ReadAheadSize, 0x5a);
+  writer.Put(2, blob).Put(3, 42);
+
+  std::stringstream stream;
+  stream.write(reinterpret_cast<const char*>(writer.data()), static_cast<std::streamsize>(writer.size()));
+  {
+    TokenStream::Reader reader{stream};
+    EXPECT_EQ(5u, reader.GetToken());
+    EXPECT_EQ(123, reader.GetLong());
+  }
+  // The bytes that were read ahead are given back to the stream
+  EXPECT_EQ(3, stream.tellg());
+
+  stream.seekg(0);
+  TokenStream::Reader reader{stream};
+  int64_t sum = 0;
+  int32_t last = 0;
+  while (!reader.EOS()) {
+    const auto token = reader.GetToken();
+    if (token == 1u) {
+      TokenStream::Reader::SubStream nested{reader};
+      while (!reader.EOS()) {
+        if (reader.GetToken() == 0u) {
+          sum += reader.GetLong();
+        } else {
+          reader.Skip();
+        }
+      }
+    } else if (token == 3u) {
+      last = reader.GetLong();
+    } else {
+      reader.Skip();
+    }
+  }
+  EXPECT_TRUE(reader.VerifyEOS());
+  EXPECT_EQ(1999 * 2000 / 2, sum);
+  EXPECT_EQ(42, last);
+
+  // A view stays valid until the next view, even when reading on refills the window
+  for (const size_t length : {990, 1000}) {
+    std::stringstream strings;
+    {
+      TokenStream::Writer writer{strings};
+      for (int i = 0; i < 200; i++) {
+        writer.Put(1, std::string(length, static_cast<char>('a' + i % 26)));
+      }
+    }
+    TokenStream::Reader stringReader{strings};
+    std::string text;
+    while (!stringReader.EOS()) {
+      stringReader.GetToken();
+      const auto view = stringReader.GetStringView();
+      const std::string copy(view.data(), view.size());
+      if (stringReader.EOS()) {
+        break;
+      }
+      stringReader.GetToken();
+      EXPECT_EQ(copy, std::string(view.data(), view.size()));
+      stringReader >> text;
+      EXPECT_EQ(copy, std::string(view.data(), view.size()));
+    }
+    EXPECT_TRUE(stringReader.VerifyEOS());
+  }
+}
+
+TEST(TokenStreamTest, LogTest) {
+  std::stringstream stream;
+  {
+    TokenStream::LogWriter log{stream, 0x100};
+    TokenStream::MemoryWriter record{false};
+    for (int32_t i = 0; i < 1000; i++) {
+      record.clear();
+      if (i != 7) {
+        record.Put(0, i).Put(1, "record " + std::to_string(i));
+      }
+      EXPECT_TRUE(log.Append(record));
+    }
+    EXPECT_EQ(1000u, log.GetRecordCount());
+    EXPECT_TRUE(log.Close());
+    EXPECT_FALSE(log.Append(record));
+  }
+  const auto text = stream.str();
+  TokenStream::Binary data{text.begin(), text.end()};
+  const auto recordNumber = [](TokenStream::BlockView record) {
+    TokenStream::Reader reader{record.data(), record.size()};
+    EXPECT_EQ(0u, reader.GetToken());
+    return reader.GetLong();
+  };
+
+  TokenStream::LogReader log{data};
+  EXPECT_TRUE(log.HasIndex());
+  EXPECT_LT(10u, log.GetBlockCount());
+  EXPECT_EQ(1000u, log.GetRecordCount());
+  TokenStream::BlockView record;
+  ASSERT_TRUE(log.GetRecord(999, record));
+  EXPECT_EQ(999, recordNumber(record));
+  ASSERT_TRUE(log.GetRecord(7, record));
+  EXPECT_TRUE(record.empty());
+  EXPECT_FALSE(log.GetRecord(1000, record));
+  std::atomic<uint64_t> count{0};
+  std::atomic<int64_t> sum{0};
+  log.ForEachRecordParallel([&](uint64_t index, TokenStream::BlockView view) {
+    count++;
+    if (index != 7) {
+      EXPECT_EQ(static_cast<int32_t>(index), recordNumber(view));
+      sum += static_cast<int64_t>(index);
+    }
+  }, 4);
+  EXPECT_EQ(1000u, count.load());
+  EXPECT_EQ(999 * 1000 / 2 - 7, sum.load());
+  EXPECT_EQ(0u, log.GetDamagedBlockCount());
+
+  // A damaged block only loses its own records
+  ASSERT_TRUE(log.GetRecord(500, record));
+  auto damaged = data;
+  damaged[static_cast<size_t>(record.data() - data.data()) + 3] ^= 0x40u;
+  TokenStream::LogReader damagedLog{damaged};
+  EXPECT_TRUE(damagedLog.HasIndex());
+  EXPECT_FALSE(damagedLog.GetRecord(500, record));
+  EXPECT_EQ(1u, damagedLog.GetDamagedBlockCount());
+  ASSERT_TRUE(damagedLog.GetRecord(998, record));
+  EXPECT_EQ(998, recordNumber(record));
+  count = 0;
+  damagedLog.ForEachRecord([&](uint64_t, TokenStream::BlockView) {
+    count++;
+  });
+  EXPECT_GT(1000u, count.load());
+  EXPECT_LT(900u, count.load());
+
+  // Without the index the blocks are found by their sync markers, and the cut block is left out
+  const TokenStream::Binary truncated(data.begin(), data.begin() + static_cast<ptrdiff_t>(data.size() / 2));
+  TokenStream::LogReader truncatedLog{truncated};
+  EXPECT_FALSE(truncatedLog.HasIndex());
+  EXPECT_EQ(1u, truncatedLog.GetDamagedBlockCount());
+  ASSERT_TRUE(truncatedLog.GetRecord(0, record));
+  EXPECT_EQ(0, recordNumber(record));
+  EXPECT_LT(300u, truncatedLog.GetRecordCount());
+  EXPECT_FALSE(truncatedLog.GetRecord(truncatedLog.GetRecordCount(), record));
+  ASSERT_TRUE(truncatedLog.GetRecord(truncatedLog.GetRecordCount() - 1, record));
+  EXPECT_EQ(static_cast<int32_t>(truncatedLog.GetRecordCount() - 1), recordNumber(record));
+}
+
+namespace {
+
+struct Part : TokenStream::Serializable {
+  std::string name;
+  uint32_t count = 0;
+  double weight = 0;
+
+  enum class Token { name, count, weight };
+
+  TOKEN_MAP(ENUMERATED_TOKEN(name), ENUMERATED_TOKEN(count), ENUMERATED_TOKEN(weight))
+};
+
+struct Assembly : TokenStream::Serializable {
+  std::string label = "none";
+  int32_t revision = 0;
+  Part main;
+  std::vector<Part> parts;
+  std::vector<uint32_t> ids;
+  std::map<std::string, uint32_t> stock;
+  StaticPoint origin;
+
+  enum class Token { label, revision, main, parts, ids, stock, origin };
+
+  TOKEN_MAP(ENUMERATED_TOKEN(label, "none"),
+            ENUMERATED_TOKEN(revision),
+            ENUMERATED_TOKEN(main),
+            ENUMERATED_TOKEN(parts),
+            ENUMERATED_TOKEN(ids),
+            ENUMERATED_TOKEN(stock),
+            ENUMERATED_TOKEN(origin))
+};
+
+// Applies the delta from old to now to a copy of old, checks that the copy now writes like now and
+// returns the delta
+TokenStream::Binary ApplyAssemblyDelta(const Assembly& old, const Assembly& now) {
+  TokenStream::MemoryWriter delta;
+  now.WriteDelta(delta, old);
+  Assembly patched = old;
+  TokenStream::Reader reader{delta.data(), delta.size()};
+  patched.ApplyDelta(reader);
+  EXPECT_TRUE(delta.empty() || reader.VerifyEOS());
+  TokenStream::MemoryWriter expected;
+  now.Write(expected);
+  TokenStream::MemoryWriter actual;
+  patched.Write(actual);
+  EXPECT_EQ(TokenStream::Binary(expected.data(), expected.data() + expected.size()),
+            TokenStream::Binary(actual.data(), actual.data() + actual.size()));
+  return {delta.data(), delta.data() + delta.size()};
+}
+
+// Collects what is written, like a socket or a pipe, which cannot report a position
+class UnseekableBuffer : public std::streambuf {
+ public:
+  std::string m_data;
+
+ protected:
+  int_type overflow(int_type c) override {
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      m_data += traits_type::to_char_type(c);
+    }
+    return traits_type::not_eof(c);
+  }
+  std::streamsize xsputn(const char* s, std::streamsize n) override {
+    m_data.append(s, static_cast<size_t>(n));
+    return n;
+  }
+};
+
+} // namespace
+
+TEST(TokenStreamTest, DeltaTest) {
+  Assembly old;
+  old.label = "frame";
+  old.revision = 3;
+  old.main.name = "base";
+  old.main.count = 2;
+  old.parts.resize(3);
+  old.parts[0].name = "bolt";
+  old.parts[1].name = "nut";
+  old.parts[2].name = "washer";
+  old.ids = {1, 2, 3};
+  old.stock = {{"bolt", 10}, {"nut", 20}};
+  old.origin.x = 5;
+  old.origin.y = 6;
+  EXPECT_TRUE(ApplyAssemblyDelta(old, old).empty());
+
+  // Only the changed member is written, and nested objects only write their changes
+  auto now = old;
+  now.revision = 4;
+  now.main.count = 7;
+  EXPECT_EQ(TokenStream::Binary({0x01, 0x01, 0x04, 0x02, 0x03, 0x01, 0x01, 0x07}), ApplyAssemblyDelta(old, now));
+
+  // Objects of a vector that did not change size leave empty placeholders
+  now = old;
+  now.parts[1].count = 9;
+  EXPECT_EQ(TokenStream::Binary({0xf8, 0x03, 0x03, 0x00, 0x03, 0x01, 0x01, 0x09, 0x00}), ApplyAssemblyDelta(old, now));
+  now.parts.pop_back();
+  ApplyAssemblyDelta(old, now);
+
+  // Containers and objects without a token map are replaced rather than merged
+  now = old;
+  now.ids = {4};
+  now.stock.erase("bolt");
+  now.origin.x = 0;
+  now.main.weight = -0.0;
+  ApplyAssemblyDelta(old, now);
+
+  // Members that went back to their defaults are listed at the end
+  now = old;
+  now.label = "none";
+  now.ids.clear();
+  now.main.name.clear();
+  const auto delta = ApplyAssemblyDelta(old, now);
+  TokenStream::Reader reader{delta.data(), delta.size()};
+  EXPECT_EQ(2u, reader.GetToken());
+  reader.Skip();
+  EXPECT_EQ(TokenStream::Serializable::DeltaResetToken, reader.GetToken());
+  std::vector<uint64_t> resets;
+  reader >> resets;
+  EXPECT_EQ(std::vector<uint64_t>({0, 4}), resets);
+  EXPECT_TRUE(reader.VerifyEOS());
+
+  // A stream Writer writes the same delta
+  std::stringstream stream;
+  {
+    TokenStream::Writer writer{stream};
+    now.WriteDelta(writer, old);
+  }
+  const auto text = stream.str();
+  EXPECT_EQ(delta, TokenStream::Binary(text.begin(), text.end()));
+
+  // So does one on a stream without positions, which only lists the members that were reset
+  now = old;
+  now.revision = 8;
+  TokenStream::MemoryWriter expected;
+  now.WriteDelta(expected, old);
+  UnseekableBuffer buffer;
+  {
+    std::ostream unseekable{&buffer};
+    TokenStream::Writer writer{unseekable};
+    now.WriteDelta(writer, old);
+  }
+  EXPECT_EQ(expected.Release(), TokenStream::Binary(buffer.m_data.begin(), buffer.m_data.end()));
+  auto patched = old;
+  TokenStream::Reader patch{reinterpret_cast<const uint8_t*>(buffer.m_data.data()), buffer.m_data.size()};
+  patched.ApplyDelta(patch);
+  EXPECT_EQ(8, patched.revision);
+}
+
+namespace {
+
+// A map kept as a sorted vector, like boost::container::flat_map
+template<typename Key, typename Value>
+struct FlatMap {
+  using key_type = Key;
+  using mapped_type = Value;
+  using value_type = std::pair<Key, Value>;
+  using const_iterator = typename std::vector<value_type>::const_iterator;
+
+  std::vector<value_type> items;
+
+  size_t size() const {
+    return items.size();
+  }
+  const_iterator begin() const {
+    return items.begin();
+  }
+  const_iterator end() const {
+    return items.end();
+  }
+  void reserve(size_t count) {
+    items.reserve(count);
+  }
+  void emplace_hint(const_iterator hint, value_type&& item) {
+    // Items that arrive in order go to the end without a search
+    if (hint == end() && (items.empty() || items.back().first < item.first)) {
+      items.push_back(std::move(item));
+      return;
+    }
+    const auto i = std::lower_bound(begin(), end(), item, [](const value_type& lhs, const value_type& rhs) {
+      return lhs.first < rhs.first;
+    });
+    if (i == end() || item.first < i->first) {
+      items.insert(i, std::move(item));
+    }
+  }
+};
+
+} // namespace
+
+namespace TokenStream {
+template<typename T>
+struct ContainerTraits<std::deque<T>> : SequenceContainerTraits<std::deque<T>> {};
+template<typename Key, typename Value>
+struct ContainerTraits<FlatMap<Key, Value>> : MapContainerTraits<FlatMap<Key, Value>> {};
+} // namespace TokenStream
+
+TEST(TokenStreamTest, ContainerTraitsTest) {
+  FlatMap<std::string, uint32_t> stock;
+  std::map<std::string, uint32_t> expected;
+  for (uint32_t i = 0; i < 100; i++) {
+    const auto key = "part" + std::to_string(i);
+    stock.emplace_hint(stock.end(), {key, i});
+    expected.emplace(key, i);
+  }
+  const std::deque<std::string> names{"bolt", "", "washer"};
+  const std::unordered_map<uint32_t, Blob> blobs{{1, Blob{}}, {2, Blob{}}};
+
+  // User containers are written like the standard ones
+  TokenStream::MemoryWriter writer;
+  writer << TokenStream::Token(1) << stock << TokenStream::Token(2) << names;
+  writer.Put(3, blobs);
+  TokenStream::MemoryWriter standard;
+  standard.Put(1, expected).Put(2, std::vector<std::string>(names.begin(), names.end())).Put(3, blobs);
+  EXPECT_EQ(TokenStream::Binary(standard.data(), standard.data() + standard.size()),
+            TokenStream::Binary(writer.data(), writer.data() + writer.size()));
+
+  TokenStream::Reader reader{writer.data(), writer.size()};
+  FlatMap<std::string, uint32_t> stock2;
+  std::deque<std::string> names2;
+  std::unordered_map<uint32_t, Blob> blobs2;
+  EXPECT_EQ(1u, reader.GetToken());
+  reader >> stock2;
+  EXPECT_EQ(2u, reader.GetToken());
+  reader >> names2;
+  EXPECT_EQ(3u, reader.GetToken());
+  reader >> blobs2;
+  EXPECT_TRUE(reader.VerifyEOS());
+  EXPECT_EQ(stock.items, stock2.items);
+  EXPECT_EQ(100u, stock2.items.capacity());
+  EXPECT_EQ(names, names2);
+  EXPECT_EQ(2u, blobs2.size());
+  EXPECT_LE(2u, blobs2.bucket_count());
+
+  // A corrupt element count does not make the Reader reserve more than the data can hold
+  TokenStream::MemoryWriter list;
+  list.Put(1, std::vector<std::string>{"a", "b"});
+  TokenStream::Binary corrupt(list.data(), list.data() + list.size());
+  ASSERT_EQ(0xf8u, corrupt[0]);
+  ASSERT_EQ(0x02u, corrupt[1]);
+  const uint8_t hugeCount[] = {0xfc, 0x10, 0x00, 0x00, 0x00, 0x00};
+  corrupt.erase(corrupt.begin() + 1);
+  corrupt.insert(corrupt.begin() + 1, std::begin(hugeCount), std::end(hugeCount));
+  TokenStream::Reader corruptReader{corrupt.data(), corrupt.size()};
+  std::vector<std::string> strings;
+  EXPECT_EQ(1u, corruptReader.GetToken());
+  corruptReader >> strings;
+  EXPECT_GE(corrupt.size(), strings.capacity());
+  EXPECT_EQ(std::vector<std::string>({"a", "b"}), strings);
+}
+
+TEST(TokenStreamTest, PoolTest) {
+  TokenStream::MemoryWriter first;
+  first.Put(1, 7).Put(2, std::vector<int32_t>{1, 2, 3});
+  TokenStream::MemoryWriter second;
+  second.Put(3, "second");
+
+  // Reset in the middle of a container starts over on the new buffer
+  TokenStream::Reader reader{first.data(), first.size()};
+  EXPECT_EQ(1u, reader.GetToken());
+  EXPECT_EQ(7, reader.GetLong());
+  EXPECT_EQ(2u, reader.GetToken());
+  reader.Reset(second.data(), second.size());
+  EXPECT_EQ(3u, reader.GetToken());
+  EXPECT_EQ("second", reader.GetString());
+  EXPECT_TRUE(reader.VerifyEOS());
+
+  // From memory to a stream and back. The bytes read ahead go back to the stream.
+  std::stringstream stream;
+  stream.write(reinterpret_cast<const char*>(first.data()), static_cast<std::streamsize>(first.size()));
+  reader.Rebind(stream);
+  EXPECT_EQ(1u, reader.GetToken());
+  EXPECT_EQ(7, reader.GetLong());
+  reader.Reset(first.data(), first.size());
+  EXPECT_EQ(3, stream.tellg());
+  std::vector<int32_t> values;
+  EXPECT_EQ(1u, reader.GetToken());
+  reader.Skip();
+  EXPECT_EQ(2u, reader.GetToken());
+  reader >> values;
+  EXPECT_EQ((std::vector<int32_t>{1, 2, 3}), values);
+  EXPECT_TRUE(reader.VerifyEOS());
+
+  // A rebound Writer starts over with the settings of a new one
+  std::stringstream out1;
+  std::stringstream out2;
+  TokenStream::Writer streamWriter{out1};
+  streamWriter.SetPackContainers(true);
+  streamWriter.Put(1, 7);
+  streamWriter.Rebind(out2);
+  EXPECT_FALSE(streamWriter.GetPackContainers());
+  streamWriter.Put(3, "second");
+  EXPECT_EQ(std::string(reinterpret_cast<const char*>(second.data()), second.size()), out2.str());
+  EXPECT_EQ(3u, out1.str().size());
+
+  // Leases that are returned come back warm on the same thread
+  TokenStream::Pool::Clear();
+  const TokenStream::MemoryWriter* pooledWriter = nullptr;
+  const uint8_t* pooledData = nullptr;
+  {
+    auto writer = TokenStream::Pool::GetWriter();
+    writer->SetPackContainers(true);
+    writer->Put(2, std::vector<int32_t>(1000, 5));
+    pooledWriter = &*writer;
+    pooledData = writer->data();
+  }
+  {
+    TokenStream::Arena arena;
+    TokenStream::Arena::Scope scope{arena};
+    auto writer = TokenStream::Pool::GetWriter();
+    EXPECT_EQ(pooledWriter, &*writer);
+    EXPECT_TRUE(writer->empty());
+    EXPECT_FALSE(writer->GetPackContainers());
+    writer->Put(1, 7).Put(2, std::vector<int32_t>{1, 2, 3});
+    EXPECT_EQ(pooledData, writer->data());
+    EXPECT_EQ(first.Release(), writer->Release());
+
+    // Objects created inside a Scope still use the heap, since they outlive it
+    auto other = TokenStream::Pool::GetWriter();
+    EXPECT_NE(pooledWriter, &*other);
+    other->Put(3, std::vector<int32_t>(1000, 5));
+    EXPECT_EQ(0u, arena.GetBytesUsed());
+  }
+
+  stream.seekg(0);
+  {
+    auto pooledReader = TokenStream::Pool::GetReader(stream);
+    EXPECT_EQ(1u, pooledReader->GetToken());
+    EXPECT_EQ(7, pooledReader->GetLong());
+  }
+  EXPECT_EQ(3, stream.tellg());
+  {
+    auto pooledReader = TokenStream::Pool::GetReader(second.data(), second.size());
+    EXPECT_EQ(3u, pooledReader->GetToken());
+    EXPECT_EQ("second", pooledReader->GetString());
+    EXPECT_TRUE(pooledReader->VerifyEOS());
+  }
+  TokenStream::Pool::Clear();
+}
+
+TEST(TokenStreamTest, ValidateTest) {
+  const auto package = MakeTestPackageWithStructure();
+  TokenStream::MemoryWriter writer;
+  writer.PutCompressed(5, package);
+  writer.Put(6, std::string(300, 'x'));
+  writer.PutPacked(7, std::vector<int32_t>{1, -2, 300000});
+  writer.Put(8, std::vector<uint32_t>{1, 2, 3});
+  {
+    // Objects nested 3 deep under token 1
+    TokenStream::Writer::SubStream a{writer, 1};
+    TokenStream::Writer::SubStream b{writer, 1};
+    TokenStream::Writer::SubStream c{writer, 1};
+    writer.Put(2, 42);
+  }
+  const auto data = writer.Release();
+  const auto nested = [](TokenStream::Token token, size_t) {
+    return token == 1u;
+  };
+  EXPECT_TRUE(TokenStream::Validate(data));
+  EXPECT_TRUE(TokenStream::Validate(data, 3, 3, nested));
+  EXPECT_FALSE(TokenStream::Validate(data, 2, 3, nested));
+  // The list of 3 and the packed list of 3 are over the limit
+  EXPECT_FALSE(TokenStream::Validate(data, 3, 2, nested));
+  EXPECT_TRUE(TokenStream::Validate(nullptr, 0));
+
+  // Cutting the frame anywhere inside the nested object breaks its length
+  for (size_t size = data.size() - 7; size < data.size(); size++) {
+    EXPECT_FALSE(TokenStream::Validate(data.data(), size, 3, 3, nested)) << size;
+  }
+  EXPECT_FALSE(TokenStream::Validate(data.data(), data.size() - 1));
+
+  // A length that runs past the end of the enclosing object
+  const TokenStream::Binary overrun{0x01, 0x04, 0x02, 0x03, 0x00, 0x00};
+  EXPECT_TRUE(TokenStream::Validate(overrun));
+  EXPECT_FALSE(TokenStream::Validate(overrun, 1, UINT64_MAX, nested));
+  // A list of 2 whose second element is missing, and a count that cannot be reached
+  EXPECT_FALSE(TokenStream::Validate(TokenStream::Binary{0xf8, 0x02, 0x03, 0x01, 0x07}));
+  EXPECT_FALSE(TokenStream::Validate(TokenStream::Binary{0xf8, 0xff, 0x7f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+                                                         0x03, 0x00}));
+  // Packed lists need a known format and whole elements
+  EXPECT_TRUE(TokenStream::Validate(TokenStream::Binary{0xf8, 0x00, 0x03, 0x05, 0x02, 0x00, 0x01, 0x00, 0x02}));
+  EXPECT_FALSE(TokenStream::Validate(TokenStream::Binary{0xf8, 0x00, 0x03, 0x04, 0x02, 0x00, 0x01, 0x00}));
+  EXPECT_FALSE(TokenStream::Validate(TokenStream::Binary{0xf8, 0x00, 0x03, 0x02, 0x09, 0x00}));
+  EXPECT_FALSE(TokenStream::Validate(TokenStream::Binary{0xf8, 0x00, 0x03, 0x02, 0x80, 0x81}));
+  // A compressed chunk that claims to inflate to more than LZ4 can produce
+  EXPECT_FALSE(TokenStream::Validate(TokenStream::Binary{0xf8, 0x01, 0x03, 0x05, 0x01, 0xc0, 0x00, 0x00, 0x00}));
+  // 0xf8 is never a length
+  EXPECT_FALSE(TokenStream::Validate(TokenStream::Binary{0x03, 0xf8, 0x00}));
+
+  // Whatever Validate accepts can be walked by a Reader without going past the end
+  std::vector<uint8_t> mutated = data;
+  std::srand(1);
+  for (int i = 0; i < 2000; i++) {
+    mutated = data;
+    mutated[static_cast<size_t>(std::rand()) % mutated.size()] = static_cast<uint8_t>(std::rand());
+    if (!TokenStream::Validate(mutated)) {
+      continue;
+    }
+    TokenStream::Reader reader{mutated};
+    while (!reader.EOS()) {
+      reader.GetToken();
+      reader.Skip();
+    }
+    EXPECT_TRUE(reader.VerifyEOS());
+  }
+}
+
+namespace {
+
+struct Reading : TokenStream::Serializable {
+  uint32_t sensor = 0;
+  double value = 0;
+  std::string unit;
+  uint8_t flags = 0;
+  bool valid = false;
+  Part part;
+
+  enum class Token { sensor, value, unit, flags, valid, part };
+
+  TOKEN_MAP(ENUMERATED_TOKEN(sensor),
+            ENUMERATED_TOKEN(value),
+            ENUMERATED_TOKEN(unit),
+            ENUMERATED_TOKEN(flags),
+            ENUMERATED_TOKEN(valid),
+            ENUMERATED_TOKEN(part))
+};
+
+struct Sample : TokenStream::Serializable {
+  int64_t time = 0;
+  uint16_t count = 0;
+
+  enum class Token { time, count };
+
+  TOKEN_MAP(ENUMERATED_TOKEN(time), ENUMERATED_TOKEN(count))
+};
+
+// The objects of token 1 in the normal encoding
+template<typename T>
+TokenStream::Binary RowWise(const std::vector<T>& objects) {
+  TokenStream::MemoryWriter writer;
+  writer.Put(1, objects);
+  return writer.Release();
+}
+
+} // namespace
+
+TEST(TokenStreamTest, ColumnarTest) {
+  // Numbers only: the row count and a packed list per member
+  std::vector<Sample> samples(2);
+  samples[0].time = 1;
+  samples[0].count = 3;
+  samples[1].time = 2;
+  samples[1].count = 4;
+  TokenStream::MemoryWriter writer;
+  writer.PutColumns(1, samples);
+  EXPECT_EQ(TokenStream::Binary({0xf8, 0x00, 0x01, 0x10, 0x40, 0x02, 0xf8, 0x00, 0x00, 0x03, 0x01, 0x01, 0x02,
+                                 0xf8, 0x00, 0x01, 0x03, 0x01, 0x03, 0x04}),
+            writer.Release());
+
+  std::vector<Reading> readings(300);
+  for (size_t i = 0; i < readings.size(); i++) {
+    readings[i].sensor = static_cast<uint32_t>(i % 7);
+    readings[i].value = static_cast<double>(i) / 4;
+    readings[i].unit = i % 2 ? "kPa" : "";
+    readings[i].flags = static_cast<uint8_t>(i);
+    readings[i].valid = i % 3 == 0;
+    readings[i].part.count = static_cast<uint32_t>(i % 5);
+  }
+  writer.PutColumns(1, readings);
+  writer.Put(2, 42);
+  const auto data = writer.Release();
+  EXPECT_LT(data.size(), RowWise(readings).size());
+  EXPECT_TRUE(TokenStream::Validate(data));
+  EXPECT_TRUE(TokenStream::Validate(data, 1));
+  EXPECT_FALSE(TokenStream::Validate(data, 0));
+
+  // The objects are read back as usual, including the members that are written row by row
+  {
+    TokenStream::Reader reader{data};
+    EXPECT_EQ(1u, reader.GetToken());
+    EXPECT_TRUE(reader.NextContainerIsPacked());
+    std::vector<Reading> copy;
+    reader >> copy;
+    EXPECT_EQ(RowWise(readings), RowWise(copy));
+    EXPECT_EQ(2u, reader.GetToken());
+    int32_t value = 0;
+    reader >> value;
+    EXPECT_EQ(42, value);
+    EXPECT_TRUE(reader.VerifyEOS());
+  }
+
+  // One column can be read without the others
+  {
+    TokenStream::Reader reader{data};
+    EXPECT_EQ(1u, reader.GetToken());
+    std::vector<std::string> units;
+    EXPECT_TRUE(reader.GetColumn(Reading::Token::unit, units));
+    ASSERT_EQ(readings.size(), units.size());
+    EXPECT_EQ("kPa", units[299]);
+    EXPECT_EQ(2u, reader.GetToken());
+    reader.Skip();
+    EXPECT_TRUE(reader.VerifyEOS());
+  }
+  {
+    TokenStream::Reader reader{data};
+    EXPECT_EQ(1u, reader.GetToken());
+    std::vector<uint32_t> members;
+    EXPECT_FALSE(reader.GetColumn(Reading::Token::valid, members));
+    EXPECT_EQ(2u, reader.GetToken());
+  }
+
+  // A stream Writer writes the same chunk
+  std::stringstream stream;
+  {
+    TokenStream::Writer streamWriter{stream};
+    streamWriter.PutColumns(1, readings);
+    streamWriter.Put(2, 42);
+  }
+  const auto text = stream.str();
+  EXPECT_EQ(data, TokenStream::Binary(text.begin(), text.end()));
+
+  // Vectors with fewer than two objects are written as usual
+  readings.resize(1);
+  writer.PutColumns(1, readings);
+  EXPECT_EQ(RowWise(readings), writer.Release());
+}
+
+#if TOKENSTREAM_COROUTINES
+// Runs until its first suspension and is resumed by OutputQueue::Flush()
+struct DetachedTask {
+  struct promise_type {
+    DetachedTask get_return_object() {
+      return {};
+    }
+    std::suspend_never initial_suspend() noexcept {
+      return {};
+    }
+    std::suspend_never final_suspend() noexcept {
+      return {};
+    }
+    void return_void() {}
+    void unhandled_exception() {
+      std::terminate();
+    }
+  };
+};
+
+DetachedTask WriteWhenDrained(TokenStream::OutputQueue& queue, int count, int& written) {
+  for (int i = 0; i < count; i++) {
+    co_await queue.Drained();
+    TokenStream::Writer writer{queue.GetStream()};
+    writer.Put(1, std::string(100, 'x'));
+    written++;
+  }
+}
+#endif
+
+TEST(TokenStreamTest, OutputQueueTest) {
+  std::string received;
+  size_t budget = 0;
+  // A socket that takes up to 64 bytes per call while it has room
+  TokenStream::OutputQueue queue{[&](const uint8_t* data, size_t size) {
+                                   const auto taken = std::min({size, budget, static_cast<size_t>(64)});
+                                   received.append(reinterpret_cast<const char*>(data), taken);
+                                   budget -= taken;
+                                   return taken;
+                                 },
+                                 1000, 200};
+  int drained = 0;
+  queue.SetOnDrained([&] {
+    drained++;
+  });
+
+  // Nothing leaves while the socket is blocked, and the queue fills up
+  const auto package = MakeTestPackageWithStructure();
+  TokenStream::MemoryWriter expected;
+  int messages = 0;
+  while (!queue.IsFull()) {
+    TokenStream::Writer writer{queue.GetStream()};
+    package.Write(writer);
+    package.Write(expected);
+    EXPECT_FALSE(queue.Flush());
+    messages++;
+  }
+  EXPECT_GT(messages, 1);
+  EXPECT_TRUE(received.empty());
+  EXPECT_EQ(expected.size(), queue.GetQueuedBytes());
+  EXPECT_EQ(expected.size(), static_cast<size_t>(queue.GetStream().tellp()));
+
+  // Part of the queue is sent, but it is only drained at the low-water mark
+  budget = expected.size() - 500;
+  EXPECT_FALSE(queue.Flush());
+  EXPECT_TRUE(queue.IsFull());
+  EXPECT_EQ(0, drained);
+  budget = 300;
+  EXPECT_FALSE(queue.Flush());
+  EXPECT_FALSE(queue.IsFull());
+  EXPECT_EQ(1, drained);
+  budget = SIZE_MAX;
+  EXPECT_TRUE(queue.Flush());
+  EXPECT_EQ(std::string(reinterpret_cast<const char*>(expected.data()), expected.size()), received);
+  EXPECT_EQ(1, drained);
+
+  // Large messages go out while they are written, without waiting for Flush()
+  received.clear();
+  {
+    TokenStream::Writer writer{queue.GetStream()};
+    writer.Put(1, std::string(TokenStream::OutputQueue::SendSize, 'x'));
+  }
+  EXPECT_FALSE(received.empty());
+  EXPECT_TRUE(queue.Flush());
+  EXPECT_EQ(TokenStream::OutputQueue::SendSize + 3, received.size());
+
+#if TOKENSTREAM_COROUTINES
+  budget = 0;
+  int written = 0;
+  WriteWhenDrained(queue, 20, written);
+  EXPECT_TRUE(queue.IsFull());
+  const auto firstBatch = written;
+  EXPECT_LT(firstBatch, 20);
+  budget = SIZE_MAX;
+  while (!queue.Flush() || written < 20) {
+  }
+  EXPECT_EQ(20, written);
+#endif
+}